@@ -0,0 +1,67 @@
+/**
+ * @file capture.h
+ *
+ */
+
+#ifndef G_CAPTURE_H
+#define G_CAPTURE_H
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+
+#include <comm/cmd_payload.h>
+#include <comm/capture_codec.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+/*
+ * Path of the traffic capture. When set, every command frame decoded by a
+ * listener (bus, peer socket and each command of a batch) is appended to it
+ * with its receive time, for "sys-utils replay".
+ */
+#define CAPTURE_PATH_ENV                "SYS_MGR_CAPTURE"
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  GLOBAL PROTOTYPES
+ **********************/
+/* Open the capture named by CAPTURE_PATH_ENV, nothing to do when unset */
+int32_t capture_init(void);
+void capture_deinit(void);
+
+/* Append cmd, stamped with cmd->rx_ns. No-op while capture is off */
+void capture_record(const remote_cmd_t *cmd);
+
+/* Push buffered records to the file, bounds what a crash loses */
+void capture_flush(void);
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+
+#endif /* G_CAPTURE_H */
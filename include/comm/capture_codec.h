@@ -0,0 +1,102 @@
+/**
+ * @file capture_codec.h
+ *
+ */
+
+#ifndef G_CAPTURE_CODEC_H
+#define G_CAPTURE_CODEC_H
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdio.h>
+#include <stdint.h>
+
+#include <comm/cmd_payload.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+/*
+ * Traffic capture file: a header, then one record per decoded command, back
+ * to back. Integers are in host byte order, a capture is replayed on the
+ * machine class it was taken on.
+ *
+ *  header  "SMCP" u16 version, u16 reserved, u64 start_ns
+ *  record  u16 length of the rest of the record
+ *          u64 rx_ns - start_ns, u32 umid, u32 opcode, u8 flow,
+ *          u8 duration, u8 entry count, u8 component length, component
+ *  entry   u8 key length, key, u8 data type, value: 4 bytes for i/u,
+ *          8 for d, u16 length and the bytes for s
+ *
+ * Strings are stored without their terminator.
+ */
+#define CAPTURE_MAGIC                   "SMCP"
+#define CAPTURE_VERSION                 1
+#define CAPTURE_HEADER_SIZE             16
+#define CAPTURE_RECORD_MAX              4096
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+struct capture_header {
+    uint16_t version;
+    uint64_t start_ns;              /* CLOCK_MONOTONIC when capture began */
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  GLOBAL PROTOTYPES
+ **********************/
+int32_t capture_write_header(FILE *fp, uint64_t start_ns);
+
+/*
+ * Read and check the file header.
+ *  -EIO      short read
+ *  -EPROTO   not a capture file
+ *  -EPROTONOSUPPORT  capture of a newer version
+ */
+int32_t capture_read_header(FILE *fp, struct capture_header *hdr);
+
+/*
+ * Serialize cmd received offset_ns after the start of the capture into buf.
+ * Returns the record length.
+ *  -EINVAL   missing string, unsupported data type
+ *  -ENOSPC   record larger than size
+ */
+int32_t capture_encode(const remote_cmd_t *cmd, uint64_t offset_ns, \
+                       uint8_t *buf, size_t size);
+
+/*
+ * Read the next record into out, with its strings in out->str_pool. Returns
+ * 1 for a record and 0 at the end of the file. A record cut short by the
+ * end of the file, as left by a writer that did not exit cleanly, is the
+ * end of the file too.
+ *  -EPROTO   malformed record
+ *  -ENOSPC   strings do not fit in the pool
+ */
+int32_t capture_read(FILE *fp, remote_cmd_t *out, uint64_t *offset_ns);
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+
+#endif /* G_CAPTURE_CODEC_H */
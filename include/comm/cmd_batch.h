@@ -0,0 +1,60 @@
+/**
+ * @file cmd_batch.h
+ *
+ */
+
+#ifndef G_CMD_BATCH_H
+#define G_CMD_BATCH_H
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+#include <dbus/dbus.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+/* Reply: first failure in frame order (0 if none), then (umid, result) */
+#define CMD_BATCH_REPLY_SIGNATURE       "ia(ii)"
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  GLOBAL PROTOTYPES
+ **********************/
+/*
+ * Route handler of a batch frame. All sub-commands are queued at once in
+ * the sender's queue, as blocking work in ORDERED mode and as non-blocking
+ * work in PARALLEL mode. The reply is queued once the last one completes,
+ * so the handler returns DBUS_ROUTE_REPLY_DEFERRED unless the frame is
+ * rejected up front.
+ */
+DBusMessage *cmd_batch_dispatch(DBusMessage *msg);
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+
+#endif /* G_CMD_BATCH_H */
@@ -15,6 +15,7 @@
  *********************/
 #define COMP_NAME                       "SYSTEM-MANAGER"
 #define MAX_ENTRIES                     32
+#define CMD_STR_POOL_SIZE               1024
 
 /**********************
  *      TYPEDEFS
@@ -63,6 +64,14 @@ typedef enum {
     OP_AUDIO_INIT,
     OP_AUDIO_RELEASE,
     OP_SOUND_PLAY,
+    /* Telemetry API */
+    OP_START_PUBLISHER,
+    OP_STATE_UPDATE,
+    /* Peer-to-peer API */
+    OP_START_P2P,
+    /* Async DBus API */
+    OP_DBUS_REPLY,
+    OP_DBUS_ROUTE,
 } opcode_t;
 
 
@@ -91,6 +100,10 @@ typedef struct {
     uint8_t duration;
     uint32_t entry_count;         // Number of entries in the payload
     payload_t entries[MAX_ENTRIES]; // Payload entries
+    uint16_t version;             // Frame protocol version, set on decode
+    uint64_t rx_ns;               // Receipt by the listener, CLOCK_MONOTONIC
+    uint32_t str_used;
+    char str_pool[CMD_STR_POOL_SIZE]; // Decoded strings, owned by the frame
 } remote_cmd_t;
 
 
@@ -123,6 +136,7 @@ void remote_cmd_init(remote_cmd_t *cmd, const char *component_id, int32_t umid,
 int32_t remote_cmd_add_string(remote_cmd_t *cmd, const char *key, \
               const char *value);
 int32_t remote_cmd_add_int(remote_cmd_t *cmd, const char *key, int32_t value);
+int32_t remote_cmd_add_double(remote_cmd_t *cmd, const char *key, double value);
 
 /**********************
  *  STATIC VARIABLES
@@ -12,6 +12,7 @@
 #include <dbus/dbus.h>
 
 #include <comm/cmd_payload.h>
+#include <comm/dbus_pending.h>
 #include <sched/workqueue.h>
 #include <sched/task.h>
 
@@ -22,7 +23,42 @@
 #define SYS_MGR_DBUS_OBJ_PATH           "/com/SystemManager/Obj/SysCmd"
 #define SYS_MGR_DBUS_IFACE              "com.SystemManager.Interface"
 #define SYS_MGR_DBUS_METH               "SysMeth"
+#define SYS_MGR_DBUS_BATCH_METH         "SysBatch"
 #define SYS_MGR_DBUS_SIG                "SysSig"
+#define SYS_MGR_DBUS_P2P_METH           "PeerAddr"
+#define SYS_MGR_DBUS_STREAM_METH        "SensorStream"
+#define SYS_MGR_DBUS_QSTATS_METH        "QueueStats"
+/* name, weight, quota, depth, peak, enqueued, dequeued, dropped, wait sum/max */
+#define SYS_MGR_QSTATS_SIGNATURE        "a(suuuuttttt)"
+#define SYS_MGR_DBUS_IMU_STATS_METH     "ImuStats"
+/*
+ * target Hz, buffered, samples, missed, overruns, rate Hz,
+ * jitter avg/max ns, wake-up lateness avg/max ns
+ */
+#define SYS_MGR_IMU_STATS_SIGNATURE     "ubtttduuuu"
+#define SYS_MGR_DBUS_CALL_STATS_METH    "CallStats"
+/*
+ * Outbound method calls: sent, replied, errors, timeouts, cancelled,
+ * unmatched, untracked, rtt min/max/sum ns, in flight and its peak
+ */
+#define SYS_MGR_CALL_STATS_SIGNATURE    "ttttttttttuu"
+#define SYS_MGR_DBUS_IMU_HISTORY_METH   "ImuHistory"
+/*
+ * In: since ns (0: the latest entries), max entries. Out, oldest first:
+ * timestamp ns, accel x y z (g), gyro x y z (deg/s), roll, pitch, yaw (deg).
+ * Passing the last timestamp received as since pages through the history.
+ */
+#define SYS_MGR_IMU_HISTORY_IN_SIGNATURE "tu"
+#define SYS_MGR_IMU_HISTORY_SIGNATURE   "a(tddddddddd)"
+/* Entries per ImuHistory reply at most */
+#define SYS_MGR_IMU_HISTORY_MAX         512
+#define SYS_MGR_DBUS_IMU_HISTORY_AT_METH "ImuHistoryAt"
+/*
+ * In: timestamp ns. Out: one ImuHistory entry interpolated at that time,
+ * an InvalidArgs error when it is outside the history
+ */
+#define SYS_MGR_IMU_HISTORY_AT_IN_SIGNATURE "t"
+#define SYS_MGR_IMU_HISTORY_AT_SIGNATURE "(tddddddddd)"
 
 #define UI_DBUS_SER                     "com.TerminalUI.Service"
 #define UI_DBUS_OBJ_PATH                "/com/TerminalUI/Obj/UsrCmd"
@@ -32,10 +68,23 @@
 
 
 #define SER_BUS_TYPE                    DBUS_BUS_SYSTEM
+/*
+ * Bus override for tests and benchmarks: "system", "session" or a bus
+ * address (e.g. a private dbus-daemon). Unset means SER_BUS_TYPE.
+ */
+#define SYS_MGR_DBUS_BUS_ENV            "SYS_MGR_DBUS_BUS"
 #define SER_NAME                        SYS_MGR_DBUS_SER
 #define SER_IFACE                       SYS_MGR_DBUS_IFACE
 #define SER_METH                        SYS_MGR_DBUS_METH
+#define SER_BATCH_METH                  SYS_MGR_DBUS_BATCH_METH
 #define SER_SIG                         SYS_MGR_DBUS_SIG
+#define SER_P2P_METH                    SYS_MGR_DBUS_P2P_METH
+#define SER_STREAM_METH                 SYS_MGR_DBUS_STREAM_METH
+#define SER_QSTATS_METH                 SYS_MGR_DBUS_QSTATS_METH
+#define SER_IMU_STATS_METH              SYS_MGR_DBUS_IMU_STATS_METH
+#define SER_CALL_STATS_METH             SYS_MGR_DBUS_CALL_STATS_METH
+#define SER_IMU_HISTORY_METH            SYS_MGR_DBUS_IMU_HISTORY_METH
+#define SER_IMU_HISTORY_AT_METH         SYS_MGR_DBUS_IMU_HISTORY_AT_METH
 #define SER_OBJ_PATH                    SYS_MGR_DBUS_OBJ_PATH
 
 #define LISTEN_IFACE                    UI_DBUS_IFACE
@@ -47,9 +96,27 @@
 #define REMOTE_SER_IFACE                UI_DBUS_IFACE
 #define REMOTE_SER_METH                 UI_DBUS_METH
 
+/*
+ * OP_PING replies with its server side timestamps as a variant of
+ * PING_STAMPS_SIGNATURE. The string entry PING_PATH_KEY selects the path:
+ * PING_PATH_INLINE (default) or PING_PATH_WORKQUEUE, the latter on the bus
+ * only. Inline pings report the same enqueue and dequeue time.
+ */
+#define PING_STAMPS_SIGNATURE           "(tttt)"
+#define PING_PATH_KEY                   "path"
+#define PING_PATH_INLINE                "inline"
+#define PING_PATH_WORKQUEUE             "workqueue"
+
 /**********************
  *      TYPEDEFS
  **********************/
+/* CLOCK_MONOTONIC, in ns */
+struct ping_stamps {
+    uint64_t rx_ns;                 /* frame received by the listener */
+    uint64_t enqueue_ns;            /* handed to the workqueue */
+    uint64_t dequeue_ns;            /* taken by the task handler */
+    uint64_t reply_ns;              /* reply built */
+};
 
 /**********************
  *  GLOBAL VARIABLES
@@ -65,11 +132,24 @@
 int32_t add_dbus_match_rule(DBusConnection *conn, const char *rule);
 int32_t dbus_fn_thread_handler();
 
+int32_t dbus_queue_message(DBusMessage *msg);
+int32_t dbus_dispatch_cmd_message(DBusMessage *msg, DBusMessage **reply);
+DBusMessage *dbus_new_cmd_reply(DBusMessage *msg, int32_t ret);
+int32_t dbus_append_ping_stamps(DBusMessageIter *iter, \
+                                const struct ping_stamps *ps);
+
 int32_t dbus_method_call(const char *destination, const char *path, \
                          const char *iface, const char *method, \
                          remote_cmd_t *cmd);
 int32_t dbus_method_call_with_data(remote_cmd_t *cmd);
 
+int32_t dbus_method_call_async(const char *destination, const char *path, \
+                               const char *iface, const char *method, \
+                               remote_cmd_t *cmd, int32_t timeout_ms, \
+                               dbus_reply_cb_t cb, void *user_data);
+int32_t dbus_method_call_with_data_async(remote_cmd_t *cmd, int32_t timeout_ms, \
+                                         dbus_reply_cb_t cb, void *user_data);
+
 int32_t dbus_emit_signal(const char *path, const char *iface, \
                          const char *sig, remote_cmd_t *cmd);
 int32_t dbus_emit_signal_with_data(remote_cmd_t *cmd);
@@ -0,0 +1,125 @@
+/**
+ * @file dbus_pending.h
+ *
+ */
+
+#ifndef G_DBUS_PENDING_H
+#define G_DBUS_PENDING_H
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+#include <dbus/dbus.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define DBUS_PENDING_DEFAULT_TIMEOUT_MS 2000
+/* Outstanding calls allowed at once, further calls fail with -EBUSY */
+#define DBUS_PENDING_MAX                1024
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+/*
+ * Completion of an outbound method call, run by the task handler.
+ *  - status: 0 on method return, -EREMOTEIO on error reply, -ETIMEDOUT when
+ *            no reply came in time, -ECANCELED when the listener exits
+ *  - reply:  the reply message (return or error), NULL otherwise. Only valid
+ *            during the callback.
+ * Callbacks run on the task handler thread and must not block.
+ */
+typedef void (*dbus_reply_cb_t)(int32_t status, DBusMessage *reply, \
+                                void *user_data);
+
+/*
+ * Outstanding call. Created by the caller, then owned by the listener
+ * thread once the message is on the bus.
+ */
+struct dbus_pending {
+    uint32_t serial;
+    int32_t umid;
+    uint64_t sent_ns;
+    uint64_t deadline_ns;
+    dbus_reply_cb_t cb;
+    void *user_data;
+    struct dbus_pending *hnext;     /* serial hash chain */
+    struct dbus_pending *prev;      /* deadline ordered list */
+    struct dbus_pending *next;
+};
+
+/* Data of an OP_DBUS_REPLY work item */
+struct dbus_reply_work {
+    int32_t status;
+    int32_t umid;
+    DBusMessage *reply;
+    dbus_reply_cb_t cb;
+    void *user_data;
+};
+
+struct dbus_pending_stats {
+    uint64_t sent;
+    uint64_t replied;
+    uint64_t errors;
+    uint64_t timeouts;
+    uint64_t cancelled;
+    uint64_t unmatched;             /* late replies or replies to untracked calls */
+    uint64_t untracked;             /* sent without an entry, the table was full */
+    uint64_t rtt_min_ns;
+    uint64_t rtt_max_ns;
+    uint64_t rtt_sum_ns;            /* over replied + errors */
+    uint32_t in_flight;
+    uint32_t in_flight_peak;
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  GLOBAL PROTOTYPES
+ **********************/
+/* Any thread: reserve an entry, NULL when DBUS_PENDING_MAX is reached */
+struct dbus_pending *dbus_pending_new(int32_t umid, int32_t timeout_ms, \
+                                      dbus_reply_cb_t cb, void *user_data);
+/* Any thread: release an entry that never made it to the bus */
+void dbus_pending_free(struct dbus_pending *p);
+
+/*
+ * Listener thread only: the timer fd to watch, the table itself is not
+ * locked since only the listener sends messages and reads replies.
+ */
+int32_t dbus_pending_init(void);
+void dbus_pending_track(struct dbus_pending *p, uint32_t serial);
+int32_t dbus_pending_complete(DBusMessage *reply);
+void dbus_pending_expire(void);
+void dbus_pending_release(void);
+
+/* Task handler: run the completion of an OP_DBUS_REPLY work item */
+void dbus_pending_run_callback(struct dbus_reply_work *rw);
+
+/* Any thread: a call went out without an entry */
+void dbus_pending_count_untracked(void);
+void dbus_pending_get_stats(struct dbus_pending_stats *out);
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+
+#endif /* G_DBUS_PENDING_H */
@@ -0,0 +1,96 @@
+/**
+ * @file dbus_router.h
+ *
+ */
+
+#ifndef G_DBUS_ROUTER_H
+#define G_DBUS_ROUTER_H
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+#include <dbus/dbus.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define DBUS_ROUTE_MAX                  64
+/*
+ * Returned by a method call handler that queues the reply itself later with
+ * dbus_queue_message(), nothing is sent on its behalf.
+ */
+#define DBUS_ROUTE_REPLY_DEFERRED       ((DBusMessage *)-1)
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+/*
+ * Handler of a routed message. Returns the reply of a method call, or NULL
+ * for signals. A method call handler returning NULL is answered with a
+ * generic error so the caller never waits for its timeout.
+ */
+typedef DBusMessage *(*dbus_route_fn_t)(DBusMessage *msg);
+
+typedef enum {
+    DBUS_ROUTE_INLINE = 0,          /* on the listener thread, must be cheap */
+    DBUS_ROUTE_WORKQUEUE,           /* on the task handler, reply queued */
+} dbus_route_mode_t;
+
+/*
+ * Handler entry, keyed by (type, interface, member). The signatures are only
+ * used to describe the method or signal in the introspection data.
+ */
+struct dbus_route {
+    int32_t type;                   /* DBUS_MESSAGE_TYPE_METHOD_CALL/SIGNAL */
+    const char *iface;
+    const char *member;
+    dbus_route_mode_t mode;
+    dbus_route_fn_t fn;
+    const char *sig_in;             /* may be NULL */
+    const char *sig_out;            /* may be NULL, method calls only */
+};
+
+/* Data of an OP_DBUS_ROUTE work item */
+struct dbus_route_work {
+    DBusMessage *msg;
+    dbus_route_fn_t fn;
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  GLOBAL PROTOTYPES
+ **********************/
+/*
+ * Routes are registered before the router is attached, the table is not
+ * locked. Method calls are served on obj_path through an object path vtable,
+ * signals and replies to outbound calls through a connection filter.
+ */
+int32_t dbus_router_add(const struct dbus_route *routes, int32_t count);
+int32_t dbus_router_attach(DBusConnection *conn, const char *obj_path);
+void dbus_router_detach(DBusConnection *conn);
+void dbus_router_run_work(struct dbus_route_work *rw);
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+
+#endif /* G_DBUS_ROUTER_H */
@@ -17,6 +17,8 @@
  *********************/
 #define MAX_PATH_LEN                    256
 #define IIO_DEV_SYSFS_PATH              "/sys/bus/iio/devices"
+/* Other root for the IIO devices, e.g. a tree made by "sys-utils iio-sim" */
+#define IIO_DEV_SYSFS_PATH_ENV          "SYS_MGR_IIO_BASE"
 #define IIO_DEV_NAME_FILE               "name"
 
 /**********************
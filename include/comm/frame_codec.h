@@ -0,0 +1,114 @@
+/**
+ * @file frame_codec.h
+ *
+ */
+
+#ifndef G_FRAME_CODEC_H
+#define G_FRAME_CODEC_H
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+#include <dbus/dbus.h>
+
+#include <comm/cmd_payload.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+/*
+ * Version 1 is the original frame (s i i i i a(siiv)). Version 2 appends the
+ * protocol version as a trailing uint16, which decoders of version 1 never
+ * read, so both sides can be upgraded independently.
+ */
+#define FRAME_PROTO_VERSION             2
+#define FRAME_SIGNATURE_V1              "siiiia(siiv)"
+#define FRAME_SIGNATURE                 FRAME_SIGNATURE_V1 "q"
+
+/*
+ * Batch frame: component, batch umid, mode, the sub-command bodies and the
+ * protocol version. Sub-commands share the component of the batch.
+ */
+#define FRAME_BATCH_MAX                 16
+#define FRAME_BATCH_SIGNATURE           "siia(iiiia(siiv))q"
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+typedef enum {
+    FRAME_BATCH_ORDERED = 0,    /* run one after another, in frame order */
+    FRAME_BATCH_PARALLEL,       /* run concurrently, no ordering */
+} frame_batch_mode_t;
+
+struct frame_batch {
+    const char *component_id;
+    uint32_t umid;
+    uint32_t mode;
+    uint16_t version;
+    uint32_t count;
+    remote_cmd_t *cmds[FRAME_BATCH_MAX];
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  GLOBAL PROTOTYPES
+ **********************/
+/*
+ * Append cmd to an empty message as a FRAME_PROTO_VERSION frame. The data
+ * length of each entry is derived from its value.
+ *  -EINVAL   missing string, unsupported data type
+ *  -E2BIG    more than MAX_ENTRIES entries
+ *  -ENOMEM   libdbus failed to append
+ */
+int32_t frame_encode(DBusMessage *msg, const remote_cmd_t *cmd);
+
+/*
+ * Decode a frame of any supported version into out. Strings are copied into
+ * out->str_pool, so out stays valid after the message is released.
+ *  -EPROTO   signature is not a frame, flow/duration out of range, value
+ *            type does not match the declared data type
+ *  -E2BIG    more than MAX_ENTRIES entries
+ *  -ENOSPC   strings do not fit in the pool
+ *  -EPROTONOSUPPORT  frame of a newer protocol version
+ */
+int32_t frame_decode(DBusMessage *msg, remote_cmd_t *out);
+
+/*
+ * Append batch to an empty message. Errors as frame_encode, and -E2BIG for
+ * more than FRAME_BATCH_MAX commands.
+ */
+int32_t frame_encode_batch(DBusMessage *msg, const struct frame_batch *batch);
+
+/*
+ * Decode a whole batch frame in one pass. Each command is allocated and owns
+ * its strings; a caller taking one over sets its slot to NULL before
+ * frame_batch_release(). Errors as frame_decode, and -EPROTO for an empty
+ * batch or an unknown mode. Nothing is left allocated on error.
+ */
+int32_t frame_decode_batch(DBusMessage *msg, struct frame_batch *out);
+void frame_batch_release(struct frame_batch *batch);
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+
+#endif /* G_FRAME_CODEC_H */
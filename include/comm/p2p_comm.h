@@ -0,0 +1,62 @@
+/**
+ * @file p2p_comm.h
+ *
+ */
+
+#ifndef G_P2P_COMM_H
+#define G_P2P_COMM_H
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+/*
+ * Private peer channel: a SOCK_SEQPACKET Unix socket carrying the same DBus
+ * frame as the bus path, serialized with dbus_message_marshal(). One packet
+ * is one message. Clients look the path up with SER_P2P_METH on the bus.
+ */
+#define P2P_SOCK_PATH_ENV               "SYS_MGR_P2P_PATH"
+#define P2P_DEFAULT_SOCK_PATH           "/run/sys-mgr-p2p.sock"
+#define P2P_MAX_CLIENTS                 8
+#define P2P_MAX_PACKET                  65536
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  GLOBAL PROTOTYPES
+ **********************/
+int32_t p2p_fn_thread_handler();
+
+/* Socket path while the peer server is listening, NULL otherwise */
+const char *p2p_get_sock_path(void);
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+
+#endif /* G_P2P_COMM_H */
@@ -0,0 +1,93 @@
+/**
+ * @file publisher.h
+ *
+ */
+
+#ifndef G_PUBLISHER_H
+#define G_PUBLISHER_H
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+#include <stdbool.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define PUB_MAX_TOPICS                  16
+#define PUB_TOPIC_LEN                   32
+#define PUB_DEFAULT_HZ                  10
+/* Events waiting for the publisher thread */
+#define PUB_EVENT_QUEUE                 32
+
+/* Well-known topics */
+#define PUB_TOPIC_IMU_ROLL              "imu.roll"
+#define PUB_TOPIC_IMU_PITCH             "imu.pitch"
+#define PUB_TOPIC_IMU_YAW               "imu.yaw"
+#define PUB_TOPIC_ALS_LUX               "als.lux"
+
+/* Well-known events, values in imu_motion.h */
+#define PUB_EVENT_IMU_QUADRANT          "imu.quadrant"
+#define PUB_EVENT_IMU_SHAKE             "imu.shake"
+#define PUB_EVENT_IMU_TAP               "imu.tap"
+#define PUB_EVENT_IMU_MOVING            "imu.moving"
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  GLOBAL PROTOTYPES
+ **********************/
+/*
+ * Register (or retune) a topic.
+ *  - max_hz: upper bound of signals per second for this topic (0 -> default)
+ *  - deadband: changes smaller than or equal to this are not emitted
+ * Returns 0 on success, negative on error.
+ */
+int32_t publisher_add_topic(const char *topic, uint32_t max_hz, double deadband);
+
+/*
+ * Store the latest value of a topic. Never blocks on the bus; callers may
+ * publish at any rate, only the most recent value is emitted. Unknown topics
+ * are registered on the fly with default settings.
+ */
+int32_t publish(const char *topic, double value);
+
+/*
+ * Queue an event. Unlike topics, every event is emitted, in order, in a
+ * signal of its own, with no rate cap or deadband. Never blocks on the bus.
+ * Returns -ENOSPC when PUB_EVENT_QUEUE events are already waiting.
+ */
+int32_t publish_event(const char *name, double value);
+
+/* Emit all due topics in one signal (true) or one signal per topic (false) */
+void publisher_set_batching(bool enable);
+
+int32_t publisher_fn_thread_handler();
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+
+#endif /* G_PUBLISHER_H */
@@ -0,0 +1,61 @@
+/**
+ * @file seqlock.h
+ *
+ */
+
+#ifndef G_SEQLOCK_H
+#define G_SEQLOCK_H
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+/*
+ * Sequence lock for a small value with a single writer: the sequence is odd
+ * while the writer copies the value in, and bumped to the next even number
+ * once it is complete. The writer never waits; a reader copies the value out
+ * and retries only if the sequence moved meanwhile, i.e. its copy is torn.
+ *
+ * Concurrent writers must be serialised by the caller.
+ */
+struct seqlock {
+    _Atomic uint32_t seq;
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  GLOBAL PROTOTYPES
+ **********************/
+void seqlock_init(struct seqlock *sl);
+
+/* Publish len bytes of src into the protected value dst */
+void seqlock_store(struct seqlock *sl, void *dst, const void *src, size_t len);
+
+/*
+ * Copy a consistent snapshot of the protected value src into dst. Returns
+ * the number of torn copies that had to be retried.
+ */
+uint32_t seqlock_load(const struct seqlock *sl, void *dst, const void *src, \
+                      size_t len);
+
+/**********************
+ *      MACROS
+ **********************/
+
+#endif /* G_SEQLOCK_H */
@@ -0,0 +1,130 @@
+/**
+ * @file shm_ring.h
+ *
+ */
+
+#ifndef G_SHM_RING_H
+#define G_SHM_RING_H
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define SHM_RING_MAGIC                  0x474F5252U /* "GORR" */
+#define SHM_RING_VERSION                1
+#define SHM_RING_ALIGN                  64
+#define SHM_RING_MAX_SUBS               8
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+/*
+ * Shared memory layout (memfd, mapped by the producer read-write and by the
+ * consumers read-only):
+ *
+ *   [struct shm_ring_hdr][slot 0][slot 1]...[slot slot_count - 1]
+ *
+ * Every slot starts with a 64-bit sequence word followed by slot_size bytes
+ * of payload, padded to SHM_RING_ALIGN. The sequence word is a per-slot
+ * seqlock: it is odd while the producer writes the slot and becomes
+ * 2 * (n + 1) once sample n is complete, so a reader knows both whether
+ * the copy it took is consistent and which sample it got.
+ */
+struct shm_ring_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_size;             /* payload bytes per slot */
+    uint32_t slot_count;            /* power of two */
+    uint32_t slot_stride;           /* bytes between two slots */
+    uint32_t reserved;
+    _Atomic uint64_t head;          /* sequence number of the next sample */
+    uint8_t pad[SHM_RING_ALIGN - 32];
+};
+
+struct shm_ring {
+    struct shm_ring_hdr *hdr;
+    uint8_t *slots;
+    size_t map_len;
+    int32_t mem_fd;
+    int32_t writable;
+
+    /* Consumer side: eventfd signalled by the producer after every write */
+    int32_t event_fd;
+
+    /*
+     * Producer side: one eventfd per subscriber, since a consumer draining
+     * a shared eventfd would steal the wake-up of the others. When full, the
+     * oldest subscription is recycled.
+     */
+    pthread_mutex_t sub_lock;
+    int32_t sub_fds[SHM_RING_MAX_SUBS];
+    uint32_t sub_next;
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  GLOBAL PROTOTYPES
+ **********************/
+/* Producer side: create the memfd and map it */
+int32_t shm_ring_create(struct shm_ring *ring, const char *name, \
+                        uint32_t slot_size, uint32_t slot_count);
+
+/*
+ * Producer side: create a notification eventfd for a new consumer.
+ * The returned fd stays owned by the ring, callers hand out a duplicate.
+ */
+int32_t shm_ring_subscribe(struct shm_ring *ring);
+
+/* Consumer side: map a ring received from the producer (fds are kept) */
+int32_t shm_ring_attach(struct shm_ring *ring, int32_t mem_fd, int32_t event_fd);
+
+void shm_ring_destroy(struct shm_ring *ring);
+
+/* Single producer only. Never blocks. */
+int32_t shm_ring_write(struct shm_ring *ring, const void *data);
+
+/*
+ * Copy the sample at *cursor into out and advance the cursor.
+ * Returns 0 on success, -EAGAIN when there is nothing new. When the reader
+ * fell behind by more than a ring, the cursor jumps to the oldest sample
+ * still available and the number of skipped samples is added to *lost.
+ */
+int32_t shm_ring_read(struct shm_ring *ring, uint64_t *cursor, void *out, \
+                      uint64_t *lost);
+
+/* Sequence number of the next sample the producer will write */
+uint64_t shm_ring_head(const struct shm_ring *ring);
+
+/* Consumer side: block until the producer signals new data or timeout */
+int32_t shm_ring_wait(struct shm_ring *ring, int32_t timeout_ms);
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+
+#endif /* G_SHM_RING_H */
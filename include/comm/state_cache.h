@@ -0,0 +1,92 @@
+/**
+ * @file state_cache.h
+ *
+ */
+
+#ifndef G_STATE_CACHE_H
+#define G_STATE_CACHE_H
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+#include <stdbool.h>
+#include <dbus/dbus.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define STATE_STR_LEN                   64
+/* Upper bound of PropertiesChanged signals per second */
+#define STATE_CHANGED_MAX_HZ            20
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+/*
+ * Device state exported as properties of SYS_MGR_DBUS_IFACE on the service
+ * object, through org.freedesktop.DBus.Properties.
+ */
+typedef enum {
+    STATE_BRIGHTNESS = 0,           /* i: percent */
+    STATE_AUDIO_GAIN,               /* d: master gain 0..1 */
+    STATE_AUDIO_GAIN_LEFT,          /* d */
+    STATE_AUDIO_GAIN_RIGHT,         /* d */
+    STATE_IMU_ROLL,                 /* d: degrees */
+    STATE_IMU_PITCH,                /* d: degrees */
+    STATE_IMU_YAW,                  /* d: degrees */
+    STATE_WIFI_CONNECTED,           /* b */
+    STATE_WIFI_SSID,                /* s */
+    STATE_PROP_COUNT,
+} state_prop_t;
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  GLOBAL PROTOTYPES
+ **********************/
+/*
+ * Setters, callable from any thread. A value equal to the cached one is
+ * not a change. Changes are coalesced into one PropertiesChanged signal.
+ */
+void state_cache_set_i32(state_prop_t prop, int32_t value);
+void state_cache_set_double(state_prop_t prop, double value);
+void state_cache_set_bool(state_prop_t prop, bool value);
+void state_cache_set_str(state_prop_t prop, const char *value);
+
+/* Any thread: cached value, -ENODATA until it has been set once */
+int32_t state_cache_get_i32(state_prop_t prop, int32_t *value);
+
+/*
+ * Listener thread only.
+ *  - init: returns the timer fd to watch, it fires when changes are due
+ *  - handle_call: reply to a Properties method call (Get, GetAll, Set)
+ *  - emit_changes: send the pending PropertiesChanged signal
+ */
+int32_t state_cache_init(void);
+DBusMessage *state_cache_handle_call(DBusMessage *msg);
+void state_cache_emit_changes(DBusConnection *conn);
+void state_cache_release(void);
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+
+#endif /* G_STATE_CACHE_H */
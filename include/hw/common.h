@@ -37,6 +37,7 @@ int32_t rumble_trigger(uint32_t event_id, uint32_t ff_type, uint32_t duration);
 /*=====================
  * Getter functions
  *====================*/
+int32_t get_brightness(void);
 
 /*=====================
  * Other functions
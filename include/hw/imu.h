@@ -13,12 +13,70 @@
 /*********************
  *      DEFINES
  *********************/
+/*
+ * IMU acquisition: the IIO buffer (/dev/iio:deviceN) when the device
+ * supports it, sysfs polling otherwise or when set to IMU_ACQ_POLL.
+ */
+#define IMU_ACQ_ENV                     "SYS_MGR_IMU_ACQ"
+#define IMU_ACQ_BUFFER                  "buffer"
+#define IMU_ACQ_POLL                    "poll"
+/* Sample rate of the IMU task in Hz, 100 when unset */
+#define IMU_HZ_ENV                      "SYS_MGR_IMU_HZ"
+/* Fusion engine: "kalman" (default), "madgwick" or "mahony", see imu_fusion.h */
+#define IMU_FUSION_ENV                  "SYS_MGR_IMU_FUSION"
+/*
+ * Calibration kept across starts, so the IMU starts without the blocking
+ * calibration. IMU_CALIB_NONE always calibrates at start.
+ */
+#define IMU_CALIB_PATH_ENV              "SYS_MGR_IMU_CALIB"
+#define IMU_DEFAULT_CALIB_PATH          "/var/lib/sys-mgr/imu-calib"
+#define IMU_CALIB_NONE                  "none"
+/*
+ * Raw sample recording and replay, see imu_record.h. IMU_RECORD_ENV: file
+ * the acquired samples are recorded to. IMU_REPLAY_ENV: recording fused in
+ * place of the device, at the recorded pace (default) or as fast as possible.
+ */
+#define IMU_RECORD_ENV                  "SYS_MGR_IMU_RECORD"
+#define IMU_REPLAY_ENV                  "SYS_MGR_IMU_REPLAY"
+#define IMU_REPLAY_PACE_ENV             "SYS_MGR_IMU_REPLAY_PACE"
+#define IMU_REPLAY_REALTIME             "realtime"
+#define IMU_REPLAY_FAST                 "fast"
+
 struct imu_angles {
     float roll;   /* degrees */
     float pitch;  /* degrees */
     float yaw;    /* degrees */
 };
 
+/*
+ * One slot of the sensor stream ring (see imu_stream_open()). Calibrated
+ * accel in g and gyro in deg/s, with the fused angles of the same step.
+ */
+struct imu_sample {
+    uint64_t ts_ns;         /* CLOCK_MONOTONIC */
+    float accel[3];
+    float gyro[3];
+    struct imu_angles angles;
+};
+
+/*
+ * Timing of the IMU loop. Counters run since the task started, rate and
+ * jitter cover the last second. Polled acquisition wakes on a fixed grid of
+ * deadlines, buffered acquisition is paced by the device.
+ */
+struct imu_loop_stats {
+    uint32_t target_hz;
+    uint32_t buffered;          /* 1: IIO buffer, 0: sysfs polling */
+    uint64_t samples;
+    uint64_t missed;            /* sample periods without a sample */
+    uint64_t overruns;          /* polled steps that ran past the next deadline */
+    double rate_hz;             /* measured */
+    uint32_t jitter_avg_ns;     /* |sample interval - period| */
+    uint32_t jitter_max_ns;
+    uint32_t wake_late_avg_ns;  /* polled: wake-up past the deadline */
+    uint32_t wake_late_max_ns;
+};
+
 /**********************
  *      TYPEDEFS
  **********************/
@@ -42,12 +100,13 @@ struct imu_angles {
  * Other functions
  *====================*/
 /*
- * Initialize module.
+ * Initialize module. Calibrates (blocking) unless the calibration cache
+ * holds one for this sensor and mounting.
  *  - path: sysfs base (must end with '/'), e.g. "/sys/bus/iio/devices/iio:device1/"
  *          if NULL -> "/sys/bus/iio/devices/iio:device0/"
  *  - sample_hz: desired sampling frequency (Hz)
  *  - q_angle,q_bias,r_measure: Kalman tuning parameters (typical 0.001,0.003,0.03)
- * Returns 0 on success, negative on error.
+ * Returns 0 on success, -EBUSY while the IMU thread runs, negative on error.
  */
 int32_t imu_kalman_init(const char *path, int32_t sample_hz,
             float q_angle, float q_bias, float r_measure);
@@ -58,18 +117,30 @@ int32_t imu_kalman_start(void);
 /* Stop acquisition thread (blocks until joined) */
 void imu_kalman_stop(void);
 
-/* Blocking calibration: device must be still. returns 0 on success */
+/*
+ * Blocking calibration: device must be still and level. Saved to the
+ * calibration cache, returns 0 on success.
+ */
 int32_t imu_kalman_calibrate(void);
 
-/* Reset yaw. If isnan(yaw_deg) -> reset to 0.0 */
+/*
+ * Reset yaw. If isnan(yaw_deg) -> reset to 0.0. While the IMU thread runs
+ * it applies the new heading before its next batch.
+ */
 void imu_kalman_reset_yaw(float yaw_deg);
 
-/* Snapshot latest fused angles (thread-safe) */
+/* Snapshot latest fused angles (thread-safe, never blocks the IMU thread) */
 struct imu_angles imu_get_angles(void);
 
-/* Runtime tuning (pass >0 to change parameter) */
+/*
+ * Runtime tuning (pass >0 to change parameter). While the IMU thread runs
+ * it applies the new tuning before its next batch.
+ */
 void imu_kalman_set_tuning(float q_angle, float q_bias, float r_measure);
 
+/* Latest loop timing. Returns 0, or -ENODEV before the loop has started */
+int32_t imu_get_loop_stats(struct imu_loop_stats *out);
+
 /* Running state */
 int32_t imu_kalman_is_running(void);
 
@@ -81,6 +152,14 @@ int32_t imu_kalman_is_running(void);
 int32_t imu_kalman_read_raw(float *ax, float *ay, float *az,
             float *gx, float *gy, float *gz);
 
+/*
+ * Open a subscription to the sample stream: a read-only shared ring of
+ * struct imu_sample plus an eventfd signalled after every sample.
+ * Both fds are new and owned by the caller. Returns 0 or negative errno.
+ */
+int32_t imu_stream_open(int32_t *mem_fd, int32_t *event_fd, \
+                        uint32_t *slot_size, uint32_t *slot_count);
+
 int32_t imu_fn_thread_handler();
 void imu_fn_thread_stop(void);
 /**********************
@@ -0,0 +1,98 @@
+/**
+ * @file imu_batch.h
+ *
+ */
+#ifndef G_IMU_BATCH_H
+#define G_IMU_BATCH_H
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+#include <stdbool.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+/*
+ * Samples fused together: one IIO FIFO read or one replay chunk. A multiple
+ * of the vector width, the calibration stage runs over whole vectors.
+ */
+#define IMU_BATCH_MAX                   32
+/* Gyro spikes above this (deg/s) are clamped */
+#define IMU_GYRO_CLAMP_DPS              2000.0f
+
+/*
+ * Gyro bias adaptation: samples under IMU_IDLE_GYRO_DPS on every axis with
+ * an accel magnitude within IMU_IDLE_ACCEL_TOL of 1 g count as idle, the
+ * offsets move toward them by IMU_BIAS_ADAPT_ALPHA per sample
+ */
+#define IMU_IDLE_GYRO_DPS               1.0f
+#define IMU_IDLE_ACCEL_TOL              0.03f
+#define IMU_BIAS_ADAPT_ALPHA            0.0008f
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+/*
+ * Raw counts to calibrated units as one affine map per sensor:
+ *   accel (g)     = accel_m * raw - accel_off
+ *   gyro (deg/s)  = gyro_m * raw - gyro_off
+ * the matrices (row-major) fold the sysfs scale, the mount matrix and the
+ * unit conversion.
+ */
+struct imu_calib {
+    float accel_m[9];
+    float gyro_m[9];
+    float accel_off[3];
+    float gyro_off[3];
+};
+
+/* Samples of a batch, one array per axis so each stage runs across samples */
+struct imu_batch {
+    uint32_t n;
+    uint64_t ts_ns[IMU_BATCH_MAX];
+    float dt[IMU_BATCH_MAX];            /* seconds since the previous sample */
+    float raw[6][IMU_BATCH_MAX];        /* accel x y z, gyro x y z counts */
+    float accel[3][IMU_BATCH_MAX];      /* g, offsets applied */
+    float gyro[3][IMU_BATCH_MAX];       /* deg/s, offsets applied, clamped */
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ * GLOBAL PROTOTYPES
+ **********************/
+/*=====================
+ * Other functions
+ *====================*/
+/*
+ * Fill accel and gyro of the batch from its raw counts: SSE or NEON when
+ * the target has them, scalar otherwise. Lanes past n are zeroed.
+ */
+void imu_calib_apply(const struct imu_calib *c, struct imu_batch *b);
+
+/* Name of the implementation imu_calib_apply was built with */
+const char *imu_calib_simd(void);
+
+/*
+ * Adapt the gyro offsets of c on the idle samples of a calibrated batch.
+ * The batch was calibrated with the offsets it starts with, the adapted
+ * ones apply from the next batch on. Returns whether they changed.
+ */
+bool imu_calib_adapt_gyro(struct imu_calib *c, const struct imu_batch *b);
+
+/*
+ * dt of every sample of the batch from its timestamps, 1 / hz where the
+ * interval is missing or implausible. prev_ts_ns: last timestamp of the
+ * previous batch, 0 at the start, updated.
+ */
+void imu_batch_dt(struct imu_batch *b, uint64_t *prev_ts_ns, int32_t hz);
+
+/**********************
+ *      MACROS
+ **********************/
+
+#endif /*  G_IMU_BATCH_H */
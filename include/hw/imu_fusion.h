@@ -0,0 +1,156 @@
+/**
+ * @file imu_fusion.h
+ *
+ */
+#ifndef G_IMU_FUSION_H
+#define G_IMU_FUSION_H
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <hw/imu.h>
+#include <hw/kalman.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+/*
+ * Attitude fusion engines, fed with calibrated accel (g) and gyro (deg/s):
+ *  - kalman:   two 1-D Kalman filters on accel tilt for roll and pitch, gyro
+ *              Z integrated for yaw. Angles are its state, so every update
+ *              pays the atan2f/sqrtf chain.
+ *  - madgwick: quaternion, gradient descent correction towards gravity.
+ *  - mahony:   quaternion, PI feedback of the gravity error.
+ * The quaternion engines update at a fixed cost without trigonometry, the
+ * angles are derived only when they are asked for.
+ */
+#define IMU_FUSION_KALMAN_NAME          "kalman"
+#define IMU_FUSION_MADGWICK_NAME        "madgwick"
+#define IMU_FUSION_MAHONY_NAME          "mahony"
+
+/* Default gains of the quaternion engines */
+#define IMU_FUSION_MADGWICK_BETA        0.033f
+#define IMU_FUSION_MAHONY_KP            0.5f
+#define IMU_FUSION_MAHONY_KI            0.02f
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+enum imu_fusion_type {
+    IMU_FUSION_KALMAN = 0,
+    IMU_FUSION_MADGWICK,
+    IMU_FUSION_MAHONY,
+    IMU_FUSION_COUNT,
+};
+
+struct imu_fusion_tuning {
+    /* kalman */
+    float q_angle;
+    float q_bias;
+    float r_measure;
+    /* madgwick */
+    float beta;
+    /* mahony */
+    float kp;
+    float ki;
+};
+
+/*
+ * Output of an update, what the angles are derived from. Small enough to be
+ * copied out after every sample.
+ */
+struct imu_attitude {
+    uint32_t type;              /* enum imu_fusion_type */
+    float q[4];                 /* w x y z, quaternion engines */
+    struct imu_angles angles;   /* kalman */
+};
+
+struct imu_fusion {
+    enum imu_fusion_type type;
+    struct imu_attitude att;
+
+    /* kalman */
+    struct kalman k_roll;
+    struct kalman k_pitch;
+
+    /* quaternion engines */
+    float beta;
+    float kp;
+    float ki;
+    float e_int[3];             /* mahony integral feedback, rad/s */
+
+    /* angles of att, derived on demand */
+    struct imu_angles angles;
+    bool angles_valid;
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ * GLOBAL PROTOTYPES
+ **********************/
+/*=====================
+ * Setter functions
+ *====================*/
+/* Change the tuning of the engine, only the fields > 0 are applied */
+void imu_fusion_set_tuning(struct imu_fusion *f, const struct imu_fusion_tuning *t);
+
+/* Set the heading, roll and pitch are kept */
+void imu_fusion_set_yaw(struct imu_fusion *f, float yaw_deg);
+
+/*=====================
+ * Getter functions
+ *====================*/
+/* Angles of the last update, derived once per update */
+struct imu_angles imu_fusion_angles(struct imu_fusion *f);
+
+/* Angles of an attitude copied out of the engine */
+void imu_attitude_angles(const struct imu_attitude *att, struct imu_angles *out);
+
+/*
+ * Attitude between a (t = 0) and b (t = 1) of the same engine: normalised
+ * quaternion lerp, or per angle for kalman (the caller keeps yaw unwrapped)
+ */
+void imu_attitude_lerp(const struct imu_attitude *a, const struct imu_attitude *b, \
+                       float t, struct imu_attitude *out);
+
+/* Engine name, and back. imu_fusion_parse returns the type or -EINVAL */
+const char *imu_fusion_name(enum imu_fusion_type type);
+int32_t imu_fusion_parse(const char *name);
+
+/*=====================
+ * Other functions
+ *====================*/
+/* Select the engine. NULL tuning means the defaults */
+void imu_fusion_init(struct imu_fusion *f, enum imu_fusion_type type, \
+                     const struct imu_fusion_tuning *t);
+
+/* Restart from a known attitude (degrees) */
+void imu_fusion_reset(struct imu_fusion *f, float roll, float pitch, float yaw);
+
+/*
+ * One step: accel in g and gyro in deg/s of the same instant, offsets
+ * applied, dt seconds after the previous step.
+ */
+void imu_fusion_update(struct imu_fusion *f, const float a[3], const float g[3], \
+                       float dt);
+
+/*
+ * n steps over per-axis arrays (a[k][i], g[k][i], dt[i]), e.g. the columns
+ * of a struct imu_batch. The attitude after every step is stored in att
+ * when it is not NULL.
+ */
+void imu_fusion_update_batch(struct imu_fusion *f, const float *const a[3], \
+                             const float *const g[3], const float *dt, uint32_t n, \
+                             struct imu_attitude *att);
+
+/**********************
+ *      MACROS
+ **********************/
+
+#endif /*  G_IMU_FUSION_H */
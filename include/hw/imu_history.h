@@ -0,0 +1,86 @@
+/**
+ * @file imu_history.h
+ *
+ */
+#ifndef G_IMU_HISTORY_H
+#define G_IMU_HISTORY_H
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+
+#include <hw/imu.h>
+#include <hw/imu_fusion.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+/*
+ * Samples kept by the history: a power of two covering at least 2 s at the
+ * highest IMU rate (1 kHz), 20 s at the default 100 Hz
+ */
+#define IMU_HISTORY_SLOTS               2048
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+/* One fusion step: its calibrated input and the attitude it produced */
+struct imu_history_entry {
+    uint64_t ts_ns;             /* CLOCK_MONOTONIC */
+    float accel[3];             /* g */
+    float gyro[3];              /* deg/s */
+    struct imu_attitude att;
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ * GLOBAL PROTOTYPES
+ **********************/
+/*=====================
+ * Setter functions
+ *====================*/
+/*
+ * Append the step of a sample, timestamps increasing. Single writer (the
+ * IMU thread), it never waits for the readers.
+ */
+void imu_history_push(const struct imu_history_entry *e);
+
+/*=====================
+ * Getter functions
+ *====================*/
+/*
+ * Lock-free queries, from any thread. Entries come oldest first; one
+ * overwritten by the writer while being read is left out.
+ */
+/* The n most recent entries. Returns the count */
+int32_t imu_history_latest(struct imu_history_entry *out, uint32_t n);
+
+/*
+ * Up to max entries taken after ts_ns, the oldest first: pass the timestamp
+ * of the last entry received to page through. Returns the count.
+ */
+int32_t imu_history_since(uint64_t ts_ns, struct imu_history_entry *out, \
+                          uint32_t max);
+
+/*
+ * State at ts_ns, interpolated between the two entries around it. Returns
+ * -ERANGE when ts_ns is outside the history, -EAGAIN when it moved under the
+ * query.
+ */
+int32_t imu_history_at(uint64_t ts_ns, struct imu_history_entry *out);
+
+/*=====================
+ * Other functions
+ *====================*/
+/* Forget every entry, e.g. when the engine changes */
+void imu_history_clear(void);
+
+/**********************
+ *      MACROS
+ **********************/
+
+#endif /*  G_IMU_HISTORY_H */
@@ -0,0 +1,122 @@
+/**
+ * @file imu_motion.h
+ *
+ */
+#ifndef G_IMU_MOTION_H
+#define G_IMU_MOTION_H
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <hw/imu.h>
+#include <hw/imu_batch.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+/*
+ * Orientation quadrants, the event value in degrees: the device axis
+ * pointing up. 0: +y, 90: +x, 180: -y, 270: -x. Lying flat keeps the last
+ * quadrant.
+ */
+#define IMU_QUADRANT_MIN_TILT_DEG       25.0f
+/* A new quadrant must be this far past the 45 degree boundary */
+#define IMU_QUADRANT_HYST_DEG           15.0f
+
+/*
+ * Taps and shakes work on the acceleration magnitude with gravity and slow
+ * motion removed (a high-pass). A tap is one spike above
+ * IMU_TAP_THRESHOLD_G shorter than IMU_TAP_MAX_MS; a second one within
+ * IMU_TAP_DOUBLE_MS makes a double tap, so a single tap is reported once
+ * that window has passed.
+ */
+#define IMU_TAP_THRESHOLD_G             0.5f
+#define IMU_TAP_MAX_MS                  60
+#define IMU_TAP_DOUBLE_MS               400
+/* Spikes closer than this to a tap are its ringing */
+#define IMU_TAP_MIN_GAP_MS              80
+/* Shake: IMU_SHAKE_COUNT spikes above IMU_SHAKE_THRESHOLD_G within the window */
+#define IMU_SHAKE_THRESHOLD_G           0.8f
+#define IMU_SHAKE_COUNT                 4
+#define IMU_SHAKE_WINDOW_MS             1000
+#define IMU_SHAKE_HOLDOFF_MS            1000
+
+/*
+ * Moving when the smoothed gyro norm (deg/s) or high-passed magnitude (g)
+ * goes above these, still after IMU_STILL_HOLD_MS under half of both
+ */
+#define IMU_MOVING_GYRO_DPS             5.0f
+#define IMU_MOVING_ACCEL_G              0.05f
+#define IMU_STILL_HOLD_MS               1000
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+enum imu_motion_type {
+    IMU_MOTION_QUADRANT = 0,    /* value: quadrant in degrees */
+    IMU_MOTION_SHAKE,           /* value: peak high-passed magnitude, g */
+    IMU_MOTION_TAP,             /* value: 1 single, 2 double */
+    IMU_MOTION_MOVING,          /* value: 1 moving, 0 still */
+    IMU_MOTION_COUNT,
+};
+
+struct imu_motion_event {
+    uint64_t ts_ns;
+    enum imu_motion_type type;
+    float value;
+};
+
+/* Detector state, owned by the IMU thread */
+struct imu_motion {
+    bool started;
+    float lp_mag;                   /* slow magnitude, the high-pass base */
+    float act_accel;                /* smoothed activity, moving vs still */
+    float act_gyro;
+
+    int32_t quadrant;               /* degrees, -1 before the first one */
+
+    bool spike;                     /* above the tap threshold */
+    uint64_t spike_ns;              /* its start */
+    uint64_t tap_ns;                /* single tap waiting for a second, 0: none */
+
+    uint64_t shake_edges[IMU_SHAKE_COUNT];  /* spike starts, a ring */
+    float shake_peaks[IMU_SHAKE_COUNT];
+    uint32_t shake_edge;
+    bool shake_high;
+    uint64_t shake_until_ns;        /* holdoff after a shake */
+
+    int32_t moving;                 /* 1, 0, -1 before the first decision */
+    uint64_t motion_ns;             /* last sample seen moving */
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ * GLOBAL PROTOTYPES
+ **********************/
+/*=====================
+ * Other functions
+ *====================*/
+void imu_motion_init(struct imu_motion *m);
+
+/*
+ * Run the detector over a calibrated batch. angles: attitude at the end of
+ * the batch, or NULL when it was not derived for this batch (the quadrant
+ * is then left as is). Writes up to max events, returns the count.
+ */
+uint32_t imu_motion_update(struct imu_motion *m, const struct imu_batch *b, \
+                           const struct imu_angles *angles, \
+                           struct imu_motion_event *ev, uint32_t max);
+
+const char *imu_motion_name(enum imu_motion_type type);
+
+/**********************
+ *      MACROS
+ **********************/
+
+#endif /*  G_IMU_MOTION_H */
@@ -0,0 +1,92 @@
+/**
+ * @file imu_record.h
+ *
+ */
+#ifndef G_IMU_RECORD_H
+#define G_IMU_RECORD_H
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdio.h>
+#include <stdint.h>
+
+#include <hw/imu_batch.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+/*
+ * Raw IMU recording: a header, then one struct imu_record_sample per
+ * sample as the acquisition delivered it, before any calibration. Host
+ * byte order, the file is replayed on the machine type that recorded it.
+ */
+#define IMU_RECORD_MAGIC                "IMUR"
+#define IMU_RECORD_VERSION              1
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+struct imu_record_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t sample_hz;
+    uint32_t reserved;
+    /* calibration in use when the recording started */
+    struct imu_calib calib;
+};
+
+struct imu_record_sample {
+    uint64_t ts_ns;             /* CLOCK_MONOTONIC */
+    int32_t raw[6];             /* accel x y z, gyro x y z counts */
+};
+
+/* A recording open for writing or for replay */
+struct imu_record {
+    FILE *fp;
+    struct imu_record_header hdr;
+    uint64_t samples;
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ * GLOBAL PROTOTYPES
+ **********************/
+/*=====================
+ * Setter functions
+ *====================*/
+/* Create the recording at path. Returns 0 or a negative errno */
+int32_t imu_record_create(struct imu_record *r, const char *path, \
+                          uint32_t sample_hz, const struct imu_calib *calib);
+
+/*
+ * Append the raw counts and timestamps of a batch. Buffered: the IMU
+ * thread pays a copy per sample, the file is written in blocks.
+ */
+int32_t imu_record_write(struct imu_record *r, const struct imu_batch *b);
+
+/*=====================
+ * Getter functions
+ *====================*/
+/* Open a recording for replay, its header in r->hdr */
+int32_t imu_record_open(struct imu_record *r, const char *path);
+
+/*
+ * Next samples of the recording into the raw counts and timestamps of b,
+ * up to max (IMU_BATCH_MAX at most). Returns the count, 0 at the end.
+ */
+int32_t imu_record_read(struct imu_record *r, struct imu_batch *b, uint32_t max);
+
+/*=====================
+ * Other functions
+ *====================*/
+void imu_record_close(struct imu_record *r);
+
+/**********************
+ *      MACROS
+ **********************/
+
+#endif /*  G_IMU_RECORD_H */
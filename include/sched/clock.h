@@ -0,0 +1,49 @@
+/**
+ * @file clock.h
+ *
+ */
+
+#ifndef G_CLOCK_H
+#define G_CLOCK_H
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+#include <time.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  GLOBAL PROTOTYPES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+/*
+ * CLOCK_MONOTONIC in nanoseconds: the time base of deadlines, latencies
+ * and sample timestamps across sys-mgr and sys-utils
+ */
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif /* G_CLOCK_H */
@@ -10,6 +10,9 @@
  *********************/
 #include <stdint.h>
 #include <stdbool.h>
+#include <dbus/dbus.h>
+
+#include <comm/cmd_payload.h>
 
 /*********************
  *      DEFINES
@@ -43,6 +46,8 @@ void * main_task_handler(void* arg);
 
 int32_t process_opcode_endless(uint32_t opcode, void *data);
 int32_t process_opcode(uint32_t opcode, void *data);
+bool opcode_is_inline(uint32_t opcode);
+int32_t process_opcode_inline(const remote_cmd_t *cmd, DBusMessageIter *iter);
 int32_t create_local_simple_task(uint8_t flow, uint8_t duration, uint32_t opcode);
 int32_t create_remote_task(uint8_t flow, void *data);
 
@@ -9,6 +9,7 @@
  *      INCLUDES
  *********************/
 #include <stdint.h>
+#include <stdbool.h>
 #include <pthread.h>
 
 #include <comm/dbus_comm.h>
@@ -32,6 +33,25 @@ typedef enum {
     ENDLESS,
 } work_duration_t;
 
+/*
+ * Work is queued per client (the component_id of remote work) and clients
+ * are served by deficit round-robin, one item costing one credit. Clients
+ * past WQ_MAX_CLIENTS - 1 share the last queue.
+ */
+#define WQ_MAX_CLIENTS                  16
+#define WQ_CLIENT_NAME_LEN              32
+/* Work of sys-mgr itself, never subject to a quota */
+#define WQ_LOCAL_CLIENT                 "sys-mgr"
+#define WQ_OTHER_CLIENT                 "*"
+#define WQ_DEFAULT_WEIGHT               1
+/* Queued items allowed per client, further pushes fail with -EBUSY */
+#define WQ_DEFAULT_QUOTA                64
+/*
+ * Per-client overrides, "name:weight[:quota],...", a quota of 0 meaning
+ * unlimited. e.g. SYS_MGR_WQ_CLIENTS="terminal-ui:4:128,logger:1:16"
+ */
+#define WQ_CLIENTS_ENV                  "SYS_MGR_WQ_CLIENTS"
+
 /**********************
  *      TYPEDEFS
  **********************/
@@ -41,12 +61,42 @@ typedef struct work {
     uint8_t duration;
     uint32_t opcode;
     void *data;
+    /* Optional, called with the opcode result before the work is deleted */
+    void (*done)(struct work *w, int32_t ret);
+    void *done_data;
+    const char *client;         /* component_id, NULL for WQ_LOCAL_CLIENT */
+    uint64_t enqueue_ns;        /* CLOCK_MONOTONIC, set by push/pop */
+    uint64_t dequeue_ns;
     struct work *next;
 } work_t;
 
-typedef struct workqueue {
+struct wq_client_stats {
+    char name[WQ_CLIENT_NAME_LEN];
+    uint32_t weight;
+    uint32_t quota;                 /* 0: unlimited */
+    uint32_t depth;
+    uint32_t depth_peak;
+    uint64_t enqueued;
+    uint64_t dequeued;
+    uint64_t dropped;               /* refused over quota */
+    uint64_t wait_sum_ns;           /* enqueue to dequeue, over dequeued */
+    uint64_t wait_max_ns;
+};
+
+typedef struct wq_client {
+    struct wq_client_stats st;
+    int32_t deficit;
     work_t *head;
     work_t *tail;
+    bool active;                    /* has work, linked in the round */
+    struct wq_client *next_active;
+} wq_client_t;
+
+typedef struct workqueue {
+    wq_client_t clients[WQ_MAX_CLIENTS];
+    int32_t n_clients;
+    wq_client_t *active_head;       /* client being served */
+    wq_client_t *active_tail;
     pthread_mutex_t mutex;
     pthread_cond_t cond;
 } workqueue_t;
@@ -84,9 +134,11 @@ typedef struct workqueue {
 work_t *create_work(uint8_t type, uint8_t flow, uint8_t duration, \
                     uint32_t opcode, void *data);
 void delete_work(work_t *work);
-void push_work(work_t *work);
+int32_t push_work(work_t *work);
+int32_t push_work_list(work_t *head);
 work_t* pop_work_wait();
 void workqueue_stop();
+int32_t workqueue_get_stats(struct wq_client_stats *out, int32_t max);
 
 /**********************
  *   STATIC FUNCTIONS
@@ -14,6 +14,7 @@
 
 #include <audio/audio.h>
 #include <audio/sound.h>
+#include <comm/state_cache.h>
 
 /*********************
  *      DEFINES
@@ -85,6 +86,10 @@ int32_t snd_sys_init()
     audio_mgr_set_master_gain(&mgr, 0.8f);
     if (mgr.fmt.channels >= 1) audio_mgr_set_channel_gain(&mgr, 0, 1.0f);
     if (mgr.fmt.channels >= 2) audio_mgr_set_channel_gain(&mgr, 1, 1.0f);
+    state_cache_set_double(STATE_AUDIO_GAIN, mgr.master_gain);
+    state_cache_set_double(STATE_AUDIO_GAIN_LEFT, mgr.ch_gain[0]);
+    state_cache_set_double(STATE_AUDIO_GAIN_RIGHT, \
+                           mgr.fmt.channels >= 2 ? mgr.ch_gain[1] : mgr.ch_gain[0]);
 
     /* 5) play first file (we already have it mapped) */
     ret = audio_play_wav_map(&mgr, &first, false);
@@ -0,0 +1,167 @@
+/**
+ * @file capture.c
+ *
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <comm/capture.h>
+#include <sched/clock.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define CAPTURE_STDIO_BUF               (64 * 1024)
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *capture_fp;
+static char *capture_buf;
+static uint64_t capture_start_ns;
+static uint64_t capture_records;
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+/* Called with capture_mutex held */
+static void capture_close_locked(void)
+{
+    if (!capture_fp)
+        return;
+
+    fclose(capture_fp);
+    capture_fp = NULL;
+    free(capture_buf);
+    capture_buf = NULL;
+    LOG_INFO("Traffic capture closed, %llu record(s)", \
+             (unsigned long long)capture_records);
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+int32_t capture_init(void)
+{
+    const char *path;
+    int32_t ret;
+
+    path = getenv(CAPTURE_PATH_ENV);
+    if (!path || !*path)
+        return 0;
+
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_fp) {
+        pthread_mutex_unlock(&capture_mutex);
+        return 0;
+    }
+
+    capture_fp = fopen(path, "wb");
+    if (!capture_fp) {
+        ret = -errno;
+        pthread_mutex_unlock(&capture_mutex);
+        LOG_ERROR("Failed to open capture %s: %s", path, strerror(-ret));
+        return ret;
+    }
+
+    // Records are small, let stdio batch them into large writes
+    capture_buf = malloc(CAPTURE_STDIO_BUF);
+    if (capture_buf)
+        setvbuf(capture_fp, capture_buf, _IOFBF, CAPTURE_STDIO_BUF);
+
+    capture_start_ns = now_ns();
+    capture_records = 0;
+    ret = capture_write_header(capture_fp, capture_start_ns);
+    if (ret)
+        capture_close_locked();
+    pthread_mutex_unlock(&capture_mutex);
+
+    if (ret)
+        LOG_ERROR("Failed to write capture header to %s", path);
+    else
+        LOG_INFO("Capturing command traffic to %s", path);
+    return ret;
+}
+
+void capture_deinit(void)
+{
+    pthread_mutex_lock(&capture_mutex);
+    capture_close_locked();
+    pthread_mutex_unlock(&capture_mutex);
+}
+
+void capture_record(const remote_cmd_t *cmd)
+{
+    uint8_t rec[CAPTURE_RECORD_MAX];
+    uint64_t offset_ns;
+    int32_t len;
+
+    // Unlocked peek, capture is opened before any listener starts
+    if (!capture_fp)
+        return;
+
+    pthread_mutex_lock(&capture_mutex);
+    if (!capture_fp) {
+        pthread_mutex_unlock(&capture_mutex);
+        return;
+    }
+
+    offset_ns = cmd->rx_ns > capture_start_ns ? cmd->rx_ns - capture_start_ns : 0;
+    len = capture_encode(cmd, offset_ns, rec, sizeof(rec));
+    if (len < 0) {
+        pthread_mutex_unlock(&capture_mutex);
+        LOG_WARN("Opcode %u not captured: %d", cmd->opcode, len);
+        return;
+    }
+
+    if (fwrite(rec, len, 1, capture_fp) != 1) {
+        LOG_ERROR("Capture write failed, capture stopped");
+        capture_close_locked();
+    } else {
+        capture_records++;
+    }
+    pthread_mutex_unlock(&capture_mutex);
+}
+
+void capture_flush(void)
+{
+    if (!capture_fp)
+        return;
+
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_fp)
+        fflush(capture_fp);
+    pthread_mutex_unlock(&capture_mutex);
+}
@@ -0,0 +1,223 @@
+/**
+ * @file cmd_batch.c
+ *
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <dbus/dbus.h>
+
+#include <comm/cmd_payload.h>
+#include <comm/frame_codec.h>
+#include <comm/dbus_comm.h>
+#include <comm/dbus_router.h>
+#include <comm/cmd_batch.h>
+#include <comm/capture.h>
+#include <sched/workqueue.h>
+#include <sched/clock.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+struct cmd_batch;
+
+/* done_data of each sub-command work */
+struct cmd_batch_slot {
+    struct cmd_batch *batch;
+    uint32_t idx;
+};
+
+/*
+ * In-flight batch. Each slot is written by the one task running its
+ * command, the last one to complete fills in the reply and frees the batch.
+ * The reply is created by the listener on dispatch: the call itself is not
+ * touched from the tasks, libdbus updates its header cache on reads.
+ */
+struct cmd_batch {
+    DBusMessage *reply;
+    atomic_uint remaining;
+    uint32_t count;
+    int32_t umid[FRAME_BATCH_MAX];
+    int32_t result[FRAME_BATCH_MAX];
+    struct cmd_batch_slot slots[FRAME_BATCH_MAX];
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+static int32_t cmd_batch_fill_reply(struct cmd_batch *b)
+{
+    DBusMessageIter iter, array, st;
+    int32_t status = 0;
+    dbus_bool_t ok;
+
+    for (uint32_t i = 0; i < b->count && !status; i++)
+        status = b->result[i];
+
+    dbus_message_iter_init_append(b->reply, &iter);
+    ok = dbus_message_iter_append_basic(&iter, DBUS_TYPE_INT32, &status);
+    ok = ok && dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, \
+                                                "(ii)", &array);
+    for (uint32_t i = 0; ok && i < b->count; i++) {
+        ok = dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, \
+                                              NULL, &st);
+        ok = ok && dbus_message_iter_append_basic(&st, DBUS_TYPE_INT32, \
+                                                  &b->umid[i]);
+        ok = ok && dbus_message_iter_append_basic(&st, DBUS_TYPE_INT32, \
+                                                  &b->result[i]);
+        ok = ok && dbus_message_iter_close_container(&array, &st);
+    }
+    ok = ok && dbus_message_iter_close_container(&iter, &array);
+
+    return ok ? 0 : -ENOMEM;
+}
+
+/* Work done hook, runs on whichever thread executed the command */
+static void cmd_batch_work_done(work_t *w, int32_t ret)
+{
+    struct cmd_batch_slot *slot = w->done_data;
+    struct cmd_batch *b = slot->batch;
+
+    b->result[slot->idx] = ret;
+    if (atomic_fetch_sub(&b->remaining, 1) != 1)
+        return;
+
+    if (cmd_batch_fill_reply(b)) {
+        // The caller is left to its timeout
+        LOG_ERROR("Failed to build batch reply");
+        dbus_message_unref(b->reply);
+    } else {
+        dbus_queue_message(b->reply);
+    }
+
+    free(b);
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+DBusMessage *cmd_batch_dispatch(DBusMessage *msg)
+{
+    struct frame_batch fb;
+    uint64_t rx_ns;
+    struct cmd_batch *b;
+    work_t *head = NULL, **link = &head, *w;
+    uint8_t flow;
+    int32_t ret;
+
+    rx_ns = now_ns();
+    ret = frame_decode_batch(msg, &fb);
+    if (ret) {
+        LOG_ERROR("Failed to decode batch frame: %d", ret);
+        return dbus_new_cmd_reply(msg, ret);
+    }
+
+    for (uint32_t i = 0; i < fb.count; i++) {
+        fb.cmds[i]->rx_ns = rx_ns;
+        capture_record(fb.cmds[i]);
+    }
+
+    // An endless command would never complete the batch
+    for (uint32_t i = 0; i < fb.count; i++) {
+        if (fb.cmds[i]->duration == ENDLESS) {
+            LOG_WARN("Batch umid %u: endless opcode %u", fb.umid, \
+                     fb.cmds[i]->opcode);
+            frame_batch_release(&fb);
+            return dbus_new_cmd_reply(msg, -EPROTO);
+        }
+    }
+
+    b = calloc(1, sizeof(*b));
+    if (b)
+        b->reply = dbus_message_new_method_return(msg);
+    if (!b || !b->reply) {
+        free(b);
+        frame_batch_release(&fb);
+        return dbus_new_cmd_reply(msg, -ENOMEM);
+    }
+
+    /*
+     * The task handler runs blocking work itself, one item at a time, and
+     * takes the work of a client in queue order, so blocking work executes
+     * in frame order.
+     */
+    flow = fb.mode == FRAME_BATCH_ORDERED ? BLOCK : NON_BLOCK;
+    b->count = fb.count;
+    atomic_init(&b->remaining, fb.count);
+
+    for (uint32_t i = 0; i < fb.count; i++) {
+        w = create_work(REMOTE, flow, fb.cmds[i]->duration, \
+                        fb.cmds[i]->opcode, fb.cmds[i]);
+        if (!w) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+
+        // The work owns the command from here
+        b->umid[i] = fb.cmds[i]->umid;
+        w->client = fb.cmds[i]->component_id;
+        fb.cmds[i] = NULL;
+        b->slots[i].batch = b;
+        b->slots[i].idx = i;
+        w->done = cmd_batch_work_done;
+        w->done_data = &b->slots[i];
+        *link = w;
+        link = &w->next;
+    }
+
+    LOG_DEBUG("Batch umid %u from %s: %u command(s), %s", fb.umid, \
+              fb.component_id, fb.count, \
+              fb.mode == FRAME_BATCH_ORDERED ? "ordered" : "parallel");
+
+    // Accepted or refused as a whole against the sender's quota
+    ret = push_work_list(head);
+    if (ret)
+        goto fail;
+
+    frame_batch_release(&fb);
+    return DBUS_ROUTE_REPLY_DEFERRED;
+
+fail:
+    while (head) {
+        w = head;
+        head = head->next;
+        delete_work(w);
+    }
+    frame_batch_release(&fb);
+    dbus_message_unref(b->reply);
+    free(b);
+    return dbus_new_cmd_reply(msg, ret);
+}
@@ -145,3 +145,18 @@ int32_t remote_cmd_add_int(remote_cmd_t *cmd, const char *key, int32_t value)
     return 0;
 }
 
+int32_t remote_cmd_add_double(remote_cmd_t *cmd, const char *key, double value)
+{
+    payload_t *entry;
+
+    if (cmd->entry_count >= MAX_ENTRIES)
+        return -1;
+
+    entry = &cmd->entries[cmd->entry_count++];
+    entry->key = key;
+    entry->data_type = DBUS_TYPE_DOUBLE;
+    entry->data_length = sizeof(double);
+    entry->value.dbl = value;
+
+    return 0;
+}
@@ -0,0 +1,302 @@
+/**
+ * @file capture_codec.c
+ *
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <dbus/dbus.h>
+
+#include <comm/cmd_payload.h>
+#include <comm/capture_codec.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+/* Write or read position in a record; the first error sticks */
+struct capture_cursor {
+    uint8_t *buf;
+    size_t pos;
+    size_t size;
+    int32_t err;
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+static void capture_put(struct capture_cursor *c, const void *src, size_t n)
+{
+    if (c->err)
+        return;
+    if (n > c->size - c->pos) {
+        c->err = -ENOSPC;
+        return;
+    }
+
+    memcpy(c->buf + c->pos, src, n);
+    c->pos += n;
+}
+
+static void capture_put_str8(struct capture_cursor *c, const char *s)
+{
+    uint8_t len;
+
+    if (!s || strlen(s) > UINT8_MAX) {
+        c->err = c->err ? c->err : -EINVAL;
+        return;
+    }
+
+    len = (uint8_t)strlen(s);
+    capture_put(c, &len, 1);
+    capture_put(c, s, len);
+}
+
+static void capture_put_entry(struct capture_cursor *c, const payload_t *e)
+{
+    uint8_t type = (uint8_t)e->data_type;
+    uint16_t len;
+
+    capture_put_str8(c, e->key);
+    capture_put(c, &type, 1);
+
+    switch (e->data_type) {
+    case DBUS_TYPE_INT32:
+        capture_put(c, &e->value.i32, 4);
+        break;
+    case DBUS_TYPE_UINT32:
+        capture_put(c, &e->value.u32, 4);
+        break;
+    case DBUS_TYPE_DOUBLE:
+        capture_put(c, &e->value.dbl, 8);
+        break;
+    case DBUS_TYPE_STRING:
+        if (!e->value.str || strlen(e->value.str) > UINT16_MAX) {
+            c->err = c->err ? c->err : -EINVAL;
+            break;
+        }
+        len = (uint16_t)strlen(e->value.str);
+        capture_put(c, &len, 2);
+        capture_put(c, e->value.str, len);
+        break;
+    default:
+        c->err = c->err ? c->err : -EINVAL;
+        break;
+    }
+}
+
+static void capture_get(struct capture_cursor *c, void *dst, size_t n)
+{
+    if (c->err)
+        return;
+    if (n > c->size - c->pos) {
+        c->err = -EPROTO;
+        return;
+    }
+
+    memcpy(dst, c->buf + c->pos, n);
+    c->pos += n;
+}
+
+/* Copy a string of len bytes into the pool of out, terminated */
+static void capture_get_str(struct capture_cursor *c, size_t len, \
+                            remote_cmd_t *out, const char **dst)
+{
+    char *s;
+
+    if (c->err)
+        return;
+    if (len > c->size - c->pos) {
+        c->err = -EPROTO;
+        return;
+    }
+    if (len + 1 > CMD_STR_POOL_SIZE - out->str_used) {
+        c->err = -ENOSPC;
+        return;
+    }
+
+    s = out->str_pool + out->str_used;
+    memcpy(s, c->buf + c->pos, len);
+    s[len] = '\0';
+    out->str_used += len + 1;
+    c->pos += len;
+    *dst = s;
+}
+
+static void capture_get_str8(struct capture_cursor *c, remote_cmd_t *out, \
+                             const char **dst)
+{
+    uint8_t len = 0;
+
+    capture_get(c, &len, 1);
+    capture_get_str(c, len, out, dst);
+}
+
+static void capture_get_entry(struct capture_cursor *c, remote_cmd_t *out, \
+                              payload_t *e)
+{
+    uint8_t type = 0;
+    uint16_t len = 0;
+
+    capture_get_str8(c, out, &e->key);
+    capture_get(c, &type, 1);
+    if (c->err)
+        return;
+
+    e->data_type = type;
+    switch (type) {
+    case DBUS_TYPE_INT32:
+        e->data_length = 4;
+        capture_get(c, &e->value.i32, 4);
+        break;
+    case DBUS_TYPE_UINT32:
+        e->data_length = 4;
+        capture_get(c, &e->value.u32, 4);
+        break;
+    case DBUS_TYPE_DOUBLE:
+        e->data_length = 8;
+        capture_get(c, &e->value.dbl, 8);
+        break;
+    case DBUS_TYPE_STRING:
+        capture_get(c, &len, 2);
+        e->data_length = len;
+        capture_get_str(c, len, out, &e->value.str);
+        break;
+    default:
+        c->err = -EPROTO;
+        break;
+    }
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+int32_t capture_write_header(FILE *fp, uint64_t start_ns)
+{
+    uint8_t hdr[CAPTURE_HEADER_SIZE] = { 0 };
+    uint16_t version = CAPTURE_VERSION;
+
+    memcpy(hdr, CAPTURE_MAGIC, 4);
+    memcpy(hdr + 4, &version, 2);
+    memcpy(hdr + 8, &start_ns, 8);
+
+    return fwrite(hdr, sizeof(hdr), 1, fp) == 1 ? 0 : -EIO;
+}
+
+int32_t capture_read_header(FILE *fp, struct capture_header *hdr)
+{
+    uint8_t raw[CAPTURE_HEADER_SIZE];
+
+    if (fread(raw, sizeof(raw), 1, fp) != 1)
+        return -EIO;
+
+    if (memcmp(raw, CAPTURE_MAGIC, 4))
+        return -EPROTO;
+
+    memcpy(&hdr->version, raw + 4, 2);
+    memcpy(&hdr->start_ns, raw + 8, 8);
+    if (hdr->version > CAPTURE_VERSION)
+        return -EPROTONOSUPPORT;
+
+    return 0;
+}
+
+int32_t capture_encode(const remote_cmd_t *cmd, uint64_t offset_ns, \
+                       uint8_t *buf, size_t size)
+{
+    struct capture_cursor c = { .buf = buf, .pos = 2, .size = size };
+    uint8_t hdr[3] = { cmd->flow, cmd->duration, (uint8_t)cmd->entry_count };
+    uint16_t len;
+
+    if (size < 2)
+        return -ENOSPC;
+    if (cmd->entry_count > MAX_ENTRIES)
+        return -EINVAL;
+    // The length prefix bounds a record
+    if (c.size > 2 + UINT16_MAX)
+        c.size = 2 + UINT16_MAX;
+
+    capture_put(&c, &offset_ns, 8);
+    capture_put(&c, &cmd->umid, 4);
+    capture_put(&c, &cmd->opcode, 4);
+    capture_put(&c, hdr, sizeof(hdr));
+    capture_put_str8(&c, cmd->component_id);
+    for (uint32_t i = 0; i < cmd->entry_count; i++)
+        capture_put_entry(&c, &cmd->entries[i]);
+    if (c.err)
+        return c.err;
+
+    len = (uint16_t)(c.pos - 2);
+    memcpy(buf, &len, 2);
+    return (int32_t)c.pos;
+}
+
+int32_t capture_read(FILE *fp, remote_cmd_t *out, uint64_t *offset_ns)
+{
+    uint8_t buf[CAPTURE_RECORD_MAX];
+    struct capture_cursor c = { .buf = buf };
+    uint8_t hdr[3] = { 0 };
+    uint16_t len;
+
+    if (fread(&len, 2, 1, fp) != 1)
+        return 0;
+    if (len > sizeof(buf))
+        return -EPROTO;
+    if (fread(buf, len, 1, fp) != 1) {
+        LOG_WARN("Capture ends with a truncated record");
+        return 0;
+    }
+    c.size = len;
+
+    memset(out, 0, sizeof(*out));
+    capture_get(&c, offset_ns, 8);
+    capture_get(&c, &out->umid, 4);
+    capture_get(&c, &out->opcode, 4);
+    capture_get(&c, hdr, sizeof(hdr));
+    capture_get_str8(&c, out, &out->component_id);
+    if (c.err)
+        return c.err;
+
+    out->flow = hdr[0];
+    out->duration = hdr[1];
+    out->entry_count = hdr[2];
+    if (out->entry_count > MAX_ENTRIES)
+        return -EPROTO;
+
+    for (uint32_t i = 0; i < out->entry_count; i++)
+        capture_get_entry(&c, out, &out->entries[i]);
+    if (c.err)
+        return c.err;
+
+    return c.pos == c.size ? 1 : -EPROTO;
+}
@@ -0,0 +1,497 @@
+/**
+ * @file frame_codec.c
+ *
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dbus/dbus.h>
+
+#include <comm/cmd_payload.h>
+#include <comm/frame_codec.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+/* Variant signature of a payload type, NULL if the type is not supported */
+static const char *frame_value_sig(uint32_t data_type)
+{
+    switch (data_type) {
+    case DBUS_TYPE_STRING:
+        return DBUS_TYPE_STRING_AS_STRING;
+    case DBUS_TYPE_INT32:
+        return DBUS_TYPE_INT32_AS_STRING;
+    case DBUS_TYPE_UINT32:
+        return DBUS_TYPE_UINT32_AS_STRING;
+    case DBUS_TYPE_DOUBLE:
+        return DBUS_TYPE_DOUBLE_AS_STRING;
+    default:
+        return NULL;
+    }
+}
+
+static int32_t frame_encode_entry(DBusMessageIter *array, \
+                                  const payload_t *entry)
+{
+    DBusMessageIter st, variant;
+    const char *sig;
+    int32_t type, len;
+    dbus_bool_t ok;
+
+    sig = frame_value_sig(entry->data_type);
+    if (!sig || !entry->key || \
+        (entry->data_type == DBUS_TYPE_STRING && !entry->value.str)) {
+        LOG_ERROR("Invalid entry '%s' of type %u", \
+                  entry->key ? entry->key : "(null)", entry->data_type);
+        return -EINVAL;
+    }
+
+    type = entry->data_type;
+    switch (type) {
+    case DBUS_TYPE_STRING:
+        len = strlen(entry->value.str) + 1;
+        break;
+    case DBUS_TYPE_DOUBLE:
+        len = sizeof(double);
+        break;
+    default:
+        len = sizeof(int32_t);
+        break;
+    }
+
+    ok = dbus_message_iter_open_container(array, DBUS_TYPE_STRUCT, NULL, &st);
+    ok = ok && dbus_message_iter_append_basic(&st, DBUS_TYPE_STRING, \
+                                              &entry->key);
+    ok = ok && dbus_message_iter_append_basic(&st, DBUS_TYPE_INT32, &type);
+    ok = ok && dbus_message_iter_append_basic(&st, DBUS_TYPE_INT32, &len);
+    ok = ok && dbus_message_iter_open_container(&st, DBUS_TYPE_VARIANT, sig, \
+                                                &variant);
+    // Every supported value is a basic type stored at the start of the union
+    if (type == DBUS_TYPE_STRING)
+        ok = ok && dbus_message_iter_append_basic(&variant, type, \
+                                                  &entry->value.str);
+    else
+        ok = ok && dbus_message_iter_append_basic(&variant, type, \
+                                                  &entry->value);
+    ok = ok && dbus_message_iter_close_container(&st, &variant);
+    ok = ok && dbus_message_iter_close_container(array, &st);
+
+    return ok ? 0 : -ENOMEM;
+}
+
+/* Copy a string out of the message into the frame's own pool */
+static int32_t frame_pool_copy(remote_cmd_t *out, const char *src, \
+                               const char **dst)
+{
+    size_t len = strlen(src) + 1;
+
+    if (len > CMD_STR_POOL_SIZE - out->str_used)
+        return -ENOSPC;
+
+    memcpy(out->str_pool + out->str_used, src, len);
+    *dst = out->str_pool + out->str_used;
+    out->str_used += len;
+    return 0;
+}
+
+static int32_t frame_decode_entry(DBusMessageIter *array, remote_cmd_t *out, \
+                                  payload_t *entry)
+{
+    DBusMessageIter st, variant;
+    const char *key, *str;
+    int32_t type, len;
+
+    dbus_message_iter_recurse(array, &st);
+    dbus_message_iter_get_basic(&st, &key);
+    dbus_message_iter_next(&st);
+    dbus_message_iter_get_basic(&st, &type);
+    dbus_message_iter_next(&st);
+    dbus_message_iter_get_basic(&st, &len);
+    dbus_message_iter_next(&st);
+    dbus_message_iter_recurse(&st, &variant);
+
+    // The declared type must be supported and match what was actually sent
+    if (!frame_value_sig(type) || \
+        dbus_message_iter_get_arg_type(&variant) != type) {
+        LOG_WARN("Entry '%s' declares type %d, carries %c", key, type, \
+                 dbus_message_iter_get_arg_type(&variant));
+        return -EPROTO;
+    }
+
+    if (frame_pool_copy(out, key, &entry->key))
+        return -ENOSPC;
+
+    entry->data_type = type;
+    switch (type) {
+    case DBUS_TYPE_STRING:
+        dbus_message_iter_get_basic(&variant, &str);
+        if (frame_pool_copy(out, str, &entry->value.str))
+            return -ENOSPC;
+        entry->data_length = strlen(str) + 1;
+        break;
+    case DBUS_TYPE_DOUBLE:
+        dbus_message_iter_get_basic(&variant, &entry->value.dbl);
+        entry->data_length = sizeof(double);
+        break;
+    default:
+        dbus_message_iter_get_basic(&variant, &entry->value.u32);
+        entry->data_length = sizeof(int32_t);
+        break;
+    }
+
+    return 0;
+}
+
+/*
+ * Command body shared by single and batch frames: umid, opcode, flow,
+ * duration and the entry array, appended to it.
+ */
+static int32_t frame_encode_body(DBusMessageIter *it, const remote_cmd_t *cmd)
+{
+    DBusMessageIter array;
+    int32_t umid, opcode, flow, duration, ret;
+    dbus_bool_t ok;
+
+    if (cmd->entry_count > MAX_ENTRIES)
+        return -E2BIG;
+
+    // Wire fields are int32, widen the narrower members of remote_cmd_t
+    umid = cmd->umid;
+    opcode = cmd->opcode;
+    flow = cmd->flow;
+    duration = cmd->duration;
+
+    ok = dbus_message_iter_append_basic(it, DBUS_TYPE_INT32, &umid);
+    ok = ok && dbus_message_iter_append_basic(it, DBUS_TYPE_INT32, &opcode);
+    ok = ok && dbus_message_iter_append_basic(it, DBUS_TYPE_INT32, &flow);
+    ok = ok && dbus_message_iter_append_basic(it, DBUS_TYPE_INT32, &duration);
+    ok = ok && dbus_message_iter_open_container(it, DBUS_TYPE_ARRAY, \
+                                                "(siiv)", &array);
+    if (!ok)
+        return -ENOMEM;
+
+    for (uint32_t i = 0; i < cmd->entry_count; i++) {
+        ret = frame_encode_entry(&array, &cmd->entries[i]);
+        if (ret) {
+            dbus_message_iter_abandon_container(it, &array);
+            return ret;
+        }
+    }
+
+    return dbus_message_iter_close_container(it, &array) ? 0 : -ENOMEM;
+}
+
+/* Read the command body at it, leaving it on the entry array */
+static int32_t frame_decode_body(DBusMessageIter *it, const char *component_id, \
+                                 uint16_t version, remote_cmd_t *out)
+{
+    DBusMessageIter array;
+    int32_t umid, opcode, flow, duration, ret;
+    uint32_t i = 0;
+
+    dbus_message_iter_get_basic(it, &umid);
+    dbus_message_iter_next(it);
+    dbus_message_iter_get_basic(it, &opcode);
+    dbus_message_iter_next(it);
+    dbus_message_iter_get_basic(it, &flow);
+    dbus_message_iter_next(it);
+    dbus_message_iter_get_basic(it, &duration);
+    dbus_message_iter_next(it);
+
+    if (flow < 0 || flow > UINT8_MAX || duration < 0 || duration > UINT8_MAX) {
+        LOG_WARN("Frame flow %d / duration %d out of range", flow, duration);
+        return -EPROTO;
+    }
+
+    out->str_used = 0;
+    ret = frame_pool_copy(out, component_id, &out->component_id);
+    if (ret)
+        return ret;
+
+    out->version = version;
+    out->umid = umid;
+    out->opcode = opcode;
+    out->flow = flow;
+    out->duration = duration;
+
+    dbus_message_iter_recurse(it, &array);
+    while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT) {
+        if (i == MAX_ENTRIES) {
+            LOG_WARN("Frame umid %d has more than %d entries", umid, \
+                     MAX_ENTRIES);
+            return -E2BIG;
+        }
+
+        ret = frame_decode_entry(&array, out, &out->entries[i]);
+        if (ret)
+            return ret;
+
+        dbus_message_iter_next(&array);
+        i++;
+    }
+
+    out->entry_count = i;
+    return 0;
+}
+
+static int32_t frame_check_version(dbus_uint16_t version)
+{
+    if (version > FRAME_PROTO_VERSION) {
+        LOG_WARN("Frame version %u is newer than %u", version, \
+                 FRAME_PROTO_VERSION);
+        return -EPROTONOSUPPORT;
+    }
+
+    return 0;
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+int32_t frame_encode(DBusMessage *msg, const remote_cmd_t *cmd)
+{
+    DBusMessageIter iter;
+    dbus_uint16_t version = FRAME_PROTO_VERSION;
+    int32_t ret;
+
+    if (!msg || !cmd || !cmd->component_id)
+        return -EINVAL;
+
+    dbus_message_iter_init_append(msg, &iter);
+    if (!dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, \
+                                        &cmd->component_id))
+        return -ENOMEM;
+
+    ret = frame_encode_body(&iter, cmd);
+    if (ret)
+        return ret;
+
+    if (!dbus_message_iter_append_basic(&iter, DBUS_TYPE_UINT16, &version))
+        return -ENOMEM;
+
+    return 0;
+}
+
+/*
+ * The signature is checked once up front, after which every field has a
+ * known type and the iterators can be walked without further checks.
+ */
+int32_t frame_decode(DBusMessage *msg, remote_cmd_t *out)
+{
+    DBusMessageIter iter, body;
+    const char *sig, *component_id;
+    dbus_uint16_t version = 1;
+    int32_t ret;
+
+    if (!msg || !out)
+        return -EINVAL;
+
+    sig = dbus_message_get_signature(msg);
+    if (strcmp(sig, FRAME_SIGNATURE) != 0 && \
+        strcmp(sig, FRAME_SIGNATURE_V1) != 0) {
+        LOG_WARN("Not a command frame, signature '%s'", sig);
+        return -EPROTO;
+    }
+
+    dbus_message_iter_init(msg, &iter);
+    dbus_message_iter_get_basic(&iter, &component_id);
+    dbus_message_iter_next(&iter);
+
+    /*
+     * The version trails the body, peek at it before decoding: step over
+     * the four ints and the entry array, v1 frames end there
+     */
+    body = iter;
+    for (int32_t i = 0; i < 4; i++)
+        dbus_message_iter_next(&iter);
+    if (dbus_message_iter_next(&iter))
+        dbus_message_iter_get_basic(&iter, &version);
+
+    ret = frame_check_version(version);
+    if (ret)
+        return ret;
+
+    return frame_decode_body(&body, component_id, version, out);
+}
+
+int32_t frame_encode_batch(DBusMessage *msg, const struct frame_batch *batch)
+{
+    DBusMessageIter iter, array, st;
+    dbus_uint16_t version = FRAME_PROTO_VERSION;
+    int32_t umid, mode, ret;
+    dbus_bool_t ok;
+
+    if (!msg || !batch || !batch->component_id)
+        return -EINVAL;
+
+    if (batch->count > FRAME_BATCH_MAX)
+        return -E2BIG;
+
+    for (uint32_t i = 0; i < batch->count; i++) {
+        if (!batch->cmds[i])
+            return -EINVAL;
+    }
+
+    umid = batch->umid;
+    mode = batch->mode;
+
+    dbus_message_iter_init_append(msg, &iter);
+    ok = dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, \
+                                        &batch->component_id);
+    ok = ok && dbus_message_iter_append_basic(&iter, DBUS_TYPE_INT32, &umid);
+    ok = ok && dbus_message_iter_append_basic(&iter, DBUS_TYPE_INT32, &mode);
+    ok = ok && dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, \
+                                                "(iiiia(siiv))", &array);
+    if (!ok)
+        return -ENOMEM;
+
+    for (uint32_t i = 0; i < batch->count; i++) {
+        if (!dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, \
+                                              NULL, &st)) {
+            dbus_message_iter_abandon_container(&iter, &array);
+            return -ENOMEM;
+        }
+
+        ret = frame_encode_body(&st, batch->cmds[i]);
+        if (ret || !dbus_message_iter_close_container(&array, &st)) {
+            dbus_message_iter_abandon_container(&array, &st);
+            dbus_message_iter_abandon_container(&iter, &array);
+            return ret ? ret : -ENOMEM;
+        }
+    }
+
+    ok = dbus_message_iter_close_container(&iter, &array);
+    ok = ok && dbus_message_iter_append_basic(&iter, DBUS_TYPE_UINT16, \
+                                              &version);
+    return ok ? 0 : -ENOMEM;
+}
+
+/*
+ * Every sub-command is decoded up front, so a malformed one rejects the
+ * whole batch before anything runs.
+ */
+int32_t frame_decode_batch(DBusMessage *msg, struct frame_batch *out)
+{
+    DBusMessageIter iter, array, st;
+    const char *component_id;
+    int32_t umid, mode, ret;
+    dbus_uint16_t version;
+    uint32_t n = 0;
+
+    if (!msg || !out)
+        return -EINVAL;
+
+    memset(out, 0, sizeof(*out));
+    if (strcmp(dbus_message_get_signature(msg), FRAME_BATCH_SIGNATURE) != 0) {
+        LOG_WARN("Not a batch frame, signature '%s'", \
+                 dbus_message_get_signature(msg));
+        return -EPROTO;
+    }
+
+    dbus_message_iter_init(msg, &iter);
+    dbus_message_iter_get_basic(&iter, &component_id);
+    dbus_message_iter_next(&iter);
+    dbus_message_iter_get_basic(&iter, &umid);
+    dbus_message_iter_next(&iter);
+    dbus_message_iter_get_basic(&iter, &mode);
+    dbus_message_iter_next(&iter);
+    dbus_message_iter_recurse(&iter, &array);
+    dbus_message_iter_next(&iter);
+    dbus_message_iter_get_basic(&iter, &version);
+
+    ret = frame_check_version(version);
+    if (ret)
+        return ret;
+
+    if (mode != FRAME_BATCH_ORDERED && mode != FRAME_BATCH_PARALLEL) {
+        LOG_WARN("Batch umid %d has unknown mode %d", umid, mode);
+        return -EPROTO;
+    }
+
+    out->umid = umid;
+    out->mode = mode;
+    out->version = version;
+
+    while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT) {
+        if (n == FRAME_BATCH_MAX) {
+            LOG_WARN("Batch umid %d has more than %d commands", umid, \
+                     FRAME_BATCH_MAX);
+            ret = -E2BIG;
+            goto fail;
+        }
+
+        out->cmds[n] = calloc(1, sizeof(remote_cmd_t));
+        if (!out->cmds[n]) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+        out->count = ++n;
+
+        dbus_message_iter_recurse(&array, &st);
+        ret = frame_decode_body(&st, component_id, version, out->cmds[n - 1]);
+        if (ret)
+            goto fail;
+
+        dbus_message_iter_next(&array);
+    }
+
+    if (!n) {
+        LOG_WARN("Batch umid %d is empty", umid);
+        return -EPROTO;
+    }
+
+    out->component_id = out->cmds[0]->component_id;
+    return 0;
+
+fail:
+    frame_batch_release(out);
+    return ret;
+}
+
+void frame_batch_release(struct frame_batch *batch)
+{
+    if (!batch)
+        return;
+
+    for (uint32_t i = 0; i < batch->count; i++) {
+        free(batch->cmds[i]);
+        batch->cmds[i] = NULL;
+    }
+    batch->count = 0;
+    batch->component_id = NULL;
+}
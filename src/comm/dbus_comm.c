@@ -22,22 +22,42 @@
 #include <signal.h>
 #include <sys/eventfd.h>
 #include <inttypes.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
 #include <dbus/dbus.h>
 
 #include <comm/dbus_comm.h>
 #include <comm/f_comm.h>
 #include <comm/cmd_payload.h>
+#include <comm/frame_codec.h>
+#include <comm/p2p_comm.h>
+#include <comm/dbus_pending.h>
+#include <comm/state_cache.h>
+#include <comm/dbus_router.h>
+#include <comm/cmd_batch.h>
+#include <comm/capture.h>
+#include <hw/imu.h>
+#include <hw/imu_history.h>
 #include <sched/workqueue.h>
 #include <sched/task.h>
+#include <sched/clock.h>
 
 /*********************
  *      DEFINES
  *********************/
-#define MAX_EVENTS 2
+#define MAX_EVENTS 5
 
 /**********************
  *      TYPEDEFS
  **********************/
+/* Encoded message waiting for the listener thread to put it on the bus */
+struct dbus_out_msg {
+    DBusMessage *msg;
+    struct dbus_pending *pending;   /* method calls awaiting a reply */
+    struct dbus_out_msg *next;
+};
 
 /**********************
  *  GLOBAL VARIABLES
@@ -54,6 +74,20 @@ extern int32_t event_fd;
  **********************/
 static DBusConnection *dbus_conn = NULL;
 
+/*
+ * Outbound queue: a lock-free LIFO list that producers push to from any
+ * thread. The listener detaches the whole list at once, so there is no ABA
+ * problem, and restores the FIFO order before sending.
+ */
+static _Atomic(struct dbus_out_msg *) out_head = NULL;
+static atomic_int send_evfd = -1;
+/*
+ * Pins the listener for producers: held shared from the send_evfd check to
+ * the wake-up, exclusive while the listener publishes or retires the
+ * eventfd, so a retired one is never written and no node is left behind.
+ */
+static pthread_rwlock_t send_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 /**********************
  *      MACROS
  **********************/
@@ -61,158 +95,189 @@ static DBusConnection *dbus_conn = NULL;
 /**********************
  *   STATIC FUNCTIONS
  **********************/
-// Encode remote_cmd_t into an existing DBusMessage
-static int32_t encode_data_frame(DBusMessage *msg, const remote_cmd_t *cmd)
+/* Method return carrying the usual status string, more may be appended */
+static DBusMessage *dbus_new_ok_reply(DBusMessage *msg, DBusMessageIter *args)
 {
-    DBusMessageIter iter, array_iter, struct_iter, variant_iter;
-
-    dbus_message_iter_init_append(msg, &iter);
-
-    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &cmd->component_id);
-    dbus_message_iter_append_basic(&iter, DBUS_TYPE_INT32, &cmd->umid);
-    dbus_message_iter_append_basic(&iter, DBUS_TYPE_INT32, &cmd->opcode);
-    dbus_message_iter_append_basic(&iter, DBUS_TYPE_INT32, &cmd->flow);
-    dbus_message_iter_append_basic(&iter, DBUS_TYPE_INT32, &cmd->duration);
-
-    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(siiv)", &array_iter);
-
-    for (int32_t i = 0; i < cmd->entry_count; ++i) {
-        const payload_t *entry = &cmd->entries[i];
+    DBusMessage *reply;
+    const char *reply_str = "Method reply OK";
 
-        dbus_message_iter_open_container(&array_iter, DBUS_TYPE_STRUCT, NULL, &struct_iter);
+    reply = dbus_message_new_method_return(msg);
+    if (!reply)
+        return NULL;
 
-        dbus_message_iter_append_basic(&struct_iter, DBUS_TYPE_STRING, &entry->key);
-        dbus_message_iter_append_basic(&struct_iter, DBUS_TYPE_INT32, &entry->data_type);
-        dbus_message_iter_append_basic(&struct_iter, DBUS_TYPE_INT32, &entry->data_length);
+    dbus_message_iter_init_append(reply, args);
+    if (!dbus_message_iter_append_basic(args, DBUS_TYPE_STRING, &reply_str)) {
+        dbus_message_unref(reply);
+        return NULL;
+    }
 
-        const char *sig = NULL;
-        switch (entry->data_type) {
-            case DBUS_TYPE_STRING: sig = "s"; break;
-            case DBUS_TYPE_INT32:  sig = "i"; break;
-            case DBUS_TYPE_UINT32: sig = "u"; break;
-            case DBUS_TYPE_DOUBLE: sig = "d"; break;
-            default:
-                LOG_ERROR("Unsupported data_type %d for key '%s'", entry->data_type, entry->key);
-                return -EINVAL;
-        }
+    return reply;
+}
 
-        dbus_message_iter_open_container(&struct_iter, DBUS_TYPE_VARIANT, sig, &variant_iter);
+/* Reply to an inline opcode: the usual status string, then the value */
+static DBusMessage *dbus_new_inline_reply(DBusMessage *msg, \
+                                          const remote_cmd_t *cmd)
+{
+    DBusMessage *reply;
+    DBusMessageIter args;
+    int32_t ret;
 
-        switch (entry->data_type) {
-            case DBUS_TYPE_STRING:
-                dbus_message_iter_append_basic(&variant_iter, DBUS_TYPE_STRING, &entry->value.str);
-                break;
-            case DBUS_TYPE_INT32:
-                dbus_message_iter_append_basic(&variant_iter, DBUS_TYPE_INT32, &entry->value.i32);
-                break;
-            case DBUS_TYPE_UINT32:
-                dbus_message_iter_append_basic(&variant_iter, DBUS_TYPE_UINT32, &entry->value.u32);
-                break;
-            case DBUS_TYPE_DOUBLE:
-                dbus_message_iter_append_basic(&variant_iter, DBUS_TYPE_DOUBLE, &entry->value.dbl);
-                break;
-        }
+    reply = dbus_new_ok_reply(msg, &args);
+    if (!reply)
+        return NULL;
 
-        dbus_message_iter_close_container(&struct_iter, &variant_iter);
-        dbus_message_iter_close_container(&array_iter, &struct_iter);
+    ret = process_opcode_inline(cmd, &args);
+    if (ret) {
+        dbus_message_unref(reply);
+        LOG_DEBUG("Inline opcode %u failed: %d", cmd->opcode, ret);
+        return dbus_message_new_error_printf(msg, DBUS_ERROR_FAILED, \
+                                             "Opcode %u: %s", cmd->opcode, \
+                                             strerror(-ret));
     }
 
-    dbus_message_iter_close_container(&iter, &array_iter);
-    return 0;
+    return reply;
 }
 
-// Decode DBusMessage into remote_cmd_t
-static int32_t decode_data_frame(DBusMessage *msg, remote_cmd_t *out)
+static bool dbus_ping_wants_workqueue(const remote_cmd_t *cmd)
 {
-    DBusMessageIter iter, array_iter, struct_iter, variant_iter;
+    for (uint32_t i = 0; i < cmd->entry_count; i++) {
+        const payload_t *e = &cmd->entries[i];
 
-    if (!dbus_message_iter_init(msg, &iter)) {
-        LOG_ERROR("Failed to init DBus iterator");
-        return -EINVAL;
+        if (e->data_type == DBUS_TYPE_STRING && \
+            strcmp(e->key, PING_PATH_KEY) == 0)
+            return strcmp(e->value.str, PING_PATH_WORKQUEUE) == 0;
     }
 
-    dbus_message_iter_get_basic(&iter, &out->component_id);
-    dbus_message_iter_next(&iter);
-
-    dbus_message_iter_get_basic(&iter, &out->umid);
-    dbus_message_iter_next(&iter);
-
-    dbus_message_iter_get_basic(&iter, &out->opcode);
-    dbus_message_iter_next(&iter);
+    return false;
+}
 
-    dbus_message_iter_get_basic(&iter, &out->flow);
-    dbus_message_iter_next(&iter);
+/*
+ * Work done hook of a queued ping, on the task handler: the work carries
+ * its queue timestamps, done_data a reference to the call to answer. A
+ * failed ping is answered with an error.
+ */
+static void dbus_ping_work_done(work_t *w, int32_t ret)
+{
+    DBusMessage *call = w->done_data, *reply;
+    DBusMessageIter args;
+    struct ping_stamps ps;
 
-    dbus_message_iter_get_basic(&iter, &out->duration);
-    dbus_message_iter_next(&iter);
+    if (ret) {
+        LOG_DEBUG("Queued ping failed: %d", ret);
+        reply = dbus_message_new_error_printf(call, DBUS_ERROR_FAILED, \
+                                              "Opcode %u: %s", w->opcode, \
+                                              strerror(-ret));
+        dbus_message_unref(call);
+        if (reply)
+            dbus_queue_message(reply);
+        return;
+    }
 
-    dbus_message_iter_recurse(&iter, &array_iter);
+    reply = dbus_new_ok_reply(call, &args);
+    dbus_message_unref(call);
+    if (!reply) {
+        LOG_ERROR("Failed to build ping reply");
+        return;
+    }
 
-    int32_t i = 0;
-    while (dbus_message_iter_get_arg_type(&array_iter) == DBUS_TYPE_STRUCT && \
-           i < MAX_ENTRIES) {
-        payload_t *entry = &out->entries[i];
-        dbus_message_iter_recurse(&array_iter, &struct_iter);
+    ps.rx_ns = ((remote_cmd_t *)w->data)->rx_ns;
+    ps.enqueue_ns = w->enqueue_ns;
+    ps.dequeue_ns = w->dequeue_ns;
+    ps.reply_ns = now_ns();
 
-        dbus_message_iter_get_basic(&struct_iter, &entry->key);
-        dbus_message_iter_next(&struct_iter);
+    if (dbus_append_ping_stamps(&args, &ps)) {
+        LOG_ERROR("Failed to build ping reply");
+        dbus_message_unref(reply);
+        return;
+    }
 
-        dbus_message_iter_get_basic(&struct_iter, &entry->data_type);
-        dbus_message_iter_next(&struct_iter);
+    dbus_queue_message(reply);
+}
 
-        dbus_message_iter_get_basic(&struct_iter, &entry->data_length);
-        dbus_message_iter_next(&struct_iter);
+static int32_t dbus_push_cmd(remote_cmd_t *cmd, DBusMessage *call)
+{
+    work_t *work;
+    int32_t ret;
 
-        dbus_message_iter_recurse(&struct_iter, &variant_iter);
+    work = create_work(REMOTE, cmd->flow, cmd->duration, cmd->opcode, \
+                       (void *)cmd);
+    if (!work) {
+        LOG_ERROR("Failed to create work from cmd");
+        delete_remote_cmd(cmd);
+        return -ENOMEM;
+    }
 
-        switch (entry->data_type) {
-            case DBUS_TYPE_STRING:
-                dbus_message_iter_get_basic(&variant_iter, &entry->value.str);
-                break;
-            case DBUS_TYPE_INT32:
-                dbus_message_iter_get_basic(&variant_iter, &entry->value.i32);
-                break;
-            case DBUS_TYPE_UINT32:
-                dbus_message_iter_get_basic(&variant_iter, &entry->value.u32);
-                break;
-            case DBUS_TYPE_DOUBLE:
-                dbus_message_iter_get_basic(&variant_iter, &entry->value.dbl);
-                break;
-            default:
-                LOG_WARN("Unsupported type %d for entry %d", entry->data_type, i);
-                break;
-        }
+    // Queued and accounted per sender
+    work->client = cmd->component_id;
+    if (call) {
+        work->done = dbus_ping_work_done;
+        work->done_data = call;
+    }
 
-        dbus_message_iter_next(&array_iter);
-        i++;
+    ret = push_work(work);
+    if (ret) {
+        LOG_DEBUG("Work of %s refused: %d", cmd->component_id, ret);
+        delete_work(work);
     }
 
-    out->entry_count = i;
-    return 0;
+    return ret;
 }
 
-static int32_t dispatch_cmd_from_message(DBusMessage *msg)
+/*
+ * Decode a command frame and hand it over to the workqueue. Shared by every
+ * transport that carries the command frame, FRAME_SIGNATURE (system bus and
+ * peer socket).
+ *
+ * When the caller expects a reply, read-only opcodes are answered on the
+ * spot instead: *reply is set and nothing is queued. It stays NULL for
+ * queued work, which is acknowledged with dbus_new_cmd_reply(). A ping
+ * asking for the workqueue path is only honoured when the caller can
+ * defer the reply, *reply is then DBUS_ROUTE_REPLY_DEFERRED.
+ */
+static int32_t dbus_dispatch_cmd(DBusMessage *msg, DBusMessage **reply, \
+                                 bool deferrable)
 {
     remote_cmd_t *cmd;
-    work_t *work;
-    int32_t i;
+    uint64_t rx_ns;
+    int32_t i, ret;
 
+    rx_ns = now_ns();
     cmd = create_remote_cmd();
     if (!cmd) {
         LOG_ERROR("Failed to allocate memory for cmd_data");
         return -ENOMEM;
     }
 
-    if (decode_data_frame(msg, cmd)) {
-        LOG_ERROR("Failed to decode DBus message");
+    ret = frame_decode(msg, cmd);
+    if (ret) {
+        LOG_ERROR("Failed to decode DBus message: %d", ret);
         delete_remote_cmd(cmd);
-        return -EINVAL;
+        return ret;
     }
+    cmd->rx_ns = rx_ns;
+    capture_record(cmd);
 
     LOG_DEBUG("Received frame from component: %s", cmd->component_id);
     LOG_DEBUG("Message ID: %d, Opcode: %d, Flow %d, Duration %d", cmd->umid, \
               cmd->opcode, cmd->flow, cmd->duration);
 
+    if (reply && deferrable && cmd->opcode == OP_PING && \
+        dbus_ping_wants_workqueue(cmd)) {
+        // Answered by dbus_ping_work_done once the work ran
+        ret = dbus_push_cmd(cmd, dbus_message_ref(msg));
+        if (ret)
+            dbus_message_unref(msg);
+        else
+            *reply = DBUS_ROUTE_REPLY_DEFERRED;
+        return ret;
+    }
+
+    if (reply && opcode_is_inline(cmd->opcode)) {
+        *reply = dbus_new_inline_reply(msg, cmd);
+        delete_remote_cmd(cmd);
+        return *reply ? 0 : -ENOMEM;
+    }
+
     for (i = 0; i < cmd->entry_count; ++i) {
         payload_t *entry = &cmd->entries[i];
         LOG_TRACE("Entry (%d): Key [%s] - type [%c] - length [%d]", i, \
@@ -230,76 +295,525 @@ static int32_t dispatch_cmd_from_message(DBusMessage *msg)
         }
     }
 
-    work = create_work(REMOTE, cmd->flow, cmd->duration, cmd->opcode, \
-                       (void *)cmd);
-    if (!work) {
-        LOG_ERROR("Failed to create work from cmd");
-        delete_remote_cmd(cmd);
-        return -ENOMEM;
-    }
+    return dbus_push_cmd(cmd, NULL);
+}
 
-    push_work(work);
-    return 0;
+int32_t dbus_dispatch_cmd_message(DBusMessage *msg, DBusMessage **reply)
+{
+    return dbus_dispatch_cmd(msg, reply, false);
 }
 
-static int32_t dbus_connection_event_handler(DBusConnection *conn)
+int32_t dbus_append_ping_stamps(DBusMessageIter *iter, \
+                                const struct ping_stamps *ps)
 {
-    DBusMessage *msg = NULL;
-    DBusMessage *reply = NULL;
+    DBusMessageIter var, st;
+    const uint64_t *stamp[] = {
+        &ps->rx_ns, &ps->enqueue_ns, &ps->dequeue_ns, &ps->reply_ns,
+    };
+    dbus_bool_t ok;
+
+    ok = dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, \
+                                          PING_STAMPS_SIGNATURE, &var);
+    ok = ok && dbus_message_iter_open_container(&var, DBUS_TYPE_STRUCT, \
+                                                NULL, &st);
+    for (uint32_t i = 0; ok && i < sizeof(stamp) / sizeof(stamp[0]); i++)
+        ok = dbus_message_iter_append_basic(&st, DBUS_TYPE_UINT64, stamp[i]);
+    ok = ok && dbus_message_iter_close_container(&var, &st);
+    ok = ok && dbus_message_iter_close_container(iter, &var);
+
+    return ok ? 0 : -ENOMEM;
+}
+
+/* Build the reply of a command frame from its dispatch result */
+DBusMessage *dbus_new_cmd_reply(DBusMessage *msg, int32_t ret)
+{
+    DBusMessage *reply;
     DBusMessageIter args;
     const char *reply_str = "Method reply OK";
-    int32_t ret;
 
-    while (dbus_connection_read_write_dispatch(conn, 0)) {
-        msg = dbus_connection_pop_message(conn);
-        if (!msg) {
-            usleep(10000);
-            continue;
-        }
+    // Malformed frames are the sender's fault, tell it why
+    if (ret == -EPROTO || ret == -E2BIG || ret == -ENOSPC || \
+        ret == -EPROTONOSUPPORT)
+        return dbus_message_new_error_printf(msg, DBUS_ERROR_INVALID_ARGS, \
+                                             "Invalid frame: %s", \
+                                             strerror(-ret));
+    if (ret == -EBUSY)
+        return dbus_message_new_error(msg, DBUS_ERROR_LIMITS_EXCEEDED, \
+                                      "Client queue full");
+    if (ret < 0)
+        return dbus_message_new_error(msg, DBUS_ERROR_FAILED, \
+                                      "Dispatch failed");
+
+    reply = dbus_message_new_method_return(msg);
+    if (!reply)
+        return NULL;
 
-        if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_CALL) {
-            const char *iface = dbus_message_get_interface(msg);
-            const char *member = dbus_message_get_member(msg);
-
-            if (iface && member && strcmp(iface, SER_IFACE) == 0 && \
-                strcmp(member, SER_METH) == 0) {
-                ret = dispatch_cmd_from_message(msg);
-                if (ret < 0) {
-                    LOG_ERROR("Dispatch failed: iface=%s, meth=%s", iface, \
-                              member);
-                    reply = dbus_message_new_error(msg, DBUS_ERROR_FAILED, \
-                                                   "Dispatch failed");
-                } else {
-                    reply = dbus_message_new_method_return(msg);
-                    dbus_message_iter_init_append(reply, &args);
-                    dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, \
-                                                   &reply_str);
-                }
+    dbus_message_iter_init_append(reply, &args);
+    dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &reply_str);
+    return reply;
+}
 
-                if (reply) {
-                    dbus_connection_send(conn, reply, NULL);
-                    dbus_message_unref(reply);
-                }
-            }
-        } else if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_SIGNAL) {
-            const char *iface = dbus_message_get_interface(msg);
-            const char *member = dbus_message_get_member(msg);
-
-            if (iface && member && strcmp(iface, LISTEN_IFACE) == 0 && \
-                strcmp(member, LISTEN_SIG) == 0) {
-                ret = dispatch_cmd_from_message(msg);
-                if (ret < 0)
-                    LOG_ERROR("Dispatch signal failed: %s.%s",
-                          iface, member);
-            }
-        } else if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_RETURN) {
-            LOG_TRACE("Dbus method return is detected");
+/* Watch the DBus fd for EPOLLOUT only while libdbus has unsent data */
+static void dbus_fd_watch_writable(int32_t epoll_fd, int32_t dbus_fd, \
+                                   bool enable)
+{
+    struct epoll_event ev;
+
+    ev.events = enable ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.fd = dbus_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, dbus_fd, &ev) == -1)
+        LOG_ERROR("Failed to update DBus fd watch: %s", strerror(errno));
+}
+
+/*
+ * Read what the socket holds and dispatch every queued message. epoll only
+ * reports the socket, never messages libdbus already read into its queue,
+ * so whoever reads must dispatch them all.
+ */
+static void dbus_read_dispatch(DBusConnection *conn)
+{
+    dbus_connection_read_write(conn, 0);
+    while (dbus_connection_dispatch(conn) == DBUS_DISPATCH_DATA_REMAINS)
+        ;
+}
+
+/*
+ * Write out as much as the socket accepts without blocking. If data is left
+ * in the libdbus outgoing buffer, the listener keeps watching EPOLLOUT and
+ * continues from here once the bus drains.
+ *
+ * The iteration reads as well: a call that came in meanwhile would otherwise
+ * wait in the libdbus queue until unrelated traffic wakes the socket.
+ * Replies it produces are left to the EPOLLOUT watch.
+ */
+static void dbus_flush_nonblock(DBusConnection *conn, int32_t epoll_fd, \
+                                int32_t dbus_fd)
+{
+    dbus_read_dispatch(conn);
+    dbus_fd_watch_writable(epoll_fd, dbus_fd, \
+                           dbus_connection_has_messages_to_send(conn));
+}
+
+static struct dbus_out_msg *detach_out_queue(void)
+{
+    struct dbus_out_msg *node, *next, *fifo = NULL;
+
+    node = atomic_exchange(&out_head, NULL);
+    while (node) {
+        next = node->next;
+        node->next = fifo;
+        fifo = node;
+        node = next;
+    }
+
+    return fifo;
+}
+
+/* Send every queued message, followed by one flush for the whole batch */
+static int32_t dbus_out_queue_drain(DBusConnection *conn, int32_t epoll_fd, \
+                                    int32_t dbus_fd)
+{
+    struct dbus_out_msg *node, *next;
+    dbus_uint32_t serial;
+    int32_t cnt = 0;
+
+    node = detach_out_queue();
+    while (node) {
+        next = node->next;
+        if (!dbus_connection_send(conn, node->msg, &serial)) {
+            LOG_ERROR("Out of memory while sending message");
+            dbus_pending_free(node->pending);
+        } else if (node->pending) {
+            dbus_pending_track(node->pending, serial);
         }
+        dbus_message_unref(node->msg);
+        free(node);
+        node = next;
+        cnt++;
+    }
 
-        dbus_message_unref(msg);
-        break;
+    if (cnt) {
+        LOG_TRACE("Sent %d queued DBus message(s)", cnt);
+        dbus_flush_nonblock(conn, epoll_fd, dbus_fd);
+    }
+
+    return cnt;
+}
+
+static void dbus_out_queue_release(void)
+{
+    struct dbus_out_msg *node, *next;
+
+    node = detach_out_queue();
+    while (node) {
+        next = node->next;
+        dbus_pending_free(node->pending);
+        dbus_message_unref(node->msg);
+        free(node);
+        node = next;
+    }
+}
+
+/*
+ * Reply (h h u u): the sample ring memfd, a wake-up eventfd owned by this
+ * subscriber, the slot size and the slot count. libdbus duplicates the fds
+ * it sends, so the local copies are closed once appended.
+ */
+static DBusMessage *dbus_new_stream_reply(DBusMessage *msg)
+{
+    DBusMessage *reply;
+    int32_t mem_fd, sub_fd, ret;
+    uint32_t slot_size, slot_count;
+
+    ret = imu_stream_open(&mem_fd, &sub_fd, &slot_size, &slot_count);
+    if (ret) {
+        LOG_WARN("Sensor stream request failed (%d)", ret);
+        return dbus_message_new_error(msg, DBUS_ERROR_FAILED, \
+                                      "Sensor stream unavailable");
+    }
+
+    reply = dbus_message_new_method_return(msg);
+    if (reply && !dbus_message_append_args(reply, \
+                                           DBUS_TYPE_UNIX_FD, &mem_fd, \
+                                           DBUS_TYPE_UNIX_FD, &sub_fd, \
+                                           DBUS_TYPE_UINT32, &slot_size, \
+                                           DBUS_TYPE_UINT32, &slot_count, \
+                                           DBUS_TYPE_INVALID)) {
+        LOG_ERROR("Failed to append stream fds");
+        dbus_message_unref(reply);
+        reply = NULL;
+    }
+
+    close(mem_fd);
+    close(sub_fd);
+    return reply;
+}
+
+static DBusMessage *dbus_route_cmd_method(DBusMessage *msg)
+{
+    DBusMessage *reply = NULL;
+    int32_t ret;
+
+    ret = dbus_dispatch_cmd(msg, &reply, true);
+    if (ret < 0)
+        LOG_ERROR("Dispatch failed: iface=%s, meth=%s", \
+                  dbus_message_get_interface(msg), \
+                  dbus_message_get_member(msg));
+
+    return reply ? reply : dbus_new_cmd_reply(msg, ret);
+}
+
+static DBusMessage *dbus_route_cmd_signal(DBusMessage *msg)
+{
+    if (dbus_dispatch_cmd_message(msg, NULL) < 0)
+        LOG_ERROR("Dispatch signal failed: %s.%s", \
+                  dbus_message_get_interface(msg), \
+                  dbus_message_get_member(msg));
+
+    return NULL;
+}
+
+static DBusMessage *dbus_route_p2p_path(DBusMessage *msg)
+{
+    DBusMessage *reply;
+    const char *p2p_path;
+
+    p2p_path = p2p_get_sock_path();
+    if (!p2p_path)
+        return dbus_message_new_error(msg, DBUS_ERROR_FAILED, \
+                                      "Peer channel unavailable");
+
+    reply = dbus_message_new_method_return(msg);
+    if (reply)
+        dbus_message_append_args(reply, DBUS_TYPE_STRING, &p2p_path, \
+                                 DBUS_TYPE_INVALID);
+    return reply;
+}
+
+/* Per-client workqueue counters, see struct wq_client_stats */
+static DBusMessage *dbus_route_queue_stats(DBusMessage *msg)
+{
+    struct wq_client_stats st[WQ_MAX_CLIENTS];
+    DBusMessageIter iter, array, s;
+    DBusMessage *reply;
+    const char *name;
+    dbus_bool_t ok;
+    int32_t n;
+
+    reply = dbus_message_new_method_return(msg);
+    if (!reply)
+        return NULL;
+
+    n = workqueue_get_stats(st, WQ_MAX_CLIENTS);
+    dbus_message_iter_init_append(reply, &iter);
+    ok = dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, \
+                                          SYS_MGR_QSTATS_SIGNATURE + 1, &array);
+    for (int32_t i = 0; ok && i < n; i++) {
+        name = st[i].name;
+        ok = dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, \
+                                              NULL, &s);
+        ok = ok && dbus_message_iter_append_basic(&s, DBUS_TYPE_STRING, &name);
+        ok = ok && dbus_message_iter_append_basic(&s, DBUS_TYPE_UINT32, \
+                                                  &st[i].weight);
+        ok = ok && dbus_message_iter_append_basic(&s, DBUS_TYPE_UINT32, \
+                                                  &st[i].quota);
+        ok = ok && dbus_message_iter_append_basic(&s, DBUS_TYPE_UINT32, \
+                                                  &st[i].depth);
+        ok = ok && dbus_message_iter_append_basic(&s, DBUS_TYPE_UINT32, \
+                                                  &st[i].depth_peak);
+        ok = ok && dbus_message_iter_append_basic(&s, DBUS_TYPE_UINT64, \
+                                                  &st[i].enqueued);
+        ok = ok && dbus_message_iter_append_basic(&s, DBUS_TYPE_UINT64, \
+                                                  &st[i].dequeued);
+        ok = ok && dbus_message_iter_append_basic(&s, DBUS_TYPE_UINT64, \
+                                                  &st[i].dropped);
+        ok = ok && dbus_message_iter_append_basic(&s, DBUS_TYPE_UINT64, \
+                                                  &st[i].wait_sum_ns);
+        ok = ok && dbus_message_iter_append_basic(&s, DBUS_TYPE_UINT64, \
+                                                  &st[i].wait_max_ns);
+        ok = ok && dbus_message_iter_close_container(&array, &s);
+    }
+    ok = ok && dbus_message_iter_close_container(&iter, &array);
+
+    if (!ok) {
+        dbus_message_unref(reply);
+        return NULL;
+    }
+
+    return reply;
+}
+
+static DBusMessage *dbus_route_imu_stats(DBusMessage *msg)
+{
+    struct imu_loop_stats st;
+    DBusMessage *reply;
+    dbus_bool_t buffered;
+    int32_t ret;
+
+    ret = imu_get_loop_stats(&st);
+    if (ret)
+        return dbus_message_new_error(msg, DBUS_ERROR_FAILED, \
+                                      "IMU loop not running");
+
+    reply = dbus_message_new_method_return(msg);
+    if (!reply)
+        return NULL;
+
+    buffered = st.buffered != 0;
+    if (!dbus_message_append_args(reply, \
+                                  DBUS_TYPE_UINT32, &st.target_hz, \
+                                  DBUS_TYPE_BOOLEAN, &buffered, \
+                                  DBUS_TYPE_UINT64, &st.samples, \
+                                  DBUS_TYPE_UINT64, &st.missed, \
+                                  DBUS_TYPE_UINT64, &st.overruns, \
+                                  DBUS_TYPE_DOUBLE, &st.rate_hz, \
+                                  DBUS_TYPE_UINT32, &st.jitter_avg_ns, \
+                                  DBUS_TYPE_UINT32, &st.jitter_max_ns, \
+                                  DBUS_TYPE_UINT32, &st.wake_late_avg_ns, \
+                                  DBUS_TYPE_UINT32, &st.wake_late_max_ns, \
+                                  DBUS_TYPE_INVALID)) {
+        dbus_message_unref(reply);
+        return NULL;
     }
 
+    return reply;
+}
+
+/* Pending call table counters, see struct dbus_pending_stats */
+static DBusMessage *dbus_route_call_stats(DBusMessage *msg)
+{
+    struct dbus_pending_stats st;
+    DBusMessage *reply;
+
+    reply = dbus_message_new_method_return(msg);
+    if (!reply)
+        return NULL;
+
+    dbus_pending_get_stats(&st);
+    if (!dbus_message_append_args(reply, \
+                                  DBUS_TYPE_UINT64, &st.sent, \
+                                  DBUS_TYPE_UINT64, &st.replied, \
+                                  DBUS_TYPE_UINT64, &st.errors, \
+                                  DBUS_TYPE_UINT64, &st.timeouts, \
+                                  DBUS_TYPE_UINT64, &st.cancelled, \
+                                  DBUS_TYPE_UINT64, &st.unmatched, \
+                                  DBUS_TYPE_UINT64, &st.untracked, \
+                                  DBUS_TYPE_UINT64, &st.rtt_min_ns, \
+                                  DBUS_TYPE_UINT64, &st.rtt_max_ns, \
+                                  DBUS_TYPE_UINT64, &st.rtt_sum_ns, \
+                                  DBUS_TYPE_UINT32, &st.in_flight, \
+                                  DBUS_TYPE_UINT32, &st.in_flight_peak, \
+                                  DBUS_TYPE_INVALID)) {
+        dbus_message_unref(reply);
+        return NULL;
+    }
+
+    return reply;
+}
+
+/* One history entry as the (tddddddddd) struct of ImuHistory */
+static dbus_bool_t dbus_append_history_entry(DBusMessageIter *iter, \
+                                             const struct imu_history_entry *e)
+{
+    struct imu_angles angles;
+    DBusMessageIter s;
+    double v[9];
+    dbus_bool_t ok;
+
+    imu_attitude_angles(&e->att, &angles);
+    for (int32_t k = 0; k < 3; k++) {
+        v[k] = e->accel[k];
+        v[3 + k] = e->gyro[k];
+    }
+    v[6] = angles.roll;
+    v[7] = angles.pitch;
+    v[8] = angles.yaw;
+
+    ok = dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT, NULL, &s);
+    ok = ok && dbus_message_iter_append_basic(&s, DBUS_TYPE_UINT64, &e->ts_ns);
+    for (int32_t k = 0; ok && k < 9; k++)
+        ok = dbus_message_iter_append_basic(&s, DBUS_TYPE_DOUBLE, &v[k]);
+    return ok && dbus_message_iter_close_container(iter, &s);
+}
+
+/* Batch of IMU history entries, see SYS_MGR_IMU_HISTORY_SIGNATURE */
+static DBusMessage *dbus_route_imu_history(DBusMessage *msg)
+{
+    struct imu_history_entry *e;
+    DBusMessageIter iter, array;
+    DBusMessage *reply;
+    dbus_uint64_t since;
+    dbus_uint32_t max;
+    dbus_bool_t ok;
+    int32_t n;
+
+    if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_UINT64, &since, \
+                               DBUS_TYPE_UINT32, &max, DBUS_TYPE_INVALID))
+        return dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS, \
+                                      "Expected since ns and max entries");
+    if (!max || max > SYS_MGR_IMU_HISTORY_MAX)
+        max = SYS_MGR_IMU_HISTORY_MAX;
+
+    e = malloc(max * sizeof(*e));
+    if (!e)
+        return NULL;
+
+    n = since ? imu_history_since(since, e, max) : imu_history_latest(e, max);
+
+    reply = dbus_message_new_method_return(msg);
+    if (!reply) {
+        free(e);
+        return NULL;
+    }
+
+    dbus_message_iter_init_append(reply, &iter);
+    ok = dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, \
+                                          SYS_MGR_IMU_HISTORY_SIGNATURE + 1, &array);
+    for (int32_t i = 0; ok && i < n; i++)
+        ok = dbus_append_history_entry(&array, &e[i]);
+    ok = ok && dbus_message_iter_close_container(&iter, &array);
+    free(e);
+
+    if (!ok) {
+        dbus_message_unref(reply);
+        return NULL;
+    }
+
+    return reply;
+}
+
+/*
+ * IMU state at a past time, see SYS_MGR_IMU_HISTORY_AT_SIGNATURE. The query
+ * is retried while the IMU thread overwrites the entries it looks at.
+ */
+static DBusMessage *dbus_route_imu_history_at(DBusMessage *msg)
+{
+    struct imu_history_entry e;
+    DBusMessageIter iter;
+    DBusMessage *reply;
+    dbus_uint64_t ts;
+    int32_t ret, tries = 0;
+
+    if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_UINT64, &ts, \
+                               DBUS_TYPE_INVALID))
+        return dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS, \
+                                      "Expected a timestamp ns");
+
+    do {
+        ret = imu_history_at(ts, &e);
+    } while (ret == -EAGAIN && ++tries < 3);
+
+    if (ret == -ERANGE)
+        return dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS, \
+                                      "Timestamp outside the IMU history");
+    if (ret)
+        return dbus_message_new_error_printf(msg, DBUS_ERROR_FAILED, \
+                                             "IMU history: %s", strerror(-ret));
+
+    reply = dbus_message_new_method_return(msg);
+    if (!reply)
+        return NULL;
+
+    dbus_message_iter_init_append(reply, &iter);
+    if (!dbus_append_history_entry(&iter, &e)) {
+        dbus_message_unref(reply);
+        return NULL;
+    }
+
+    return reply;
+}
+
+/*
+ * Everything the service answers on the bus. Command frames only decode and
+ * push work, so they are cheap enough to stay on the listener as well.
+ * ImuHistory allocates, copies and converts up to SYS_MGR_IMU_HISTORY_MAX
+ * entries, so it runs on the task handler instead.
+ */
+static const struct dbus_route sys_mgr_routes[] = {
+    { DBUS_MESSAGE_TYPE_METHOD_CALL, SER_IFACE, SER_METH, \
+      DBUS_ROUTE_INLINE, dbus_route_cmd_method, \
+      FRAME_SIGNATURE, "s" },
+    { DBUS_MESSAGE_TYPE_METHOD_CALL, SER_IFACE, SER_BATCH_METH, \
+      DBUS_ROUTE_INLINE, cmd_batch_dispatch, \
+      FRAME_BATCH_SIGNATURE, CMD_BATCH_REPLY_SIGNATURE },
+    { DBUS_MESSAGE_TYPE_METHOD_CALL, SER_IFACE, SER_P2P_METH, \
+      DBUS_ROUTE_INLINE, dbus_route_p2p_path, NULL, "s" },
+    { DBUS_MESSAGE_TYPE_METHOD_CALL, SER_IFACE, SER_STREAM_METH, \
+      DBUS_ROUTE_INLINE, dbus_new_stream_reply, NULL, "hhuu" },
+    { DBUS_MESSAGE_TYPE_METHOD_CALL, SER_IFACE, SER_QSTATS_METH, \
+      DBUS_ROUTE_INLINE, dbus_route_queue_stats, NULL, \
+      SYS_MGR_QSTATS_SIGNATURE },
+    { DBUS_MESSAGE_TYPE_METHOD_CALL, SER_IFACE, SER_IMU_STATS_METH, \
+      DBUS_ROUTE_INLINE, dbus_route_imu_stats, NULL, \
+      SYS_MGR_IMU_STATS_SIGNATURE },
+    { DBUS_MESSAGE_TYPE_METHOD_CALL, SER_IFACE, SER_CALL_STATS_METH, \
+      DBUS_ROUTE_INLINE, dbus_route_call_stats, NULL, \
+      SYS_MGR_CALL_STATS_SIGNATURE },
+    { DBUS_MESSAGE_TYPE_METHOD_CALL, SER_IFACE, SER_IMU_HISTORY_METH, \
+      DBUS_ROUTE_WORKQUEUE, dbus_route_imu_history, \
+      SYS_MGR_IMU_HISTORY_IN_SIGNATURE, SYS_MGR_IMU_HISTORY_SIGNATURE },
+    { DBUS_MESSAGE_TYPE_METHOD_CALL, SER_IFACE, SER_IMU_HISTORY_AT_METH, \
+      DBUS_ROUTE_INLINE, dbus_route_imu_history_at, \
+      SYS_MGR_IMU_HISTORY_AT_IN_SIGNATURE, SYS_MGR_IMU_HISTORY_AT_SIGNATURE },
+    { DBUS_MESSAGE_TYPE_METHOD_CALL, DBUS_INTERFACE_PROPERTIES, "Get", \
+      DBUS_ROUTE_INLINE, state_cache_handle_call, "ss", "v" },
+    { DBUS_MESSAGE_TYPE_METHOD_CALL, DBUS_INTERFACE_PROPERTIES, "GetAll", \
+      DBUS_ROUTE_INLINE, state_cache_handle_call, "s", "a{sv}" },
+    { DBUS_MESSAGE_TYPE_METHOD_CALL, DBUS_INTERFACE_PROPERTIES, "Set", \
+      DBUS_ROUTE_INLINE, state_cache_handle_call, "ssv", NULL },
+    { DBUS_MESSAGE_TYPE_SIGNAL, LISTEN_IFACE, LISTEN_SIG, \
+      DBUS_ROUTE_INLINE, dbus_route_cmd_signal, FRAME_SIGNATURE, NULL },
+};
+
+static int32_t dbus_connection_event_handler(DBusConnection *conn)
+{
+    /*
+     * One read may bring several messages into the libdbus queue while the
+     * socket ends up empty. The router filter and object path handlers take
+     * them from there.
+     */
+    dbus_read_dispatch(conn);
+
     return 0;
 }
 
@@ -324,6 +838,31 @@ static int32_t set_dbus_signal_match_rule(DBusConnection *conn)
     return ret;
 }
 
+/* Connect to the bus selected by SYS_MGR_DBUS_BUS_ENV, SER_BUS_TYPE otherwise */
+static DBusConnection *dbus_bus_open(DBusError *err)
+{
+    DBusConnection *conn;
+    const char *bus;
+
+    bus = getenv(SYS_MGR_DBUS_BUS_ENV);
+    if (!bus || !bus[0] || strcmp(bus, "system") == 0)
+        return dbus_bus_get(SER_BUS_TYPE, err);
+    if (strcmp(bus, "session") == 0)
+        return dbus_bus_get(DBUS_BUS_SESSION, err);
+
+    LOG_INFO("Using DBus bus at %s", bus);
+    conn = dbus_connection_open(bus, err);
+    if (!conn)
+        return NULL;
+
+    if (!dbus_bus_register(conn, err)) {
+        dbus_connection_unref(conn);
+        return NULL;
+    }
+
+    return conn;
+}
+
 static DBusConnection *setup_dbus_connection()
 {
     DBusConnection *conn = NULL;
@@ -332,7 +871,7 @@ static DBusConnection *setup_dbus_connection()
 
     dbus_error_init(&err);
 
-    conn = dbus_bus_get(SER_BUS_TYPE, &err);
+    conn = dbus_bus_open(&err);
     if (dbus_error_is_set(&err)) {
         LOG_ERROR("DBus connection Error: %s", err.message);
         dbus_error_free(&err);
@@ -366,6 +905,10 @@ static int32_t dbus_listener_loop(DBusConnection *conn)
     struct epoll_event events_detected[MAX_EVENTS];
     int32_t n_ready;
     int32_t ready_fd;
+    int32_t out_evfd;
+    int32_t timer_fd;
+    int32_t state_fd;
+    int32_t ret = 0;
 
     if (!conn) {
         LOG_ERROR("Invalid DBus connection");
@@ -404,6 +947,63 @@ static int32_t dbus_listener_loop(DBusConnection *conn)
         return -errno;
     }
 
+    // Add outbound queue file desc, producers kick it after pushing
+    out_evfd = eventfd(0, EFD_NONBLOCK);
+    if (out_evfd == -1) {
+        LOG_ERROR("Failed to create send event fd: %s", strerror(errno));
+        close(epoll_fd);
+        return -errno;
+    }
+
+    ev.data.fd = out_evfd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, out_evfd, &ev) == -1) {
+        LOG_ERROR("Failed to add send event fd to epoll: %s", strerror(errno));
+        close(out_evfd);
+        close(epoll_fd);
+        return -errno;
+    }
+    // Add reply timeout timer file desc
+    timer_fd = dbus_pending_init();
+    if (timer_fd < 0) {
+        close(out_evfd);
+        close(epoll_fd);
+        return timer_fd;
+    }
+
+    ev.data.fd = timer_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) == -1) {
+        LOG_ERROR("Failed to add timer fd to epoll: %s", strerror(errno));
+        dbus_pending_release();
+        close(out_evfd);
+        close(epoll_fd);
+        return -errno;
+    }
+
+    // Add property change timer file desc
+    state_fd = state_cache_init();
+    if (state_fd < 0) {
+        dbus_pending_release();
+        close(out_evfd);
+        close(epoll_fd);
+        return state_fd;
+    }
+
+    ev.data.fd = state_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, state_fd, &ev) == -1) {
+        LOG_ERROR("Failed to add state fd to epoll: %s", strerror(errno));
+        state_cache_release();
+        dbus_pending_release();
+        close(out_evfd);
+        close(epoll_fd);
+        return -errno;
+    }
+
+    pthread_rwlock_wrlock(&send_lock);
+    atomic_store(&send_evfd, out_evfd);
+    pthread_rwlock_unlock(&send_lock);
+    // Messages queued before the listener was ready
+    dbus_out_queue_drain(conn, epoll_fd, dbus_fd);
+
     LOG_INFO("System manager DBus communication is running...");
     while (g_run) {
         LOG_TRACE("[DBus]--> Waiting for next DBus message...");
@@ -413,15 +1013,31 @@ static int32_t dbus_listener_loop(DBusConnection *conn)
                 LOG_WARN("epoll_wait interrupted, continuing...");
                 continue;
             }
-            LOG_ERROR("epoll_wait failed: %s", strerror(errno));
-            close(epoll_fd);
-            return -errno;
+            ret = -errno;
+            LOG_ERROR("epoll_wait failed: %s", strerror(-ret));
+            break;
         }
 
         for (int32_t cnt = 0; cnt < n_ready; cnt++) {
             ready_fd = events_detected[cnt].data.fd;
             if (ready_fd == dbus_fd) {
-                dbus_connection_event_handler(conn);
+                if (events_detected[cnt].events & EPOLLOUT)
+                    dbus_flush_nonblock(conn, epoll_fd, dbus_fd);
+                if (events_detected[cnt].events & EPOLLIN) {
+                    dbus_connection_event_handler(conn);
+                    // Push out the replies produced by the handlers
+                    if (dbus_connection_has_messages_to_send(conn))
+                        dbus_flush_nonblock(conn, epoll_fd, dbus_fd);
+                }
+            } else if (ready_fd == out_evfd) {
+                uint64_t kicks = 0;
+                event_get(out_evfd, &kicks);
+                dbus_out_queue_drain(conn, epoll_fd, dbus_fd);
+            } else if (ready_fd == timer_fd) {
+                dbus_pending_expire();
+            } else if (ready_fd == state_fd) {
+                state_cache_emit_changes(conn);
+                dbus_flush_nonblock(conn, epoll_fd, dbus_fd);
             } else if (ready_fd == event_fd) {
                 uint64_t event_id = 0;
                 if (!event_get(event_fd, &event_id)) {
@@ -432,10 +1048,19 @@ static int32_t dbus_listener_loop(DBusConnection *conn)
         }
     }
 
+    /* No producer is past its send_evfd check once the lock is ours */
+    pthread_rwlock_wrlock(&send_lock);
+    atomic_store(&send_evfd, -1);
+    pthread_rwlock_unlock(&send_lock);
+    dbus_out_queue_release();
+    dbus_pending_release();
+    state_cache_release();
+    close(out_evfd);
     close(epoll_fd);
-    LOG_INFO("The DBus handler thread exited successfully");
+    if (!ret)
+        LOG_INFO("The DBus handler thread exited successfully");
 
-    return 0;
+    return ret;
 }
 
 /**********************
@@ -499,6 +1124,15 @@ int32_t dbus_fn_thread_handler()
         return ret;
     }
 
+    ret = dbus_router_add(sys_mgr_routes, \
+                          sizeof(sys_mgr_routes) / sizeof(sys_mgr_routes[0]));
+    if (!ret)
+        ret = dbus_router_attach(conn, SER_OBJ_PATH);
+    if (ret) {
+        LOG_FATAL("Unable to set up DBus message routing: %d", ret);
+        return ret;
+    }
+
     ret = set_dbus_connection(conn);
     if (ret) {
         LOG_FATAL("Unable to save connection with DBus: %d", ret);
@@ -512,10 +1146,67 @@ int32_t dbus_fn_thread_handler()
         return ret;
     }
 
+    dbus_router_detach(conn);
     dbus_connection_unref(conn);
     return 0;
 }
 
+/*
+ * Hand an encoded message over to the listener thread, which owns the
+ * connection. Never blocks on the bus: the message is pushed to the
+ * outbound queue and the listener is woken up only when the queue was
+ * empty, so a burst of sends costs a single wake-up and a single flush.
+ * Takes over the caller's reference of msg and of pending (may be NULL),
+ * which the listener starts tracking once the serial is known.
+ */
+static int32_t dbus_queue_message_pending(DBusMessage *msg, \
+                                          struct dbus_pending *pending)
+{
+    struct dbus_out_msg *node, *prev;
+    int32_t evfd;
+
+    if (!msg) {
+        dbus_pending_free(pending);
+        return -EINVAL;
+    }
+
+    node = malloc(sizeof(*node));
+    if (!node) {
+        dbus_pending_free(pending);
+        dbus_message_unref(msg);
+        return -ENOMEM;
+    }
+    node->msg = msg;
+    node->pending = pending;
+
+    pthread_rwlock_rdlock(&send_lock);
+    evfd = atomic_load(&send_evfd);
+    if (evfd < 0) {
+        pthread_rwlock_unlock(&send_lock);
+        LOG_ERROR("DBus listener is not running");
+        dbus_pending_free(pending);
+        dbus_message_unref(msg);
+        free(node);
+        return -EIO;
+    }
+
+    prev = atomic_load(&out_head);
+    do {
+        node->next = prev;
+    } while (!atomic_compare_exchange_weak(&out_head, &prev, node));
+
+    if (!prev)
+        event_set(evfd, 1);
+    pthread_rwlock_unlock(&send_lock);
+
+    return 0;
+}
+
+int32_t dbus_queue_message(DBusMessage *msg)
+{
+    return dbus_queue_message_pending(msg, NULL);
+}
+
 /*
  * The DBus command will be sent by the task handler after the corresponding
  * work item is created and pushed into the workqueue. This work item will hold
@@ -524,21 +1215,18 @@ int32_t dbus_fn_thread_handler()
  * which will be encoded and decoded by the DBus communication framework during
  * message transmission and reception.
  */
-static int32_t dbus_send_message_async(DBusMessage *msg, remote_cmd_t *cmd)
+static int32_t dbus_send_message_async(DBusMessage *msg, remote_cmd_t *cmd, \
+                                       struct dbus_pending *pending)
 {
-    DBusConnection *conn;
-
-    if (!msg || !cmd)
+    if (!msg || !cmd) {
+        dbus_pending_free(pending);
         return -EINVAL;
-
-    conn = get_dbus_connection();
-    if (!conn) {
-        LOG_ERROR("Failed to get dbus connection");
-        return -EIO;
     }
 
-    if (encode_data_frame(msg, cmd)) {
+    /* Encode on the caller's thread, cmd does not need to outlive the call */
+    if (frame_encode(msg, cmd)) {
         LOG_ERROR("Failed to encode data frame");
+        dbus_pending_free(pending);
         dbus_message_unref(msg);
         return -EIO;
     }
@@ -547,34 +1235,60 @@ static int32_t dbus_send_message_async(DBusMessage *msg, remote_cmd_t *cmd)
      * Sends a method call or signal without waiting for a reply, because the
      * listener thread will handle the reply message.
      */
-    if (!dbus_connection_send(conn, msg, NULL)) {
-        LOG_ERROR("Out of memory while sending message");
-        dbus_message_unref(msg);
-        return -ENOMEM;
+    return dbus_queue_message_pending(msg, pending);
+}
+
+/*
+ * This function sends a D-Bus method call to the dbus client and returns
+ * right away. The reply is matched by the listener thread against the
+ * pending call table; cb (may be NULL) then runs from the task handler with
+ * the reply, or with -ETIMEDOUT once timeout_ms expired. Any number of
+ * calls may be outstanding at once, up to DBUS_PENDING_MAX.
+ */
+int32_t dbus_method_call_async(const char *destination, const char *path, \
+                               const char *iface, const char *method, \
+                               remote_cmd_t *cmd, int32_t timeout_ms, \
+                               dbus_reply_cb_t cb, void *user_data)
+{
+    DBusMessage *msg;
+    struct dbus_pending *pending;
+
+    if (!destination || !path || !iface || !method || !cmd) {
+        LOG_ERROR("Invalid argument");
+        return -EINVAL;
     }
 
-    dbus_connection_flush(conn);
-    dbus_message_unref(msg);
+    pending = dbus_pending_new(cmd->umid, timeout_ms, cb, user_data);
+    if (!pending)
+        return -EBUSY;
 
-    return 0;
+    msg = dbus_message_new_method_call(destination, path, iface, method);
+    if (!msg) {
+        LOG_ERROR("Failed to create method call message");
+        dbus_pending_free(pending);
+        return -ENOMEM;
+    }
+
+    return dbus_send_message_async(msg, cmd, pending);
 }
 
 /*
- * This function sends a D-Bus method call to the dbus client.
- * It operates without a specific callback for the reply message
- * because all responses are processed centrally in the D-Bus
- * listener thread rather than assigning per-call callbacks.
+ * Fire-and-forget method call. The call is still tracked with the default
+ * timeout so that a peer that stopped answering shows up in the statistics.
+ * With the table full it goes out untracked instead, the peer is then told
+ * not to reply.
  */
 int32_t dbus_method_call(const char *destination, const char *path, \
                          const char *iface, const char *method, \
                          remote_cmd_t *cmd)
 {
     DBusMessage *msg;
+    int32_t ret;
 
-    if (!destination || !path || !iface || !method || !cmd) {
-        LOG_ERROR("Invalid argument");
-        return -EINVAL;
-    }
+    ret = dbus_method_call_async(destination, path, iface, method, cmd, \
+                                 DBUS_PENDING_DEFAULT_TIMEOUT_MS, NULL, NULL);
+    if (ret != -EBUSY)
+        return ret;
 
     msg = dbus_message_new_method_call(destination, path, iface, method);
     if (!msg) {
@@ -582,7 +1296,26 @@ int32_t dbus_method_call(const char *destination, const char *path, \
         return -ENOMEM;
     }
 
-    return dbus_send_message_async(msg, cmd);
+    dbus_message_set_no_reply(msg, TRUE);
+    ret = dbus_send_message_async(msg, cmd, NULL);
+    if (!ret)
+        dbus_pending_count_untracked();
+
+    return ret;
+}
+
+int32_t dbus_method_call_with_data_async(remote_cmd_t *cmd, int32_t timeout_ms, \
+                                         dbus_reply_cb_t cb, void *user_data)
+{
+    int32_t ret;
+    ret = dbus_method_call_async(REMOTE_SER_NAME, REMOTE_SER_OBJ_PATH,
+                                 REMOTE_SER_IFACE, REMOTE_SER_METH, cmd,
+                                 timeout_ms, cb, user_data);
+    if (ret) {
+        LOG_ERROR("Failed to send method call message, ret %d", ret);
+    }
+
+    return ret;
 }
 
 int32_t dbus_method_call_with_data(remote_cmd_t *cmd)
@@ -616,7 +1349,7 @@ int32_t dbus_emit_signal(const char *path, const char *iface, \
         return -ENOMEM;
     }
 
-    return dbus_send_message_async(msg, cmd);
+    return dbus_send_message_async(msg, cmd, NULL);
 }
 
 int32_t dbus_emit_signal_with_data(remote_cmd_t *cmd)
@@ -0,0 +1,400 @@
+/**
+ * @file dbus_pending.c
+ *
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/timerfd.h>
+#include <dbus/dbus.h>
+
+#include <comm/cmd_payload.h>
+#include <comm/dbus_pending.h>
+#include <sched/workqueue.h>
+#include <sched/clock.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define PENDING_HASH_SIZE               256
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+/* Listener thread only */
+static struct dbus_pending *pending_hash[PENDING_HASH_SIZE];
+static struct dbus_pending *deadline_head = NULL;
+static struct dbus_pending *deadline_tail = NULL;
+static int32_t timer_fd = -1;
+
+static atomic_uint in_flight;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dbus_pending_stats stats;
+
+/**********************
+ *      MACROS
+ **********************/
+#define PENDING_HASH(serial)            ((serial) & (PENDING_HASH_SIZE - 1))
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+/* Program the timer for the earliest deadline, or disarm it */
+static void pending_timer_arm(void)
+{
+    struct itimerspec its;
+
+    if (timer_fd < 0)
+        return;
+
+    memset(&its, 0, sizeof(its));
+    if (deadline_head) {
+        its.it_value.tv_sec = deadline_head->deadline_ns / 1000000000ULL;
+        its.it_value.tv_nsec = deadline_head->deadline_ns % 1000000000ULL;
+        // A zero it_value disarms, make sure an expired deadline still fires
+        if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+            its.it_value.tv_nsec = 1;
+    }
+
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        LOG_ERROR("Failed to arm pending call timer: %s", strerror(errno));
+}
+
+static void pending_unlink(struct dbus_pending *p)
+{
+    struct dbus_pending **pp;
+
+    for (pp = &pending_hash[PENDING_HASH(p->serial)]; *pp; pp = &(*pp)->hnext) {
+        if (*pp == p) {
+            *pp = p->hnext;
+            break;
+        }
+    }
+
+    if (p->prev)
+        p->prev->next = p->next;
+    else
+        deadline_head = p->next;
+    if (p->next)
+        p->next->prev = p->prev;
+    else
+        deadline_tail = p->prev;
+}
+
+static void pending_stats_done(const struct dbus_pending *p, int32_t status, \
+                               uint64_t now)
+{
+    uint64_t rtt = now - p->sent_ns;
+
+    pthread_mutex_lock(&stats_lock);
+    switch (status) {
+    case 0:
+    case -EREMOTEIO:
+        if (status)
+            stats.errors++;
+        else
+            stats.replied++;
+        if (!stats.rtt_min_ns || rtt < stats.rtt_min_ns)
+            stats.rtt_min_ns = rtt;
+        if (rtt > stats.rtt_max_ns)
+            stats.rtt_max_ns = rtt;
+        stats.rtt_sum_ns += rtt;
+        break;
+    case -ETIMEDOUT:
+        stats.timeouts++;
+        break;
+    default:
+        stats.cancelled++;
+        break;
+    }
+    stats.in_flight = atomic_load(&in_flight);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * Hand the completion over to the task handler, the listener must not run
+ * user code. Calls without a callback only feed the statistics.
+ */
+static void pending_finish(struct dbus_pending *p, int32_t status, \
+                           DBusMessage *reply)
+{
+    struct dbus_reply_work *rw;
+    work_t *w;
+
+    atomic_fetch_sub(&in_flight, 1);
+    pending_stats_done(p, status, now_ns());
+
+    if (status == -ETIMEDOUT)
+        LOG_WARN("No reply for call umid %d (serial %u)", p->umid, p->serial);
+
+    if (!p->cb) {
+        free(p);
+        return;
+    }
+
+    rw = calloc(1, sizeof(*rw));
+    if (!rw) {
+        LOG_ERROR("Failed to allocate reply work for umid %d", p->umid);
+        free(p);
+        return;
+    }
+
+    rw->status = status;
+    rw->umid = p->umid;
+    rw->reply = reply ? dbus_message_ref(reply) : NULL;
+    rw->cb = p->cb;
+    rw->user_data = p->user_data;
+    free(p);
+
+    w = create_work(LOCAL, BLOCK, SHORT, OP_DBUS_REPLY, rw);
+    if (!w) {
+        LOG_ERROR("Failed to create reply work for umid %d", rw->umid);
+        if (rw->reply)
+            dbus_message_unref(rw->reply);
+        free(rw);
+        return;
+    }
+
+    push_work(w);
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+struct dbus_pending *dbus_pending_new(int32_t umid, int32_t timeout_ms, \
+                                      dbus_reply_cb_t cb, void *user_data)
+{
+    struct dbus_pending *p;
+
+    if (atomic_fetch_add(&in_flight, 1) >= DBUS_PENDING_MAX) {
+        atomic_fetch_sub(&in_flight, 1);
+        LOG_WARN("Too many outstanding calls, umid %d rejected", umid);
+        return NULL;
+    }
+
+    p = calloc(1, sizeof(*p));
+    if (!p) {
+        atomic_fetch_sub(&in_flight, 1);
+        return NULL;
+    }
+
+    if (timeout_ms <= 0)
+        timeout_ms = DBUS_PENDING_DEFAULT_TIMEOUT_MS;
+
+    p->umid = umid;
+    p->cb = cb;
+    p->user_data = user_data;
+    // Provisional, restarted once the listener puts the call on the bus
+    p->deadline_ns = (uint64_t)timeout_ms * 1000000ULL;
+
+    return p;
+}
+
+void dbus_pending_free(struct dbus_pending *p)
+{
+    if (!p)
+        return;
+
+    atomic_fetch_sub(&in_flight, 1);
+    free(p);
+}
+
+int32_t dbus_pending_init(void)
+{
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        LOG_ERROR("Failed to create pending call timer: %s", strerror(errno));
+        return -errno;
+    }
+
+    return timer_fd;
+}
+
+/*
+ * Start tracking a call that was just sent with the given serial. Deadlines
+ * are mostly increasing, so the sorted insert walks from the tail.
+ */
+void dbus_pending_track(struct dbus_pending *p, uint32_t serial)
+{
+    struct dbus_pending *pos;
+    uint32_t cnt;
+
+    p->serial = serial;
+    p->sent_ns = now_ns();
+    p->deadline_ns += p->sent_ns;
+
+    p->hnext = pending_hash[PENDING_HASH(serial)];
+    pending_hash[PENDING_HASH(serial)] = p;
+
+    for (pos = deadline_tail; pos && pos->deadline_ns > p->deadline_ns; \
+         pos = pos->prev)
+        ;
+
+    p->prev = pos;
+    p->next = pos ? pos->next : deadline_head;
+    if (p->next)
+        p->next->prev = p;
+    else
+        deadline_tail = p;
+    if (pos)
+        pos->next = p;
+    else
+        deadline_head = p;
+
+    cnt = atomic_load(&in_flight);
+    pthread_mutex_lock(&stats_lock);
+    stats.sent++;
+    stats.in_flight = cnt;
+    if (cnt > stats.in_flight_peak)
+        stats.in_flight_peak = cnt;
+    pthread_mutex_unlock(&stats_lock);
+
+    if (deadline_head == p)
+        pending_timer_arm();
+}
+
+/* Match a method return or error against the table */
+int32_t dbus_pending_complete(DBusMessage *reply)
+{
+    struct dbus_pending *p;
+    uint32_t serial;
+    int32_t was_head;
+
+    serial = dbus_message_get_reply_serial(reply);
+    for (p = pending_hash[PENDING_HASH(serial)]; p; p = p->hnext) {
+        if (p->serial == serial)
+            break;
+    }
+
+    if (!p) {
+        LOG_TRACE("Reply to unknown serial %u", serial);
+        pthread_mutex_lock(&stats_lock);
+        stats.unmatched++;
+        pthread_mutex_unlock(&stats_lock);
+        return -ENOENT;
+    }
+
+    was_head = (deadline_head == p);
+    pending_unlink(p);
+    if (was_head)
+        pending_timer_arm();
+
+    if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+        LOG_DEBUG("Call umid %d failed: %s", p->umid, \
+                  dbus_message_get_error_name(reply));
+        pending_finish(p, -EREMOTEIO, reply);
+    } else {
+        pending_finish(p, 0, reply);
+    }
+
+    return 0;
+}
+
+/* Timer fd is readable: fail every call whose deadline has passed */
+void dbus_pending_expire(void)
+{
+    struct dbus_pending *p;
+    uint64_t expirations, now;
+
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && \
+        errno != EAGAIN) {
+        LOG_TRACE("Pending call timer read: %s", strerror(errno));
+    }
+
+    now = now_ns();
+    while (deadline_head && deadline_head->deadline_ns <= now) {
+        p = deadline_head;
+        pending_unlink(p);
+        pending_finish(p, -ETIMEDOUT, NULL);
+    }
+
+    pending_timer_arm();
+}
+
+/* Listener exit: every outstanding call completes with -ECANCELED */
+void dbus_pending_release(void)
+{
+    struct dbus_pending *p;
+
+    while (deadline_head) {
+        p = deadline_head;
+        pending_unlink(p);
+        pending_finish(p, -ECANCELED, NULL);
+    }
+
+    if (timer_fd >= 0)
+        close(timer_fd);
+    timer_fd = -1;
+
+    pthread_mutex_lock(&stats_lock);
+    LOG_INFO("Outbound calls: sent %llu, replied %llu, errors %llu, " \
+             "timeouts %llu, cancelled %llu, untracked %llu, " \
+             "peak in flight %u", \
+             (unsigned long long)stats.sent, \
+             (unsigned long long)stats.replied, \
+             (unsigned long long)stats.errors, \
+             (unsigned long long)stats.timeouts, \
+             (unsigned long long)stats.cancelled, \
+             (unsigned long long)stats.untracked, stats.in_flight_peak);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void dbus_pending_run_callback(struct dbus_reply_work *rw)
+{
+    if (!rw)
+        return;
+
+    LOG_TRACE("Completing call umid %d with status %d", rw->umid, rw->status);
+    if (rw->cb)
+        rw->cb(rw->status, rw->reply, rw->user_data);
+
+    // rw itself is released with the work item
+    if (rw->reply)
+        dbus_message_unref(rw->reply);
+    rw->reply = NULL;
+}
+
+void dbus_pending_count_untracked(void)
+{
+    pthread_mutex_lock(&stats_lock);
+    stats.untracked++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void dbus_pending_get_stats(struct dbus_pending_stats *out)
+{
+    if (!out)
+        return;
+
+    pthread_mutex_lock(&stats_lock);
+    *out = stats;
+    pthread_mutex_unlock(&stats_lock);
+}
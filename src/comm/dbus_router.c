@@ -0,0 +1,446 @@
+/**
+ * @file dbus_router.c
+ *
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <dbus/dbus.h>
+
+#include <comm/cmd_payload.h>
+#include <comm/dbus_comm.h>
+#include <comm/dbus_pending.h>
+#include <comm/dbus_router.h>
+#include <sched/workqueue.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define ROUTE_HASH_SIZE                 128
+#define FNV_OFFSET                      2166136261u
+#define FNV_PRIME                       16777619u
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+struct route_entry {
+    struct dbus_route route;
+    uint32_t hash;
+    int32_t hnext;                  /* next index in the bucket, -1 ends */
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+static DBusMessage *router_introspect(DBusMessage *msg);
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+static struct route_entry route_table[DBUS_ROUTE_MAX];
+static int32_t route_cnt = 0;
+static int32_t route_hash[ROUTE_HASH_SIZE];
+static int32_t route_hash_ready = 0;
+static char *router_path = NULL;
+
+static const struct dbus_route introspect_route = {
+    DBUS_MESSAGE_TYPE_METHOD_CALL, DBUS_INTERFACE_INTROSPECTABLE, \
+    "Introspect", DBUS_ROUTE_INLINE, router_introspect, NULL, "s"
+};
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+static uint32_t fnv1a(uint32_t h, const char *s)
+{
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= FNV_PRIME;
+    }
+
+    // Separator, so ("a.b", "c") and ("a", "b.c") do not collide
+    h ^= 0xff;
+    return h * FNV_PRIME;
+}
+
+static uint32_t route_key(int32_t type, const char *iface, const char *member)
+{
+    uint32_t h = FNV_OFFSET;
+
+    h ^= (uint8_t)type;
+    h *= FNV_PRIME;
+    h = fnv1a(h, iface);
+    return fnv1a(h, member);
+}
+
+static void route_hash_init(void)
+{
+    if (route_hash_ready)
+        return;
+
+    for (int32_t i = 0; i < ROUTE_HASH_SIZE; i++)
+        route_hash[i] = -1;
+    route_hash_ready = 1;
+}
+
+static const struct dbus_route *route_lookup(int32_t type, const char *iface, \
+                                             const char *member)
+{
+    const struct route_entry *e;
+    uint32_t h;
+    int32_t i;
+
+    if (!member)
+        return NULL;
+
+    // Calls may leave out the interface, the member name has to be unique
+    if (!iface) {
+        for (i = 0; i < route_cnt; i++) {
+            e = &route_table[i];
+            if (e->route.type == type && strcmp(e->route.member, member) == 0)
+                return &e->route;
+        }
+        return NULL;
+    }
+
+    h = route_key(type, iface, member);
+    for (i = route_hash[h & (ROUTE_HASH_SIZE - 1)]; i >= 0; i = e->hnext) {
+        e = &route_table[i];
+        if (e->hash == h && e->route.type == type && \
+            strcmp(e->route.member, member) == 0 && \
+            strcmp(e->route.iface, iface) == 0)
+            return &e->route;
+    }
+
+    return NULL;
+}
+
+static int32_t route_insert(const struct dbus_route *r)
+{
+    struct route_entry *e;
+    uint32_t h;
+
+    if (!r || !r->iface || !r->member || !r->fn || \
+        (r->sig_in && !dbus_signature_validate(r->sig_in, NULL)) || \
+        (r->sig_out && !dbus_signature_validate(r->sig_out, NULL)))
+        return -EINVAL;
+
+    if (route_lookup(r->type, r->iface, r->member)) {
+        LOG_ERROR("Route %s.%s is already registered", r->iface, r->member);
+        return -EEXIST;
+    }
+
+    if (route_cnt >= DBUS_ROUTE_MAX) {
+        LOG_ERROR("Route table is full, %s.%s dropped", r->iface, r->member);
+        return -ENOSPC;
+    }
+
+    h = route_key(r->type, r->iface, r->member);
+    e = &route_table[route_cnt];
+    e->route = *r;
+    e->hash = h;
+    e->hnext = route_hash[h & (ROUTE_HASH_SIZE - 1)];
+    route_hash[h & (ROUTE_HASH_SIZE - 1)] = route_cnt;
+    route_cnt++;
+
+    LOG_TRACE("Route %s.%s (%s)", r->iface, r->member, \
+              r->mode == DBUS_ROUTE_INLINE ? "inline" : "workqueue");
+    return 0;
+}
+
+static bool route_wants_reply(DBusMessage *msg)
+{
+    return dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_CALL && \
+           !dbus_message_get_no_reply(msg);
+}
+
+/* Method calls always get an answer, even when the handler had none */
+static DBusMessage *route_reply_or_error(DBusMessage *msg, DBusMessage *reply)
+{
+    if (reply == DBUS_ROUTE_REPLY_DEFERRED)
+        return NULL;
+
+    if (!route_wants_reply(msg)) {
+        if (reply)
+            dbus_message_unref(reply);
+        return NULL;
+    }
+
+    if (!reply)
+        reply = dbus_message_new_error(msg, DBUS_ERROR_FAILED, \
+                                       "Request failed");
+    return reply;
+}
+
+static void route_run(DBusConnection *conn, DBusMessage *msg, \
+                      const struct dbus_route *r)
+{
+    struct dbus_route_work *rw;
+    DBusMessage *reply;
+    work_t *w;
+
+    if (r->mode == DBUS_ROUTE_INLINE) {
+        reply = route_reply_or_error(msg, r->fn(msg));
+        if (reply) {
+            dbus_connection_send(conn, reply, NULL);
+            dbus_message_unref(reply);
+        }
+        return;
+    }
+
+    rw = calloc(1, sizeof(*rw));
+    if (rw) {
+        rw->msg = dbus_message_ref(msg);
+        rw->fn = r->fn;
+        w = create_work(LOCAL, BLOCK, SHORT, OP_DBUS_ROUTE, rw);
+        if (w && !push_work(w))
+            return;
+        dbus_message_unref(rw->msg);
+        if (w)
+            delete_work(w);
+        else
+            free(rw);
+    }
+
+    LOG_ERROR("Failed to queue %s.%s", r->iface, r->member);
+    reply = route_reply_or_error(msg, NULL);
+    if (reply) {
+        dbus_connection_send(conn, reply, NULL);
+        dbus_message_unref(reply);
+    }
+}
+
+/* Method calls on the service object */
+static DBusHandlerResult router_object_message(DBusConnection *conn, \
+                                               DBusMessage *msg, void *data)
+{
+    const struct dbus_route *r;
+
+    (void)data;
+    r = route_lookup(DBUS_MESSAGE_TYPE_METHOD_CALL, \
+                     dbus_message_get_interface(msg), \
+                     dbus_message_get_member(msg));
+    if (!r) {
+        // libdbus answers with UnknownMethod
+        LOG_DEBUG("No route for %s.%s", dbus_message_get_interface(msg), \
+                  dbus_message_get_member(msg));
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+
+    route_run(conn, msg, r);
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* Signals on any path, replies to outbound calls */
+static DBusHandlerResult router_filter(DBusConnection *conn, DBusMessage *msg, \
+                                       void *data)
+{
+    const struct dbus_route *r;
+
+    (void)data;
+    switch (dbus_message_get_type(msg)) {
+    case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+    case DBUS_MESSAGE_TYPE_ERROR:
+        if (dbus_pending_complete(msg) == 0)
+            return DBUS_HANDLER_RESULT_HANDLED;
+        break;
+    case DBUS_MESSAGE_TYPE_SIGNAL:
+        r = route_lookup(DBUS_MESSAGE_TYPE_SIGNAL, \
+                         dbus_message_get_interface(msg), \
+                         dbus_message_get_member(msg));
+        if (r) {
+            route_run(conn, msg, r);
+            return DBUS_HANDLER_RESULT_HANDLED;
+        }
+        break;
+    default:
+        break;
+    }
+
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static void introspect_args(FILE *out, const char *sig, const char *dir)
+{
+    DBusSignatureIter iter;
+    char *type;
+
+    if (!sig || !sig[0])
+        return;
+
+    dbus_signature_iter_init(&iter, sig);
+    do {
+        type = dbus_signature_iter_get_signature(&iter);
+        if (dir)
+            fprintf(out, "      <arg type=\"%s\" direction=\"%s\"/>\n", \
+                    type, dir);
+        else
+            fprintf(out, "      <arg type=\"%s\"/>\n", type);
+        dbus_free(type);
+    } while (dbus_signature_iter_next(&iter));
+}
+
+/* Introspection data, generated from the route table */
+static DBusMessage *router_introspect(DBusMessage *msg)
+{
+    DBusMessage *reply;
+    const struct dbus_route *r;
+    FILE *out;
+    char *xml = NULL;
+    size_t len = 0;
+    int32_t i, j;
+
+    out = open_memstream(&xml, &len);
+    if (!out)
+        return NULL;
+
+    fputs(DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE "<node>\n" \
+          "  <interface name=\"" DBUS_INTERFACE_PEER "\">\n" \
+          "    <method name=\"Ping\"/>\n" \
+          "    <method name=\"GetMachineId\">\n" \
+          "      <arg type=\"s\" direction=\"out\"/>\n" \
+          "    </method>\n" \
+          "  </interface>\n", out);
+
+    for (i = 0; i < route_cnt; i++) {
+        // One block per interface, in registration order
+        for (j = 0; j < i; j++) {
+            if (strcmp(route_table[j].route.iface, \
+                       route_table[i].route.iface) == 0)
+                break;
+        }
+        if (j < i)
+            continue;
+
+        fprintf(out, "  <interface name=\"%s\">\n", route_table[i].route.iface);
+        for (j = i; j < route_cnt; j++) {
+            r = &route_table[j].route;
+            if (strcmp(r->iface, route_table[i].route.iface) != 0)
+                continue;
+            if (r->type == DBUS_MESSAGE_TYPE_SIGNAL) {
+                fprintf(out, "    <signal name=\"%s\">\n", r->member);
+                introspect_args(out, r->sig_in, NULL);
+                fputs("    </signal>\n", out);
+            } else {
+                fprintf(out, "    <method name=\"%s\">\n", r->member);
+                introspect_args(out, r->sig_in, "in");
+                introspect_args(out, r->sig_out, "out");
+                fputs("    </method>\n", out);
+            }
+        }
+        fputs("  </interface>\n", out);
+    }
+    fputs("</node>\n", out);
+    fclose(out);
+
+    reply = dbus_message_new_method_return(msg);
+    if (reply && !dbus_message_append_args(reply, DBUS_TYPE_STRING, &xml, \
+                                           DBUS_TYPE_INVALID)) {
+        dbus_message_unref(reply);
+        reply = NULL;
+    }
+
+    free(xml);
+    return reply;
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+int32_t dbus_router_add(const struct dbus_route *routes, int32_t count)
+{
+    int32_t ret;
+
+    route_hash_init();
+    for (int32_t i = 0; i < count; i++) {
+        ret = route_insert(&routes[i]);
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Incoming messages are delivered by dbus_connection_dispatch(): the filter
+ * sees every message first, method calls left over are matched against the
+ * object path. Both look the handler up with a single hash probe.
+ */
+int32_t dbus_router_attach(DBusConnection *conn, const char *obj_path)
+{
+    static const DBusObjectPathVTable vtable = {
+        .message_function = router_object_message,
+    };
+    int32_t ret;
+
+    if (!conn || !obj_path)
+        return -EINVAL;
+
+    ret = dbus_router_add(&introspect_route, 1);
+    if (ret && ret != -EEXIST)
+        return ret;
+
+    if (!dbus_connection_add_filter(conn, router_filter, NULL, NULL))
+        return -ENOMEM;
+
+    if (!dbus_connection_register_object_path(conn, obj_path, &vtable, NULL)) {
+        LOG_ERROR("Failed to register object path %s", obj_path);
+        dbus_connection_remove_filter(conn, router_filter, NULL);
+        return -ENOMEM;
+    }
+
+    router_path = strdup(obj_path);
+    LOG_INFO("DBus router serving %d route(s) on %s", route_cnt, obj_path);
+    return 0;
+}
+
+void dbus_router_detach(DBusConnection *conn)
+{
+    if (!conn)
+        return;
+
+    dbus_connection_remove_filter(conn, router_filter, NULL);
+    if (router_path) {
+        dbus_connection_unregister_object_path(conn, router_path);
+        free(router_path);
+        router_path = NULL;
+    }
+}
+
+/* Task handler side of a DBUS_ROUTE_WORKQUEUE entry */
+void dbus_router_run_work(struct dbus_route_work *rw)
+{
+    DBusMessage *reply;
+
+    if (!rw || !rw->msg)
+        return;
+
+    reply = route_reply_or_error(rw->msg, rw->fn(rw->msg));
+    if (reply)
+        dbus_queue_message(reply);
+
+    // rw itself is released with the work item
+    dbus_message_unref(rw->msg);
+    rw->msg = NULL;
+}
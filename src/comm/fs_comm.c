@@ -197,9 +197,13 @@ int32_t find_device_path_by_name(const char *basepath, const char *fid, \
 int32_t iio_dev_get_path_by_name(const char *name, char *dev_path, \
                                  size_t path_len)
 {
+    const char *base = getenv(IIO_DEV_SYSFS_PATH_ENV);
     int32_t ret;
 
-    ret = find_device_path_by_name(IIO_DEV_SYSFS_PATH, IIO_DEV_NAME_FILE, \
+    if (!base || !base[0])
+        base = IIO_DEV_SYSFS_PATH;
+
+    ret = find_device_path_by_name(base, IIO_DEV_NAME_FILE, \
                                    name, dev_path, path_len);
     if (ret == 0) {
         LOG_INFO("Found IIO device: %s (target=%s)\n", dev_path, name);
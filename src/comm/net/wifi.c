@@ -18,6 +18,7 @@
 #include <NetworkManager.h>
 
 #include <comm/f_comm.h>
+#include <comm/state_cache.h>
 
 /*********************
  *      DEFINES
@@ -83,6 +84,9 @@ int32_t wifi_disconnect_device(const char *iface_name)
         return EXIT_FAILURE;
     }
 
+    state_cache_set_bool(STATE_WIFI_CONNECTED, false);
+    state_cache_set_str(STATE_WIFI_SSID, "");
+
     return EXIT_SUCCESS;
 }
 
@@ -114,6 +118,8 @@ int32_t wifi_is_connected_to_ssid(const char *iface_name, const char *ssid)
     active_ap = nm_device_wifi_get_active_access_point(wifi_dev);
     if (!active_ap) {
         LOG_TRACE("Device %s is not connected to any AP", iface_name);
+        state_cache_set_bool(STATE_WIFI_CONNECTED, false);
+        state_cache_set_str(STATE_WIFI_SSID, "");
         return 0;
     }
 
@@ -126,6 +132,9 @@ int32_t wifi_is_connected_to_ssid(const char *iface_name, const char *ssid)
     active_ssid_str = nm_utils_ssid_to_utf8(g_bytes_get_data(active_ssid_bytes, NULL),
                                            g_bytes_get_size(active_ssid_bytes));
 
+    state_cache_set_bool(STATE_WIFI_CONNECTED, true);
+    state_cache_set_str(STATE_WIFI_SSID, active_ssid_str);
+
     connected = (active_ssid_str && ssid &&
                  strcmp(active_ssid_str, ssid) == 0) ? 1 : 0;
 
@@ -526,5 +535,8 @@ int32_t wifi_connect_to_ssid(const char *iface_name, const char *ssid,
 
     wifi_connect_flow(client, dev, ap, iface_name, ssid, password);
 
+    // Refresh the exported link state with the outcome of the flow
+    wifi_is_connected_to_ssid(iface_name, ssid);
+
     return EXIT_SUCCESS;
 }
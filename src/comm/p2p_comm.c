@@ -0,0 +1,354 @@
+/**
+ * @file p2p_comm.c
+ *
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <dbus/dbus.h>
+
+#include <comm/dbus_comm.h>
+#include <comm/p2p_comm.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define P2P_MAX_EVENTS                  (P2P_MAX_CLIENTS + 1)
+/* epoll timeout, so g_run is noticed on shutdown */
+#define P2P_POLL_MS                     500
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+extern volatile sig_atomic_t g_run;
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+static char sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static volatile int32_t p2p_ready = 0;
+static int32_t client_fds[P2P_MAX_CLIENTS];
+static uint32_t reply_serial = 0;
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+static int32_t p2p_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int32_t fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        LOG_ERROR("Socket path too long: %s", path);
+        return -ENAMETOOLONG;
+    }
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_ERROR("Failed to create peer socket: %s", strerror(errno));
+        return -errno;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    // Remove a stale socket left by a previous instance
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        LOG_ERROR("Failed to bind peer socket %s: %s", path, strerror(errno));
+        close(fd);
+        return -errno;
+    }
+
+    chmod(path, 0660);
+    if (listen(fd, P2P_MAX_CLIENTS) < 0) {
+        LOG_ERROR("Failed to listen on peer socket: %s", strerror(errno));
+        close(fd);
+        unlink(path);
+        return -errno;
+    }
+
+    return fd;
+}
+
+static int32_t p2p_send_message(int32_t fd, DBusMessage *msg)
+{
+    char *buf = NULL;
+    int32_t len = 0;
+    ssize_t sent;
+
+    // The peer demarshals the packet, which requires a non-zero serial
+    if (++reply_serial == 0)
+        reply_serial = 1;
+    dbus_message_set_serial(msg, reply_serial);
+    if (!dbus_message_marshal(msg, &buf, &len)) {
+        LOG_ERROR("Out of memory while marshalling reply");
+        return -ENOMEM;
+    }
+
+    sent = send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    dbus_free(buf);
+    if (sent != len) {
+        LOG_WARN("Peer fd %d reply dropped: %s", fd, \
+                 sent < 0 ? strerror(errno) : "short write");
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int32_t p2p_handle_packet(int32_t fd, const char *buf, int32_t len)
+{
+    DBusMessage *msg, *reply = NULL;
+    DBusError err;
+    const char *member;
+    bool wants_reply;
+    int32_t ret;
+
+    dbus_error_init(&err);
+    msg = dbus_message_demarshal(buf, len, &err);
+    if (!msg) {
+        LOG_ERROR("Invalid peer packet: %s", err.message);
+        dbus_error_free(&err);
+        return -EINVAL;
+    }
+
+    member = dbus_message_get_member(msg);
+    if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL && \
+        dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_SIGNAL) {
+        LOG_WARN("Unexpected peer message type %d", \
+                 dbus_message_get_type(msg));
+        dbus_message_unref(msg);
+        return -EINVAL;
+    }
+
+    if (!member || strcmp(member, SER_METH) != 0) {
+        LOG_WARN("Unknown peer member: %s", member ? member : "(null)");
+        if (!dbus_message_get_no_reply(msg))
+            reply = dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_METHOD, \
+                                           "Unknown method");
+        ret = -ENOTSUP;
+    } else {
+        wants_reply = dbus_message_get_type(msg) == \
+                      DBUS_MESSAGE_TYPE_METHOD_CALL && \
+                      !dbus_message_get_no_reply(msg);
+        ret = dbus_dispatch_cmd_message(msg, wants_reply ? &reply : NULL);
+        if (ret < 0)
+            LOG_ERROR("Peer dispatch failed: %d", ret);
+        if (wants_reply && !reply)
+            reply = dbus_new_cmd_reply(msg, ret);
+    }
+
+    if (reply) {
+        p2p_send_message(fd, reply);
+        dbus_message_unref(reply);
+    }
+
+    dbus_message_unref(msg);
+    return ret;
+}
+
+static int32_t p2p_add_client(int32_t epoll_fd, int32_t fd)
+{
+    struct epoll_event ev;
+
+    for (int32_t i = 0; i < P2P_MAX_CLIENTS; i++) {
+        if (client_fds[i] >= 0)
+            continue;
+
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            LOG_ERROR("Failed to add peer fd: %s", strerror(errno));
+            return -errno;
+        }
+
+        client_fds[i] = fd;
+        LOG_INFO("Peer client connected (fd %d)", fd);
+        return 0;
+    }
+
+    LOG_WARN("Too many peer clients, rejecting fd %d", fd);
+    return -EBUSY;
+}
+
+static void p2p_remove_client(int32_t epoll_fd, int32_t fd)
+{
+    for (int32_t i = 0; i < P2P_MAX_CLIENTS; i++) {
+        if (client_fds[i] == fd)
+            client_fds[i] = -1;
+    }
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    LOG_INFO("Peer client disconnected (fd %d)", fd);
+}
+
+static void p2p_client_event(int32_t epoll_fd, int32_t fd, char *buf)
+{
+    ssize_t len;
+
+    // Drain every packet queued on this client
+    while (1) {
+        len = recv(fd, buf, P2P_MAX_PACKET, MSG_DONTWAIT | MSG_TRUNC);
+        if (len == 0) {
+            p2p_remove_client(epoll_fd, fd);
+            return;
+        }
+
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+            LOG_ERROR("Peer recv failed: %s", strerror(errno));
+            p2p_remove_client(epoll_fd, fd);
+            return;
+        }
+
+        if (len > P2P_MAX_PACKET) {
+            LOG_ERROR("Peer packet too large (%zd bytes), dropped", len);
+            continue;
+        }
+
+        p2p_handle_packet(fd, buf, (int32_t)len);
+    }
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+const char *p2p_get_sock_path(void)
+{
+    return p2p_ready ? sock_path : NULL;
+}
+
+/*
+ * Peer channel thread function. It serves high-rate commands from clients
+ * that discovered the socket through the bus, bypassing the bus daemon.
+ * The bus path remains for discovery and low-rate control.
+ */
+int32_t p2p_fn_thread_handler()
+{
+    struct epoll_event ev;
+    struct epoll_event events_detected[P2P_MAX_EVENTS];
+    const char *path;
+    char *buf;
+    int32_t listen_fd, epoll_fd, fd;
+    int32_t n_ready;
+
+    path = getenv(P2P_SOCK_PATH_ENV);
+    if (!path || !path[0])
+        path = P2P_DEFAULT_SOCK_PATH;
+
+    buf = malloc(P2P_MAX_PACKET);
+    if (!buf)
+        return -ENOMEM;
+
+    for (int32_t i = 0; i < P2P_MAX_CLIENTS; i++)
+        client_fds[i] = -1;
+
+    listen_fd = p2p_listen(path);
+    if (listen_fd < 0) {
+        free(buf);
+        return listen_fd;
+    }
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1) {
+        LOG_ERROR("Failed to create epoll fd: %s", strerror(errno));
+        close(listen_fd);
+        unlink(path);
+        free(buf);
+        return -errno;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+        LOG_ERROR("Failed to add peer socket to epoll: %s", strerror(errno));
+        close(epoll_fd);
+        close(listen_fd);
+        unlink(path);
+        free(buf);
+        return -errno;
+    }
+
+    snprintf(sock_path, sizeof(sock_path), "%s", path);
+    p2p_ready = 1;
+
+    LOG_INFO("Peer channel is listening on %s", sock_path);
+    while (g_run) {
+        n_ready = epoll_wait(epoll_fd, events_detected, P2P_MAX_EVENTS, \
+                             P2P_POLL_MS);
+        if (n_ready == -1) {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR("epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int32_t cnt = 0; cnt < n_ready; cnt++) {
+            fd = events_detected[cnt].data.fd;
+            if (fd != listen_fd) {
+                p2p_client_event(epoll_fd, fd, buf);
+                continue;
+            }
+
+            // Client I/O is done with MSG_DONTWAIT, no need for O_NONBLOCK
+            fd = accept(listen_fd, NULL, NULL);
+            if (fd < 0) {
+                LOG_WARN("Peer accept failed: %s", strerror(errno));
+                continue;
+            }
+
+            if (p2p_add_client(epoll_fd, fd))
+                close(fd);
+        }
+    }
+
+    p2p_ready = 0;
+    for (int32_t i = 0; i < P2P_MAX_CLIENTS; i++) {
+        if (client_fds[i] >= 0)
+            close(client_fds[i]);
+        client_fds[i] = -1;
+    }
+
+    close(epoll_fd);
+    close(listen_fd);
+    unlink(sock_path);
+    free(buf);
+
+    LOG_INFO("Peer channel is exited");
+    return 0;
+}
@@ -0,0 +1,365 @@
+/**
+ * @file publisher.c
+ *
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <comm/dbus_comm.h>
+#include <comm/cmd_payload.h>
+#include <comm/publisher.h>
+#include <sched/clock.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define NSEC_PER_SEC                    1000000000ULL
+/* Upper bound of an idle wait, so g_run is noticed on shutdown */
+#define PUB_IDLE_WAIT_NS                (200ULL * 1000000ULL)
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+struct pub_topic {
+    char name[PUB_TOPIC_LEN];
+    uint64_t period_ns;
+    double deadband;
+
+    double latest;          /* last value given by the producer */
+    double last_sent;       /* last value put on the bus */
+    bool dirty;             /* latest has not been emitted yet */
+    bool ever_sent;
+    uint64_t next_emit_ns;  /* earliest time the topic may be emitted again */
+};
+
+struct pub_event {
+    char name[PUB_TOPIC_LEN];
+    double value;
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+extern volatile sig_atomic_t g_run;
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+static struct pub_topic topics[PUB_MAX_TOPICS];
+static int32_t topic_cnt = 0;
+static bool batching = true;
+static uint32_t pub_umid = 0;
+
+/* FIFO of events, ev_head is the oldest */
+static struct pub_event events[PUB_EVENT_QUEUE];
+static uint32_t ev_head = 0;
+static uint32_t ev_cnt = 0;
+static uint32_t ev_dropped = 0;
+
+static pthread_mutex_t pub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pub_cond;
+static pthread_once_t pub_once = PTHREAD_ONCE_INIT;
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+static void publisher_once_init(void)
+{
+    pthread_condattr_t attr;
+
+    /* Deadlines are monotonic, the condition must wait on the same clock */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pub_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static uint64_t hz_to_period_ns(uint32_t max_hz)
+{
+    if (max_hz == 0)
+        max_hz = PUB_DEFAULT_HZ;
+
+    return NSEC_PER_SEC / max_hz;
+}
+
+/* Must be called with pub_lock held */
+static struct pub_topic *find_topic(const char *name)
+{
+    for (int32_t i = 0; i < topic_cnt; i++) {
+        if (strcmp(topics[i].name, name) == 0)
+            return &topics[i];
+    }
+
+    return NULL;
+}
+
+/* Must be called with pub_lock held */
+static struct pub_topic *new_topic(const char *name)
+{
+    struct pub_topic *t;
+
+    if (topic_cnt >= PUB_MAX_TOPICS) {
+        LOG_ERROR("Topic table is full, drop topic [%s]", name);
+        return NULL;
+    }
+
+    t = &topics[topic_cnt++];
+    memset(t, 0, sizeof(*t));
+    snprintf(t->name, sizeof(t->name), "%s", name);
+    t->period_ns = hz_to_period_ns(0);
+
+    return t;
+}
+
+static int32_t emit_batch(const char **keys, const double *values, int32_t cnt)
+{
+    remote_cmd_t cmd;
+    int32_t ret;
+
+    remote_cmd_init(&cmd, COMP_NAME, ++pub_umid, OP_STATE_UPDATE, \
+                    NON_BLOCK, SHORT);
+    for (int32_t i = 0; i < cnt; i++)
+        remote_cmd_add_double(&cmd, keys[i], values[i]);
+
+    ret = dbus_emit_signal_with_data(&cmd);
+    if (ret)
+        LOG_WARN("Failed to emit %d topic(s), ret %d", cnt, ret);
+
+    return ret;
+}
+
+/*
+ * Collect all due topics under the lock and return how long the publisher
+ * may sleep before another topic becomes due.
+ */
+static uint64_t collect_due_topics(const char **keys, double *values, \
+                                   int32_t *cnt)
+{
+    uint64_t now = now_ns();
+    uint64_t wait_ns = PUB_IDLE_WAIT_NS;
+    struct pub_topic *t;
+
+    *cnt = 0;
+    for (int32_t i = 0; i < topic_cnt; i++) {
+        t = &topics[i];
+        if (!t->dirty)
+            continue;
+
+        if (now < t->next_emit_ns) {
+            if (t->next_emit_ns - now < wait_ns)
+                wait_ns = t->next_emit_ns - now;
+            continue;
+        }
+
+        t->dirty = false;
+        /* The value may have come back within the deadband meanwhile */
+        if (t->ever_sent && fabs(t->latest - t->last_sent) <= t->deadband)
+            continue;
+
+        if (*cnt >= MAX_ENTRIES) {
+            /* Leave it for the next round */
+            t->dirty = true;
+            wait_ns = 0;
+            continue;
+        }
+
+        keys[*cnt] = t->name;
+        values[*cnt] = t->latest;
+        (*cnt)++;
+
+        t->last_sent = t->latest;
+        t->ever_sent = true;
+        t->next_emit_ns = now + t->period_ns;
+    }
+
+    return wait_ns;
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+int32_t publisher_add_topic(const char *topic, uint32_t max_hz, double deadband)
+{
+    struct pub_topic *t;
+
+    if (!topic || !topic[0] || strlen(topic) >= PUB_TOPIC_LEN || deadband < 0)
+        return -EINVAL;
+
+    pthread_once(&pub_once, publisher_once_init);
+
+    pthread_mutex_lock(&pub_lock);
+    t = find_topic(topic);
+    if (!t)
+        t = new_topic(topic);
+    if (!t) {
+        pthread_mutex_unlock(&pub_lock);
+        return -ENOSPC;
+    }
+
+    t->period_ns = hz_to_period_ns(max_hz);
+    t->deadband = deadband;
+    pthread_mutex_unlock(&pub_lock);
+
+    LOG_DEBUG("Topic [%s]: max %u Hz, deadband %f", topic, \
+              max_hz ? max_hz : PUB_DEFAULT_HZ, deadband);
+    return 0;
+}
+
+int32_t publish(const char *topic, double value)
+{
+    struct pub_topic *t;
+    bool wake;
+
+    if (!topic || !topic[0] || strlen(topic) >= PUB_TOPIC_LEN)
+        return -EINVAL;
+
+    pthread_once(&pub_once, publisher_once_init);
+
+    pthread_mutex_lock(&pub_lock);
+    t = find_topic(topic);
+    if (!t)
+        t = new_topic(topic);
+    if (!t) {
+        pthread_mutex_unlock(&pub_lock);
+        return -ENOSPC;
+    }
+
+    /* Latest wins: only the newest sample is kept */
+    t->latest = value;
+    if (!t->dirty && t->ever_sent && \
+        fabs(value - t->last_sent) <= t->deadband) {
+        pthread_mutex_unlock(&pub_lock);
+        return 0;
+    }
+
+    wake = !t->dirty;
+    t->dirty = true;
+    if (wake)
+        pthread_cond_signal(&pub_cond);
+    pthread_mutex_unlock(&pub_lock);
+
+    return 0;
+}
+
+int32_t publish_event(const char *name, double value)
+{
+    struct pub_event *e;
+    uint32_t dropped;
+
+    if (!name || !name[0] || strlen(name) >= PUB_TOPIC_LEN)
+        return -EINVAL;
+
+    pthread_once(&pub_once, publisher_once_init);
+
+    pthread_mutex_lock(&pub_lock);
+    if (ev_cnt >= PUB_EVENT_QUEUE) {
+        dropped = ++ev_dropped;
+        pthread_mutex_unlock(&pub_lock);
+        /* the bus is stuck or the producer runs away: say so, not per event */
+        if ((dropped & (dropped - 1)) == 0)
+            LOG_WARN("Event queue is full, %u event(s) dropped", dropped);
+        return -ENOSPC;
+    }
+
+    e = &events[(ev_head + ev_cnt) % PUB_EVENT_QUEUE];
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    e->value = value;
+    ev_cnt++;
+    pthread_cond_signal(&pub_cond);
+    pthread_mutex_unlock(&pub_lock);
+
+    return 0;
+}
+
+void publisher_set_batching(bool enable)
+{
+    pthread_mutex_lock(&pub_lock);
+    batching = enable;
+    pthread_mutex_unlock(&pub_lock);
+}
+
+/*
+ * Publisher thread function. Producers only update the topic table and the
+ * event queue, this loop is the single place that turns pending values into
+ * DBus signals, so the bus load is bounded by the per-topic rate and not by
+ * the sensor rate.
+ */
+int32_t publisher_fn_thread_handler()
+{
+    const char *keys[MAX_ENTRIES];
+    double values[MAX_ENTRIES];
+    struct pub_event ev;
+    const char *ev_key = ev.name;
+    struct timespec deadline;
+    uint64_t wait_ns, until;
+    int32_t cnt;
+    bool batch;
+
+    pthread_once(&pub_once, publisher_once_init);
+
+    LOG_INFO("Publisher is running...");
+    pthread_mutex_lock(&pub_lock);
+    while (g_run) {
+        /* Events first, they are what clients react to */
+        if (ev_cnt > 0) {
+            ev = events[ev_head];
+            ev_head = (ev_head + 1) % PUB_EVENT_QUEUE;
+            ev_cnt--;
+            pthread_mutex_unlock(&pub_lock);
+            emit_batch(&ev_key, &ev.value, 1);
+            pthread_mutex_lock(&pub_lock);
+            continue;
+        }
+
+        wait_ns = collect_due_topics(keys, values, &cnt);
+        batch = batching;
+
+        if (cnt > 0) {
+            /* Never hold the table lock while talking to the bus */
+            pthread_mutex_unlock(&pub_lock);
+            if (batch) {
+                emit_batch(keys, values, cnt);
+            } else {
+                for (int32_t i = 0; i < cnt; i++)
+                    emit_batch(&keys[i], &values[i], 1);
+            }
+            pthread_mutex_lock(&pub_lock);
+            continue;
+        }
+
+        until = now_ns() + wait_ns;
+        deadline.tv_sec = until / NSEC_PER_SEC;
+        deadline.tv_nsec = until % NSEC_PER_SEC;
+        pthread_cond_timedwait(&pub_cond, &pub_lock, &deadline);
+    }
+    pthread_mutex_unlock(&pub_lock);
+
+    LOG_INFO("Publisher is exited");
+    return 0;
+}
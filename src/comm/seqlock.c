@@ -0,0 +1,101 @@
+/**
+ * @file seqlock.c
+ *
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <comm/seqlock.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+/* Back off while the writer is mid-copy, without giving up the CPU */
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX()                     __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define CPU_RELAX()                     __asm__ __volatile__("yield" ::: "memory")
+#else
+#define CPU_RELAX()                     do { } while (0)
+#endif
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+void seqlock_init(struct seqlock *sl)
+{
+    atomic_init(&sl->seq, 0);
+}
+
+void seqlock_store(struct seqlock *sl, void *dst, const void *src, size_t len)
+{
+    uint32_t s = atomic_load_explicit(&sl->seq, memory_order_relaxed);
+
+    /* Odd sequence: value is being written */
+    atomic_store_explicit(&sl->seq, s + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    memcpy(dst, src, len);
+
+    atomic_store_explicit(&sl->seq, s + 2, memory_order_release);
+}
+
+uint32_t seqlock_load(const struct seqlock *sl, void *dst, const void *src, \
+                      size_t len)
+{
+    _Atomic uint32_t *seq = (_Atomic uint32_t *)&sl->seq;
+    uint32_t s1, s2, retries = 0;
+
+    while (1) {
+        s1 = atomic_load_explicit(seq, memory_order_acquire);
+        if (s1 & 1) {
+            CPU_RELAX();
+            continue;
+        }
+
+        memcpy(dst, src, len);
+
+        atomic_thread_fence(memory_order_acquire);
+        s2 = atomic_load_explicit(seq, memory_order_relaxed);
+        if (s1 == s2)
+            return retries;
+
+        /* Torn copy, the writer published meanwhile */
+        retries++;
+    }
+}
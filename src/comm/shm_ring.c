@@ -0,0 +1,369 @@
+/**
+ * @file shm_ring.c
+ *
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+/* memfd_create() and the file sealing API */
+#define _GNU_SOURCE
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include <comm/shm_ring.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define SLOT_SEQ_SIZE                   sizeof(uint64_t)
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+#define ALIGN_UP(x, a)                  (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+static inline _Atomic uint64_t *slot_seq(const struct shm_ring *ring, \
+                                         uint64_t n)
+{
+    uint64_t idx = n & (ring->hdr->slot_count - 1);
+
+    return (_Atomic uint64_t *)(ring->slots + idx * ring->hdr->slot_stride);
+}
+
+static inline uint8_t *slot_data(const struct shm_ring *ring, uint64_t n)
+{
+    return (uint8_t *)slot_seq(ring, n) + SLOT_SEQ_SIZE;
+}
+
+static size_t ring_map_len(uint32_t stride, uint32_t slot_count)
+{
+    return sizeof(struct shm_ring_hdr) + (size_t)stride * slot_count;
+}
+
+static void ring_reset(struct shm_ring *ring)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->mem_fd = -1;
+    ring->event_fd = -1;
+    for (int32_t i = 0; i < SHM_RING_MAX_SUBS; i++)
+        ring->sub_fds[i] = -1;
+}
+
+static void ring_notify(struct shm_ring *ring)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&ring->sub_lock);
+    for (int32_t i = 0; i < SHM_RING_MAX_SUBS; i++) {
+        if (ring->sub_fds[i] < 0)
+            continue;
+        /* Counter semantics: a sleeping reader wakes once for many writes */
+        if (write(ring->sub_fds[i], &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            LOG_TRACE("Ring notify failed: %s", strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&ring->sub_lock);
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+int32_t shm_ring_create(struct shm_ring *ring, const char *name, \
+                        uint32_t slot_size, uint32_t slot_count)
+{
+    uint32_t stride;
+    size_t len;
+    void *map;
+    int32_t ret;
+
+    if (!ring || !slot_size || !slot_count || \
+        (slot_count & (slot_count - 1)))
+        return -EINVAL;
+
+    ring_reset(ring);
+
+    stride = ALIGN_UP(SLOT_SEQ_SIZE + slot_size, SHM_RING_ALIGN);
+    len = ring_map_len(stride, slot_count);
+
+    ring->mem_fd = memfd_create(name ? name : "shm-ring", \
+                                MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (ring->mem_fd < 0) {
+        LOG_ERROR("memfd_create failed: %s", strerror(errno));
+        return -errno;
+    }
+
+    if (ftruncate(ring->mem_fd, len) < 0) {
+        ret = -errno;
+        LOG_ERROR("ftruncate failed: %s", strerror(errno));
+        goto err_close;
+    }
+
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, ring->mem_fd, 0);
+    if (map == MAP_FAILED) {
+        ret = -errno;
+        LOG_ERROR("mmap failed: %s", strerror(errno));
+        goto err_close;
+    }
+
+    /*
+     * Consumers get the same fd: they must not be able to resize the ring
+     * under the producer, nor (when supported) to map it writable.
+     */
+    fcntl(ring->mem_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+#ifdef F_SEAL_FUTURE_WRITE
+    fcntl(ring->mem_fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE);
+#endif
+    fcntl(ring->mem_fd, F_ADD_SEALS, F_SEAL_SEAL);
+
+    pthread_mutex_init(&ring->sub_lock, NULL);
+    ring->hdr = map;
+    ring->slots = (uint8_t *)map + sizeof(struct shm_ring_hdr);
+    ring->map_len = len;
+    ring->writable = 1;
+
+    ring->hdr->magic = SHM_RING_MAGIC;
+    ring->hdr->version = SHM_RING_VERSION;
+    ring->hdr->slot_size = slot_size;
+    ring->hdr->slot_count = slot_count;
+    ring->hdr->slot_stride = stride;
+    atomic_store_explicit(&ring->hdr->head, 0, memory_order_release);
+
+    LOG_DEBUG("Ring %s: %u slots x %u bytes (%zu bytes mapped)", \
+              name ? name : "shm-ring", slot_count, slot_size, len);
+    return 0;
+
+err_close:
+    close(ring->mem_fd);
+    ring->mem_fd = -1;
+    return ret;
+}
+
+int32_t shm_ring_attach(struct shm_ring *ring, int32_t mem_fd, int32_t event_fd)
+{
+    struct shm_ring_hdr hdr;
+    void *map;
+    size_t len;
+
+    if (!ring || mem_fd < 0)
+        return -EINVAL;
+
+    ring_reset(ring);
+    ring->mem_fd = mem_fd;
+    ring->event_fd = event_fd;
+
+    if (pread(mem_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        LOG_ERROR("Failed to read ring header");
+        return -EIO;
+    }
+
+    if (hdr.magic != SHM_RING_MAGIC || hdr.version != SHM_RING_VERSION || \
+        !hdr.slot_count || (hdr.slot_count & (hdr.slot_count - 1)) || \
+        hdr.slot_stride < SLOT_SEQ_SIZE + hdr.slot_size) {
+        LOG_ERROR("Invalid ring header (magic 0x%08x, version %u)", \
+                  hdr.magic, hdr.version);
+        return -EPROTO;
+    }
+
+    len = ring_map_len(hdr.slot_stride, hdr.slot_count);
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, mem_fd, 0);
+    if (map == MAP_FAILED) {
+        LOG_ERROR("mmap failed: %s", strerror(errno));
+        return -errno;
+    }
+
+    ring->hdr = map;
+    ring->slots = (uint8_t *)map + sizeof(struct shm_ring_hdr);
+    ring->map_len = len;
+    ring->writable = 0;
+
+    return 0;
+}
+
+int32_t shm_ring_subscribe(struct shm_ring *ring)
+{
+    int32_t fd, slot;
+
+    if (!ring || !ring->hdr || !ring->writable)
+        return -EINVAL;
+
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERROR("eventfd failed: %s", strerror(errno));
+        return -errno;
+    }
+
+    pthread_mutex_lock(&ring->sub_lock);
+    slot = ring->sub_next++ % SHM_RING_MAX_SUBS;
+    if (ring->sub_fds[slot] >= 0) {
+        LOG_DEBUG("Ring subscriber table full, recycling slot %d", slot);
+        close(ring->sub_fds[slot]);
+    }
+    ring->sub_fds[slot] = fd;
+    pthread_mutex_unlock(&ring->sub_lock);
+
+    return fd;
+}
+
+void shm_ring_destroy(struct shm_ring *ring)
+{
+    if (!ring)
+        return;
+
+    if (ring->writable) {
+        for (int32_t i = 0; i < SHM_RING_MAX_SUBS; i++) {
+            if (ring->sub_fds[i] >= 0)
+                close(ring->sub_fds[i]);
+        }
+        pthread_mutex_destroy(&ring->sub_lock);
+    }
+
+    if (ring->hdr)
+        munmap(ring->hdr, ring->map_len);
+    if (ring->mem_fd >= 0)
+        close(ring->mem_fd);
+    if (ring->event_fd >= 0)
+        close(ring->event_fd);
+
+    ring_reset(ring);
+}
+
+int32_t shm_ring_write(struct shm_ring *ring, const void *data)
+{
+    _Atomic uint64_t *seq;
+    uint64_t n;
+
+    if (!ring || !ring->hdr || !ring->writable || !data)
+        return -EINVAL;
+
+    n = atomic_load_explicit(&ring->hdr->head, memory_order_relaxed);
+    seq = slot_seq(ring, n);
+
+    /* Odd sequence: slot is being written */
+    atomic_store_explicit(seq, 2 * n + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    memcpy(slot_data(ring, n), data, ring->hdr->slot_size);
+
+    atomic_store_explicit(seq, 2 * n + 2, memory_order_release);
+    atomic_store_explicit(&ring->hdr->head, n + 1, memory_order_release);
+
+    ring_notify(ring);
+    return 0;
+}
+
+int32_t shm_ring_read(struct shm_ring *ring, uint64_t *cursor, void *out, \
+                      uint64_t *lost)
+{
+    _Atomic uint64_t *seq;
+    uint64_t head, n, s1, s2;
+
+    if (!ring || !ring->hdr || !cursor || !out)
+        return -EINVAL;
+
+    while (1) {
+        head = atomic_load_explicit(&ring->hdr->head, memory_order_acquire);
+        n = *cursor;
+        if (n >= head)
+            return -EAGAIN;
+
+        /* Fell behind: skip to the oldest sample that can still be valid */
+        if (head - n > ring->hdr->slot_count) {
+            if (lost)
+                *lost += head - ring->hdr->slot_count - n;
+            n = head - ring->hdr->slot_count;
+            *cursor = n;
+        }
+
+        seq = slot_seq(ring, n);
+        s1 = atomic_load_explicit(seq, memory_order_acquire);
+        if (s1 != 2 * n + 2) {
+            /* Overwritten (or being overwritten) by a newer sample */
+            if (lost)
+                (*lost)++;
+            *cursor = n + 1;
+            continue;
+        }
+
+        memcpy(out, slot_data(ring, n), ring->hdr->slot_size);
+
+        atomic_thread_fence(memory_order_acquire);
+        s2 = atomic_load_explicit(seq, memory_order_relaxed);
+        if (s1 != s2) {
+            /* Torn copy, the producer lapped us while copying */
+            if (lost)
+                (*lost)++;
+            *cursor = n + 1;
+            continue;
+        }
+
+        *cursor = n + 1;
+        return 0;
+    }
+}
+
+uint64_t shm_ring_head(const struct shm_ring *ring)
+{
+    if (!ring || !ring->hdr)
+        return 0;
+
+    return atomic_load_explicit(&ring->hdr->head, memory_order_acquire);
+}
+
+int32_t shm_ring_wait(struct shm_ring *ring, int32_t timeout_ms)
+{
+    struct pollfd pfd;
+    uint64_t val;
+    int32_t ret;
+
+    if (!ring || ring->event_fd < 0)
+        return -EINVAL;
+
+    pfd.fd = ring->event_fd;
+    pfd.events = POLLIN;
+    ret = poll(&pfd, 1, timeout_ms);
+    if (ret < 0)
+        return -errno;
+    if (ret == 0)
+        return -ETIMEDOUT;
+
+    /* Reset the counter, the eventfd belongs to this consumer only */
+    if (read(ring->event_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+        return -errno;
+
+    return 0;
+}
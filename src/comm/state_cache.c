@@ -0,0 +1,443 @@
+/**
+ * @file state_cache.c
+ *
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <dbus/dbus.h>
+
+#include <comm/dbus_comm.h>
+#include <comm/state_cache.h>
+#include <sched/clock.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define EMIT_PERIOD_NS                  (1000000000ULL / STATE_CHANGED_MAX_HZ)
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+struct state_prop {
+    const char *name;
+    int32_t type;                   /* DBUS_TYPE_* of the exported value */
+    bool valid;                     /* set at least once */
+    bool dirty;                     /* changed since the last signal */
+    union {
+        int32_t i32;
+        double dbl;
+        dbus_bool_t b;
+        char str[STATE_STR_LEN];
+    } value;
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+static struct state_prop props[STATE_PROP_COUNT] = {
+    [STATE_BRIGHTNESS]          = { "Brightness",       DBUS_TYPE_INT32 },
+    [STATE_AUDIO_GAIN]          = { "AudioGain",        DBUS_TYPE_DOUBLE },
+    [STATE_AUDIO_GAIN_LEFT]     = { "AudioGainLeft",    DBUS_TYPE_DOUBLE },
+    [STATE_AUDIO_GAIN_RIGHT]    = { "AudioGainRight",   DBUS_TYPE_DOUBLE },
+    [STATE_IMU_ROLL]            = { "ImuRoll",          DBUS_TYPE_DOUBLE },
+    [STATE_IMU_PITCH]           = { "ImuPitch",         DBUS_TYPE_DOUBLE },
+    [STATE_IMU_YAW]             = { "ImuYaw",           DBUS_TYPE_DOUBLE },
+    [STATE_WIFI_CONNECTED]      = { "WifiConnected",    DBUS_TYPE_BOOLEAN },
+    [STATE_WIFI_SSID]           = { "WifiSsid",         DBUS_TYPE_STRING },
+};
+
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static int32_t timer_fd = -1;
+static bool emit_armed = false;
+static uint64_t last_emit_ns = 0;
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+/*
+ * Schedule the PropertiesChanged signal, state_lock held. The first change
+ * after a quiet period goes out right away, later ones are held back until
+ * one emit period after the previous signal, so a 1 kHz producer still
+ * costs at most STATE_CHANGED_MAX_HZ signals per second.
+ */
+static void state_emit_arm(void)
+{
+    struct itimerspec its;
+    uint64_t due;
+
+    if (emit_armed || timer_fd < 0)
+        return;
+
+    due = last_emit_ns + EMIT_PERIOD_NS;
+    if (due < now_ns())
+        due = now_ns();
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = due / 1000000000ULL;
+    its.it_value.tv_nsec = due % 1000000000ULL;
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        LOG_ERROR("Failed to arm state change timer: %s", strerror(errno));
+        return;
+    }
+
+    emit_armed = true;
+}
+
+static void state_mark_dirty(struct state_prop *p)
+{
+    p->valid = true;
+    p->dirty = true;
+    state_emit_arm();
+}
+
+static struct state_prop *state_prop_get(state_prop_t prop, int32_t type)
+{
+    if (prop < 0 || prop >= STATE_PROP_COUNT || props[prop].type != type) {
+        LOG_ERROR("Invalid state property %d for type %c", prop, type);
+        return NULL;
+    }
+
+    return &props[prop];
+}
+
+static int32_t state_prop_find(const char *name)
+{
+    int32_t i;
+
+    for (i = 0; i < STATE_PROP_COUNT; i++) {
+        if (strcmp(props[i].name, name) == 0)
+            return i;
+    }
+
+    return -ENOENT;
+}
+
+/* Append the value as a variant, state_lock held */
+static void state_append_variant(DBusMessageIter *iter, \
+                                 const struct state_prop *p)
+{
+    DBusMessageIter variant;
+    const char *str;
+    char sig[2] = { (char)p->type, '\0' };
+
+    dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, sig, &variant);
+    switch (p->type) {
+    case DBUS_TYPE_STRING:
+        str = p->value.str;
+        dbus_message_iter_append_basic(&variant, DBUS_TYPE_STRING, &str);
+        break;
+    default:
+        dbus_message_iter_append_basic(&variant, p->type, &p->value);
+        break;
+    }
+    dbus_message_iter_close_container(iter, &variant);
+}
+
+static void state_append_entry(DBusMessageIter *array, \
+                               const struct state_prop *p)
+{
+    DBusMessageIter entry;
+
+    dbus_message_iter_open_container(array, DBUS_TYPE_DICT_ENTRY, NULL, \
+                                     &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &p->name);
+    state_append_variant(&entry, p);
+    dbus_message_iter_close_container(array, &entry);
+}
+
+/* Properties of an interface other than ours do not exist */
+static bool state_iface_match(const char *iface)
+{
+    return !iface || !iface[0] || strcmp(iface, SER_IFACE) == 0;
+}
+
+static DBusMessage *state_reply_get(DBusMessage *msg)
+{
+    DBusMessage *reply;
+    DBusMessageIter iter;
+    const char *iface, *name;
+    int32_t idx;
+
+    if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &iface, \
+                               DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID))
+        return dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS, \
+                                      "Expected (ss)");
+
+    if (!state_iface_match(iface))
+        return dbus_message_new_error_printf(msg, \
+                                             DBUS_ERROR_UNKNOWN_INTERFACE, \
+                                             "No such interface '%s'", iface);
+
+    idx = state_prop_find(name);
+    pthread_mutex_lock(&state_lock);
+    if (idx < 0 || !props[idx].valid) {
+        pthread_mutex_unlock(&state_lock);
+        return dbus_message_new_error_printf(msg, \
+                                             DBUS_ERROR_UNKNOWN_PROPERTY, \
+                                             "No such property '%s'", name);
+    }
+
+    reply = dbus_message_new_method_return(msg);
+    if (reply) {
+        dbus_message_iter_init_append(reply, &iter);
+        state_append_variant(&iter, &props[idx]);
+    }
+    pthread_mutex_unlock(&state_lock);
+
+    return reply;
+}
+
+/* Properties never reported by their subsystem are left out */
+static DBusMessage *state_reply_get_all(DBusMessage *msg)
+{
+    DBusMessage *reply;
+    DBusMessageIter iter, array;
+    const char *iface;
+    int32_t i;
+
+    if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &iface, \
+                               DBUS_TYPE_INVALID))
+        return dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS, \
+                                      "Expected (s)");
+
+    reply = dbus_message_new_method_return(msg);
+    if (!reply)
+        return NULL;
+
+    dbus_message_iter_init_append(reply, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &array);
+    if (state_iface_match(iface)) {
+        pthread_mutex_lock(&state_lock);
+        for (i = 0; i < STATE_PROP_COUNT; i++) {
+            if (props[i].valid)
+                state_append_entry(&array, &props[i]);
+        }
+        pthread_mutex_unlock(&state_lock);
+    }
+    dbus_message_iter_close_container(&iter, &array);
+
+    return reply;
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+void state_cache_set_i32(state_prop_t prop, int32_t value)
+{
+    struct state_prop *p = state_prop_get(prop, DBUS_TYPE_INT32);
+
+    if (!p)
+        return;
+
+    pthread_mutex_lock(&state_lock);
+    if (!p->valid || p->value.i32 != value) {
+        p->value.i32 = value;
+        state_mark_dirty(p);
+    }
+    pthread_mutex_unlock(&state_lock);
+}
+
+void state_cache_set_double(state_prop_t prop, double value)
+{
+    struct state_prop *p = state_prop_get(prop, DBUS_TYPE_DOUBLE);
+
+    if (!p)
+        return;
+
+    pthread_mutex_lock(&state_lock);
+    if (!p->valid || p->value.dbl != value) {
+        p->value.dbl = value;
+        state_mark_dirty(p);
+    }
+    pthread_mutex_unlock(&state_lock);
+}
+
+void state_cache_set_bool(state_prop_t prop, bool value)
+{
+    struct state_prop *p = state_prop_get(prop, DBUS_TYPE_BOOLEAN);
+
+    if (!p)
+        return;
+
+    pthread_mutex_lock(&state_lock);
+    if (!p->valid || p->value.b != (dbus_bool_t)value) {
+        p->value.b = value;
+        state_mark_dirty(p);
+    }
+    pthread_mutex_unlock(&state_lock);
+}
+
+void state_cache_set_str(state_prop_t prop, const char *value)
+{
+    struct state_prop *p = state_prop_get(prop, DBUS_TYPE_STRING);
+
+    if (!p)
+        return;
+
+    // DBus strings must be valid UTF-8, keep the cache safe to marshal
+    if (!value || !dbus_validate_utf8(value, NULL))
+        value = "";
+
+    pthread_mutex_lock(&state_lock);
+    if (!p->valid || strncmp(p->value.str, value, STATE_STR_LEN - 1) != 0) {
+        snprintf(p->value.str, STATE_STR_LEN, "%s", value);
+        state_mark_dirty(p);
+    }
+    pthread_mutex_unlock(&state_lock);
+}
+
+int32_t state_cache_get_i32(state_prop_t prop, int32_t *value)
+{
+    struct state_prop *p = state_prop_get(prop, DBUS_TYPE_INT32);
+    int32_t ret = 0;
+
+    if (!p || !value)
+        return -EINVAL;
+
+    pthread_mutex_lock(&state_lock);
+    if (p->valid)
+        *value = p->value.i32;
+    else
+        ret = -ENODATA;
+    pthread_mutex_unlock(&state_lock);
+
+    return ret;
+}
+
+int32_t state_cache_init(void)
+{
+    int32_t fd, i;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERROR("Failed to create state change timer: %s", strerror(errno));
+        return -errno;
+    }
+
+    pthread_mutex_lock(&state_lock);
+    timer_fd = fd;
+    // Changes recorded before the listener was up
+    for (i = 0; i < STATE_PROP_COUNT; i++) {
+        if (props[i].dirty) {
+            state_emit_arm();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&state_lock);
+
+    return fd;
+}
+
+/*
+ * Property reads never go through the workqueue: the values are copied out
+ * of the cache on the listener thread. Every property is read-only, writes
+ * go through the command frame so that they reach the hardware.
+ */
+DBusMessage *state_cache_handle_call(DBusMessage *msg)
+{
+    const char *member = dbus_message_get_member(msg);
+
+    if (!member)
+        return NULL;
+
+    if (strcmp(member, "Get") == 0)
+        return state_reply_get(msg);
+    if (strcmp(member, "GetAll") == 0)
+        return state_reply_get_all(msg);
+    if (strcmp(member, "Set") == 0)
+        return dbus_message_new_error(msg, DBUS_ERROR_PROPERTY_READ_ONLY, \
+                                      "Properties are read-only");
+
+    return dbus_message_new_error_printf(msg, DBUS_ERROR_UNKNOWN_METHOD, \
+                                         "No such method '%s'", member);
+}
+
+/* Timer fd is readable: send one signal carrying every pending change */
+void state_cache_emit_changes(DBusConnection *conn)
+{
+    DBusMessage *sig;
+    DBusMessageIter iter, array;
+    const char *iface = SER_IFACE;
+    uint64_t expirations;
+    int32_t i, cnt = 0;
+
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && \
+        errno != EAGAIN) {
+        LOG_TRACE("State change timer read: %s", strerror(errno));
+    }
+
+    sig = dbus_message_new_signal(SER_OBJ_PATH, DBUS_INTERFACE_PROPERTIES, \
+                                  "PropertiesChanged");
+    if (!sig) {
+        LOG_ERROR("Failed to create PropertiesChanged signal");
+        return;
+    }
+
+    dbus_message_iter_init_append(sig, &iter);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &iface);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &array);
+
+    pthread_mutex_lock(&state_lock);
+    for (i = 0; i < STATE_PROP_COUNT; i++) {
+        if (!props[i].dirty)
+            continue;
+        state_append_entry(&array, &props[i]);
+        props[i].dirty = false;
+        cnt++;
+    }
+    emit_armed = false;
+    last_emit_ns = now_ns();
+    pthread_mutex_unlock(&state_lock);
+
+    dbus_message_iter_close_container(&iter, &array);
+    // No invalidated properties, every change carries its value
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &array);
+    dbus_message_iter_close_container(&iter, &array);
+
+    if (cnt) {
+        LOG_TRACE("PropertiesChanged with %d value(s)", cnt);
+        if (!dbus_connection_send(conn, sig, NULL))
+            LOG_ERROR("Out of memory while sending PropertiesChanged");
+    }
+    dbus_message_unref(sig);
+}
+
+void state_cache_release(void)
+{
+    pthread_mutex_lock(&state_lock);
+    if (timer_fd >= 0)
+        close(timer_fd);
+    timer_fd = -1;
+    emit_armed = false;
+    pthread_mutex_unlock(&state_lock);
+}
@@ -14,6 +14,10 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <dbus/dbus.h>
 
 #include <comm/dbus_comm.h>
 #include <comm/cmd_payload.h>
@@ -22,6 +26,11 @@
 #include <hw/imu.h>
 #include <hw/common.h>
 #include <audio/sound.h>
+#include <comm/publisher.h>
+#include <comm/p2p_comm.h>
+#include <comm/dbus_router.h>
+#include <comm/state_cache.h>
+#include <sched/clock.h>
 
 /*********************
  *      DEFINES
@@ -50,7 +59,6 @@
 /**********************
  *   STATIC FUNCTIONS
  **********************/
-
 /**********************
  *   GLOBAL FUNCTIONS
  **********************/
@@ -65,6 +73,12 @@ int32_t process_opcode_endless(uint32_t opcode, void *data)
     case OP_START_IMU:
         ret = imu_fn_thread_handler();
         break;
+    case OP_START_PUBLISHER:
+        ret = publisher_fn_thread_handler();
+        break;
+    case OP_START_P2P:
+        ret = p2p_fn_thread_handler();
+        break;
     default:
         LOG_ERROR("Opcode [%d] is invalid", opcode);
         break;
@@ -78,6 +92,9 @@ int32_t process_opcode(uint32_t opcode, void *data)
     int32_t ret = 0;
 
     switch (opcode) {
+    case OP_PING:
+        // Queued ping, timestamps are collected by its work done hook
+        break;
     case OP_BACKLIGHT_INIT:
         backlight_setup();
         break;
@@ -87,6 +104,10 @@ int32_t process_opcode(uint32_t opcode, void *data)
         set_brightness( (*((remote_cmd_t *)data)).entries[1].value.i32);
         break;
     case OP_GET_BRIGHTNESS:
+        // Refreshes the Brightness property, readers use Properties.Get
+        ret = get_brightness();
+        if (ret > 0)
+            ret = 0;
         break;
     case OP_LEFT_VIBRATOR:
         ret = rumble_trigger(2, 80, 150);
@@ -111,15 +132,87 @@ int32_t process_opcode(uint32_t opcode, void *data)
         // TODO: support sound file path
         audio_play_sound("/usr/share/sounds/sound-icons/percussion-10.wav");
         break;
+    case OP_DBUS_REPLY:
+        dbus_pending_run_callback((struct dbus_reply_work *)data);
+        break;
+    case OP_DBUS_ROUTE:
+        dbus_router_run_work((struct dbus_route_work *)data);
+        break;
 
     default:
         LOG_ERROR("Opcode [%d] is invalid", opcode);
+        ret = -EINVAL;
         break;
     }
 
     return ret;
 }
 
+/*
+ * Opcodes that only read in-memory state, bounded by a short lock at most.
+ * They are served by the DBus listener itself, with the value in the reply.
+ */
+bool opcode_is_inline(uint32_t opcode)
+{
+    switch (opcode) {
+    case OP_PING:
+    case OP_GET_BRIGHTNESS:
+    case OP_READ_IMU:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Listener thread: append the value of an inline opcode as a variant */
+int32_t process_opcode_inline(const remote_cmd_t *cmd, DBusMessageIter *iter)
+{
+    DBusMessageIter var, st;
+    struct ping_stamps ps;
+    struct imu_angles a;
+    int32_t brightness, ret;
+    double angle[3];
+    dbus_bool_t ok;
+
+    switch (cmd->opcode) {
+    case OP_PING:
+        // Not queued: the handler starts right away
+        ps.rx_ns = cmd->rx_ns;
+        ps.enqueue_ns = ps.dequeue_ns = now_ns();
+        ps.reply_ns = now_ns();
+        return dbus_append_ping_stamps(iter, &ps);
+    case OP_GET_BRIGHTNESS:
+        // Last value written or read by the backlight driver, no sysfs access
+        ret = state_cache_get_i32(STATE_BRIGHTNESS, &brightness);
+        if (ret)
+            return ret;
+        ok = dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, \
+                                              DBUS_TYPE_INT32_AS_STRING, &var);
+        ok = ok && dbus_message_iter_append_basic(&var, DBUS_TYPE_INT32, \
+                                                  &brightness);
+        break;
+    case OP_READ_IMU:
+        a = imu_get_angles();
+        angle[0] = a.roll;
+        angle[1] = a.pitch;
+        angle[2] = a.yaw;
+        ok = dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, \
+                                              "(ddd)", &var);
+        ok = ok && dbus_message_iter_open_container(&var, DBUS_TYPE_STRUCT, \
+                                                    NULL, &st);
+        for (int32_t i = 0; ok && i < 3; i++)
+            ok = dbus_message_iter_append_basic(&st, DBUS_TYPE_DOUBLE, \
+                                                &angle[i]);
+        ok = ok && dbus_message_iter_close_container(&var, &st);
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    ok = ok && dbus_message_iter_close_container(iter, &var);
+    return ok ? 0 : -ENOMEM;
+}
+
 int32_t create_local_simple_task(uint8_t flow, uint8_t duration, uint32_t opcode)
 {
     work_t *work = create_work(LOCAL, flow, duration, opcode, NULL);
@@ -128,7 +221,10 @@ int32_t create_local_simple_task(uint8_t flow, uint8_t duration, uint32_t opcode
         return -1;
     }
 
-    push_work(work);
+    if (push_work(work)) {
+        delete_work(work);
+        return -1;
+    }
 
     return 0;
 }
@@ -143,7 +239,10 @@ int32_t create_remote_task(uint8_t flow, void *data)
         return -1;
     }
 
-    push_work(work);
+    if (push_work(work)) {
+        delete_work(work);
+        return -1;
+    }
 
     return 0;
 }
@@ -76,10 +76,10 @@ static void *non_blocking_task_thread(void *arg)
         ret = process_opcode(w->opcode, w->data);
     }
 
-    // Check ret...
-    // TODO: Handle work done notification
     LOG_TRACE("TASK: [%d:%d:%d:%d] is completed - return %d", \
               w->type, w->flow, w->duration, w->opcode, ret);
+    if (w->done)
+        w->done(w, ret);
 
     // Free working data structures for non-blocking tasks.
     if (w->duration == ENDLESS) {
@@ -98,6 +98,10 @@ static int32_t create_non_blocking_task(work_t *w)
     ret = pthread_create(&thread_id, NULL, non_blocking_task_thread, w);
     if (ret) {
         LOG_FATAL("Failed to create worker thread: %s", strerror(ret));
+        // The work never ran, complete it here since no thread owns it
+        if (w->done)
+            w->done(w, -ret);
+        delete_work(w);
         return ret;
     } else {
         pthread_detach(thread_id);
@@ -116,9 +120,10 @@ static int32_t create_blocking_task(work_t *w)
     normal_task_cnt_inc();
     ret = process_opcode(w->opcode, w->data);
 
-    // TODO: Handle work done notification
     LOG_TRACE("TASK: [%d:%d:%d:%d] is completed - return %d", \
               w->type, w->flow, w->duration, w->opcode, ret);
+    if (w->done)
+        w->done(w, ret);
 
     // The working data structures for normal tasks need to be freed
     delete_work(w);
@@ -12,14 +12,19 @@
 #endif
 #include <log.h>
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
 
 #include <comm/dbus_comm.h>
 #include <sched/workqueue.h>
 #include <sched/task.h>
+#include <sched/clock.h>
 
 /*********************
  *      DEFINES
@@ -42,8 +47,9 @@ extern volatile sig_atomic_t g_run;
  *  STATIC VARIABLES
  **********************/
 static workqueue_t g_wqueue = {
-    .head = NULL,
-    .tail = NULL,
+    .n_clients = 0,
+    .active_head = NULL,
+    .active_tail = NULL,
     .mutex = PTHREAD_MUTEX_INITIALIZER,
     .cond = PTHREAD_COND_INITIALIZER
 };
@@ -55,6 +61,63 @@ static workqueue_t g_wqueue = {
 /**********************
  *   STATIC FUNCTIONS
  **********************/
+/* Weight and quota of a new client, from WQ_CLIENTS_ENV if listed there */
+static void wq_client_config(wq_client_t *c)
+{
+    const char *env, *p;
+    size_t len = strlen(c->st.name);
+    uint32_t weight, quota;
+    int32_t n;
+
+    c->st.weight = WQ_DEFAULT_WEIGHT;
+    c->st.quota = strcmp(c->st.name, WQ_LOCAL_CLIENT) ? WQ_DEFAULT_QUOTA : 0;
+
+    env = getenv(WQ_CLIENTS_ENV);
+    for (p = env; p && *p; p = strchr(p, ',') ? strchr(p, ',') + 1 : NULL) {
+        if (strncmp(p, c->st.name, len) || p[len] != ':')
+            continue;
+
+        quota = c->st.quota;
+        n = sscanf(p + len + 1, "%u:%u", &weight, &quota);
+        if (n >= 1 && weight > 0) {
+            c->st.weight = weight;
+            c->st.quota = quota;
+        }
+        break;
+    }
+
+    LOG_DEBUG("Workqueue client %s: weight %u, quota %u", c->st.name, \
+              c->st.weight, c->st.quota);
+}
+
+/* Queue lock held */
+static wq_client_t *wq_client_get(const char *name)
+{
+    wq_client_t *c;
+
+    if (!name || !name[0])
+        name = WQ_LOCAL_CLIENT;
+
+    for (int32_t i = 0; i < g_wqueue.n_clients; i++) {
+        if (strcmp(g_wqueue.clients[i].st.name, name) == 0)
+            return &g_wqueue.clients[i];
+    }
+
+    if (g_wqueue.n_clients == WQ_MAX_CLIENTS - 1) {
+        c = &g_wqueue.clients[WQ_MAX_CLIENTS - 1];
+        if (c->st.name[0])
+            return c;
+        LOG_WARN("Too many workqueue clients, %s and later ones share the " \
+                 "\"%s\" queue", name, WQ_OTHER_CLIENT);
+        name = WQ_OTHER_CLIENT;
+    } else {
+        c = &g_wqueue.clients[g_wqueue.n_clients++];
+    }
+
+    snprintf(c->st.name, sizeof(c->st.name), "%s", name);
+    wq_client_config(c);
+    return c;
+}
 
 /**********************
  *   GLOBAL FUNCTIONS
@@ -86,46 +149,135 @@ void delete_work(work_t *w)
     }
 
     LOG_TRACE("Deleting work for opcode: %d", w->opcode);
-    if (w->data) {
+    if (w->data)
         free(w->data);
-        return;
-    }
 
     free(w);
 }
 
-void push_work(work_t *w) {
+int32_t push_work(work_t *w) {
+    w->next = NULL;
+    return push_work_list(w);
+}
+
+/*
+ * Push a chain of work linked through next, all of the same client, under a
+ * single lock: the chain is accepted or refused as a whole and the task
+ * handler takes it in order. -EBUSY when it would exceed the client quota,
+ * the work then still belongs to the caller.
+ */
+int32_t push_work_list(work_t *head) {
+    wq_client_t *c;
+    work_t *tail;
+    uint32_t n = 0;
+    uint64_t now;
+
+    if (!head)
+        return -EINVAL;
+
+    now = now_ns();
+    for (tail = head; ; tail = tail->next) {
+        tail->enqueue_ns = now;
+        n++;
+        if (!tail->next)
+            break;
+    }
+
     pthread_mutex_lock(&g_wqueue.mutex);
 
-    w->next = NULL;
-    if (!g_wqueue.tail) {
-        g_wqueue.head = g_wqueue.tail = w;
+    c = wq_client_get(head->client);
+    if (c->st.quota && c->st.depth + n > c->st.quota) {
+        c->st.dropped += n;
+        pthread_mutex_unlock(&g_wqueue.mutex);
+        LOG_DEBUG("Client %s over quota (%u queued)", c->st.name, c->st.depth);
+        return -EBUSY;
+    }
+
+    if (!c->tail) {
+        c->head = head;
     } else {
-        g_wqueue.tail->next = w;
-        g_wqueue.tail = w;
+        c->tail->next = head;
+    }
+    c->tail = tail;
+    c->st.depth += n;
+    c->st.enqueued += n;
+    if (c->st.depth > c->st.depth_peak)
+        c->st.depth_peak = c->st.depth;
+
+    // Join the end of the round, with no credit left over from earlier
+    if (!c->active) {
+        c->active = true;
+        c->deficit = 0;
+        c->next_active = NULL;
+        if (!g_wqueue.active_tail)
+            g_wqueue.active_head = c;
+        else
+            g_wqueue.active_tail->next_active = c;
+        g_wqueue.active_tail = c;
     }
     pthread_cond_signal(&g_wqueue.cond);
 
     pthread_mutex_unlock(&g_wqueue.mutex);
+    return 0;
 }
 
+/*
+ * Deficit round-robin: the client at the head of the round gets its weight
+ * in credits when it runs out, and keeps the head until they are spent.
+ */
 work_t * pop_work_wait() {
+    wq_client_t *c;
     work_t *w = NULL;
+    uint64_t wait;
 
     pthread_mutex_lock(&g_wqueue.mutex);
 
-    while (!g_wqueue.head && g_run) {
+    while (!g_wqueue.active_head && g_run) {
         pthread_cond_wait(&g_wqueue.cond, &g_wqueue.mutex);
     }
 
     if (g_run == 0) {
+        pthread_mutex_unlock(&g_wqueue.mutex);
         return NULL;
     }
 
-    w = g_wqueue.head;
-    g_wqueue.head = w->next;
-    if (g_wqueue.head == NULL) {
-        g_wqueue.tail = NULL;
+    c = g_wqueue.active_head;
+    if (c->deficit <= 0)
+        c->deficit += c->st.weight;
+
+    w = c->head;
+    c->head = w->next;
+    if (c->head == NULL) {
+        c->tail = NULL;
+    }
+    w->next = NULL;
+    c->deficit--;
+
+    w->dequeue_ns = now_ns();
+    wait = w->dequeue_ns - w->enqueue_ns;
+    c->st.depth--;
+    c->st.dequeued++;
+    c->st.wait_sum_ns += wait;
+    if (wait > c->st.wait_max_ns)
+        c->st.wait_max_ns = wait;
+
+    // Leave the round when empty, go to its end when out of credits
+    if (!c->head || c->deficit <= 0) {
+        g_wqueue.active_head = c->next_active;
+        if (!g_wqueue.active_head)
+            g_wqueue.active_tail = NULL;
+
+        if (!c->head) {
+            c->active = false;
+            c->deficit = 0;
+        } else {
+            c->next_active = NULL;
+            if (!g_wqueue.active_tail)
+                g_wqueue.active_head = c;
+            else
+                g_wqueue.active_tail->next_active = c;
+            g_wqueue.active_tail = c;
+        }
     }
 
     pthread_mutex_unlock(&g_wqueue.mutex);
@@ -138,3 +290,16 @@ void workqueue_stop() {
     pthread_mutex_unlock(&g_wqueue.mutex);
 }
 
+int32_t workqueue_get_stats(struct wq_client_stats *out, int32_t max)
+{
+    int32_t n = 0;
+
+    pthread_mutex_lock(&g_wqueue.mutex);
+    for (int32_t i = 0; i < WQ_MAX_CLIENTS && n < max; i++) {
+        if (g_wqueue.clients[i].st.name[0])
+            out[n++] = g_wqueue.clients[i].st;
+    }
+    pthread_mutex_unlock(&g_wqueue.mutex);
+
+    return n;
+}
@@ -13,10 +13,12 @@
 #include <log.h>
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
 #include <comm/f_comm.h>
+#include <comm/publisher.h>
 #include <hw/common.h>
 
 /*********************
@@ -24,6 +26,8 @@
  *********************/
 #define ALS_SAMPLE_TIME_CFG             "in_illuminance_integration_time"
 #define ALS_VALUE                       "in_illuminance_input"
+#define ALS_PUB_HZ                      2
+#define ALS_PUB_DEADBAND                5.0
 
 /**********************
  *      TYPEDEFS
@@ -80,6 +84,8 @@ int32_t als_late_init(const char *sensor_name, char *dev_path, size_t path_len)
         }
     }
 
+    publisher_add_topic(PUB_TOPIC_ALS_LUX, ALS_PUB_HZ, ALS_PUB_DEADBAND);
+
     return 0;
 }
 
@@ -103,6 +109,7 @@ int32_t als_read_illuminance(const char *dev_path)
         } else {
 
             LOG_INFO("ALS current value %s, ret %d", r_buff, ret);
+            publish(PUB_TOPIC_ALS_LUX, strtod(r_buff, NULL));
         }
     }
 
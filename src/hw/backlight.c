@@ -13,10 +13,12 @@
 #include <log.h>
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
 #include <comm/f_comm.h>
+#include <comm/state_cache.h>
 #include <hw/common.h>
 
 /*********************
@@ -63,6 +65,9 @@ int32_t backlight_setup()
         ret = gf_fs_write_file(FS_BRIGHTNESS_POWER, str, sizeof(str));
     }
 
+    // Seed the exported state with whatever the bootloader left behind
+    get_brightness();
+
     return ret;
 }
 
@@ -86,9 +91,28 @@ int32_t set_brightness(uint8_t brightness)
     }
 
     LOG_TRACE("Brightness set to %u", brightness);
+    state_cache_set_i32(STATE_BRIGHTNESS, brightness);
     return 0;
 }
 
+/* Read back the current brightness and refresh the exported state */
+int32_t get_brightness(void)
+{
+    char buf[16];
+    size_t read_len = 0;
+    int32_t ret;
+
+    ret = gf_fs_read_file(FS_BRIGHTNESS, buf, sizeof(buf), &read_len);
+    if (ret) {
+        LOG_ERROR("Failed to read brightness, ret %d", ret);
+        return ret;
+    }
+
+    ret = (int32_t)strtol(buf, NULL, 10);
+    state_cache_set_i32(STATE_BRIGHTNESS, ret);
+    return ret;
+}
+
 int32_t brightness_ramp(uint8_t from, uint8_t to, uint32_t period_us)
 {
     uint32_t step_us;
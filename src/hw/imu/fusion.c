@@ -0,0 +1,448 @@
+/**
+ * @file fusion.c
+ *
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <hw/imu_fusion.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+/* Samples whose accel tilt is computed ahead of the Kalman filters */
+#define KALMAN_CHUNK 32
+
+/**********************
+ *      MACROS
+ **********************/
+#define RAD2DEG (180.0f / (float)M_PI)
+#define DEG2RAD ((float)M_PI / 180.0f)
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+static const char *fusion_names[IMU_FUSION_COUNT] = {
+    [IMU_FUSION_KALMAN]   = IMU_FUSION_KALMAN_NAME,
+    [IMU_FUSION_MADGWICK] = IMU_FUSION_MADGWICK_NAME,
+    [IMU_FUSION_MAHONY]   = IMU_FUSION_MAHONY_NAME,
+};
+
+static const struct imu_fusion_tuning default_tuning = {
+    .q_angle = 0.001f,
+    .q_bias = 0.003f,
+    .r_measure = 0.03f,
+    .beta = IMU_FUSION_MADGWICK_BETA,
+    .kp = IMU_FUSION_MAHONY_KP,
+    .ki = IMU_FUSION_MAHONY_KI,
+};
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+static inline float inv_sqrt(float x)
+{
+    return 1.0f / sqrtf(x);
+}
+
+/* ---------- kalman ---------- */
+/* Trust the accel tilt less when it is not measuring gravity alone */
+static float compute_adaptive_r_factor(float accel_mag_g, float innovation_deg)
+{
+    float mag_dev = fabsf(accel_mag_g - 1.0f);
+    float mag_factor = 1.0f + (mag_dev / 0.6f) * 4.0f;
+    if (mag_factor < 1.0f) mag_factor = 1.0f;
+
+    float inn_factor = 1.0f;
+    if (innovation_deg > 5.0f)
+        inn_factor = 1.0f + (innovation_deg - 5.0f) / 20.0f;
+
+    return mag_factor * inn_factor;
+}
+
+/* accel-based angles (deg) and accel magnitude (g) */
+static inline void kalman_tilt(float ax, float ay, float az, float *roll_acc, \
+                               float *pitch_acc, float *mag)
+{
+    *mag = sqrtf(ax*ax + ay*ay + az*az);
+    *roll_acc  = atan2f(ay, az) * RAD2DEG;
+    *pitch_acc = atan2f(-ax, sqrtf(ay*ay + az*az)) * RAD2DEG;
+}
+
+/* Both filters advance together on the tilt of one sample */
+static void kalman_filter(struct imu_fusion *f, float roll_acc, float pitch_acc, \
+                          float mag, float gx, float gy, float gz, float dt)
+{
+    struct imu_angles *out = &f->att.angles;
+    float orig_r_roll, orig_r_pitch;
+
+    /* temporarily scale r_measure by the adaptive factor for robustness */
+    orig_r_roll  = f->k_roll.r_measure;
+    orig_r_pitch = f->k_pitch.r_measure;
+    f->k_roll.r_measure  = orig_r_roll * \
+                           compute_adaptive_r_factor(mag, fabsf(roll_acc - out->roll));
+    f->k_pitch.r_measure = orig_r_pitch * \
+                           compute_adaptive_r_factor(mag, fabsf(pitch_acc - out->pitch));
+
+    out->roll  = kalman_update(&f->k_roll,  roll_acc,  gx, dt);
+    out->pitch = kalman_update(&f->k_pitch, pitch_acc, gy, dt);
+
+    f->k_roll.r_measure  = orig_r_roll;
+    f->k_pitch.r_measure = orig_r_pitch;
+
+    out->yaw += gz * dt;
+
+    LOG_TRACE("acc_roll=%.3f acc_pitch=%.3f kal_roll=%.3f kal_pitch=%.3f yaw=%.3f",
+              roll_acc, pitch_acc, out->roll, out->pitch, out->yaw);
+}
+
+static void kalman_step(struct imu_fusion *f, const float a[3], const float g[3], \
+                        float dt)
+{
+    float roll_acc, pitch_acc, mag;
+
+    kalman_tilt(a[0], a[1], a[2], &roll_acc, &pitch_acc, &mag);
+    kalman_filter(f, roll_acc, pitch_acc, mag, g[0], g[1], g[2], dt);
+}
+
+/*
+ * The accel tilt of a sample does not depend on the filters: the atan2f
+ * chains of a whole chunk run first, independent of each other, then the
+ * filters consume them in order.
+ */
+static void kalman_batch(struct imu_fusion *f, const float *const a[3], \
+                         const float *const g[3], const float *dt, uint32_t n, \
+                         struct imu_attitude *att)
+{
+    float roll_acc[KALMAN_CHUNK], pitch_acc[KALMAN_CHUNK], mag[KALMAN_CHUNK];
+    uint32_t base, m;
+
+    for (base = 0; base < n; base += m) {
+        m = n - base < KALMAN_CHUNK ? n - base : KALMAN_CHUNK;
+
+        for (uint32_t i = 0; i < m; i++)
+            kalman_tilt(a[0][base + i], a[1][base + i], a[2][base + i], \
+                        &roll_acc[i], &pitch_acc[i], &mag[i]);
+
+        for (uint32_t i = 0; i < m; i++) {
+            kalman_filter(f, roll_acc[i], pitch_acc[i], mag[i], g[0][base + i], \
+                          g[1][base + i], g[2][base + i], dt[base + i]);
+            if (att)
+                att[base + i] = f->att;
+        }
+    }
+}
+
+/* ---------- quaternion engines ---------- */
+static void quat_normalize(float q[4])
+{
+    float n = inv_sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+
+    q[0] *= n; q[1] *= n; q[2] *= n; q[3] *= n;
+}
+
+/*
+ * Madgwick, IMU form: integrate the gyro rate and step against the gradient
+ * of the error between the measured and the predicted gravity direction.
+ */
+static void madgwick_step(struct imu_fusion *f, const float a[3], const float g[3], \
+                          float dt)
+{
+    float *q = f->att.q;
+    float q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+    float gx = g[0] * DEG2RAD, gy = g[1] * DEG2RAD, gz = g[2] * DEG2RAD;
+    float ax = a[0], ay = a[1], az = a[2];
+    float qd0, qd1, qd2, qd3, s0, s1, s2, s3, n;
+
+    /* rate of change of the quaternion from the gyro */
+    qd0 = 0.5f * (-q1 * gx - q2 * gy - q3 * gz);
+    qd1 = 0.5f * ( q0 * gx + q2 * gz - q3 * gy);
+    qd2 = 0.5f * ( q0 * gy - q1 * gz + q3 * gx);
+    qd3 = 0.5f * ( q0 * gz + q1 * gy - q2 * gx);
+
+    n = ax * ax + ay * ay + az * az;
+    if (n > 0.0f) {
+        n = inv_sqrt(n);
+        ax *= n; ay *= n; az *= n;
+
+        /* gradient of the gravity error */
+        s0 = 4.0f * q0 * (q1 * q1 + q2 * q2) + 2.0f * (q2 * ax - q1 * ay);
+        s1 = 4.0f * q1 * (q3 * q3 + q0 * q0 - 1.0f + 2.0f * (q1 * q1 + q2 * q2) + az) - \
+             2.0f * (q3 * ax + q0 * ay);
+        s2 = 4.0f * q2 * (q0 * q0 + q3 * q3 - 1.0f + 2.0f * (q1 * q1 + q2 * q2) + az) + \
+             2.0f * (q0 * ax - q3 * ay);
+        s3 = 4.0f * q3 * (q1 * q1 + q2 * q2) - 2.0f * (q1 * ax + q2 * ay);
+
+        n = s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3;
+        if (n > 0.0f) {
+            n = f->beta * inv_sqrt(n);
+            qd0 -= n * s0; qd1 -= n * s1; qd2 -= n * s2; qd3 -= n * s3;
+        }
+    }
+
+    q[0] = q0 + qd0 * dt;
+    q[1] = q1 + qd1 * dt;
+    q[2] = q2 + qd2 * dt;
+    q[3] = q3 + qd3 * dt;
+    quat_normalize(q);
+}
+
+/*
+ * Mahony, IMU form: the cross product of the measured and the predicted
+ * gravity direction corrects the gyro rate through a PI controller.
+ */
+static void mahony_step(struct imu_fusion *f, const float a[3], const float g[3], \
+                        float dt)
+{
+    float *q = f->att.q;
+    float q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+    float gx = g[0] * DEG2RAD, gy = g[1] * DEG2RAD, gz = g[2] * DEG2RAD;
+    float ax = a[0], ay = a[1], az = a[2];
+    float vx, vy, vz, ex, ey, ez, n;
+
+    n = ax * ax + ay * ay + az * az;
+    if (n > 0.0f) {
+        n = inv_sqrt(n);
+        ax *= n; ay *= n; az *= n;
+
+        /* gravity direction predicted by the quaternion */
+        vx = 2.0f * (q1 * q3 - q0 * q2);
+        vy = 2.0f * (q0 * q1 + q2 * q3);
+        vz = q0 * q0 - q1 * q1 - q2 * q2 + q3 * q3;
+
+        ex = ay * vz - az * vy;
+        ey = az * vx - ax * vz;
+        ez = ax * vy - ay * vx;
+
+        f->e_int[0] += f->ki * ex * dt;
+        f->e_int[1] += f->ki * ey * dt;
+        f->e_int[2] += f->ki * ez * dt;
+
+        gx += f->kp * ex + f->e_int[0];
+        gy += f->kp * ey + f->e_int[1];
+        gz += f->kp * ez + f->e_int[2];
+    }
+
+    gx *= 0.5f * dt; gy *= 0.5f * dt; gz *= 0.5f * dt;
+    q[0] = q0 + (-q1 * gx - q2 * gy - q3 * gz);
+    q[1] = q1 + ( q0 * gx + q2 * gz - q3 * gy);
+    q[2] = q2 + ( q0 * gy - q1 * gz + q3 * gx);
+    q[3] = q3 + ( q0 * gz + q1 * gy - q2 * gx);
+    quat_normalize(q);
+}
+
+/* ZYX (yaw, pitch, roll) angles in degrees of a unit quaternion */
+static void quat_to_angles(const float q[4], struct imu_angles *out)
+{
+    float sp = 2.0f * (q[0] * q[2] - q[3] * q[1]);
+
+    if (sp > 1.0f) sp = 1.0f;
+    if (sp < -1.0f) sp = -1.0f;
+
+    out->roll  = atan2f(2.0f * (q[0] * q[1] + q[2] * q[3]), \
+                        1.0f - 2.0f * (q[1] * q[1] + q[2] * q[2])) * RAD2DEG;
+    out->pitch = asinf(sp) * RAD2DEG;
+    out->yaw   = atan2f(2.0f * (q[0] * q[3] + q[1] * q[2]), \
+                        1.0f - 2.0f * (q[2] * q[2] + q[3] * q[3])) * RAD2DEG;
+}
+
+static void angles_to_quat(float roll, float pitch, float yaw, float q[4])
+{
+    float cr = cosf(roll * DEG2RAD * 0.5f), sr = sinf(roll * DEG2RAD * 0.5f);
+    float cp = cosf(pitch * DEG2RAD * 0.5f), sp = sinf(pitch * DEG2RAD * 0.5f);
+    float cy = cosf(yaw * DEG2RAD * 0.5f), sy = sinf(yaw * DEG2RAD * 0.5f);
+
+    q[0] = cr * cp * cy + sr * sp * sy;
+    q[1] = sr * cp * cy - cr * sp * sy;
+    q[2] = cr * sp * cy + sr * cp * sy;
+    q[3] = cr * cp * sy - sr * sp * cy;
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+const char *imu_fusion_name(enum imu_fusion_type type)
+{
+    if ((uint32_t)type >= IMU_FUSION_COUNT)
+        return "unknown";
+
+    return fusion_names[type];
+}
+
+int32_t imu_fusion_parse(const char *name)
+{
+    if (!name)
+        return -EINVAL;
+
+    for (int32_t i = 0; i < IMU_FUSION_COUNT; i++) {
+        if (strcmp(name, fusion_names[i]) == 0)
+            return i;
+    }
+
+    return -EINVAL;
+}
+
+void imu_fusion_init(struct imu_fusion *f, enum imu_fusion_type type, \
+                     const struct imu_fusion_tuning *t)
+{
+    if (!t)
+        t = &default_tuning;
+    if ((uint32_t)type >= IMU_FUSION_COUNT)
+        type = IMU_FUSION_KALMAN;
+
+    memset(f, 0, sizeof(*f));
+    f->type = type;
+    f->att.type = type;
+    kalman_init(&f->k_roll, default_tuning.q_angle, default_tuning.q_bias, \
+                default_tuning.r_measure);
+    kalman_init(&f->k_pitch, default_tuning.q_angle, default_tuning.q_bias, \
+                default_tuning.r_measure);
+    f->beta = default_tuning.beta;
+    f->kp = default_tuning.kp;
+    f->ki = default_tuning.ki;
+    imu_fusion_set_tuning(f, t);
+
+    imu_fusion_reset(f, 0.0f, 0.0f, 0.0f);
+}
+
+void imu_fusion_set_tuning(struct imu_fusion *f, const struct imu_fusion_tuning *t)
+{
+    if (t->q_angle > 0.0f) f->k_roll.q_angle = f->k_pitch.q_angle = t->q_angle;
+    if (t->q_bias > 0.0f) f->k_roll.q_bias = f->k_pitch.q_bias = t->q_bias;
+    if (t->r_measure > 0.0f) f->k_roll.r_measure = f->k_pitch.r_measure = t->r_measure;
+    if (t->beta > 0.0f) f->beta = t->beta;
+    if (t->kp > 0.0f) f->kp = t->kp;
+    if (t->ki > 0.0f) f->ki = t->ki;
+}
+
+void imu_fusion_reset(struct imu_fusion *f, float roll, float pitch, float yaw)
+{
+    kalman_reset(&f->k_roll, roll);
+    kalman_reset(&f->k_pitch, pitch);
+    f->att.angles.roll = roll;
+    f->att.angles.pitch = pitch;
+    f->att.angles.yaw = yaw;
+
+    angles_to_quat(roll, pitch, yaw, f->att.q);
+    memset(f->e_int, 0, sizeof(f->e_int));
+    f->angles_valid = false;
+}
+
+void imu_fusion_set_yaw(struct imu_fusion *f, float yaw_deg)
+{
+    struct imu_angles cur;
+
+    if (f->type == IMU_FUSION_KALMAN) {
+        f->att.angles.yaw = yaw_deg;
+    } else {
+        cur = imu_fusion_angles(f);
+        angles_to_quat(cur.roll, cur.pitch, yaw_deg, f->att.q);
+    }
+    f->angles_valid = false;
+}
+
+void imu_fusion_update(struct imu_fusion *f, const float a[3], const float g[3], \
+                       float dt)
+{
+    switch (f->type) {
+    case IMU_FUSION_MADGWICK:
+        madgwick_step(f, a, g, dt);
+        break;
+    case IMU_FUSION_MAHONY:
+        mahony_step(f, a, g, dt);
+        break;
+    default:
+        kalman_step(f, a, g, dt);
+        break;
+    }
+
+    f->angles_valid = false;
+}
+
+void imu_fusion_update_batch(struct imu_fusion *f, const float *const a[3], \
+                             const float *const g[3], const float *dt, uint32_t n, \
+                             struct imu_attitude *att)
+{
+    float as[3], gs[3];
+
+    if (f->type == IMU_FUSION_KALMAN) {
+        kalman_batch(f, a, g, dt, n, att);
+        f->angles_valid = false;
+        return;
+    }
+
+    // The quaternion engines are a recurrence, one sample after the other
+    for (uint32_t i = 0; i < n; i++) {
+        for (uint32_t k = 0; k < 3; k++) {
+            as[k] = a[k][i];
+            gs[k] = g[k][i];
+        }
+
+        if (f->type == IMU_FUSION_MADGWICK)
+            madgwick_step(f, as, gs, dt[i]);
+        else
+            mahony_step(f, as, gs, dt[i]);
+
+        if (att)
+            att[i] = f->att;
+    }
+    f->angles_valid = false;
+}
+
+void imu_attitude_angles(const struct imu_attitude *att, struct imu_angles *out)
+{
+    if (att->type == IMU_FUSION_KALMAN)
+        *out = att->angles;
+    else
+        quat_to_angles(att->q, out);
+}
+
+void imu_attitude_lerp(const struct imu_attitude *a, const struct imu_attitude *b, \
+                       float t, struct imu_attitude *out)
+{
+    float sign = 1.0f;
+
+    *out = *a;
+    if (a->type == IMU_FUSION_KALMAN) {
+        out->angles.roll = a->angles.roll + (b->angles.roll - a->angles.roll) * t;
+        out->angles.pitch = a->angles.pitch + (b->angles.pitch - a->angles.pitch) * t;
+        out->angles.yaw = a->angles.yaw + (b->angles.yaw - a->angles.yaw) * t;
+        return;
+    }
+
+    /* q and -q are the same rotation, interpolate along the short arc */
+    if (a->q[0] * b->q[0] + a->q[1] * b->q[1] + a->q[2] * b->q[2] + a->q[3] * b->q[3] < 0.0f)
+        sign = -1.0f;
+    for (int32_t i = 0; i < 4; i++)
+        out->q[i] = a->q[i] + (sign * b->q[i] - a->q[i]) * t;
+    quat_normalize(out->q);
+}
+
+struct imu_angles imu_fusion_angles(struct imu_fusion *f)
+{
+    if (!f->angles_valid) {
+        imu_attitude_angles(&f->att, &f->angles);
+        f->angles_valid = true;
+    }
+
+    return f->angles;
+}
@@ -17,23 +17,74 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <math.h>
-#include <pthread.h>
 #include <time.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 #include <comm/f_comm.h>
+#include <comm/publisher.h>
+#include <comm/seqlock.h>
+#include <comm/shm_ring.h>
+#include <comm/state_cache.h>
 #include <hw/common.h>
 #include <hw/imu.h>
-#include "kalman.h"
+#include <hw/imu_batch.h>
+#include <hw/imu_fusion.h>
+#include <hw/imu_history.h>
+#include <hw/imu_motion.h>
+#include <hw/imu_record.h>
+#include <sched/clock.h>
+#include "imu_calib_cache.h"
+#include "imu_iio_buffer.h"
 
 /*********************
  *      DEFINES
  *********************/
 #define SYSFS_PATH_MAX 256
+/* Longest attribute value read: "-2147483648\n" and IIO fixed point */
+#define SYSFS_VALUE_MAX 32
 #define CALIB_SAMPLES 300
 #define DEFAULT_SAMPLE_HZ 100
+#define MAX_SAMPLE_HZ 1000
+/* Kalman tuning of the IMU task */
+#define DEFAULT_Q_ANGLE 0.001f
+#define DEFAULT_Q_BIAS 0.003f
+#define DEFAULT_R_MEASURE 0.03f
+/* Rate and jitter of the loop are published once per window */
+#define LOOP_STATS_WINDOW_NS 1000000000ULL
+/* UI facing telemetry: rate cap and deadband of the published angles */
+#define ANGLES_PUB_HZ 20
+#define ANGLES_PUB_DEADBAND 0.2
+/* Angles are derived for the topics and properties at most this often */
+#define ANGLES_EVAL_HZ 50
+/* Motion events a batch may raise */
+#define MOTION_EVENTS_MAX 8
+/* Raw sample stream for high-rate clients: ~10 s of history at 100 Hz */
+#define STREAM_RING_SLOTS 1024
+/*
+ * Drift watch: windows of calibrated samples taken while the device is
+ * still (deviations below DRIFT_STILL_*). A gyro residual past
+ * DRIFT_GYRO_MAX, more than the bias adaptation follows, recalibrates the
+ * gyro offsets up to DRIFT_GYRO_LIMIT, past it the device is turning. An
+ * accel magnitude off 1 g by DRIFT_ACCEL_MAX drops the cache instead: only
+ * a calibration held level fixes the accel.
+ */
+#define DRIFT_WINDOW CALIB_SAMPLES
+#define DRIFT_STILL_GYRO_STD 0.5f
+#define DRIFT_STILL_ACCEL_STD 0.02f
+#define DRIFT_GYRO_MAX 0.5f
+#define DRIFT_GYRO_LIMIT 5.0f
+#define DRIFT_ACCEL_MAX 0.05f
+/* The adapted gyro bias is saved at exit once it moved this far (deg/s) */
+#define CALIB_SAVE_GYRO_DELTA 0.05f
+/* Real time replay feeds the samples of this long at once, like the FIFO */
+#define REPLAY_CHUNK_NS 10000000ULL
+/* Buffered mode falls back to polling after this long without a scan */
+#define IIO_BUF_TIMEOUT_MS 1000
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
@@ -46,6 +97,28 @@
 /**********************
  *      TYPEDEFS
  **********************/
+/* Loop timing, owned by the IMU thread */
+struct loop_timing {
+    uint64_t period_ns;
+    uint64_t deadline_ns;       /* next wake-up, polled mode */
+    uint64_t prev_ts_ns;
+    uint64_t win_start_ns;
+    uint32_t win_samples;
+    uint32_t win_intervals;
+    uint64_t win_jitter_sum_ns;
+    uint32_t win_jitter_max_ns;
+    uint32_t win_wakes;
+    uint64_t win_late_sum_ns;
+    uint32_t win_late_max_ns;
+    struct imu_loop_stats st;   /* totals, last window figures */
+};
+
+/* Sums of the calibrated samples of one drift window */
+struct drift_window {
+    uint32_t n;
+    double a_sum[3], a_sq[3];
+    double g_sum[3], g_sq[3];
+};
 
 /**********************
  *  GLOBAL VARIABLES
@@ -57,18 +130,44 @@ extern volatile sig_atomic_t g_run;
  **********************/
 static const char *DEFAULT_IIO_BASE = "/sys/bus/iio/devices/iio:device0/";
 
+static const char *raw_names[IIO_BUF_AXES] = {
+    "in_accel_x_raw", "in_accel_y_raw", "in_accel_z_raw",
+    "in_anglvel_x_raw", "in_anglvel_y_raw", "in_anglvel_z_raw",
+};
+
 /* module state */
 static char iio_base[SYSFS_PATH_MAX];
+/* fds of raw_names, opened once by imu_kalman_init, -1 if missing */
+static int32_t raw_fds[IIO_BUF_AXES] = { -1, -1, -1, -1, -1, -1 };
 static int32_t sample_hz = DEFAULT_SAMPLE_HZ;
 
-/* Kalman filters */
-static struct kalman k_roll, k_pitch;
-static float yaw_integral = 0.0f; /* degrees */
+/* fusion engine, selected by imu_kalman_init */
+static struct imu_fusion fusion;
 
 /* thread + sync */
 static int32_t imu_running = 0;
-static pthread_mutex_t angles_lock = PTHREAD_MUTEX_INITIALIZER;
-static struct imu_angles shared_angles = {0.0f, 0.0f, 0.0f};
+/*
+ * attitude of the last batch, readers derive the angles from it. Written by
+ * the IMU thread alone (or with the thread stopped), so the sensor path
+ * never waits for a reader.
+ */
+static struct seqlock att_seq;
+static struct imu_attitude shared_att;
+/* heading requested by imu_kalman_reset_yaw, NAN when none is pending */
+static _Atomic float yaw_request = NAN;
+/* tuning requested by imu_kalman_set_tuning, applied by the IMU thread */
+static pthread_mutex_t tuning_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct imu_fusion_tuning tuning_request;
+static atomic_bool tuning_pending = false;
+
+/* loop timing, snapshot published by the IMU thread once per window */
+static struct seqlock stats_seq;
+static struct imu_loop_stats loop_stats;
+
+/* sample stream, written by the IMU thread only once a client opened it */
+static struct shm_ring stream_ring;
+static volatile int32_t stream_ready = 0;
+static volatile int32_t stream_active = 0;
 
 /* offsets (stored in final units: accel -> g, gyro -> deg/s)
  * NOTE: accel offsets chosen so that after subtracting offsets:
@@ -108,39 +207,135 @@ static struct {
 static float accel_mount[9];
 static float gyro_mount[9];
 
-/* adaptive params */
-static const float IDLE_GYRO_THRESHOLD = 1.0f;   /* deg/s threshold to consider idle */
-static const float IDLE_ACC_MAG_TOL    = 0.03f;  /* g tolerance around 1.0 */
-static const float BIAS_ADAPT_ALPHA    = 0.0008f;/* slow adapt rate */
+/* scales, mount matrices and offsets folded together, see imu_calib_update */
+static struct imu_calib calib;
+
+/* calibration cache, calib_path empty when disabled */
+static char calib_path[SYSFS_PATH_MAX];
+static char device_name[IMU_CALIB_DEVICE_MAX];
+/* the cache holds the calibration in use, with these gyro offsets */
+static bool calib_cached;
+static float cached_gyro_off[3];
+/* the drift watch found the cache wrong, removed when the IMU stops */
+static bool calib_drop;
+/* calibration came from the cache: level the engine on the first sample */
+static bool attitude_pending;
+
+/* recording of the raw samples, and replay in place of the device */
+static struct imu_record recording;
+static struct imu_record replay;
+static bool replay_fast;
+
+/* motion detector, owned by the IMU thread; its events go to the publisher */
+static struct imu_motion motion;
+static const char *const motion_events[IMU_MOTION_COUNT] = {
+    [IMU_MOTION_QUADRANT] = PUB_EVENT_IMU_QUADRANT,
+    [IMU_MOTION_SHAKE] = PUB_EVENT_IMU_SHAKE,
+    [IMU_MOTION_TAP] = PUB_EVENT_IMU_TAP,
+    [IMU_MOTION_MOVING] = PUB_EVENT_IMU_MOVING,
+};
 
 /**********************
  *   STATIC FUNCTIONS
  **********************/
+/*
+ * One pread at offset 0: sysfs regenerates the value on every read from
+ * the start, so the fd is never reopened or rewound.
+ */
+static int32_t read_sysfs_fd(int32_t fd, char *buf, size_t len)
+{
+    ssize_t n;
+
+    n = pread(fd, buf, len - 1, 0);
+    if (n <= 0)
+        return n < 0 ? -errno : -ENODATA;
+
+    buf[n] = '\0';
+    return 0;
+}
+
+/* "[-]digits" as sysfs prints raw values, newline terminated */
+static int32_t parse_sysfs_int(const char *s, int32_t *out)
+{
+    int64_t v = 0;
+    bool neg = false;
+    const char *start;
+
+    if (*s == '-' || *s == '+')
+        neg = *s++ == '-';
+
+    for (start = s; *s >= '0' && *s <= '9'; s++) {
+        v = v * 10 + (*s - '0');
+        if (v > (int64_t)INT32_MAX + 1)
+            return -ERANGE;
+    }
+
+    if (s == start || (*s && *s != '\n'))
+        return -EINVAL;
+    if (!neg && v > INT32_MAX)
+        return -ERANGE;
+
+    *out = (int32_t)(neg ? -v : v);
+    return 0;
+}
+
+/* "[-]int[.frac]", the fixed point form of IIO scale values */
+static int32_t parse_sysfs_fixed(const char *s, double *out)
+{
+    double v = 0.0, frac = 1.0;
+    bool neg = false, digits = false;
+
+    if (*s == '-' || *s == '+')
+        neg = *s++ == '-';
+
+    for (; *s >= '0' && *s <= '9'; s++, digits = true)
+        v = v * 10.0 + (*s - '0');
+    if (*s == '.') {
+        for (s++; *s >= '0' && *s <= '9'; s++, digits = true) {
+            frac *= 0.1;
+            v += (*s - '0') * frac;
+        }
+    }
+
+    if (!digits || (*s && *s != '\n'))
+        return -EINVAL;
+
+    *out = neg ? -v : v;
+    return 0;
+}
+
 static int32_t read_sysfs_float_file(const char *path, float *out)
 {
-    FILE *f;
+    char buf[SYSFS_VALUE_MAX];
     double tmp;
-    int32_t ret = -1;
+    int32_t fd, ret;
+
     if (!path || !out) return -1;
-    f = fopen(path, "r");
-    if (!f) return -1;
-    if (fscanf(f, "%lf", &tmp) == 1) {
-        *out = (float)tmp;
-        ret = 0;
-    } else ret = -1;
-    fclose(f);
-    return ret;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    ret = read_sysfs_fd(fd, buf, sizeof(buf));
+    close(fd);
+    if (ret || parse_sysfs_fixed(buf, &tmp))
+        return -1;
+
+    *out = (float)tmp;
+    return 0;
 }
 
 static int32_t read_sysfs_name(const char *name, float *out)
 {
     char path[SYSFS_PATH_MAX];
     if (!name || !out) return -1;
-    snprintf(path, sizeof(path), "%s%s", iio_base, name);
+    if (snprintf(path, sizeof(path), "%s%s", iio_base, name) >= (int)sizeof(path))
+        return -1;
     return read_sysfs_float_file(path, out);
 }
 
-/* read mount matrix: file contains 9 numbers (row-major), or return identity */
+/*
+ * read mount matrix: 9 numbers (row-major) as the kernel prints them,
+ * "x, y, z; x, y, z; x, y, z", or return identity
+ */
 static void load_mount_matrix(const char *name, float m_out[9])
 {
     char path[SYSFS_PATH_MAX];
@@ -159,7 +354,7 @@ static void load_mount_matrix(const char *name, float m_out[9])
     int32_t cnt = 0;
     for (int32_t i = 0; i < 9; i++) {
         double tmp;
-        if (fscanf(f, "%lf", &tmp) == 1) {
+        if (fscanf(f, "%lf%*[,; \n]", &tmp) == 1) {
             m_out[cnt++] = (float)tmp;
         } else break;
     }
@@ -212,46 +407,213 @@ static void detect_scales(void)
     }
 }
 
+/*
+ * scale_and_mount:
+ *  - multiply raw counts (accel x y z, gyro x y z) by the sysfs scales
+ *  - apply mount matrices
+ *  - no unit conversion, calibration decides the units from these values;
+ *    shared by the polled and buffered acquisition
+ */
+static void scale_and_mount(const float raw[IIO_BUF_AXES], float a[3], float g[3])
+{
+    float a_raw[3], g_raw[3];
+
+    for (int32_t i = 0; i < 3; i++) {
+        a_raw[i] = raw[i] * scales.accel_scale;
+        g_raw[i] = raw[3 + i] * scales.gyro_scale;
+    }
+
+    apply_mount(accel_mount, a_raw, a);
+    apply_mount(gyro_mount, g_raw, g);
+}
+
+/* Raw counts of all axes from sysfs, one pread per persistent fd */
+static void read_raw_counts(float raw[IIO_BUF_AXES])
+{
+    char buf[SYSFS_VALUE_MAX];
+    int32_t v;
+
+    for (int32_t i = 0; i < IIO_BUF_AXES; i++) {
+        if (raw_fds[i] >= 0 && read_sysfs_fd(raw_fds[i], buf, sizeof(buf)) == 0 &&
+            parse_sysfs_int(buf, &v) == 0)
+            raw[i] = (float)v;
+        else
+            raw[i] = 0.0f;
+    }
+}
+
 /*
  * read_raw_scaled_no_unit_convert:
- *  - read raw values and multiply by per-axis scale from sysfs
- *  - apply mount matrix
+ *  - read raw values from sysfs, one persistent fd per axis
+ *  - scale and apply mount matrix
  *  - DO NOT convert accel to g or gyro to deg/s here (we detect units in calibration)
  *  returns 0 on success
  */
 static int32_t read_raw_scaled_no_unit_convert(float *ax, float *ay, float *az,
                        float *gx, float *gy, float *gz)
 {
-    float v;
-    float a_raw[3] = {0.0f,0.0f,0.0f};
-    float g_raw[3] = {0.0f,0.0f,0.0f};
-    int32_t ret;
+    float raw[IIO_BUF_AXES];
+    float a[3], g[3];
 
-    /* accel */
-    ret = read_sysfs_name("in_accel_x_raw", &v);
-    a_raw[0] = (ret==0) ? v * scales.accel_scale : 0.0f;
-    ret = read_sysfs_name("in_accel_y_raw", &v);
-    a_raw[1] = (ret==0) ? v * scales.accel_scale : 0.0f;
-    ret = read_sysfs_name("in_accel_z_raw", &v);
-    a_raw[2] = (ret==0) ? v * scales.accel_scale : 0.0f;
-
-    /* gyro */
-    ret = read_sysfs_name("in_anglvel_x_raw", &v);
-    g_raw[0] = (ret==0) ? v * scales.gyro_scale : 0.0f;
-    ret = read_sysfs_name("in_anglvel_y_raw", &v);
-    g_raw[1] = (ret==0) ? v * scales.gyro_scale : 0.0f;
-    ret = read_sysfs_name("in_anglvel_z_raw", &v);
-    g_raw[2] = (ret==0) ? v * scales.gyro_scale : 0.0f;
-
-    /* apply mount matrices */
-    float a_rot[3], g_rot[3];
-    apply_mount(accel_mount, a_raw, a_rot);
-    apply_mount(gyro_mount, g_raw, g_rot);
+    read_raw_counts(raw);
+    scale_and_mount(raw, a, g);
 
     /* return */
-    *ax = a_rot[0]; *ay = a_rot[1]; *az = a_rot[2];
-    *gx = g_rot[0]; *gy = g_rot[1]; *gz = g_rot[2];
+    *ax = a[0]; *ay = a[1]; *az = a[2];
+    *gx = g[0]; *gy = g[1]; *gz = g[2];
+
+    return 0;
+}
+
+/*
+ * Fold the sysfs scale, the mount matrix and the unit factor of each sensor
+ * into one matrix, so the fusion path takes raw counts in a single pass.
+ * Called whenever scales or offsets change.
+ */
+static void imu_calib_update(void)
+{
+    float ka = scales.accel_scale * scales.accel_to_g_factor;
+    float kg = scales.gyro_scale * scales.gyro_to_deg_factor;
+
+    for (int32_t i = 0; i < 9; i++) {
+        calib.accel_m[i] = accel_mount[i] * ka;
+        calib.gyro_m[i] = gyro_mount[i] * kg;
+    }
+
+    calib.accel_off[0] = offs.ax_off;
+    calib.accel_off[1] = offs.ay_off;
+    calib.accel_off[2] = offs.az_off;
+    calib.gyro_off[0] = offs.gx_off;
+    calib.gyro_off[1] = offs.gy_off;
+    calib.gyro_off[2] = offs.gz_off;
+}
+
+/* Publish the attitude of the engine to imu_get_angles */
+static void imu_att_publish(void)
+{
+    seqlock_store(&att_seq, &shared_att, &fusion.att, sizeof(shared_att));
+}
 
+/* (Re)open the raw attribute fds of the current iio_base */
+static void open_raw_fds(void)
+{
+    char path[SYSFS_PATH_MAX];
+
+    for (int32_t i = 0; i < IIO_BUF_AXES; i++) {
+        if (raw_fds[i] >= 0)
+            close(raw_fds[i]);
+
+        snprintf(path, sizeof(path), "%s%s", iio_base, raw_names[i]);
+        raw_fds[i] = open(path, O_RDONLY | O_CLOEXEC);
+        if (raw_fds[i] < 0)
+            LOG_WARN("%s not readable (%s), axis reads as 0", path, strerror(errno));
+    }
+}
+
+/* IIO name of the device, empty if it has none */
+static void read_device_name(void)
+{
+    char path[SYSFS_PATH_MAX];
+    int32_t fd;
+
+    device_name[0] = '\0';
+    if (snprintf(path, sizeof(path), "%sname", iio_base) >= (int)sizeof(path))
+        return;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    if (read_sysfs_fd(fd, device_name, sizeof(device_name)) == 0)
+        device_name[strcspn(device_name, "\n")] = '\0';
+    else
+        device_name[0] = '\0';
+    close(fd);
+}
+
+/* Level the engine on a calibrated accel reading, heading 0 */
+static void imu_attitude_from_accel(float ax, float ay, float az)
+{
+    float roll = atan2f(ay, az) * RAD2DEG;
+    float pitch = atan2f(-ax, sqrtf(ay * ay + az * az)) * RAD2DEG;
+
+    imu_fusion_reset(&fusion, roll, pitch, 0.0f);
+    imu_att_publish();
+
+    LOG_INFO("attitude init roll=%.3f pitch=%.3f", roll, pitch);
+}
+
+/* The cache entry of the calibration in use */
+static void imu_calib_fill(struct imu_calib_cache *c)
+{
+    memset(c, 0, sizeof(*c));
+    strcpy(c->device, device_name);
+    memcpy(c->accel_mount, accel_mount, sizeof(c->accel_mount));
+    memcpy(c->gyro_mount, gyro_mount, sizeof(c->gyro_mount));
+    c->accel_scale = scales.accel_scale;
+    c->gyro_scale = scales.gyro_scale;
+
+    c->accel_to_g = scales.accel_to_g_factor;
+    c->gyro_to_deg = scales.gyro_to_deg_factor;
+    c->accel_off[0] = offs.ax_off;
+    c->accel_off[1] = offs.ay_off;
+    c->accel_off[2] = offs.az_off;
+    c->gyro_off[0] = offs.gx_off;
+    c->gyro_off[1] = offs.gy_off;
+    c->gyro_off[2] = offs.gz_off;
+}
+
+static void imu_calib_save(void)
+{
+    struct imu_calib_cache c;
+
+    if (!calib_path[0])
+        return;
+
+    imu_calib_fill(&c);
+    if (imu_calib_cache_save(calib_path, &c))
+        return;
+
+    memcpy(cached_gyro_off, c.gyro_off, sizeof(cached_gyro_off));
+    calib_cached = true;
+    LOG_INFO("IMU calibration saved to %s", calib_path);
+}
+
+/*
+ * Offsets and unit factors from the cache, if it was written for this
+ * sensor and mounting. Scales and mount matrices must be loaded.
+ */
+static int32_t imu_calib_load(void)
+{
+    struct imu_calib_cache c, key;
+    int32_t ret;
+
+    if (!calib_path[0])
+        return -ENOENT;
+
+    ret = imu_calib_cache_load(calib_path, &c);
+    if (ret)
+        return ret;
+
+    imu_calib_fill(&key);
+    if (!imu_calib_cache_match(&c, &key)) {
+        LOG_INFO("IMU calibration cache %s is for another sensor or mounting", \
+                 calib_path);
+        return -ESTALE;
+    }
+
+    scales.accel_to_g_factor = c.accel_to_g;
+    scales.gyro_to_deg_factor = c.gyro_to_deg;
+    offs.ax_off = c.accel_off[0];
+    offs.ay_off = c.accel_off[1];
+    offs.az_off = c.accel_off[2];
+    offs.gx_off = c.gyro_off[0];
+    offs.gy_off = c.gyro_off[1];
+    offs.gz_off = c.gyro_off[2];
+    imu_calib_update();
+
+    memcpy(cached_gyro_off, c.gyro_off, sizeof(cached_gyro_off));
+    calib_cached = true;
+    LOG_INFO("IMU calibration loaded from %s", calib_path);
     return 0;
 }
 
@@ -359,165 +721,611 @@ int32_t imu_kalman_calibrate(void)
     offs.gx_off = mean_gx_deg;
     offs.gy_off = mean_gy_deg;
     offs.gz_off = mean_gz_deg;
+    imu_calib_update();
 
     LOG_INFO("calibrate done ax_mean=%.6f ay_mean=%.6f az_mean=%.6f mag_mean=%.4f",
          mean_ax_g, mean_ay_g, mean_az_g, mean_mag * scales.accel_to_g_factor);
     LOG_INFO("calibrate done gx_mean=%.6f gy_mean=%.6f gz_mean=%.6f",
          mean_gx_deg, mean_gy_deg, mean_gz_deg);
 
-    /* initialize Kalman filters using the mean orientation */
-    {
-        float roll_init  = atan2f(mean_ay_g, mean_az_g) * RAD2DEG;
-        float pitch_init = atan2f(-mean_ax_g, sqrtf(mean_ay_g*mean_ay_g + mean_az_g*mean_az_g)) * RAD2DEG;
+    /*
+     * initialize the fusion engine using the mean orientation, as the
+     * engine measures it: with the offsets applied
+     */
+    imu_attitude_from_accel(mean_ax_g - offs.ax_off, mean_ay_g - offs.ay_off, \
+                            mean_az_g - offs.az_off);
+    attitude_pending = false;
+
+    imu_calib_save();
+
+    return 0;
+}
+
+/* ---------- IMU thread ---------- */
+/*
+ * Export an angle to the DBus properties. Same deadband as the published
+ * topics, otherwise yaw drift alone keeps PropertiesChanged at its cap.
+ */
+static void imu_state_update(state_prop_t prop, float angle)
+{
+    static float exported[STATE_PROP_COUNT];
+    static bool valid[STATE_PROP_COUNT];
+
+    if (valid[prop] && fabsf(angle - exported[prop]) < ANGLES_PUB_DEADBAND)
+        return;
+
+    exported[prop] = angle;
+    valid[prop] = true;
+    state_cache_set_double(prop, angle);
+}
+
+/*
+ * Dynamic gyro bias adaptation on the samples taken while the device is
+ * idle, see imu_calib_adapt_gyro
+ */
+static void imu_adapt_bias(const struct imu_batch *b)
+{
+    if (!imu_calib_adapt_gyro(&calib, b))
+        return;
+
+    offs.gx_off = calib.gyro_off[0];
+    offs.gy_off = calib.gyro_off[1];
+    offs.gz_off = calib.gyro_off[2];
+}
+
+/*
+ * Drift watch over the calibrated samples, see DRIFT_WINDOW. Runs on the IMU
+ * thread with the samples already taken, the device never has to be held
+ * still for it.
+ */
+static void imu_drift_watch(const struct imu_batch *b)
+{
+    static struct drift_window w;
+    double mean_g[3], mean_a[3], var, mag;
+    bool still = true, drift = false;
+
+    for (uint32_t i = 0; i < b->n; i++) {
+        for (int32_t k = 0; k < 3; k++) {
+            w.a_sum[k] += b->accel[k][i];
+            w.a_sq[k] += (double)b->accel[k][i] * b->accel[k][i];
+            w.g_sum[k] += b->gyro[k][i];
+            w.g_sq[k] += (double)b->gyro[k][i] * b->gyro[k][i];
+        }
+    }
+    w.n += b->n;
+    if (w.n < DRIFT_WINDOW)
+        return;
 
-        kalman_reset(&k_roll, roll_init);
-        kalman_reset(&k_pitch, pitch_init);
+    for (int32_t k = 0; k < 3; k++) {
+        mean_a[k] = w.a_sum[k] / w.n;
+        var = w.a_sq[k] / w.n - mean_a[k] * mean_a[k];
+        if (var > DRIFT_STILL_ACCEL_STD * DRIFT_STILL_ACCEL_STD)
+            still = false;
 
-        pthread_mutex_lock(&angles_lock);
-        shared_angles.roll = roll_init;
-        shared_angles.pitch = pitch_init;
-        shared_angles.yaw = 0.0f;
-        pthread_mutex_unlock(&angles_lock);
+        mean_g[k] = w.g_sum[k] / w.n;
+        var = w.g_sq[k] / w.n - mean_g[k] * mean_g[k];
+        if (var > DRIFT_STILL_GYRO_STD * DRIFT_STILL_GYRO_STD)
+            still = false;
+    }
+    memset(&w, 0, sizeof(w));
+    if (!still)
+        return;
 
-        yaw_integral = 0.0f;
+    mag = sqrt(mean_a[0] * mean_a[0] + mean_a[1] * mean_a[1] + mean_a[2] * mean_a[2]);
+    if (calib_cached && fabs(mag - 1.0) > DRIFT_ACCEL_MAX) {
+        LOG_WARN("accel reads %.3f g at rest, calibration cache dropped, " \
+                 "the next start calibrates", mag);
+        calib_drop = true;
+        calib_cached = false;
+    }
 
-        LOG_INFO("calibrate init roll=%.3f pitch=%.3f", roll_init, pitch_init);
+    for (int32_t k = 0; k < 3; k++) {
+        if (fabs(mean_g[k]) > DRIFT_GYRO_LIMIT)
+            return;
+        if (fabs(mean_g[k]) > DRIFT_GYRO_MAX)
+            drift = true;
     }
 
+    if (drift) {
+        LOG_INFO("gyro drift %.3f %.3f %.3f deg/s, recalibrating the gyro", \
+                 mean_g[0], mean_g[1], mean_g[2]);
+        offs.gx_off += (float)mean_g[0];
+        offs.gy_off += (float)mean_g[1];
+        offs.gz_off += (float)mean_g[2];
+        calib.gyro_off[0] = offs.gx_off;
+        calib.gyro_off[1] = offs.gy_off;
+        calib.gyro_off[2] = offs.gz_off;
+        /* past CALIB_SAVE_GYRO_DELTA, the cache is updated when the IMU stops */
+    }
+}
+
+/*
+ * Run the motion detector on a fused batch and queue its events: clients
+ * react to them instead of polling the angles
+ */
+static void imu_motion_detect(const struct imu_batch *b, const struct imu_angles *angles)
+{
+    struct imu_motion_event ev[MOTION_EVENTS_MAX];
+    uint32_t n;
+
+    n = imu_motion_update(&motion, b, angles, ev, MOTION_EVENTS_MAX);
+    for (uint32_t i = 0; i < n; i++) {
+        LOG_DEBUG("motion %s %.2f", imu_motion_name(ev[i].type), ev[i].value);
+        publish_event(motion_events[ev[i].type], ev[i].value);
+    }
+}
+
+/*
+ * Fuse a batch of raw samples: calibration over the whole batch, both
+ * filters in lockstep, then the attitude is published once for the batch.
+ */
+static void imu_fuse_batch(struct imu_batch *b)
+{
+    static uint64_t eval_ns;
+    const float *const a[3] = { b->accel[0], b->accel[1], b->accel[2] };
+    const float *const g[3] = { b->gyro[0], b->gyro[1], b->gyro[2] };
+    struct imu_attitude per_sample[IMU_BATCH_MAX];
+    struct imu_history_entry entry;
+    struct imu_fusion_tuning tuning;
+    struct imu_angles angles = {0.0f, 0.0f, 0.0f};
+    uint64_t ts_ns = b->ts_ns[b->n - 1];
+    bool stream = stream_active, evaluated = false;
+    float yaw;
+
+    /* the engine belongs to this thread, other threads post their changes */
+    yaw = atomic_exchange_explicit(&yaw_request, NAN, memory_order_acquire);
+    if (!isnan(yaw))
+        imu_fusion_set_yaw(&fusion, yaw);
+    if (atomic_exchange_explicit(&tuning_pending, false, memory_order_acquire)) {
+        pthread_mutex_lock(&tuning_lock);
+        tuning = tuning_request;
+        pthread_mutex_unlock(&tuning_lock);
+        imu_fusion_set_tuning(&fusion, &tuning);
+    }
+
+    imu_calib_apply(&calib, b);
+    if (attitude_pending) {
+        imu_attitude_from_accel(b->accel[0][0], b->accel[1][0], b->accel[2][0]);
+        attitude_pending = false;
+    }
+    imu_adapt_bias(b);
+    imu_drift_watch(b);
+
+    imu_fusion_update_batch(&fusion, a, g, b->dt, b->n, per_sample);
+
+    /* every step goes to the history, readers derive angles on query */
+    for (uint32_t i = 0; i < b->n; i++) {
+        entry.ts_ns = b->ts_ns[i];
+        for (int32_t k = 0; k < 3; k++) {
+            entry.accel[k] = b->accel[k][i];
+            entry.gyro[k] = b->gyro[k][i];
+        }
+        entry.att = per_sample[i];
+        imu_history_push(&entry);
+    }
+
+    /* publish the attitude, readers derive the angles */
+    imu_att_publish();
+
+    /* angles only where they are consumed: topics and properties */
+    if (ts_ns - eval_ns >= 1000000000ULL / ANGLES_EVAL_HZ) {
+        eval_ns = ts_ns;
+        evaluated = true;
+        angles = imu_fusion_angles(&fusion);
+        publish(PUB_TOPIC_IMU_ROLL, angles.roll);
+        publish(PUB_TOPIC_IMU_PITCH, angles.pitch);
+        publish(PUB_TOPIC_IMU_YAW, angles.yaw);
+        imu_state_update(STATE_IMU_ROLL, angles.roll);
+        imu_state_update(STATE_IMU_PITCH, angles.pitch);
+        imu_state_update(STATE_IMU_YAW, angles.yaw);
+    }
+
+    imu_motion_detect(b, evaluated ? &angles : NULL);
+
+    for (uint32_t i = 0; stream && i < b->n; i++) {
+        struct imu_sample sample = {
+            .ts_ns = b->ts_ns[i],
+            .accel = {b->accel[0][i], b->accel[1][i], b->accel[2][i]},
+            .gyro = {b->gyro[0][i], b->gyro[1][i], b->gyro[2][i]},
+        };
+        imu_attitude_angles(&per_sample[i], &sample.angles);
+        shm_ring_write(&stream_ring, &sample);
+    }
+
+    LOG_TRACE("n=%u dt=%.4f ax=%.4f ay=%.4f az=%.4f gx=%.4f gy=%.4f gz=%.4f",
+              b->n, b->dt[b->n - 1], a[0][b->n - 1], a[1][b->n - 1], a[2][b->n - 1],
+              g[0][b->n - 1], g[1][b->n - 1], g[2][b->n - 1]);
+}
+
+/* ---------- loop timing ---------- */
+static void loop_timing_init(struct loop_timing *t, int32_t hz)
+{
+    memset(t, 0, sizeof(*t));
+    t->period_ns = 1000000000ULL / (uint64_t)hz;
+    t->win_start_ns = now_ns();
+    t->st.target_hz = (uint32_t)hz;
+}
+
+/* Acquisition (re)started: polled mode samples at once, then on the grid */
+static void loop_timing_mode(struct loop_timing *t, bool buffered)
+{
+    t->st.buffered = buffered;
+    t->deadline_ns = now_ns();
+    t->prev_ts_ns = 0;
+}
+
+static void loop_timing_publish(struct loop_timing *t, uint64_t now)
+{
+    struct imu_loop_stats *st = &t->st;
+
+    st->rate_hz = (double)t->win_samples * 1e9 / (double)(now - t->win_start_ns);
+    st->jitter_avg_ns = t->win_intervals ? \
+                        (uint32_t)(t->win_jitter_sum_ns / t->win_intervals) : 0;
+    st->jitter_max_ns = t->win_jitter_max_ns;
+    st->wake_late_avg_ns = t->win_wakes ? \
+                           (uint32_t)(t->win_late_sum_ns / t->win_wakes) : 0;
+    st->wake_late_max_ns = t->win_late_max_ns;
+
+    seqlock_store(&stats_seq, &loop_stats, st, sizeof(loop_stats));
+
+    LOG_DEBUG("rate=%.1f/%uHz jitter=%u/%uns late=%u/%uns missed=%llu overruns=%llu",
+              st->rate_hz, st->target_hz, st->jitter_avg_ns, st->jitter_max_ns,
+              st->wake_late_avg_ns, st->wake_late_max_ns,
+              (unsigned long long)st->missed, (unsigned long long)st->overruns);
+
+    t->win_start_ns = now;
+    t->win_samples = 0;
+    t->win_intervals = 0;
+    t->win_jitter_sum_ns = 0;
+    t->win_jitter_max_ns = 0;
+    t->win_wakes = 0;
+    t->win_late_sum_ns = 0;
+    t->win_late_max_ns = 0;
+}
+
+/*
+ * Sleep until the absolute deadline (polled mode). The deadlines form a
+ * fixed grid, so the time spent reading and fusing does not stretch the
+ * period the way a relative sleep after the work does.
+ */
+static int32_t loop_timing_wait(struct loop_timing *t)
+{
+    struct timespec ts;
+    uint64_t late;
+    int32_t ret;
+
+    ts.tv_sec = (time_t)(t->deadline_ns / 1000000000ULL);
+    ts.tv_nsec = (long)(t->deadline_ns % 1000000000ULL);
+    ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    if (ret)
+        return -ret;
+
+    late = now_ns() - t->deadline_ns;
+    t->win_wakes++;
+    t->win_late_sum_ns += late;
+    if (late > t->win_late_max_ns)
+        t->win_late_max_ns = (uint32_t)late;
     return 0;
 }
 
-/* ---------- adaptive r factor ---------- */
-static float compute_adaptive_r_factor(float accel_mag_g, float innovation_deg)
+/*
+ * Next deadline of the grid (polled mode). A step still running at the
+ * next deadline is an overrun, the next sample is then taken immediately.
+ * Deadlines already passed entirely are skipped and counted as missed
+ * rather than sampled in a burst.
+ */
+static void loop_timing_next(struct loop_timing *t)
 {
-    float mag_dev = fabsf(accel_mag_g - 1.0f);
-    float mag_factor = 1.0f + (mag_dev / 0.6f) * 4.0f;
-    if (mag_factor < 1.0f) mag_factor = 1.0f;
+    uint64_t now = now_ns(), behind;
+
+    t->deadline_ns += t->period_ns;
+    if (now <= t->deadline_ns)
+        return;
+
+    t->st.overruns++;
+    behind = (now - t->deadline_ns) / t->period_ns;
+    t->st.missed += behind;
+    t->deadline_ns += behind * t->period_ns;
+}
 
-    float inn_factor = 1.0f;
-    if (innovation_deg > 5.0f)
-        inn_factor = 1.0f + (innovation_deg - 5.0f) / 20.0f;
+/* Account a sample taken at ts_ns */
+static void loop_timing_sample(struct loop_timing *t, uint64_t ts_ns)
+{
+    uint64_t interval, dev, now;
+
+    t->st.samples++;
+    t->win_samples++;
+
+    if (t->prev_ts_ns && ts_ns > t->prev_ts_ns) {
+        interval = ts_ns - t->prev_ts_ns;
+        dev = interval > t->period_ns ? interval - t->period_ns : \
+                                        t->period_ns - interval;
+        t->win_intervals++;
+        t->win_jitter_sum_ns += dev;
+        if (dev > t->win_jitter_max_ns)
+            t->win_jitter_max_ns = (uint32_t)dev;
+
+        /* The device paces buffered mode, a gap in its timestamps is lost scans */
+        if (t->st.buffered && interval > t->period_ns + t->period_ns / 2)
+            t->st.missed += (interval + t->period_ns / 2) / t->period_ns - 1;
+    }
+    t->prev_ts_ns = ts_ns;
 
-    return mag_factor * inn_factor;
+    now = now_ns();
+    if (now - t->win_start_ns >= LOOP_STATS_WINDOW_NS)
+        loop_timing_publish(t, now);
+}
+
+/* Record the raw samples to IMU_RECORD_ENV, if set */
+static void imu_record_start(void)
+{
+    const char *path = getenv(IMU_RECORD_ENV);
+
+    if (!path || !*path)
+        return;
+
+    if (imu_record_create(&recording, path, (uint32_t)sample_hz, &calib) == 0)
+        LOG_INFO("recording raw IMU samples to %s", path);
+}
+
+static void imu_record_batch(const struct imu_batch *b)
+{
+    if (!recording.fp)
+        return;
+
+    if (imu_record_write(&recording, b)) {
+        LOG_WARN("IMU recording failed after %llu samples, stopped", \
+                 (unsigned long long)recording.samples);
+        imu_record_close(&recording);
+    }
+}
+
+/*
+ * Next samples of the replay, timestamps moved to the current clock. Real
+ * time replay returns them once due, REPLAY_CHUNK_NS at a time; fast
+ * replay returns full batches at once. Returns the count, 0 at the end.
+ */
+static int32_t imu_replay_batch(struct imu_batch *b)
+{
+    static int64_t shift_ns;
+    struct timespec ts;
+    uint32_t max = IMU_BATCH_MAX;
+    uint64_t due;
+    int32_t n;
+
+    if (!replay_fast)
+        max = (uint32_t)((uint64_t)sample_hz * REPLAY_CHUNK_NS / 1000000000ULL);
+    if (max < 1)
+        max = 1;
+
+    n = imu_record_read(&replay, b, max);
+    if (n <= 0)
+        return n;
+
+    if (replay.samples == (uint64_t)n)
+        shift_ns = (int64_t)(now_ns() - b->ts_ns[0]);
+    for (int32_t i = 0; i < n; i++)
+        b->ts_ns[i] += shift_ns;
+
+    if (!replay_fast) {
+        due = b->ts_ns[n - 1];
+        ts.tv_sec = (time_t)(due / 1000000000ULL);
+        ts.tv_nsec = (long)(due % 1000000000ULL);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && \
+               imu_running && g_run)
+            ;
+    }
+
+    return n;
+}
+
+/* Buffered acquisition unless IMU_ACQ_ENV asks for polling */
+static bool imu_want_buffered(void)
+{
+    const char *mode = getenv(IMU_ACQ_ENV);
+
+    return !mode || strcmp(mode, IMU_ACQ_POLL) != 0;
 }
 
-/* ---------- IMU thread ---------- */
 static int32_t imu_fn_handler()
 {
-    struct timespec t_prev, t_now;
-    float axs, ays, azs, gxs, gys, gzs;
-    float axc, ayc, azc, gxc, gyc, gzc;
-    float roll_acc, pitch_acc;
-    float roll_f, pitch_f;
-    float dt;
-    int32_t sleep_us;
-    float last_roll = 0.0f, last_pitch = 0.0f;
+    struct iio_buffer iio_buf;
+    struct iio_scan scans[IMU_BATCH_MAX];
+    struct imu_batch batch;
+    struct loop_timing timing;
+    float raw[IIO_BUF_AXES];
+    uint64_t prev_ts_ns = 0;
+    int32_t ret;
+    bool buffered = false;
 
-    LOG_INFO("start path=%s hz=%d", iio_base, sample_hz);
+    LOG_INFO("start path=%s hz=%d", replay.fp ? "replay" : iio_base, sample_hz);
 
-    clock_gettime(CLOCK_MONOTONIC, &t_prev);
-    sleep_us = (int)(1000000.0f / (float)sample_hz);
+    publisher_add_topic(PUB_TOPIC_IMU_ROLL, ANGLES_PUB_HZ, ANGLES_PUB_DEADBAND);
+    publisher_add_topic(PUB_TOPIC_IMU_PITCH, ANGLES_PUB_HZ, ANGLES_PUB_DEADBAND);
+    publisher_add_topic(PUB_TOPIC_IMU_YAW, ANGLES_PUB_HZ, ANGLES_PUB_DEADBAND);
+    imu_motion_init(&motion);
+
+    if (replay.fp) {
+        /* paced by the recorded timestamps, as the device paces the FIFO */
+        loop_timing_init(&timing, sample_hz);
+        loop_timing_mode(&timing, true);
+    } else {
+        buffered = imu_want_buffered() && \
+                   !iio_buffer_open(&iio_buf, iio_base, sample_hz);
+        if (!buffered)
+            LOG_INFO("IMU sampled by sysfs polling");
+        loop_timing_init(&timing, sample_hz);
+        loop_timing_mode(&timing, buffered);
+        imu_record_start();
+    }
 
     while (imu_running && g_run) {
-        /* read raw scaled (no unit conversion), then convert here */
-        if (read_raw_scaled_no_unit_convert(&axs, &ays, &azs, &gxs, &gys, &gzs) != 0) {
-            LOG_ERROR("read_raw_scaled_no_unit_convert failed");
-            usleep(sleep_us);
-            continue;
+        if (replay.fp) {
+            ret = imu_replay_batch(&batch);
+            if (ret <= 0) {
+                LOG_INFO("IMU replay done, %llu samples", \
+                         (unsigned long long)replay.samples);
+                break;
+            }
+        } else if (buffered) {
+            /* packed scans: all axes of one instant, hardware timestamp */
+            ret = iio_buffer_read_batch(&iio_buf, scans, IMU_BATCH_MAX, \
+                                        IIO_BUF_TIMEOUT_MS);
+            if (ret == -EINTR)
+                continue;
+            if (ret < 0) {
+                LOG_WARN("IIO buffer read failed (%d), falling back to sysfs polling", ret);
+                iio_buffer_close(&iio_buf);
+                buffered = false;
+                loop_timing_mode(&timing, buffered);
+                prev_ts_ns = 0;
+                continue;
+            }
+
+            batch.n = (uint32_t)ret;
+            for (uint32_t n = 0; n < batch.n; n++) {
+                for (int32_t i = 0; i < IIO_BUF_AXES; i++)
+                    batch.raw[i][n] = (float)scans[n].raw[i];
+                batch.ts_ns[n] = scans[n].ts_ns;
+            }
+        } else {
+            if (loop_timing_wait(&timing))
+                continue;
+
+            /* one sample per period, calibrated by the fusion step */
+            read_raw_counts(raw);
+            batch.n = 1;
+            for (int32_t i = 0; i < IIO_BUF_AXES; i++)
+                batch.raw[i][0] = raw[i];
+            batch.ts_ns[0] = now_ns();
         }
 
-        /* convert to final units (g and deg/s) */
-        float ax = axs * scales.accel_to_g_factor;
-        float ay = ays * scales.accel_to_g_factor;
-        float az = azs * scales.accel_to_g_factor;
-
-        float gx = gxs * scales.gyro_to_deg_factor;
-        float gy = gys * scales.gyro_to_deg_factor;
-        float gz = gzs * scales.gyro_to_deg_factor;
-
-        /* apply offsets (calibration) */
-        axc = ax - offs.ax_off;
-        ayc = ay - offs.ay_off;
-        azc = az - offs.az_off;
-
-        gxc = gx - offs.gx_off;
-        gyc = gy - offs.gy_off;
-        gzc = gz - offs.gz_off;
-
-        /* dt */
-        clock_gettime(CLOCK_MONOTONIC, &t_now);
-        dt = (t_now.tv_sec - t_prev.tv_sec) + (t_now.tv_nsec - t_prev.tv_nsec) / 1e9f;
-        if (dt <= 0.0f || dt > 1.0f) dt = 1.0f / (float)sample_hz;
-        t_prev = t_now;
-
-        /* clamp gyro spikes */
-        if (fabsf(gxc) > 2000.0f) gxc = copysignf(2000.0f, gxc);
-        if (fabsf(gyc) > 2000.0f) gyc = copysignf(2000.0f, gyc);
-        if (fabsf(gzc) > 2000.0f) gzc = copysignf(2000.0f, gzc);
-
-        /* accel magnitude (g) */
-        float mag = sqrtf(axc*axc + ayc*ayc + azc*azc);
-
-        /* dynamic gyro bias adaptation when device idle */
-        if (fabsf(gxc) < IDLE_GYRO_THRESHOLD &&
-            fabsf(gyc) < IDLE_GYRO_THRESHOLD &&
-            fabsf(gzc) < IDLE_GYRO_THRESHOLD &&
-            fabsf(mag - 1.0f) < IDLE_ACC_MAG_TOL) {
-            /* adapt biases slowly toward latest raw (pre-conversion) gyro values */
-            /* Note: adapt using converted deg/s values (gx,gy,gz) */
-            offs.gx_off = offs.gx_off * (1.0f - BIAS_ADAPT_ALPHA) + gx * BIAS_ADAPT_ALPHA;
-            offs.gy_off = offs.gy_off * (1.0f - BIAS_ADAPT_ALPHA) + gy * BIAS_ADAPT_ALPHA;
-            offs.gz_off = offs.gz_off * (1.0f - BIAS_ADAPT_ALPHA) + gz * BIAS_ADAPT_ALPHA;
-        }
+        imu_record_batch(&batch);
+        imu_batch_dt(&batch, &prev_ts_ns, sample_hz);
+        imu_fuse_batch(&batch);
+        for (uint32_t n = 0; n < batch.n; n++)
+            loop_timing_sample(&timing, batch.ts_ns[n]);
+
+        if (!buffered && !replay.fp)
+            loop_timing_next(&timing);
+    }
 
-        /* compute accel-based angles (deg) */
-        roll_acc  = atan2f(ayc, azc) * RAD2DEG;
-        pitch_acc = atan2f(-axc, sqrtf(ayc*ayc + azc*azc)) * RAD2DEG;
+    if (buffered)
+        iio_buffer_close(&iio_buf);
+    imu_record_close(&recording);
+    imu_record_close(&replay);
+
+    /*
+     * File work stays off the sample loop: drop a cache the drift watch
+     * found wrong, or keep the bias adapted during the run for the next start
+     */
+    if (calib_drop) {
+        if (unlink(calib_path) && errno != ENOENT)
+            LOG_WARN("Failed to remove %s: %s", calib_path, strerror(errno));
+        calib_drop = false;
+    } else if (calib_cached && \
+               (fabsf(offs.gx_off - cached_gyro_off[0]) > CALIB_SAVE_GYRO_DELTA || \
+                fabsf(offs.gy_off - cached_gyro_off[1]) > CALIB_SAVE_GYRO_DELTA || \
+                fabsf(offs.gz_off - cached_gyro_off[2]) > CALIB_SAVE_GYRO_DELTA)) {
+        imu_calib_save();
+    }
 
-        /* innovation estimate */
-        float inn_roll  = fabsf(roll_acc  - last_roll);
-        float inn_pitch = fabsf(pitch_acc - last_pitch);
+    return 0;
+}
 
-        /* adaptive r multiplier */
-        float rfac_roll  = compute_adaptive_r_factor(mag, inn_roll);
-        float rfac_pitch = compute_adaptive_r_factor(mag, inn_pitch);
+/* Fusion engine requested by IMU_FUSION_ENV */
+static enum imu_fusion_type imu_env_fusion(void)
+{
+    const char *env = getenv(IMU_FUSION_ENV);
+    int32_t type;
 
-        /* temporarily scale r_measure for robustness */
-        float orig_r_roll  = k_roll.r_measure;
-        float orig_r_pitch = k_pitch.r_measure;
+    if (!env || !*env)
+        return IMU_FUSION_KALMAN;
 
-        k_roll.r_measure  = orig_r_roll  * rfac_roll;
-        k_pitch.r_measure = orig_r_pitch * rfac_pitch;
+    type = imu_fusion_parse(env);
+    if (type < 0) {
+        LOG_WARN("%s=%s unknown, using %s", IMU_FUSION_ENV, env, \
+                 imu_fusion_name(IMU_FUSION_KALMAN));
+        return IMU_FUSION_KALMAN;
+    }
 
-        /* Kalman update (gyro in deg/s, accel angles in deg) */
-        roll_f  = kalman_update(&k_roll,  roll_acc,  gxc, dt);
-        pitch_f = kalman_update(&k_pitch, pitch_acc, gyc, dt);
+    return (enum imu_fusion_type)type;
+}
 
-        /* restore r_measure */
-        k_roll.r_measure  = orig_r_roll;
-        k_pitch.r_measure = orig_r_pitch;
+/* Calibration cache path from IMU_CALIB_PATH_ENV, empty when disabled */
+static void imu_env_calib_path(void)
+{
+    const char *env = getenv(IMU_CALIB_PATH_ENV);
 
-        /* integrate yaw */
-        yaw_integral += gzc * dt;
+    if (!env || !*env)
+        env = IMU_DEFAULT_CALIB_PATH;
+    if (!strcmp(env, IMU_CALIB_NONE))
+        env = "";
 
-        /* publish */
-        pthread_mutex_lock(&angles_lock);
-        shared_angles.roll  = roll_f;
-        shared_angles.pitch = pitch_f;
-        shared_angles.yaw   = yaw_integral;
-        pthread_mutex_unlock(&angles_lock);
+    strncpy(calib_path, env, sizeof(calib_path) - 1);
+    calib_path[sizeof(calib_path) - 1] = '\0';
+}
 
-        last_roll = roll_f;
-        last_pitch = pitch_f;
+/* Sample rate requested by IMU_HZ_ENV */
+static int32_t imu_env_hz(void)
+{
+    const char *env = getenv(IMU_HZ_ENV);
+    int32_t hz;
 
-        LOG_TRACE("dt=%.4f ax=%.4f ay=%.4f az=%.4f gx=%.4f gy=%.4f gz=%.4f mag=%.3f",
-                  dt, axc, ayc, azc, gxc, gyc, gzc, mag);
-        LOG_TRACE("acc_roll=%.3f acc_pitch=%.3f kal_roll=%.3f kal_pitch=%.3f yaw=%.3f rfac=%.3f/%.3f inn=%.3f/%.3f",
-                  roll_acc, pitch_acc, roll_f, pitch_f, yaw_integral, rfac_roll, rfac_pitch, inn_roll, inn_pitch);
+    if (!env || !*env)
+        return DEFAULT_SAMPLE_HZ;
 
-        usleep((int)(1000000.0f / (float)sample_hz));
+    hz = atoi(env);
+    if (hz <= 0 || hz > MAX_SAMPLE_HZ) {
+        LOG_WARN("%s=%s out of range, using %d Hz", IMU_HZ_ENV, env, DEFAULT_SAMPLE_HZ);
+        return DEFAULT_SAMPLE_HZ;
     }
 
+    return hz;
+}
+
+/*
+ * Samples from the recording at IMU_REPLAY_ENV instead of the device: the
+ * engine set up as imu_kalman_init does, rate and calibration from the
+ * recording, the calibration cache left alone.
+ */
+static int32_t imu_replay_init(const char *path)
+{
+    struct imu_fusion_tuning tuning = {
+        .q_angle = DEFAULT_Q_ANGLE,
+        .q_bias = DEFAULT_Q_BIAS,
+        .r_measure = DEFAULT_R_MEASURE,
+    };
+    const char *pace = getenv(IMU_REPLAY_PACE_ENV);
+    int32_t ret;
+
+    imu_record_close(&replay);
+    ret = imu_record_open(&replay, path);
+    if (ret)
+        return ret;
+
+    sample_hz = (int32_t)replay.hdr.sample_hz;
+    replay_fast = pace && !strcmp(pace, IMU_REPLAY_FAST);
+
+    imu_fusion_init(&fusion, imu_env_fusion(), &tuning);
+    imu_att_publish();
+    imu_history_clear();
+
+    calib = replay.hdr.calib;
+    offs.ax_off = calib.accel_off[0];
+    offs.ay_off = calib.accel_off[1];
+    offs.az_off = calib.accel_off[2];
+    offs.gx_off = calib.gyro_off[0];
+    offs.gy_off = calib.gyro_off[1];
+    offs.gz_off = calib.gyro_off[2];
+    calib_path[0] = '\0';
+    calib_cached = false;
+    calib_drop = false;
+    attitude_pending = true;
+
+    LOG_INFO("IMU replay of %s hz=%d fusion=%s pace=%s", path, sample_hz, \
+             imu_fusion_name(fusion.type), \
+             replay_fast ? IMU_REPLAY_FAST : IMU_REPLAY_REALTIME);
     return 0;
 }
 
@@ -525,8 +1333,15 @@ static int32_t imu_fn_handler()
 
 int32_t imu_kalman_init(const char *path, int32_t hz, float q_angle, float q_bias, float r_measure)
 {
+    struct imu_fusion_tuning tuning = { 0 };
     int32_t ret;
 
+    /* the engine, the attitude and the raw fds belong to the running thread */
+    if (imu_running) {
+        LOG_WARN("imu_kalman_init: cannot reinit while running");
+        return -EBUSY;
+    }
+
     if (!path) path = DEFAULT_IIO_BASE;
 
     /* copy base path and ensure trailing slash */
@@ -540,10 +1355,14 @@ int32_t imu_kalman_init(const char *path, int32_t hz, float q_angle, float q_bia
     if (hz <= 0) hz = DEFAULT_SAMPLE_HZ;
     sample_hz = hz;
 
-    /* init kalman */
-    kalman_init(&k_roll, q_angle, q_bias, r_measure);
-    kalman_init(&k_pitch, q_angle, q_bias, r_measure);
-    yaw_integral = 0.0f;
+    /* init the fusion engine */
+    tuning.q_angle = q_angle;
+    tuning.q_bias = q_bias;
+    tuning.r_measure = r_measure;
+    imu_fusion_init(&fusion, imu_env_fusion(), &tuning);
+    imu_att_publish();
+    /* the engine may differ from the one the history was recorded with */
+    imu_history_clear();
 
     /* zero offs and scales */
     memset(&offs, 0, sizeof(offs));
@@ -555,8 +1374,11 @@ int32_t imu_kalman_init(const char *path, int32_t hz, float q_angle, float q_bia
 
     /* detect scales and mount matrices */
     detect_scales();
+    open_raw_fds();
     load_mount_matrix("in_accel_mount_matrix", accel_mount);
     load_mount_matrix("in_anglvel_mount_matrix", gyro_mount);
+    read_device_name();
+    imu_calib_update();
 
     /* quick check base path accessibility */
     ret = access(iio_base, R_OK);
@@ -565,10 +1387,19 @@ int32_t imu_kalman_init(const char *path, int32_t hz, float q_angle, float q_bia
         return -1;
     }
 
-    LOG_INFO("imu_kalman_init path=%s hz=%d q_angle=%.6f q_bias=%.6f r_measure=%.6f",
-         iio_base, sample_hz, k_roll.q_angle, k_roll.q_bias, k_roll.r_measure);
+    LOG_INFO("imu_kalman_init path=%s hz=%d fusion=%s q_angle=%.6f q_bias=%.6f r_measure=%.6f",
+         iio_base, sample_hz, imu_fusion_name(fusion.type), fusion.k_roll.q_angle,
+         fusion.k_roll.q_bias, fusion.k_roll.r_measure);
+
+    /* cached calibration, or the initial one (blocking) */
+    calib_cached = false;
+    calib_drop = false;
+    imu_env_calib_path();
+    if (imu_calib_load() == 0) {
+        attitude_pending = true;
+        return 0;
+    }
 
-    /* initial calibration (blocking) */
     ret = imu_kalman_calibrate();
     if (ret != 0) {
         LOG_WARN("initial calibration failed");
@@ -581,27 +1412,54 @@ int32_t imu_fn_thread_handler()
 {
     int32_t ret;
     char dev_path[MAX_PATH_LEN];
+    const char *replay_path = getenv(IMU_REPLAY_ENV);
 
-    ret = iio_dev_get_path_by_name(IMU_SENSOR_NAME, dev_path, sizeof(dev_path));
-    if (ret) {
-        return ret;
+    /*
+     * A second start must not touch the running loop: init reopens the raw
+     * fds it preads and recalibrates, the replay reopens its recording
+     */
+    if (imu_running) {
+        LOG_WARN("imu already running");
+        return 0;
     }
 
-    ret = imu_kalman_init(dev_path, 100, 0.001f, 0.003f, 0.03f);
-    if (ret) {
-        LOG_ERROR("IMU init task has failed (%d)", ret);
+    if (replay_path && *replay_path) {
+        ret = imu_replay_init(replay_path);
+        if (ret) {
+            LOG_ERROR("IMU replay init has failed (%d)", ret);
+            return ret;
+        }
+    } else {
+        ret = iio_dev_get_path_by_name(IMU_SENSOR_NAME, dev_path, sizeof(dev_path));
+        if (ret) {
+            return ret;
+        }
+
+        ret = imu_kalman_init(dev_path, imu_env_hz(), DEFAULT_Q_ANGLE, \
+                              DEFAULT_Q_BIAS, DEFAULT_R_MEASURE);
+        if (ret) {
+            LOG_ERROR("IMU init task has failed (%d)", ret);
+        }
     }
 
-    if (imu_running) {
-        LOG_WARN("imu already running");
-        return 0;
+    /*
+     * The ring lives as long as the process: subscribers keep their own
+     * mappings, and a restarted IMU task continues the same stream.
+     */
+    if (!stream_ready) {
+        ret = shm_ring_create(&stream_ring, "imu-stream", \
+                              sizeof(struct imu_sample), STREAM_RING_SLOTS);
+        if (ret)
+            LOG_WARN("IMU sample stream unavailable (%d)", ret);
+        else
+            stream_ready = 1;
     }
 
     imu_running = 1;
     ret = imu_fn_handler();
+    imu_running = 0;
     if (ret) {
         LOG_ERROR("IMU background task has failed (%d)", ret);
-        imu_running = 0;
         return ret;
     } else {
         LOG_INFO("IMU handler is exited");
@@ -620,6 +1478,48 @@ void imu_fn_thread_stop(void)
     imu_running = 0;
 }
 
+int32_t imu_stream_open(int32_t *mem_fd, int32_t *event_fd, \
+                        uint32_t *slot_size, uint32_t *slot_count)
+{
+    int32_t sub_fd;
+
+    if (!mem_fd || !event_fd || !slot_size || !slot_count)
+        return -EINVAL;
+
+    if (!stream_ready)
+        return -ENODEV;
+
+    sub_fd = shm_ring_subscribe(&stream_ring);
+    if (sub_fd < 0)
+        return sub_fd;
+
+    *mem_fd = dup(stream_ring.mem_fd);
+    *event_fd = dup(sub_fd);
+    if (*mem_fd < 0 || *event_fd < 0) {
+        LOG_ERROR("Failed to duplicate stream fds: %s", strerror(errno));
+        if (*mem_fd >= 0)
+            close(*mem_fd);
+        if (*event_fd >= 0)
+            close(*event_fd);
+        return -EMFILE;
+    }
+
+    *slot_size = stream_ring.hdr->slot_size;
+    *slot_count = stream_ring.hdr->slot_count;
+    stream_active = 1;
+    return 0;
+}
+
+int32_t imu_get_loop_stats(struct imu_loop_stats *out)
+{
+    if (!out)
+        return -EINVAL;
+
+    seqlock_load(&stats_seq, out, &loop_stats, sizeof(*out));
+
+    return out->target_hz ? 0 : -ENODEV;
+}
+
 int32_t imu_kalman_is_running(void)
 {
     return imu_running;
@@ -627,31 +1527,48 @@ int32_t imu_kalman_is_running(void)
 
 void imu_kalman_reset_yaw(float yaw_deg)
 {
-    pthread_mutex_lock(&angles_lock);
     if (isnan(yaw_deg))
-        shared_angles.yaw = 0.0f;
-    else
-        shared_angles.yaw = yaw_deg;
-    yaw_integral = shared_angles.yaw;
-    pthread_mutex_unlock(&angles_lock);
-    LOG_INFO("imu_kalman_reset_yaw -> %.3f deg", shared_angles.yaw);
+        yaw_deg = 0.0f;
+
+    if (imu_running) {
+        /* applied by the IMU thread before its next batch */
+        atomic_store_explicit(&yaw_request, yaw_deg, memory_order_release);
+    } else {
+        imu_fusion_set_yaw(&fusion, yaw_deg);
+        imu_att_publish();
+    }
+    LOG_INFO("imu_kalman_reset_yaw -> %.3f deg", yaw_deg);
 }
 
 struct imu_angles imu_get_angles(void)
 {
+    struct imu_attitude att;
     struct imu_angles out;
-    pthread_mutex_lock(&angles_lock);
-    out = shared_angles;
-    pthread_mutex_unlock(&angles_lock);
+
+    seqlock_load(&att_seq, &att, &shared_att, sizeof(att));
+
+    imu_attitude_angles(&att, &out);
     return out;
 }
 
 void imu_kalman_set_tuning(float q_angle, float q_bias, float r_measure)
 {
-    if (q_angle > 0.0f) k_roll.q_angle = k_pitch.q_angle = q_angle;
-    if (q_bias  > 0.0f) k_roll.q_bias  = k_pitch.q_bias  = q_bias;
-    if (r_measure> 0.0f) k_roll.r_measure = k_pitch.r_measure = r_measure;
+    struct imu_fusion_tuning tuning = {
+        .q_angle = q_angle,
+        .q_bias = q_bias,
+        .r_measure = r_measure,
+    };
+
+    if (imu_running) {
+        /* applied by the IMU thread before its next batch */
+        pthread_mutex_lock(&tuning_lock);
+        tuning_request = tuning;
+        pthread_mutex_unlock(&tuning_lock);
+        atomic_store_explicit(&tuning_pending, true, memory_order_release);
+    } else {
+        imu_fusion_set_tuning(&fusion, &tuning);
+    }
 
     LOG_INFO("imu_kalman_set_tuning q_angle=%.6f q_bias=%.6f r_measure=%.6f",
-         k_roll.q_angle, k_roll.q_bias, k_roll.r_measure);
+         q_angle, q_bias, r_measure);
 }
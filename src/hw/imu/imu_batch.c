@@ -0,0 +1,183 @@
+/**
+ * @file imu_batch.c
+ *
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <hw/imu_batch.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define LANES                   4
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+/*
+ * out[r] = m[r] . in - off[r] for the three rows, clamped to +-clamp, over
+ * the first `lanes` samples (a multiple of LANES)
+ */
+#if defined(__SSE__)
+static void affine3(const float m[9], const float off[3], float clamp, \
+                    float *const in[3], float *const out[3], uint32_t lanes)
+{
+    __m128 x, y, z, v;
+    __m128 hi = _mm_set1_ps(clamp), lo = _mm_set1_ps(-clamp);
+
+    for (uint32_t i = 0; i < lanes; i += LANES) {
+        x = _mm_loadu_ps(in[0] + i);
+        y = _mm_loadu_ps(in[1] + i);
+        z = _mm_loadu_ps(in[2] + i);
+        for (uint32_t r = 0; r < 3; r++) {
+            v = _mm_mul_ps(_mm_set1_ps(m[r * 3]), x);
+            v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(m[r * 3 + 1]), y));
+            v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(m[r * 3 + 2]), z));
+            v = _mm_sub_ps(v, _mm_set1_ps(off[r]));
+            v = _mm_min_ps(_mm_max_ps(v, lo), hi);
+            _mm_storeu_ps(out[r] + i, v);
+        }
+    }
+}
+#elif defined(__ARM_NEON)
+static void affine3(const float m[9], const float off[3], float clamp, \
+                    float *const in[3], float *const out[3], uint32_t lanes)
+{
+    float32x4_t x, y, z, v;
+    float32x4_t hi = vdupq_n_f32(clamp), lo = vdupq_n_f32(-clamp);
+
+    for (uint32_t i = 0; i < lanes; i += LANES) {
+        x = vld1q_f32(in[0] + i);
+        y = vld1q_f32(in[1] + i);
+        z = vld1q_f32(in[2] + i);
+        for (uint32_t r = 0; r < 3; r++) {
+            v = vdupq_n_f32(-off[r]);
+            v = vmlaq_n_f32(v, x, m[r * 3]);
+            v = vmlaq_n_f32(v, y, m[r * 3 + 1]);
+            v = vmlaq_n_f32(v, z, m[r * 3 + 2]);
+            v = vminq_f32(vmaxq_f32(v, lo), hi);
+            vst1q_f32(out[r] + i, v);
+        }
+    }
+}
+#else
+static void affine3(const float m[9], const float off[3], float clamp, \
+                    float *const in[3], float *const out[3], uint32_t lanes)
+{
+    float v;
+
+    for (uint32_t i = 0; i < lanes; i++) {
+        for (uint32_t r = 0; r < 3; r++) {
+            v = m[r * 3] * in[0][i] + m[r * 3 + 1] * in[1][i] + \
+                m[r * 3 + 2] * in[2][i] - off[r];
+            if (v > clamp) v = clamp;
+            if (v < -clamp) v = -clamp;
+            out[r][i] = v;
+        }
+    }
+}
+#endif
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+const char *imu_calib_simd(void)
+{
+#if defined(__SSE__)
+    return "sse";
+#elif defined(__ARM_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+void imu_calib_apply(const struct imu_calib *c, struct imu_batch *b)
+{
+    float *const a_in[3] = { b->raw[0], b->raw[1], b->raw[2] };
+    float *const g_in[3] = { b->raw[3], b->raw[4], b->raw[5] };
+    float *const a_out[3] = { b->accel[0], b->accel[1], b->accel[2] };
+    float *const g_out[3] = { b->gyro[0], b->gyro[1], b->gyro[2] };
+    uint32_t lanes = (b->n + LANES - 1) & ~(uint32_t)(LANES - 1);
+
+    // Whole vectors only: the lanes past n hold zeros, not stale samples
+    for (uint32_t k = 0; k < 6; k++)
+        memset(&b->raw[k][b->n], 0, (lanes - b->n) * sizeof(float));
+
+    /* accel is not clamped: the bound only has to exceed any reading */
+    affine3(c->accel_m, c->accel_off, 1e30f, a_in, a_out, lanes);
+    affine3(c->gyro_m, c->gyro_off, IMU_GYRO_CLAMP_DPS, g_in, g_out, lanes);
+}
+
+bool imu_calib_adapt_gyro(struct imu_calib *c, const struct imu_batch *b)
+{
+    const float lo = (1.0f - IMU_IDLE_ACCEL_TOL) * (1.0f - IMU_IDLE_ACCEL_TOL);
+    const float hi = (1.0f + IMU_IDLE_ACCEL_TOL) * (1.0f + IMU_IDLE_ACCEL_TOL);
+    float off[3] = { c->gyro_off[0], c->gyro_off[1], c->gyro_off[2] };
+    float mag2;
+    bool adapted = false;
+
+    for (uint32_t i = 0; i < b->n; i++) {
+        if (fabsf(b->gyro[0][i]) >= IMU_IDLE_GYRO_DPS ||
+            fabsf(b->gyro[1][i]) >= IMU_IDLE_GYRO_DPS ||
+            fabsf(b->gyro[2][i]) >= IMU_IDLE_GYRO_DPS)
+            continue;
+
+        /* squared accel magnitude (g^2), compared without the square root */
+        mag2 = b->accel[0][i] * b->accel[0][i] + b->accel[1][i] * b->accel[1][i] + \
+               b->accel[2][i] * b->accel[2][i];
+        if (mag2 <= lo || mag2 >= hi)
+            continue;
+
+        /* adapt slowly toward the uncorrected (deg/s) gyro reading */
+        for (int32_t k = 0; k < 3; k++)
+            c->gyro_off[k] = c->gyro_off[k] * (1.0f - IMU_BIAS_ADAPT_ALPHA) + \
+                             (b->gyro[k][i] + off[k]) * IMU_BIAS_ADAPT_ALPHA;
+        adapted = true;
+    }
+
+    return adapted;
+}
+
+void imu_batch_dt(struct imu_batch *b, uint64_t *prev_ts_ns, int32_t hz)
+{
+    float dt;
+
+    for (uint32_t i = 0; i < b->n; i++) {
+        dt = *prev_ts_ns ? (float)((int64_t)(b->ts_ns[i] - *prev_ts_ns) / 1e9) : 0.0f;
+        if (dt <= 0.0f || dt > 1.0f) dt = 1.0f / (float)hz;
+        b->dt[i] = dt;
+        *prev_ts_ns = b->ts_ns[i];
+    }
+}
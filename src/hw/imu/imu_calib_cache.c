@@ -0,0 +1,243 @@
+/**
+ * @file imu_calib_cache.c
+ *
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#include "imu_calib_cache.h"
+
+/*********************
+ *      DEFINES
+ *********************/
+#define CACHE_LINE_MAX                  256
+#define CACHE_PATH_MAX                  256
+/* Relative tolerance on the key floats, they went through "%.9g" */
+#define CACHE_KEY_EPS                   1e-6f
+
+/* Every field below must be present for the file to load */
+#define FIELD_VERSION                   (1U << 0)
+#define FIELD_DEVICE                    (1U << 1)
+#define FIELD_ACCEL_MOUNT               (1U << 2)
+#define FIELD_GYRO_MOUNT                (1U << 3)
+#define FIELD_SCALES                    (1U << 4)
+#define FIELD_UNITS                     (1U << 5)
+#define FIELD_ACCEL_OFF                 (1U << 6)
+#define FIELD_GYRO_OFF                  (1U << 7)
+#define FIELD_ALL                       ((1U << 8) - 1)
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+/* n floats separated by blanks, nothing after them */
+static int32_t parse_floats(const char *s, float *out, int32_t n)
+{
+    char *end;
+
+    for (int32_t i = 0; i < n; i++) {
+        out[i] = strtof(s, &end);
+        if (end == s || !isfinite(out[i]))
+            return -EINVAL;
+        s = end;
+    }
+
+    while (*s == ' ' || *s == '\t' || *s == '\n')
+        s++;
+
+    return *s ? -EINVAL : 0;
+}
+
+static bool float_eq(float a, float b)
+{
+    return fabsf(a - b) <= CACHE_KEY_EPS * fmaxf(1.0f, fmaxf(fabsf(a), fabsf(b)));
+}
+
+/* Create the directory of path, one level: its parent is the system's */
+static int32_t cache_mkdir_parent(const char *path)
+{
+    char dir[CACHE_PATH_MAX];
+    char *slash;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    slash = strrchr(dir, '/');
+    if (!slash || slash == dir)
+        return -ENOENT;
+
+    *slash = '\0';
+    return mkdir(dir, 0755) && errno != EEXIST ? -errno : 0;
+}
+
+static void write_floats(FILE *fp, const char *key, const float *v, int32_t n)
+{
+    fputs(key, fp);
+    for (int32_t i = 0; i < n; i++)
+        fprintf(fp, " %.9g", v[i]);
+    fputc('\n', fp);
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+int32_t imu_calib_cache_load(const char *path, struct imu_calib_cache *c)
+{
+    char line[CACHE_LINE_MAX], *val;
+    float scales[2], units[2];
+    uint32_t fields = 0;
+    int32_t ret = 0;
+    FILE *fp;
+
+    if (!path || !c)
+        return -EINVAL;
+
+    fp = fopen(path, "r");
+    if (!fp)
+        return -ENOENT;
+
+    memset(c, 0, sizeof(*c));
+    while (!ret && fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        val = strchr(line, ' ');
+        if (!val) {
+            ret = -EINVAL;
+            break;
+        }
+        *val++ = '\0';
+
+        if (!strcmp(line, "version")) {
+            if (strtol(val, NULL, 10) != IMU_CALIB_CACHE_VERSION)
+                ret = -EINVAL;
+            fields |= FIELD_VERSION;
+        } else if (!strcmp(line, "device")) {
+            val[strcspn(val, "\n")] = '\0';
+            if (strlen(val) >= sizeof(c->device))
+                ret = -EINVAL;
+            else
+                strcpy(c->device, val);
+            fields |= FIELD_DEVICE;
+        } else if (!strcmp(line, "accel_mount")) {
+            ret = parse_floats(val, c->accel_mount, 9);
+            fields |= FIELD_ACCEL_MOUNT;
+        } else if (!strcmp(line, "gyro_mount")) {
+            ret = parse_floats(val, c->gyro_mount, 9);
+            fields |= FIELD_GYRO_MOUNT;
+        } else if (!strcmp(line, "scales")) {
+            ret = parse_floats(val, scales, 2);
+            c->accel_scale = scales[0];
+            c->gyro_scale = scales[1];
+            fields |= FIELD_SCALES;
+        } else if (!strcmp(line, "units")) {
+            ret = parse_floats(val, units, 2);
+            c->accel_to_g = units[0];
+            c->gyro_to_deg = units[1];
+            fields |= FIELD_UNITS;
+        } else if (!strcmp(line, "accel_offset")) {
+            ret = parse_floats(val, c->accel_off, 3);
+            fields |= FIELD_ACCEL_OFF;
+        } else if (!strcmp(line, "gyro_offset")) {
+            ret = parse_floats(val, c->gyro_off, 3);
+            fields |= FIELD_GYRO_OFF;
+        }
+        /* unknown keys are skipped, later versions may add some */
+    }
+    fclose(fp);
+
+    if (!ret && fields != FIELD_ALL)
+        ret = -EINVAL;
+    if (ret)
+        LOG_WARN("IMU calibration cache %s is invalid, ignored", path);
+
+    return ret;
+}
+
+int32_t imu_calib_cache_save(const char *path, const struct imu_calib_cache *c)
+{
+    char tmp[CACHE_PATH_MAX];
+    int32_t ret = 0;
+    FILE *fp;
+
+    if (!path || !c)
+        return -EINVAL;
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        return -ENAMETOOLONG;
+
+    fp = fopen(tmp, "w");
+    if (!fp && errno == ENOENT && cache_mkdir_parent(path) == 0)
+        fp = fopen(tmp, "w");
+    if (!fp) {
+        ret = -errno;
+        LOG_WARN("Cannot write IMU calibration cache %s: %s", tmp, strerror(-ret));
+        return ret;
+    }
+
+    fprintf(fp, "# sys-mgr IMU calibration\n");
+    fprintf(fp, "version %d\n", IMU_CALIB_CACHE_VERSION);
+    fprintf(fp, "device %s\n", c->device);
+    write_floats(fp, "accel_mount", c->accel_mount, 9);
+    write_floats(fp, "gyro_mount", c->gyro_mount, 9);
+    fprintf(fp, "scales %.9g %.9g\n", c->accel_scale, c->gyro_scale);
+    fprintf(fp, "units %.9g %.9g\n", c->accel_to_g, c->gyro_to_deg);
+    write_floats(fp, "accel_offset", c->accel_off, 3);
+    write_floats(fp, "gyro_offset", c->gyro_off, 3);
+
+    /* the rename must not expose a file whose data is not on disk yet */
+    if (fflush(fp) || fsync(fileno(fp)))
+        ret = -errno;
+    if (fclose(fp) && !ret)
+        ret = -errno;
+    if (!ret && rename(tmp, path))
+        ret = -errno;
+
+    if (ret) {
+        LOG_WARN("Cannot write IMU calibration cache %s: %s", path, strerror(-ret));
+        unlink(tmp);
+    }
+
+    return ret;
+}
+
+bool imu_calib_cache_match(const struct imu_calib_cache *a, \
+                           const struct imu_calib_cache *b)
+{
+    if (strcmp(a->device, b->device))
+        return false;
+
+    for (int32_t i = 0; i < 9; i++) {
+        if (!float_eq(a->accel_mount[i], b->accel_mount[i]) || \
+            !float_eq(a->gyro_mount[i], b->gyro_mount[i]))
+            return false;
+    }
+
+    return float_eq(a->accel_scale, b->accel_scale) && \
+           float_eq(a->gyro_scale, b->gyro_scale);
+}
@@ -0,0 +1,77 @@
+/**
+ * @file imu_calib_cache.h
+ *
+ */
+#ifndef G_IMU_CALIB_CACHE_H
+#define G_IMU_CALIB_CACHE_H
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+#include <stdbool.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+/*
+ * Calibration of the IMU kept across starts, a small text file:
+ *
+ *   version 1
+ *   device <IIO name>
+ *   accel_mount <9 values>
+ *   gyro_mount <9 values>
+ *   scales <accel> <gyro>
+ *   units <accel to g> <gyro to deg/s>
+ *   accel_offset <x> <y> <z>
+ *   gyro_offset <x> <y> <z>
+ *
+ * The device name, mount matrices and sysfs scales are the key: the file
+ * only applies to the same sensor, mounted the same way, at the same range.
+ */
+#define IMU_CALIB_CACHE_VERSION         1
+#define IMU_CALIB_DEVICE_MAX            64
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+struct imu_calib_cache {
+    /* key */
+    char device[IMU_CALIB_DEVICE_MAX];
+    float accel_mount[9];
+    float gyro_mount[9];
+    float accel_scale;
+    float gyro_scale;
+
+    /* calibration */
+    float accel_to_g;
+    float gyro_to_deg;
+    float accel_off[3];         /* g */
+    float gyro_off[3];          /* deg/s */
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ * GLOBAL PROTOTYPES
+ **********************/
+/*
+ * Read the cache at path. Returns -ENOENT when there is none, -EINVAL when
+ * it is malformed or of another version.
+ */
+int32_t imu_calib_cache_load(const char *path, struct imu_calib_cache *c);
+
+/* Replace the cache at path atomically (temporary file, then rename) */
+int32_t imu_calib_cache_save(const char *path, const struct imu_calib_cache *c);
+
+/* Whether a and b describe the same sensor and mounting */
+bool imu_calib_cache_match(const struct imu_calib_cache *a, \
+                           const struct imu_calib_cache *b);
+
+/**********************
+ *      MACROS
+ **********************/
+
+#endif /*  G_IMU_CALIB_CACHE_H */
@@ -0,0 +1,206 @@
+/**
+ * @file imu_history.c
+ *
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include <hw/imu_history.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define SLOT_MASK                       (IMU_HISTORY_SLOTS - 1)
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+/*
+ * Same scheme as the slots of shm_ring: the sequence word is odd while the
+ * entry is written and 2 * (n + 1) once entry n is complete.
+ */
+struct hist_slot {
+    _Atomic uint64_t seq;
+    struct imu_history_entry e;
+};
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+static struct hist_slot slots[IMU_HISTORY_SLOTS];
+/* number of the next entry */
+static _Atomic uint64_t head;
+/* entries before it were cleared */
+static _Atomic uint64_t floor_n;
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+/* Copy entry n, 0 if it is complete and was not overwritten meanwhile */
+static int32_t slot_read(uint64_t n, struct imu_history_entry *out)
+{
+    struct hist_slot *s = &slots[n & SLOT_MASK];
+    uint64_t s1, s2;
+
+    s1 = atomic_load_explicit(&s->seq, memory_order_acquire);
+    if (s1 != 2 * n + 2)
+        return -EAGAIN;
+
+    memcpy(out, &s->e, sizeof(*out));
+
+    atomic_thread_fence(memory_order_acquire);
+    s2 = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    return s1 == s2 ? 0 : -EAGAIN;
+}
+
+/*
+ * Entries still readable: [lo, hi). The oldest slot is left out, the writer
+ * may be overwriting it already.
+ */
+static void hist_window(uint64_t *lo, uint64_t *hi)
+{
+    uint64_t fl = atomic_load_explicit(&floor_n, memory_order_acquire);
+
+    *hi = atomic_load_explicit(&head, memory_order_acquire);
+    *lo = *hi > IMU_HISTORY_SLOTS - 1 ? *hi - (IMU_HISTORY_SLOTS - 1) : 0;
+    if (*lo < fl)
+        *lo = fl;
+}
+
+/*
+ * First entry in [lo, hi) taken after ts_ns (at or after when inclusive).
+ * An entry lost to the writer means everything older is lost as well.
+ */
+static uint64_t hist_search(uint64_t lo, uint64_t hi, uint64_t ts_ns, bool inclusive)
+{
+    struct imu_history_entry e;
+    uint64_t mid;
+    bool after;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        after = slot_read(mid, &e) == 0 && \
+                (inclusive ? e.ts_ns >= ts_ns : e.ts_ns > ts_ns);
+        if (after)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return lo;
+}
+
+/* Copy [from, hi) up to max entries, leaving out the lost ones */
+static int32_t hist_copy(uint64_t from, uint64_t hi, struct imu_history_entry *out, \
+                         uint32_t max)
+{
+    uint32_t count = 0;
+
+    for (uint64_t n = from; n < hi && count < max; n++) {
+        if (slot_read(n, &out[count]) == 0)
+            count++;
+    }
+
+    return (int32_t)count;
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+void imu_history_push(const struct imu_history_entry *e)
+{
+    uint64_t n = atomic_load_explicit(&head, memory_order_relaxed);
+    struct hist_slot *s = &slots[n & SLOT_MASK];
+
+    /* Odd sequence: slot is being written */
+    atomic_store_explicit(&s->seq, 2 * n + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    memcpy(&s->e, e, sizeof(s->e));
+
+    atomic_store_explicit(&s->seq, 2 * n + 2, memory_order_release);
+    atomic_store_explicit(&head, n + 1, memory_order_release);
+}
+
+void imu_history_clear(void)
+{
+    atomic_store_explicit(&floor_n, atomic_load(&head), memory_order_release);
+}
+
+int32_t imu_history_latest(struct imu_history_entry *out, uint32_t n)
+{
+    uint64_t lo, hi;
+
+    if (!out)
+        return -EINVAL;
+
+    hist_window(&lo, &hi);
+    if (hi - lo > n)
+        lo = hi - n;
+
+    return hist_copy(lo, hi, out, n);
+}
+
+int32_t imu_history_since(uint64_t ts_ns, struct imu_history_entry *out, \
+                          uint32_t max)
+{
+    uint64_t lo, hi;
+
+    if (!out)
+        return -EINVAL;
+
+    hist_window(&lo, &hi);
+    return hist_copy(hist_search(lo, hi, ts_ns, false), hi, out, max);
+}
+
+int32_t imu_history_at(uint64_t ts_ns, struct imu_history_entry *out)
+{
+    struct imu_history_entry a, b;
+    uint64_t lo, hi, n;
+    float t;
+
+    if (!out)
+        return -EINVAL;
+
+    hist_window(&lo, &hi);
+    n = hist_search(lo, hi, ts_ns, true);
+    if (n >= hi)
+        return -ERANGE;
+    if (slot_read(n, &b))
+        return -EAGAIN;
+
+    /* exactly on a sample, or before the oldest one */
+    if (b.ts_ns == ts_ns) {
+        *out = b;
+        return 0;
+    }
+    if (n == lo)
+        return -ERANGE;
+    if (slot_read(n - 1, &a))
+        return -EAGAIN;
+    if (a.att.type != b.att.type)
+        return -ERANGE;
+
+    t = (float)(ts_ns - a.ts_ns) / (float)(b.ts_ns - a.ts_ns);
+    out->ts_ns = ts_ns;
+    for (int32_t i = 0; i < 3; i++) {
+        out->accel[i] = a.accel[i] + (b.accel[i] - a.accel[i]) * t;
+        out->gyro[i] = a.gyro[i] + (b.gyro[i] - a.gyro[i]) * t;
+    }
+    imu_attitude_lerp(&a.att, &b.att, t, &out->att);
+
+    return 0;
+}
@@ -0,0 +1,471 @@
+/**
+ * @file imu_iio_buffer.c
+ *
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+
+#include <comm/f_comm.h>
+#include "imu_iio_buffer.h"
+
+/*********************
+ *      DEFINES
+ *********************/
+#define IIO_BUF_KERNEL_LENGTH   "64"
+/*
+ * Wake-ups per second at most: above this rate the device queues
+ * sample_hz / IIO_BUF_WAKE_HZ scans per wake-up, fused as one batch
+ */
+#define IIO_BUF_WAKE_HZ         100
+#define IIO_ATTR_MAX            64
+/* Room for a device directory plus a dirent name and an attribute */
+#define IIO_SYSFS_PATH_MAX      (IIO_BUF_PATH_MAX * 3)
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+static const char *axis_names[IIO_BUF_AXES] = {
+    "in_accel_x", "in_accel_y", "in_accel_z",
+    "in_anglvel_x", "in_anglvel_y", "in_anglvel_z",
+};
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+static uint64_t clock_ns(clockid_t clk)
+{
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Write an attribute quietly, a missing one is not an error for callers */
+static int32_t iio_write_attr(const struct iio_buffer *buf, const char *name, \
+                              const char *val)
+{
+    char path[IIO_SYSFS_PATH_MAX];
+    int32_t fd, ret = 0;
+
+    snprintf(path, sizeof(path), "%s%s", buf->base, name);
+    fd = open(path, O_WRONLY);
+    if (fd < 0)
+        return -errno;
+
+    if (write(fd, val, strlen(val)) < 0)
+        ret = -errno;
+    close(fd);
+    return ret;
+}
+
+static int32_t iio_read_attr(const char *path, char *out, size_t len)
+{
+    size_t n;
+    int32_t ret;
+
+    ret = gf_fs_read_file(path, out, len, &n);
+    if (ret)
+        return ret;
+
+    out[strcspn(out, "\n")] = '\0';
+    return 0;
+}
+
+/* Only the channels of this module may shape the scan */
+static void iio_disable_scan_elements(const struct iio_buffer *buf)
+{
+    char dir_path[IIO_SYSFS_PATH_MAX], name[IIO_SYSFS_PATH_MAX];
+    struct dirent *entry;
+    size_t len;
+    DIR *dir;
+
+    snprintf(dir_path, sizeof(dir_path), "%sscan_elements", buf->base);
+    dir = opendir(dir_path);
+    if (!dir)
+        return;
+
+    while ((entry = readdir(dir)) != NULL) {
+        len = strlen(entry->d_name);
+        if (len < 3 || strcmp(entry->d_name + len - 3, "_en"))
+            continue;
+        snprintf(name, sizeof(name), "scan_elements/%s", entry->d_name);
+        iio_write_attr(buf, name, "0");
+    }
+
+    closedir(dir);
+}
+
+/* Enable a scan element and parse its index and "le:s16/16>>0" type */
+static int32_t iio_setup_chan(const struct iio_buffer *buf, const char *chan, \
+                              struct iio_buf_chan *out)
+{
+    char path[IIO_SYSFS_PATH_MAX], val[IIO_ATTR_MAX], name[IIO_ATTR_MAX];
+    char endian, sign;
+    uint32_t bits, storage, shift;
+    int32_t ret;
+
+    snprintf(path, sizeof(path), "%sscan_elements/%s_index", buf->base, chan);
+    ret = iio_read_attr(path, val, sizeof(val));
+    if (ret)
+        return ret;
+    out->index = atoi(val);
+
+    snprintf(path, sizeof(path), "%sscan_elements/%s_type", buf->base, chan);
+    ret = iio_read_attr(path, val, sizeof(val));
+    if (ret)
+        return ret;
+
+    // Repeated channels ("X2") carry no axis data of interest
+    if (sscanf(val, "%ce:%c%u/%u>>%u", &endian, &sign, &bits, &storage, \
+               &shift) != 5 || (endian != 'l' && endian != 'b') || \
+        (storage != 8 && storage != 16 && storage != 32 && storage != 64) || \
+        !bits || bits > storage || shift >= storage) {
+        LOG_ERROR("%s: unsupported scan type '%s'", chan, val);
+        return -EPROTO;
+    }
+
+    out->bytes = storage / 8;
+    out->bits = bits;
+    out->shift = shift;
+    out->is_signed = sign == 's';
+    out->big_endian = endian == 'b';
+
+    snprintf(name, sizeof(name), "scan_elements/%s_en", chan);
+    return iio_write_attr(buf, name, "1");
+}
+
+/* Byte offsets of the enabled channels: index order, naturally aligned */
+static void iio_layout(struct iio_buffer *buf)
+{
+    struct iio_buf_chan *chans[IIO_BUF_AXES + 1];
+    uint32_t n = 0, offset = 0, align = 1;
+
+    for (uint32_t i = 0; i < IIO_BUF_AXES; i++)
+        chans[n++] = &buf->axes[i];
+    if (buf->has_ts)
+        chans[n++] = &buf->ts;
+
+    for (uint32_t i = 1; i < n; i++) {
+        struct iio_buf_chan *c = chans[i];
+        uint32_t j = i;
+
+        for (; j > 0 && chans[j - 1]->index > c->index; j--)
+            chans[j] = chans[j - 1];
+        chans[j] = c;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        offset = (offset + chans[i]->bytes - 1) / chans[i]->bytes * chans[i]->bytes;
+        chans[i]->offset = offset;
+        offset += chans[i]->bytes;
+        if (chans[i]->bytes > align)
+            align = chans[i]->bytes;
+    }
+
+    buf->scan_size = (offset + align - 1) / align * align;
+}
+
+/*
+ * Keep a trigger already set up by the system. Otherwise use the device's
+ * own data-ready trigger, "<name>-dev<N>". A device without a trigger
+ * directory pushes scans from its hardware FIFO.
+ */
+static int32_t iio_setup_trigger(const struct iio_buffer *buf)
+{
+    char path[IIO_SYSFS_PATH_MAX], devices[IIO_BUF_PATH_MAX];
+    char cur[IIO_ATTR_MAX], name[IIO_ATTR_MAX], want[IIO_ATTR_MAX * 2];
+    const char *dev;
+    struct dirent *entry;
+    size_t len;
+    DIR *dir;
+    int32_t ret = -ENOENT;
+
+    snprintf(path, sizeof(path), "%strigger/current_trigger", buf->base);
+    if (!gf_fs_file_exists(path))
+        return 0;
+    if (!iio_read_attr(path, cur, sizeof(cur)) && cur[0])
+        return 0;
+
+    snprintf(path, sizeof(path), "%sname", buf->base);
+    if (iio_read_attr(path, name, sizeof(name)))
+        return -ENOENT;
+
+    // base is ".../iio:deviceN/"
+    snprintf(devices, sizeof(devices), "%s", buf->base);
+    len = strlen(devices);
+    if (len)
+        devices[len - 1] = '\0';
+    dev = strrchr(devices, '/');
+    if (!dev || strncmp(dev + 1, "iio:device", 10))
+        return -ENOENT;
+    snprintf(want, sizeof(want), "%s-dev%s", name, dev + 11);
+    devices[dev - devices] = '\0';
+
+    dir = opendir(devices);
+    if (!dir)
+        return -errno;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "trigger", 7))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/name", devices, entry->d_name);
+        if (iio_read_attr(path, cur, sizeof(cur)) || strcmp(cur, want))
+            continue;
+
+        ret = iio_write_attr(buf, "trigger/current_trigger", want);
+        if (!ret)
+            LOG_INFO("IIO trigger %s attached", want);
+        break;
+    }
+
+    closedir(dir);
+    return ret;
+}
+
+/*
+ * Ask for CLOCK_MONOTONIC timestamps. Kernels without the choice stamp
+ * with CLOCK_REALTIME, which is mapped with the offset between the two.
+ */
+static void iio_setup_ts_clock(struct iio_buffer *buf)
+{
+    char path[IIO_SYSFS_PATH_MAX], clk[IIO_ATTR_MAX];
+
+    iio_write_attr(buf, "current_timestamp_clock", "monotonic");
+    snprintf(path, sizeof(path), "%scurrent_timestamp_clock", buf->base);
+    if (!iio_read_attr(path, clk, sizeof(clk)) && !strcmp(clk, "monotonic")) {
+        buf->ts_offset_ns = 0;
+        return;
+    }
+
+    buf->ts_offset_ns = (int64_t)(clock_ns(CLOCK_REALTIME) - \
+                                  clock_ns(CLOCK_MONOTONIC));
+}
+
+static int64_t iio_chan_value(const struct iio_buf_chan *c, const uint8_t *scan)
+{
+    const uint8_t *p = scan + c->offset;
+    uint64_t v = 0;
+
+    for (uint32_t i = 0; i < c->bytes; i++)
+        v = (v << 8) | p[c->big_endian ? i : c->bytes - 1 - i];
+
+    v >>= c->shift;
+    if (c->bits < 64) {
+        v &= (1ULL << c->bits) - 1;
+        if (c->is_signed && (v >> (c->bits - 1)))
+            v |= ~0ULL << c->bits;
+    }
+
+    return (int64_t)v;
+}
+
+/*
+ * The IIO core only hands out whole scans, other sources may not: a
+ * partial scan is kept at the front of the buffer for the next read.
+ */
+static int32_t iio_buffer_fill(struct iio_buffer *buf, int32_t timeout_ms)
+{
+    struct pollfd pfd = { .fd = buf->fd, .events = POLLIN };
+    size_t cap = (size_t)buf->scan_size * IIO_BUF_MAX_SCANS, held;
+    ssize_t n;
+    int32_t ret;
+
+    if (buf->partial)
+        memmove(buf->scans, buf->scans + (size_t)buf->n_scans * buf->scan_size, \
+                buf->partial);
+    buf->n_scans = buf->next = 0;
+
+    ret = poll(&pfd, 1, timeout_ms);
+    if (ret < 0)
+        return -errno;
+    if (ret == 0)
+        return -ETIMEDOUT;
+    if (pfd.revents & (POLLERR | POLLNVAL))
+        return -EIO;
+    if (!(pfd.revents & POLLIN))
+        return -ENODATA;
+
+    n = read(buf->fd, buf->scans + buf->partial, cap - buf->partial);
+    if (n < 0)
+        return errno == EAGAIN ? -ETIMEDOUT : -errno;
+    if (n == 0)
+        return -ENODATA;
+
+    buf->fill_ns = clock_ns(CLOCK_MONOTONIC);
+    held = buf->partial + (size_t)n;
+    buf->n_scans = held / buf->scan_size;
+    buf->partial = held % buf->scan_size;
+    return buf->n_scans ? 0 : -EAGAIN;
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+int32_t iio_buffer_open(struct iio_buffer *buf, const char *base, \
+                        int32_t sample_hz)
+{
+    char dev_path[IIO_BUF_PATH_MAX], hz[16], watermark[16];
+    const char *dev;
+    int32_t ret, wm;
+
+    memset(buf, 0, sizeof(*buf));
+    buf->fd = -1;
+    snprintf(buf->base, sizeof(buf->base), "%s", base);
+
+    // Layout and trigger can only change while the buffer is off
+    iio_write_attr(buf, "buffer/enable", "0");
+    iio_disable_scan_elements(buf);
+
+    for (uint32_t i = 0; i < IIO_BUF_AXES; i++) {
+        ret = iio_setup_chan(buf, axis_names[i], &buf->axes[i]);
+        if (ret) {
+            LOG_WARN("%s: no buffered channel %s (%d)", buf->base, \
+                     axis_names[i], ret);
+            return ret;
+        }
+    }
+
+    buf->has_ts = !iio_setup_chan(buf, "in_timestamp", &buf->ts);
+    if (buf->has_ts)
+        iio_setup_ts_clock(buf);
+    iio_layout(buf);
+
+    ret = iio_setup_trigger(buf);
+    if (ret)
+        LOG_WARN("%s: no data-ready trigger (%d)", buf->base, ret);
+
+    snprintf(hz, sizeof(hz), "%d", sample_hz);
+    if (iio_write_attr(buf, "sampling_frequency", hz)) {
+        LOG_DEBUG("%s: sampling_frequency not set", buf->base);
+    }
+    iio_write_attr(buf, "buffer/length", IIO_BUF_KERNEL_LENGTH);
+    wm = sample_hz / IIO_BUF_WAKE_HZ;
+    if (wm < 1)
+        wm = 1;
+    if (wm > IIO_BUF_MAX_SCANS / 2)
+        wm = IIO_BUF_MAX_SCANS / 2;
+    snprintf(watermark, sizeof(watermark), "%d", wm);
+    iio_write_attr(buf, "buffer/watermark", watermark);
+
+    buf->scans = malloc((size_t)buf->scan_size * IIO_BUF_MAX_SCANS);
+    if (!buf->scans)
+        return -ENOMEM;
+
+    // The character device is named after the sysfs directory
+    snprintf(dev_path, sizeof(dev_path), "%s", buf->base);
+    dev_path[strlen(dev_path) - 1] = '\0';
+    dev = strrchr(dev_path, '/');
+    snprintf(dev_path, sizeof(dev_path), "/dev/%s", dev ? dev + 1 : "");
+
+    buf->fd = open(dev_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (buf->fd < 0) {
+        ret = -errno;
+        LOG_WARN("Failed to open %s: %s", dev_path, strerror(-ret));
+        goto fail;
+    }
+
+    ret = iio_write_attr(buf, "buffer/enable", "1");
+    if (ret) {
+        LOG_WARN("%s: buffer enable failed: %s", buf->base, strerror(-ret));
+        goto fail;
+    }
+
+    LOG_INFO("IIO buffer on %s: %u-byte scans%s", dev_path, buf->scan_size, \
+             buf->has_ts ? ", hardware timestamps" : "");
+    return 0;
+
+fail:
+    if (buf->fd >= 0)
+        close(buf->fd);
+    buf->fd = -1;
+    free(buf->scans);
+    buf->scans = NULL;
+    return ret;
+}
+
+int32_t iio_buffer_read(struct iio_buffer *buf, struct iio_scan *scan, \
+                        int32_t timeout_ms)
+{
+    const uint8_t *p;
+    int32_t ret;
+
+    while (buf->next == buf->n_scans) {
+        ret = iio_buffer_fill(buf, timeout_ms);
+        if (ret && ret != -EAGAIN)
+            return ret;
+    }
+
+    p = buf->scans + (size_t)buf->next++ * buf->scan_size;
+    for (uint32_t i = 0; i < IIO_BUF_AXES; i++)
+        scan->raw[i] = (int32_t)iio_chan_value(&buf->axes[i], p);
+
+    if (buf->has_ts)
+        scan->ts_ns = (uint64_t)(iio_chan_value(&buf->ts, p) - buf->ts_offset_ns);
+    else
+        scan->ts_ns = buf->fill_ns;
+
+    return 0;
+}
+
+int32_t iio_buffer_read_batch(struct iio_buffer *buf, struct iio_scan *scans, \
+                              uint32_t max, int32_t timeout_ms)
+{
+    uint32_t n;
+    int32_t ret;
+
+    if (!max)
+        return -EINVAL;
+
+    ret = iio_buffer_read(buf, &scans[0], timeout_ms);
+    if (ret)
+        return ret;
+
+    // The rest of what the last read brought in, without waiting
+    for (n = 1; n < max && buf->next < buf->n_scans; n++)
+        iio_buffer_read(buf, &scans[n], 0);
+
+    return (int32_t)n;
+}
+
+void iio_buffer_close(struct iio_buffer *buf)
+{
+    if (buf->fd < 0)
+        return;
+
+    iio_write_attr(buf, "buffer/enable", "0");
+    close(buf->fd);
+    buf->fd = -1;
+    free(buf->scans);
+    buf->scans = NULL;
+    buf->n_scans = buf->next = buf->partial = 0;
+}
@@ -0,0 +1,103 @@
+/**
+ * @file imu_iio_buffer.h
+ *
+ */
+#ifndef G_IMU_IIO_BUFFER_H
+#define G_IMU_IIO_BUFFER_H
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+#include <stdbool.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+/* Buffered IIO acquisition: packed scans read from /dev/iio:deviceN */
+
+/* accel x y z, then anglvel x y z */
+#define IIO_BUF_AXES            6
+/* Scans fetched by one read() when the device has queued several */
+#define IIO_BUF_MAX_SCANS       32
+#define IIO_BUF_PATH_MAX        256
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+/* Position and format of a channel in a scan, from scan_elements */
+struct iio_buf_chan {
+    int32_t index;
+    uint32_t offset;        /* bytes from the start of the scan */
+    uint8_t bytes;          /* storage size */
+    uint8_t bits;           /* significant bits */
+    uint8_t shift;
+    bool is_signed;
+    bool big_endian;
+};
+
+struct iio_buffer {
+    char base[IIO_BUF_PATH_MAX];
+    int32_t fd;
+    struct iio_buf_chan axes[IIO_BUF_AXES];
+    struct iio_buf_chan ts;
+    bool has_ts;
+    int64_t ts_offset_ns;   /* subtracted to get CLOCK_MONOTONIC */
+    uint64_t fill_ns;       /* read time, stamps scans without timestamp */
+    uint32_t scan_size;
+    uint32_t n_scans;
+    uint32_t next;
+    uint32_t partial;       /* bytes of an incomplete scan after the last */
+    uint8_t *scans;
+};
+
+/* One decoded scan: raw counts, all axes sampled at ts_ns */
+struct iio_scan {
+    int32_t raw[IIO_BUF_AXES];
+    uint64_t ts_ns;         /* CLOCK_MONOTONIC */
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ * GLOBAL PROTOTYPES
+ **********************/
+/*=====================
+ * Other functions
+ *====================*/
+/*
+ * Set up and start buffered capture of the accel and gyro channels of the
+ * device at base (sysfs path ending with '/'): enable the scan elements,
+ * attach the device's data-ready trigger unless one is set or the device
+ * runs its hardware FIFO without one, and open the character device.
+ * Returns 0 or negative errno, the buffer is left disabled on error.
+ */
+int32_t iio_buffer_open(struct iio_buffer *buf, const char *base, \
+                        int32_t sample_hz);
+
+/*
+ * Next scan, waiting up to timeout_ms when none is queued.
+ *  -ETIMEDOUT  no scan in time
+ *  -EINTR      interrupted by a signal
+ *  -ENODATA    the device was closed
+ */
+int32_t iio_buffer_read(struct iio_buffer *buf, struct iio_scan *scan, \
+                        int32_t timeout_ms);
+
+/*
+ * Up to max scans: waits for the first one like iio_buffer_read, then
+ * takes the ones already queued. Returns the count or negative errno.
+ */
+int32_t iio_buffer_read_batch(struct iio_buffer *buf, struct iio_scan *scans, \
+                              uint32_t max, int32_t timeout_ms);
+
+/* Stop the buffer and release the device */
+void iio_buffer_close(struct iio_buffer *buf);
+
+/**********************
+ *      MACROS
+ **********************/
+
+#endif /*  G_IMU_IIO_BUFFER_H */
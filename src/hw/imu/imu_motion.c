@@ -0,0 +1,282 @@
+/**
+ * @file imu_motion.c
+ *
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include <hw/imu_motion.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+/* Time constants (s) of the high-pass base and of the activity smoothing */
+#define MOTION_LP_TAU_S                 0.5f
+#define MOTION_ACT_TAU_S                0.05f
+/* Tap and shake spikes end below this share of their threshold */
+#define MOTION_SPIKE_RELEASE            0.5f
+
+#define NS_PER_MS                       1000000ULL
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+static const char *const motion_names[IMU_MOTION_COUNT] = {
+    [IMU_MOTION_QUADRANT] = "quadrant",
+    [IMU_MOTION_SHAKE] = "shake",
+    [IMU_MOTION_TAP] = "tap",
+    [IMU_MOTION_MOVING] = "moving",
+};
+
+/**********************
+ *      MACROS
+ **********************/
+#define DEG2RAD(d) ((d) * (float)M_PI / 180.0f)
+#define RAD2DEG(r) ((r) * 180.0f / (float)M_PI)
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+static void motion_emit(struct imu_motion_event *ev, uint32_t max, uint32_t *cnt, \
+                        uint64_t ts_ns, enum imu_motion_type type, float value)
+{
+    if (*cnt >= max) {
+        LOG_WARN("Motion event %s dropped, %u per batch at most", \
+                 motion_names[type], max);
+        return;
+    }
+
+    ev[*cnt].ts_ns = ts_ns;
+    ev[*cnt].type = type;
+    ev[*cnt].value = value;
+    (*cnt)++;
+}
+
+/* Smoothing factor of an exponential average with time constant tau */
+static float motion_alpha(float dt, float tau)
+{
+    return dt / (tau + dt);
+}
+
+static void motion_moving(struct imu_motion *m, uint64_t ts_ns, \
+                          struct imu_motion_event *ev, uint32_t max, uint32_t *cnt)
+{
+    if (m->act_accel > IMU_MOVING_ACCEL_G || m->act_gyro > IMU_MOVING_GYRO_DPS) {
+        m->motion_ns = ts_ns;
+        if (m->moving != 1) {
+            m->moving = 1;
+            motion_emit(ev, max, cnt, ts_ns, IMU_MOTION_MOVING, 1.0f);
+        }
+        return;
+    }
+
+    if (m->act_accel > IMU_MOVING_ACCEL_G * 0.5f || \
+        m->act_gyro > IMU_MOVING_GYRO_DPS * 0.5f)
+        m->motion_ns = ts_ns;
+
+    if (m->moving != 0 && ts_ns - m->motion_ns >= IMU_STILL_HOLD_MS * NS_PER_MS) {
+        m->moving = 0;
+        motion_emit(ev, max, cnt, ts_ns, IMU_MOTION_MOVING, 0.0f);
+    }
+}
+
+/* A tap spike ended: pair it with a waiting one or make it wait */
+static void motion_tap(struct imu_motion *m, uint64_t ts_ns, \
+                       struct imu_motion_event *ev, uint32_t max, uint32_t *cnt)
+{
+    uint64_t since;
+
+    if (ts_ns < m->shake_until_ns)
+        return;
+
+    if (ts_ns - m->spike_ns > IMU_TAP_MAX_MS * NS_PER_MS) {
+        /* a push or a swing, not a tap: a waiting tap stays single */
+        return;
+    }
+
+    if (!m->tap_ns) {
+        m->tap_ns = m->spike_ns;
+        return;
+    }
+
+    since = m->spike_ns - m->tap_ns;
+    if (since < IMU_TAP_MIN_GAP_MS * NS_PER_MS)
+        return;
+
+    m->tap_ns = 0;
+    motion_emit(ev, max, cnt, ts_ns, IMU_MOTION_TAP, 2.0f);
+}
+
+/* A shake spike ended: enough of them within the window make a shake */
+static void motion_shake(struct imu_motion *m, uint64_t ts_ns, \
+                         struct imu_motion_event *ev, uint32_t max, uint32_t *cnt)
+{
+    uint64_t oldest;
+    float peak = 0.0f;
+
+    if (m->shake_edge < IMU_SHAKE_COUNT || ts_ns < m->shake_until_ns)
+        return;
+
+    oldest = m->shake_edges[m->shake_edge % IMU_SHAKE_COUNT];
+    if (ts_ns - oldest > IMU_SHAKE_WINDOW_MS * NS_PER_MS)
+        return;
+
+    for (int32_t i = 0; i < IMU_SHAKE_COUNT; i++) {
+        if (m->shake_peaks[i] > peak)
+            peak = m->shake_peaks[i];
+    }
+
+    m->shake_edge = 0;
+    m->shake_until_ns = ts_ns + IMU_SHAKE_HOLDOFF_MS * NS_PER_MS;
+    /* the swings of a shake are no taps */
+    m->tap_ns = 0;
+    motion_emit(ev, max, cnt, ts_ns, IMU_MOTION_SHAKE, peak);
+}
+
+/* Spikes of the high-passed magnitude: taps and shakes */
+static void motion_spikes(struct imu_motion *m, uint64_t ts_ns, float hp, \
+                          struct imu_motion_event *ev, uint32_t max, uint32_t *cnt)
+{
+    uint32_t slot;
+
+    if (!m->spike && hp > IMU_TAP_THRESHOLD_G) {
+        m->spike = true;
+        m->spike_ns = ts_ns;
+    } else if (m->spike && hp < IMU_TAP_THRESHOLD_G * MOTION_SPIKE_RELEASE) {
+        m->spike = false;
+        motion_tap(m, ts_ns, ev, max, cnt);
+    }
+
+    slot = (m->shake_edge + IMU_SHAKE_COUNT - 1) % IMU_SHAKE_COUNT;
+    if (!m->shake_high && hp > IMU_SHAKE_THRESHOLD_G) {
+        m->shake_high = true;
+        slot = m->shake_edge % IMU_SHAKE_COUNT;
+        m->shake_edges[slot] = ts_ns;
+        m->shake_peaks[slot] = hp;
+        m->shake_edge++;
+    } else if (m->shake_high) {
+        if (hp > m->shake_peaks[slot])
+            m->shake_peaks[slot] = hp;
+        if (hp < IMU_SHAKE_THRESHOLD_G * MOTION_SPIKE_RELEASE) {
+            m->shake_high = false;
+            motion_shake(m, ts_ns, ev, max, cnt);
+        }
+    }
+
+    /* no second tap came */
+    if (m->tap_ns && !m->spike && ts_ns - m->tap_ns > IMU_TAP_DOUBLE_MS * NS_PER_MS) {
+        m->tap_ns = 0;
+        motion_emit(ev, max, cnt, ts_ns, IMU_MOTION_TAP, 1.0f);
+    }
+}
+
+/*
+ * Quadrant of the gravity direction in the device x/y plane, from the fused
+ * roll and pitch: steadier than the accelerometer while the device moves.
+ */
+static void motion_quadrant(struct imu_motion *m, uint64_t ts_ns, \
+                            const struct imu_angles *a, \
+                            struct imu_motion_event *ev, uint32_t max, uint32_t *cnt)
+{
+    float roll = DEG2RAD(a->roll), pitch = DEG2RAD(a->pitch);
+    float gx = -sinf(pitch), gy = sinf(roll) * cosf(pitch);
+    float dir, off;
+    int32_t q;
+
+    if (sqrtf(gx * gx + gy * gy) < sinf(DEG2RAD(IMU_QUADRANT_MIN_TILT_DEG)))
+        return;
+
+    dir = RAD2DEG(atan2f(gx, gy));
+    if (dir < 0.0f)
+        dir += 360.0f;
+    q = ((int32_t)lroundf(dir / 90.0f) % 4) * 90;
+    if (q == m->quadrant)
+        return;
+
+    if (m->quadrant >= 0) {
+        off = fabsf(dir - (float)m->quadrant);
+        if (off > 180.0f)
+            off = 360.0f - off;
+        if (off < 45.0f + IMU_QUADRANT_HYST_DEG)
+            return;
+    }
+
+    m->quadrant = q;
+    motion_emit(ev, max, cnt, ts_ns, IMU_MOTION_QUADRANT, (float)q);
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+void imu_motion_init(struct imu_motion *m)
+{
+    memset(m, 0, sizeof(*m));
+    m->quadrant = -1;
+    m->moving = -1;
+}
+
+uint32_t imu_motion_update(struct imu_motion *m, const struct imu_batch *b, \
+                           const struct imu_angles *angles, \
+                           struct imu_motion_event *ev, uint32_t max)
+{
+    float ax, ay, az, gx, gy, gz, mag, hp;
+    uint32_t cnt = 0;
+
+    for (uint32_t i = 0; i < b->n; i++) {
+        ax = b->accel[0][i];
+        ay = b->accel[1][i];
+        az = b->accel[2][i];
+        gx = b->gyro[0][i];
+        gy = b->gyro[1][i];
+        gz = b->gyro[2][i];
+        mag = sqrtf(ax * ax + ay * ay + az * az);
+
+        if (!m->started) {
+            m->started = true;
+            m->lp_mag = mag;
+            m->motion_ns = b->ts_ns[i];
+        }
+
+        hp = fabsf(mag - m->lp_mag);
+        m->lp_mag += motion_alpha(b->dt[i], MOTION_LP_TAU_S) * (mag - m->lp_mag);
+        m->act_accel += motion_alpha(b->dt[i], MOTION_ACT_TAU_S) * (hp - m->act_accel);
+        m->act_gyro += motion_alpha(b->dt[i], MOTION_ACT_TAU_S) * \
+                       (sqrtf(gx * gx + gy * gy + gz * gz) - m->act_gyro);
+
+        motion_spikes(m, b->ts_ns[i], hp, ev, max, &cnt);
+        motion_moving(m, b->ts_ns[i], ev, max, &cnt);
+    }
+
+    if (angles && b->n)
+        motion_quadrant(m, b->ts_ns[b->n - 1], angles, ev, max, &cnt);
+
+    return cnt;
+}
+
+const char *imu_motion_name(enum imu_motion_type type)
+{
+    if ((uint32_t)type >= IMU_MOTION_COUNT)
+        return "unknown";
+
+    return motion_names[type];
+}
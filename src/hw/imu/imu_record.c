@@ -0,0 +1,166 @@
+/**
+ * @file imu_record.c
+ *
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <hw/imu_record.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+/* stdio buffer of a recording: ~2 s of samples at 1 kHz */
+#define RECORD_BUF_SIZE                 (64 * 1024)
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+/* Counts come from sysfs or the scan decoder as floats holding integers */
+static int32_t raw_to_count(float v)
+{
+    if (v >= 2147483647.0f)
+        return INT32_MAX;
+    if (v <= -2147483648.0f)
+        return INT32_MIN;
+    return (int32_t)v;
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+int32_t imu_record_create(struct imu_record *r, const char *path, \
+                          uint32_t sample_hz, const struct imu_calib *calib)
+{
+    int32_t ret;
+
+    if (!r || !path || !calib)
+        return -EINVAL;
+
+    memset(r, 0, sizeof(*r));
+    r->fp = fopen(path, "wb");
+    if (!r->fp) {
+        ret = -errno;
+        LOG_ERROR("Cannot create IMU recording %s: %s", path, strerror(-ret));
+        return ret;
+    }
+    setvbuf(r->fp, NULL, _IOFBF, RECORD_BUF_SIZE);
+
+    memcpy(r->hdr.magic, IMU_RECORD_MAGIC, sizeof(r->hdr.magic));
+    r->hdr.version = IMU_RECORD_VERSION;
+    r->hdr.sample_hz = sample_hz;
+    r->hdr.calib = *calib;
+
+    if (fwrite(&r->hdr, sizeof(r->hdr), 1, r->fp) != 1) {
+        LOG_ERROR("Cannot write IMU recording %s", path);
+        fclose(r->fp);
+        r->fp = NULL;
+        return -EIO;
+    }
+
+    return 0;
+}
+
+int32_t imu_record_write(struct imu_record *r, const struct imu_batch *b)
+{
+    struct imu_record_sample s[IMU_BATCH_MAX];
+
+    if (!r || !r->fp || !b)
+        return -EINVAL;
+
+    for (uint32_t i = 0; i < b->n; i++) {
+        s[i].ts_ns = b->ts_ns[i];
+        for (int32_t k = 0; k < 6; k++)
+            s[i].raw[k] = raw_to_count(b->raw[k][i]);
+    }
+
+    if (fwrite(s, sizeof(s[0]), b->n, r->fp) != b->n)
+        return -EIO;
+
+    r->samples += b->n;
+    return 0;
+}
+
+int32_t imu_record_open(struct imu_record *r, const char *path)
+{
+    int32_t ret;
+
+    if (!r || !path)
+        return -EINVAL;
+
+    memset(r, 0, sizeof(*r));
+    r->fp = fopen(path, "rb");
+    if (!r->fp) {
+        ret = -errno;
+        LOG_ERROR("Cannot open IMU recording %s: %s", path, strerror(-ret));
+        return ret;
+    }
+    setvbuf(r->fp, NULL, _IOFBF, RECORD_BUF_SIZE);
+
+    if (fread(&r->hdr, sizeof(r->hdr), 1, r->fp) != 1 || \
+        memcmp(r->hdr.magic, IMU_RECORD_MAGIC, sizeof(r->hdr.magic)) || \
+        r->hdr.version != IMU_RECORD_VERSION || !r->hdr.sample_hz) {
+        LOG_ERROR("%s is not an IMU recording of version %d", path, IMU_RECORD_VERSION);
+        fclose(r->fp);
+        r->fp = NULL;
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+int32_t imu_record_read(struct imu_record *r, struct imu_batch *b, uint32_t max)
+{
+    struct imu_record_sample s[IMU_BATCH_MAX];
+    size_t n;
+
+    if (!r || !r->fp || !b)
+        return -EINVAL;
+    if (max > IMU_BATCH_MAX)
+        max = IMU_BATCH_MAX;
+
+    /* a truncated last sample, from a recorder killed mid-write, is dropped */
+    n = fread(s, sizeof(s[0]), max, r->fp);
+    for (uint32_t i = 0; i < n; i++) {
+        b->ts_ns[i] = s[i].ts_ns;
+        for (int32_t k = 0; k < 6; k++)
+            b->raw[k][i] = (float)s[i].raw[k];
+    }
+
+    b->n = (uint32_t)n;
+    r->samples += n;
+    return (int32_t)n;
+}
+
+void imu_record_close(struct imu_record *r)
+{
+    if (!r || !r->fp)
+        return;
+
+    fclose(r->fp);
+    r->fp = NULL;
+}
@@ -13,7 +13,7 @@
 #include <log.h>
 
 #include <string.h>
-#include "kalman.h"
+#include <hw/kalman.h>
 
 /*********************
  *      DEFINES
@@ -24,6 +24,7 @@
 
 #include <comm/dbus_comm.h>
 #include <comm/f_comm.h>
+#include <comm/capture.h>
 #include <comm/net/network.h>
 #include <sched/workqueue.h>
 #include <sched/task.h>
@@ -111,6 +112,7 @@ static int32_t main_loop()
         if (++cnt == 20) {
             cnt = 0;
             is_task_handler_idle();
+            capture_flush();
         }
     };
 
@@ -131,6 +133,9 @@ int32_t main(void)
         goto exit_error;
     }
 
+    // Before any listener, the capture must see every frame
+    capture_init();
+
     ret = pthread_create(&task_handler, NULL, main_task_handler, NULL);
     if (ret) {
         LOG_FATAL("Failed to create worker thread: %s", strerror(ret));
@@ -145,6 +150,8 @@ int32_t main(void)
     }
 
     create_local_simple_task(NON_BLOCK, ENDLESS, OP_START_DBUS);
+    create_local_simple_task(NON_BLOCK, ENDLESS, OP_START_PUBLISHER);
+    create_local_simple_task(NON_BLOCK, ENDLESS, OP_START_P2P);
     create_local_simple_task(NON_BLOCK, SHORT, OP_AUDIO_INIT);
 
     ret = network_manager_comm_init();
@@ -163,6 +170,7 @@ int32_t main(void)
     // TODO: release audio HW
     snd_sys_release();
     cleanup_event_file();
+    capture_deinit();
 
     LOG_INFO("|-------------> All services stopped. Safe exit <-------------|");
     return 0;
@@ -177,6 +185,7 @@ exit_workqueue:
     workqueue_stop();
     pthread_join(task_handler, NULL);
     cleanup_event_file();
+    capture_deinit();
 
 exit_error:
     return -1;
@@ -0,0 +1,261 @@
+/**
+ * @file codec_bench.c
+ *
+ * Frame codec micro-benchmark: encode and decode rates of a typical command
+ * frame and of the largest frame the decoder accepts.
+ *
+ *   sys-utils codec-bench [-n iterations]
+ *
+ * Encoding includes creating the message, as every sender has to. Decoding
+ * runs on a message that went through marshal/demarshal, like one read from
+ * the bus. Each frame is round-tripped and compared once before timing.
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <dbus/dbus.h>
+
+#include <comm/dbus_comm.h>
+#include <comm/frame_codec.h>
+#include <sched/clock.h>
+#include "sys_utils.h"
+
+/*********************
+ *      DEFINES
+ *********************/
+#define BENCH_DEFAULT_ITERATIONS        200000
+#define BENCH_MAX_STR_ENTRIES           8
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+static char max_keys[MAX_ENTRIES][8];
+static char max_strs[BENCH_MAX_STR_ENTRIES][CMD_STR_POOL_SIZE];
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+static DBusMessage *bench_new_msg(void)
+{
+    return dbus_message_new_method_call(SYS_MGR_DBUS_SER, \
+                                        SYS_MGR_DBUS_OBJ_PATH, \
+                                        SYS_MGR_DBUS_IFACE, \
+                                        SYS_MGR_DBUS_METH);
+}
+
+/*
+ * MAX_ENTRIES entries cycling through every value type, with the string
+ * values sized so that the frame fills the decoder's string pool.
+ */
+static void bench_max_frame(remote_cmd_t *cmd)
+{
+    const char *comp = "terminal-ui";
+    size_t used, str_len;
+    int32_t i, n_str = 0;
+
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->component_id = comp;
+    cmd->umid = 0x7fffffff;
+    cmd->opcode = OP_SET_BRIGHTNESS;
+    cmd->flow = NON_BLOCK;
+    cmd->duration = SHORT;
+    cmd->entry_count = MAX_ENTRIES;
+
+    used = strlen(comp) + 1;
+    for (i = 0; i < MAX_ENTRIES; i++) {
+        snprintf(max_keys[i], sizeof(max_keys[i]), "key-%02d", i);
+        used += strlen(max_keys[i]) + 1;
+        if (i % 4 == 0)
+            n_str++;
+    }
+    str_len = (CMD_STR_POOL_SIZE - used) / n_str - 1;
+
+    for (i = 0; i < MAX_ENTRIES; i++) {
+        payload_t *e = &cmd->entries[i];
+
+        e->key = max_keys[i];
+        switch (i % 4) {
+        case 0:
+            memset(max_strs[i / 4], 'a' + i / 4, str_len);
+            max_strs[i / 4][str_len] = '\0';
+            e->data_type = DBUS_TYPE_STRING;
+            e->value.str = max_strs[i / 4];
+            break;
+        case 1:
+            e->data_type = DBUS_TYPE_INT32;
+            e->value.i32 = -i;
+            break;
+        case 2:
+            e->data_type = DBUS_TYPE_UINT32;
+            e->value.u32 = i;
+            break;
+        default:
+            e->data_type = DBUS_TYPE_DOUBLE;
+            e->value.dbl = i * 0.5;
+            break;
+        }
+    }
+}
+
+/* Turn an outgoing message into one as it would be read from the socket */
+static DBusMessage *bench_wire_copy(DBusMessage *msg, int32_t *wire_len)
+{
+    DBusMessage *copy;
+    char *buf = NULL;
+    int32_t len;
+
+    dbus_message_set_serial(msg, 1);
+    if (!dbus_message_marshal(msg, &buf, &len))
+        return NULL;
+
+    copy = dbus_message_demarshal(buf, len, NULL);
+    dbus_free(buf);
+    *wire_len = len;
+    return copy;
+}
+
+static int32_t bench_compare(const remote_cmd_t *a, const remote_cmd_t *b)
+{
+    if (strcmp(a->component_id, b->component_id) || a->umid != b->umid || \
+        a->opcode != b->opcode || a->flow != b->flow || \
+        a->duration != b->duration || a->entry_count != b->entry_count || \
+        b->version != FRAME_PROTO_VERSION)
+        return -1;
+
+    for (uint32_t i = 0; i < a->entry_count; i++) {
+        const payload_t *x = &a->entries[i], *y = &b->entries[i];
+
+        if (strcmp(x->key, y->key) || x->data_type != y->data_type)
+            return -1;
+        if (x->data_type == DBUS_TYPE_STRING ? \
+            strcmp(x->value.str, y->value.str) != 0 : \
+            x->data_type == DBUS_TYPE_DOUBLE ? \
+            x->value.dbl != y->value.dbl : x->value.u32 != y->value.u32)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int32_t bench_frame(const char *name, const remote_cmd_t *cmd, \
+                           int32_t iterations, remote_cmd_t *out)
+{
+    DBusMessage *msg, *wire;
+    uint64_t start, enc_ns, dec_ns;
+    int32_t i, wire_len = 0;
+
+    msg = bench_new_msg();
+    if (!msg || frame_encode(msg, cmd)) {
+        LOG_ERROR("%s: encode failed", name);
+        if (msg)
+            dbus_message_unref(msg);
+        return -1;
+    }
+
+    wire = bench_wire_copy(msg, &wire_len);
+    dbus_message_unref(msg);
+    if (!wire || frame_decode(wire, out) || bench_compare(cmd, out)) {
+        LOG_ERROR("%s: round trip mismatch", name);
+        if (wire)
+            dbus_message_unref(wire);
+        return -1;
+    }
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        msg = bench_new_msg();
+        if (!msg || frame_encode(msg, cmd))
+            break;
+        dbus_message_unref(msg);
+    }
+    enc_ns = now_ns() - start;
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        if (frame_decode(wire, out))
+            break;
+    }
+    dec_ns = now_ns() - start;
+    dbus_message_unref(wire);
+
+    printf("%-8s %2u entries %5d bytes | encode %9.0f frames/s %7.0f ns | " \
+           "decode %9.0f frames/s %7.0f ns\n", name, cmd->entry_count, \
+           wire_len, iterations * 1e9 / enc_ns, (double)enc_ns / iterations, \
+           iterations * 1e9 / dec_ns, (double)dec_ns / iterations);
+    return 0;
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+int32_t run_codec_bench(int32_t argc, char **argv)
+{
+    remote_cmd_t typical, *max, *out;
+    int32_t opt, iterations = BENCH_DEFAULT_ITERATIONS, ret = 0;
+
+    while ((opt = getopt(argc, argv, "n:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            printf("Usage: sys-utils codec-bench [-n iterations]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (iterations <= 0)
+        iterations = BENCH_DEFAULT_ITERATIONS;
+
+    max = calloc(1, sizeof(*max));
+    out = calloc(1, sizeof(*out));
+    if (!max || !out) {
+        free(max);
+        free(out);
+        return EXIT_FAILURE;
+    }
+
+    printf("frame protocol v%d, %d iterations\n", FRAME_PROTO_VERSION, \
+           iterations);
+
+    memset(&typical, 0, sizeof(typical));
+    create_method_frame(&typical);
+    ret |= bench_frame("typical", &typical, iterations, out);
+
+    bench_max_frame(max);
+    ret |= bench_frame("maximal", max, iterations, out);
+
+    free(max);
+    free(out);
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
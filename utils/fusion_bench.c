@@ -0,0 +1,526 @@
+/**
+ * @file fusion_bench.c
+ *
+ * IMU fusion benchmark: cost per sample and accuracy of every engine of
+ * imu_fusion.h over the same data.
+ *
+ *   sys-utils fusion-bench [-r hz] [-t seconds] [-n passes] [recording]
+ *
+ * Without a recording the data is a synthetic motion (roll, pitch and yaw
+ * swings with linear acceleration bursts, sensor noise and residual gyro
+ * bias) whose true angles are known. A recording is a file of struct
+ * imu_sample written by "sys-utils stream count file"; the engines are then
+ * compared with the angles sys-mgr computed when it was recorded.
+ *
+ * "update" is the fusion step alone, what the IMU loop pays per sample.
+ * "+angles" adds deriving the angles after every step.
+ *
+ * The pipeline table runs the whole IMU path from raw counts to a published
+ * attitude: once per sample ("single", scalar calibration and a publish per
+ * sample), then over batches of IMU_BATCH_MAX samples as imu_fuse_batch
+ * does ("batch"). "diff" is the largest angle difference between the two.
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include <hw/imu.h>
+#include <hw/imu_batch.h>
+#include <hw/imu_fusion.h>
+#include <sched/clock.h>
+#include "sys_utils.h"
+
+/*********************
+ *      DEFINES
+ *********************/
+#define FUSION_BENCH_DEFAULT_HZ         200
+#define FUSION_BENCH_DEFAULT_SECONDS    120
+#define FUSION_BENCH_DEFAULT_PASSES     20
+#define FUSION_BENCH_MAX_SAMPLES        (10 * 1000 * 1000)
+
+/* Synthetic sensor errors, after calibration */
+#define SYNTH_ACCEL_NOISE_G             0.01f
+#define SYNTH_GYRO_NOISE_DPS            0.15f
+#define SYNTH_BURST_PERIOD_S            10.0
+#define SYNTH_BURST_LEN_S               1.0
+#define SYNTH_BURST_G                   0.3
+
+/* Sensor the pipeline counts are generated for: LSB per g and per deg/s */
+#define PIPE_ACCEL_LSB                  4096.0f
+#define PIPE_GYRO_LSB                   16.4f
+#define PIPE_AXES                       6
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/**********************
+ *      MACROS
+ **********************/
+#define DEG2RAD(d) ((d) * M_PI / 180.0)
+#define RAD2DEG(r) ((r) * 180.0 / M_PI)
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+struct bench_trace {
+    struct imu_sample *s;       /* angles: truth or recorded reference */
+    float *dt;                  /* seconds since the previous sample */
+    uint32_t n;
+    int32_t hz;
+    int32_t synthetic;
+};
+
+struct bench_errors {
+    double sum2[3];
+    double tilt_max;
+};
+
+/* The trace as raw counts, and the calibration that turns them back */
+struct bench_pipe {
+    struct imu_calib calib;
+    float *raw[PIPE_AXES];
+};
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+/* Where the pipeline publishes, as the IMU loop does for its readers */
+static volatile struct imu_attitude pipe_published;
+
+/* Sensor mounted rotated by 90 degrees around Z, with a residual offset */
+static const float pipe_mount[9] = {
+    0.0f, -1.0f, 0.0f,
+    1.0f,  0.0f, 0.0f,
+    0.0f,  0.0f, 1.0f,
+};
+static const float pipe_accel_off[3] = { 0.02f, -0.01f, 0.03f };
+static const float pipe_gyro_off[3] = { 0.5f, -0.3f, 0.2f };
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+/* Deterministic noise, the same trace on every run */
+static double rng_uniform(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return ((rng_state >> 11) + 0.5) / (double)(1ULL << 53);
+}
+
+static float rng_gauss(float sigma)
+{
+    return (float)(sigma * sqrt(-2.0 * log(rng_uniform())) * \
+                   cos(2.0 * M_PI * rng_uniform()));
+}
+
+/*
+ * Angle swings of different periods, each angle a * sin(w t + p), with
+ * their derivatives to turn them into body rates.
+ */
+static void synth_angles(double t, double e[3], double de[3])
+{
+    static const double amp[3] = { 35.0, 25.0, 90.0 };
+    static const double hz[3] = { 0.25, 0.17, 0.05 };
+    static const double phase[3] = { 0.0, 0.7, 0.3 };
+
+    for (int32_t i = 0; i < 3; i++) {
+        double w = 2.0 * M_PI * hz[i];
+
+        e[i] = amp[i] * sin(w * t + phase[i]);
+        de[i] = amp[i] * w * cos(w * t + phase[i]);
+    }
+}
+
+static int32_t synth_trace(struct bench_trace *tr, int32_t hz, int32_t seconds)
+{
+    static const float gyro_bias[3] = { 0.2f, -0.15f, 0.1f };
+    double e[3], de[3], sr, cr, sp, cp, t, burst;
+    struct imu_sample *s;
+
+    tr->n = (uint32_t)hz * (uint32_t)seconds;
+    tr->hz = hz;
+    tr->synthetic = 1;
+    tr->s = calloc(tr->n, sizeof(*tr->s));
+    if (!tr->s)
+        return -ENOMEM;
+
+    for (uint32_t i = 0; i < tr->n; i++) {
+        s = &tr->s[i];
+        t = (double)i / hz;
+        synth_angles(t, e, de);
+        sr = sin(DEG2RAD(e[0])); cr = cos(DEG2RAD(e[0]));
+        sp = sin(DEG2RAD(e[1])); cp = cos(DEG2RAD(e[1]));
+
+        /* gravity seen by the sensor, plus linear acceleration bursts */
+        burst = fmod(t, SYNTH_BURST_PERIOD_S) < SYNTH_BURST_LEN_S ? \
+                SYNTH_BURST_G * sin(2.0 * M_PI * 3.0 * t) : 0.0;
+        s->accel[0] = (float)(-sp + burst) + rng_gauss(SYNTH_ACCEL_NOISE_G);
+        s->accel[1] = (float)(cp * sr - burst) + rng_gauss(SYNTH_ACCEL_NOISE_G);
+        s->accel[2] = (float)(cp * cr) + rng_gauss(SYNTH_ACCEL_NOISE_G);
+
+        /* body rates (deg/s) of the ZYX angles */
+        s->gyro[0] = (float)(de[0] - de[2] * sp);
+        s->gyro[1] = (float)(de[1] * cr + de[2] * cp * sr);
+        s->gyro[2] = (float)(-de[1] * sr + de[2] * cp * cr);
+        for (int32_t k = 0; k < 3; k++)
+            s->gyro[k] += gyro_bias[k] + rng_gauss(SYNTH_GYRO_NOISE_DPS);
+
+        s->ts_ns = (uint64_t)(t * 1e9);
+        s->angles.roll = (float)e[0];
+        s->angles.pitch = (float)e[1];
+        s->angles.yaw = (float)e[2];
+    }
+
+    return 0;
+}
+
+static int32_t load_trace(struct bench_trace *tr, const char *path)
+{
+    struct stat st;
+    FILE *fp;
+    uint64_t span;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        LOG_ERROR("Cannot open %s: %s", path, strerror(errno));
+        return -ENOENT;
+    }
+    if (fstat(fileno(fp), &st)) {
+        fclose(fp);
+        return -EIO;
+    }
+
+    tr->n = (uint32_t)(st.st_size / sizeof(struct imu_sample));
+    if (tr->n < 2 || tr->n > FUSION_BENCH_MAX_SAMPLES || \
+        st.st_size % sizeof(struct imu_sample)) {
+        LOG_ERROR("%s is not a sample recording", path);
+        fclose(fp);
+        return -EINVAL;
+    }
+
+    tr->s = malloc(tr->n * sizeof(*tr->s));
+    if (!tr->s || fread(tr->s, sizeof(*tr->s), tr->n, fp) != tr->n) {
+        LOG_ERROR("Cannot read %s", path);
+        fclose(fp);
+        return -EIO;
+    }
+    fclose(fp);
+
+    span = tr->s[tr->n - 1].ts_ns - tr->s[0].ts_ns;
+    tr->hz = span ? (int32_t)llround((tr->n - 1) * 1e9 / span) : 0;
+    tr->synthetic = 0;
+    if (tr->hz <= 0) {
+        LOG_ERROR("%s has no usable timestamps", path);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Step lengths as the IMU loop derives them, out of the timed loops */
+static int32_t trace_dt(struct bench_trace *tr)
+{
+    float dt;
+
+    tr->dt = malloc(tr->n * sizeof(*tr->dt));
+    if (!tr->dt)
+        return -ENOMEM;
+
+    for (uint32_t i = 0; i < tr->n; i++) {
+        dt = i ? (float)((tr->s[i].ts_ns - tr->s[i - 1].ts_ns) / 1e9) : 0.0f;
+        if (dt <= 0.0f || dt > 1.0f)
+            dt = 1.0f / (float)tr->hz;
+        tr->dt[i] = dt;
+    }
+
+    return 0;
+}
+
+static void bench_reset(struct imu_fusion *f, const struct bench_trace *tr)
+{
+    const struct imu_angles *a = &tr->s[0].angles;
+
+    imu_fusion_reset(f, a->roll, a->pitch, a->yaw);
+}
+
+static double wrap_deg(double d)
+{
+    d = fmod(d + 180.0, 360.0);
+    if (d < 0.0)
+        d += 360.0;
+    return d - 180.0;
+}
+
+static void bench_engine(enum imu_fusion_type type, const struct bench_trace *tr, \
+                         int32_t passes)
+{
+    struct imu_fusion f;
+    struct imu_angles a = { 0.0f, 0.0f, 0.0f };
+    struct bench_errors err;
+    const struct imu_angles *ref;
+    uint64_t start, update_ns, angles_ns;
+    double d[3], tilt;
+    volatile float sink = 0.0f;
+
+    imu_fusion_init(&f, type, NULL);
+
+    /* update alone */
+    start = now_ns();
+    for (int32_t p = 0; p < passes; p++) {
+        bench_reset(&f, tr);
+        for (uint32_t i = 0; i < tr->n; i++)
+            imu_fusion_update(&f, tr->s[i].accel, tr->s[i].gyro, tr->dt[i]);
+        sink += f.att.q[0] + f.att.angles.roll;
+    }
+    update_ns = now_ns() - start;
+
+    /* update and angles, the last pass also scores them */
+    start = now_ns();
+    for (int32_t p = 0; p < passes; p++) {
+        bench_reset(&f, tr);
+        memset(&err, 0, sizeof(err));
+        for (uint32_t i = 0; i < tr->n; i++) {
+            imu_fusion_update(&f, tr->s[i].accel, tr->s[i].gyro, tr->dt[i]);
+            a = imu_fusion_angles(&f);
+            if (p != passes - 1)
+                continue;
+
+            ref = &tr->s[i].angles;
+            d[0] = wrap_deg(a.roll - ref->roll);
+            d[1] = wrap_deg(a.pitch - ref->pitch);
+            d[2] = wrap_deg(a.yaw - ref->yaw);
+            for (int32_t k = 0; k < 3; k++)
+                err.sum2[k] += d[k] * d[k];
+            tilt = sqrt(d[0] * d[0] + d[1] * d[1]);
+            if (tilt > err.tilt_max)
+                err.tilt_max = tilt;
+        }
+        sink += a.roll;
+    }
+    angles_ns = now_ns() - start;
+    (void)sink;
+
+    printf("%-9s %9.1f %9.1f %9.3f %9.3f %9.3f %9.3f\n", imu_fusion_name(type),
+           (double)update_ns / passes / tr->n, (double)angles_ns / passes / tr->n,
+           sqrt(err.sum2[0] / tr->n), sqrt(err.sum2[1] / tr->n),
+           err.tilt_max, sqrt(err.sum2[2] / tr->n));
+}
+
+/*
+ * Raw counts the trace would have been read as: offsets added back, the
+ * mount rotation undone (its transpose) and the units scaled to LSB.
+ */
+static int32_t pipe_init(struct bench_pipe *pp, const struct bench_trace *tr)
+{
+    float v[3];
+
+    for (int32_t i = 0; i < 9; i++) {
+        pp->calib.accel_m[i] = pipe_mount[i] / PIPE_ACCEL_LSB;
+        pp->calib.gyro_m[i] = pipe_mount[i] / PIPE_GYRO_LSB;
+    }
+    memcpy(pp->calib.accel_off, pipe_accel_off, sizeof(pipe_accel_off));
+    memcpy(pp->calib.gyro_off, pipe_gyro_off, sizeof(pipe_gyro_off));
+
+    for (int32_t k = 0; k < PIPE_AXES; k++) {
+        pp->raw[k] = malloc(tr->n * sizeof(float));
+        if (!pp->raw[k])
+            return -ENOMEM;
+    }
+
+    for (uint32_t i = 0; i < tr->n; i++) {
+        for (int32_t k = 0; k < 3; k++)
+            v[k] = tr->s[i].accel[k] + pipe_accel_off[k];
+        for (int32_t k = 0; k < 3; k++)
+            pp->raw[k][i] = roundf((pipe_mount[k] * v[0] + pipe_mount[3 + k] * v[1] + \
+                                    pipe_mount[6 + k] * v[2]) * PIPE_ACCEL_LSB);
+
+        for (int32_t k = 0; k < 3; k++)
+            v[k] = tr->s[i].gyro[k] + pipe_gyro_off[k];
+        for (int32_t k = 0; k < 3; k++)
+            pp->raw[3 + k][i] = roundf((pipe_mount[k] * v[0] + pipe_mount[3 + k] * v[1] + \
+                                        pipe_mount[6 + k] * v[2]) * PIPE_GYRO_LSB);
+    }
+
+    return 0;
+}
+
+static void pipe_free(struct bench_pipe *pp)
+{
+    for (int32_t k = 0; k < PIPE_AXES; k++)
+        free(pp->raw[k]);
+}
+
+/* One sample at a time, the way the IMU loop fused before batching */
+static void pipe_single(struct imu_fusion *f, const struct bench_pipe *pp, \
+                        const struct bench_trace *tr)
+{
+    const struct imu_calib *c = &pp->calib;
+    float a[3], g[3], r[PIPE_AXES];
+
+    for (uint32_t i = 0; i < tr->n; i++) {
+        for (int32_t k = 0; k < PIPE_AXES; k++)
+            r[k] = pp->raw[k][i];
+
+        for (int32_t k = 0; k < 3; k++) {
+            a[k] = c->accel_m[k * 3] * r[0] + c->accel_m[k * 3 + 1] * r[1] + \
+                   c->accel_m[k * 3 + 2] * r[2] - c->accel_off[k];
+            g[k] = c->gyro_m[k * 3] * r[3] + c->gyro_m[k * 3 + 1] * r[4] + \
+                   c->gyro_m[k * 3 + 2] * r[5] - c->gyro_off[k];
+            if (fabsf(g[k]) > IMU_GYRO_CLAMP_DPS)
+                g[k] = copysignf(IMU_GYRO_CLAMP_DPS, g[k]);
+        }
+
+        imu_fusion_update(f, a, g, tr->dt[i]);
+        pipe_published = f->att;
+    }
+}
+
+/* Batches of IMU_BATCH_MAX, calibrated together, published once */
+static void pipe_batch(struct imu_fusion *f, const struct bench_pipe *pp, \
+                       const struct bench_trace *tr, struct imu_batch *b)
+{
+    const float *const a[3] = { b->accel[0], b->accel[1], b->accel[2] };
+    const float *const g[3] = { b->gyro[0], b->gyro[1], b->gyro[2] };
+
+    for (uint32_t i = 0; i < tr->n; i += b->n) {
+        b->n = tr->n - i < IMU_BATCH_MAX ? tr->n - i : IMU_BATCH_MAX;
+        for (int32_t k = 0; k < PIPE_AXES; k++)
+            memcpy(b->raw[k], &pp->raw[k][i], b->n * sizeof(float));
+        memcpy(b->dt, &tr->dt[i], b->n * sizeof(float));
+
+        imu_calib_apply(&pp->calib, b);
+        imu_fusion_update_batch(f, a, g, b->dt, b->n, NULL);
+        pipe_published = f->att;
+    }
+}
+
+static void bench_pipeline(enum imu_fusion_type type, const struct bench_trace *tr, \
+                           const struct bench_pipe *pp, int32_t passes)
+{
+    struct imu_fusion f;
+    struct imu_batch b;
+    struct imu_angles single, batch;
+    uint64_t start, single_ns, batch_ns;
+    double diff;
+
+    imu_fusion_init(&f, type, NULL);
+
+    start = now_ns();
+    for (int32_t p = 0; p < passes; p++) {
+        bench_reset(&f, tr);
+        pipe_single(&f, pp, tr);
+    }
+    single_ns = now_ns() - start;
+    single = imu_fusion_angles(&f);
+
+    start = now_ns();
+    for (int32_t p = 0; p < passes; p++) {
+        bench_reset(&f, tr);
+        pipe_batch(&f, pp, tr, &b);
+    }
+    batch_ns = now_ns() - start;
+    batch = imu_fusion_angles(&f);
+
+    diff = fabs(wrap_deg(single.roll - batch.roll));
+    diff = fmax(diff, fabs(wrap_deg(single.pitch - batch.pitch)));
+    diff = fmax(diff, fabs(wrap_deg(single.yaw - batch.yaw)));
+
+    printf("%-9s %9.1f %9.1f %8.2fx %9.4f\n", imu_fusion_name(type),
+           (double)single_ns / passes / tr->n, (double)batch_ns / passes / tr->n,
+           (double)single_ns / batch_ns, diff);
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+int32_t run_fusion_bench(int32_t argc, char **argv)
+{
+    struct bench_trace tr;
+    struct bench_pipe pp;
+    int32_t opt, hz = FUSION_BENCH_DEFAULT_HZ, seconds = FUSION_BENCH_DEFAULT_SECONDS;
+    int32_t passes = FUSION_BENCH_DEFAULT_PASSES, ret;
+
+    while ((opt = getopt(argc, argv, "r:t:n:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            hz = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'n':
+            passes = atoi(optarg);
+            break;
+        default:
+            printf("Usage: sys-utils fusion-bench [-r hz] [-t seconds] " \
+                   "[-n passes] [recording]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (hz <= 0 || seconds <= 0 || passes <= 0 || \
+        (uint64_t)hz * seconds > FUSION_BENCH_MAX_SAMPLES) {
+        LOG_ERROR("Invalid rate, duration or passes");
+        return EXIT_FAILURE;
+    }
+
+    memset(&tr, 0, sizeof(tr));
+    memset(&pp, 0, sizeof(pp));
+    if (optind < argc)
+        ret = load_trace(&tr, argv[optind]);
+    else
+        ret = synth_trace(&tr, hz, seconds);
+    if (!ret)
+        ret = trace_dt(&tr);
+    if (ret) {
+        free(tr.s);
+        free(tr.dt);
+        return EXIT_FAILURE;
+    }
+
+    if (tr.synthetic)
+        printf("synthetic motion, %u samples at %d Hz, errors against the true angles\n",
+               tr.n, tr.hz);
+    else
+        printf("%s, %u samples at %d Hz, errors against the recorded angles\n",
+               argv[optind], tr.n, tr.hz);
+    printf("%d passes, ns per sample, errors in degrees\n", passes);
+    printf("%-9s %9s %9s %9s %9s %9s %9s\n", "engine", "update", "+angles",
+           "roll rms", "pitch rms", "tilt max", "yaw rms");
+
+    for (int32_t type = 0; type < IMU_FUSION_COUNT; type++)
+        bench_engine((enum imu_fusion_type)type, &tr, passes);
+
+    ret = pipe_init(&pp, &tr);
+    if (!ret) {
+        printf("\npipeline from raw counts, ns per sample, %s calibration, " \
+               "batches of %d\n", imu_calib_simd(), IMU_BATCH_MAX);
+        printf("%-9s %9s %9s %9s %9s\n", "engine", "single", "batch", "speedup", "diff");
+        for (int32_t type = 0; type < IMU_FUSION_COUNT; type++)
+            bench_pipeline((enum imu_fusion_type)type, &tr, &pp, passes);
+    }
+
+    pipe_free(&pp);
+    free(tr.s);
+    free(tr.dt);
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
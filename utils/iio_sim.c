@@ -0,0 +1,392 @@
+/**
+ * @file iio_sim.c
+ *
+ * Synthetic IIO sysfs tree: an mpu6500 IMU and an opt3001 ALS as
+ * directories of attribute files, the raw channels driven by a motion
+ * model, so the IMU and ALS pipelines run without the hardware.
+ *
+ *   sys-utils iio-sim [-r hz] [-t seconds] [-s settle] dir
+ *
+ * Creates dir/iio:device0 (IMU) and dir/iio:device1 (ALS), then updates
+ * them at hz until the duration ends (0, the default: until interrupted).
+ * Point sys-mgr at the tree with SYS_MGR_IIO_BASE=dir. There is no device
+ * node, so the IMU is sampled by sysfs polling.
+ *
+ * The IMU lies level and still for the settle time, for the start
+ * calibration, then swings in roll, pitch and yaw. Its mount matrix turns
+ * the chip 90 degrees about z, the raw counts are in the chip frame. The
+ * true angles are printed once per second.
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include <comm/f_comm.h>
+#include <hw/common.h>
+#include <sched/clock.h>
+#include "sys_utils.h"
+
+/*********************
+ *      DEFINES
+ *********************/
+#define IIO_SIM_DEFAULT_HZ              200
+#define IIO_SIM_MAX_HZ                  1000
+#define IIO_SIM_DEFAULT_SETTLE_S        3
+
+/* mpu6500 at +-2 g and +-250 deg/s: m/s^2 and rad/s per LSB */
+#define SIM_ACCEL_SCALE                 0.000598550
+#define SIM_GYRO_SCALE                  0.000133231
+#define SIM_GRAVITY                     9.80665
+/* Chip x along the board -y, chip y along the board x */
+#define SIM_MOUNT_MATRIX                "0, 1, 0; -1, 0, 0; 0, 0, 1"
+
+/* Sensor errors, in g and deg/s */
+#define SIM_ACCEL_NOISE_G               0.004
+#define SIM_GYRO_NOISE_DPS              0.05
+
+/* Illuminance: a slow swing around an office level */
+#define SIM_LUX_BASE                    300.0
+#define SIM_LUX_SWING                   250.0
+#define SIM_LUX_PERIOD_S                20.0
+
+#define SIM_PATH_MAX                    256
+#define SIM_AXES                        6
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/**********************
+ *      MACROS
+ **********************/
+#define DEG2RAD(d) ((d) * M_PI / 180.0)
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+struct sim_attr {
+    const char *name;
+    const char *value;
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+static const char *raw_names[SIM_AXES] = {
+    "in_accel_x_raw", "in_accel_y_raw", "in_accel_z_raw",
+    "in_anglvel_x_raw", "in_anglvel_y_raw", "in_anglvel_z_raw",
+};
+
+static volatile sig_atomic_t sim_run = 1;
+static uint64_t rng_state = 0x2545f4914f6cdd1dULL;
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+static void sim_stop(int sig)
+{
+    (void)sig;
+    sim_run = 0;
+}
+
+static double rng_uniform(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return ((rng_state >> 11) + 0.5) / (double)(1ULL << 53);
+}
+
+static double rng_gauss(double sigma)
+{
+    return sigma * sqrt(-2.0 * log(rng_uniform())) * cos(2.0 * M_PI * rng_uniform());
+}
+
+static int32_t sim_write_attr(const char *dir, const char *name, const char *value)
+{
+    char path[SIM_PATH_MAX];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fp = fopen(path, "w");
+    if (!fp) {
+        LOG_ERROR("Cannot create %s: %s", path, strerror(errno));
+        return -errno;
+    }
+
+    fprintf(fp, "%s\n", value);
+    fclose(fp);
+    return 0;
+}
+
+static int32_t sim_make_device(const char *dir, const struct sim_attr *attrs, \
+                               uint32_t count)
+{
+    int32_t ret;
+
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        LOG_ERROR("Cannot create %s: %s", dir, strerror(errno));
+        return -errno;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        ret = sim_write_attr(dir, attrs[i].name, attrs[i].value);
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Values are rewritten in place at a fixed width: the readers keep their
+ * fds open and pread at offset 0, they must never see a shorter file.
+ */
+static void sim_set(int32_t fd, const char *value, size_t len)
+{
+    if (pwrite(fd, value, len, 0) != (ssize_t)len)
+        LOG_WARN("Attribute update failed: %s", strerror(errno));
+}
+
+static void sim_set_raw(int32_t fd, double v)
+{
+    char buf[16];
+    int32_t count;
+
+    /* the chip saturates at its 16 bit range */
+    if (v > INT16_MAX)
+        v = INT16_MAX;
+    if (v < INT16_MIN)
+        v = INT16_MIN;
+    count = (int32_t)lround(v);
+
+    sim_set(fd, buf, (size_t)snprintf(buf, sizeof(buf), "%+07d\n", count));
+}
+
+static int32_t sim_open(const char *dir, const char *name)
+{
+    char path[SIM_PATH_MAX];
+    int32_t fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        LOG_ERROR("Cannot open %s: %s", path, strerror(errno));
+    return fd;
+}
+
+/*
+ * Angle swings of different periods after the settle time, each angle
+ * a * sin(w t + p), with their derivatives to turn them into body rates.
+ */
+static void sim_angles(double t, double e[3], double de[3])
+{
+    static const double amp[3] = { 30.0, 20.0, 60.0 };
+    static const double hz[3] = { 0.2, 0.13, 0.05 };
+    static const double phase[3] = { 0.0, 0.0, 0.0 };
+
+    for (int32_t i = 0; i < 3; i++) {
+        double w = 2.0 * M_PI * hz[i];
+
+        e[i] = t > 0.0 ? amp[i] * sin(w * t + phase[i]) : 0.0;
+        de[i] = t > 0.0 ? amp[i] * w * cos(w * t + phase[i]) : 0.0;
+    }
+}
+
+/* Raw counts of the chip at time t (board frame angles e, rates de) */
+static void sim_imu_counts(const double e[3], const double de[3], double raw[SIM_AXES])
+{
+    double sr = sin(DEG2RAD(e[0])), cr = cos(DEG2RAD(e[0]));
+    double sp = sin(DEG2RAD(e[1])), cp = cos(DEG2RAD(e[1]));
+    double a[3], g[3];
+
+    /* gravity seen by the board (g), body rates of the ZYX angles (deg/s) */
+    a[0] = -sp + rng_gauss(SIM_ACCEL_NOISE_G);
+    a[1] = cp * sr + rng_gauss(SIM_ACCEL_NOISE_G);
+    a[2] = cp * cr + rng_gauss(SIM_ACCEL_NOISE_G);
+    g[0] = de[0] - de[2] * sp + rng_gauss(SIM_GYRO_NOISE_DPS);
+    g[1] = de[1] * cr + de[2] * cp * sr + rng_gauss(SIM_GYRO_NOISE_DPS);
+    g[2] = -de[1] * sr + de[2] * cp * cr + rng_gauss(SIM_GYRO_NOISE_DPS);
+
+    /*
+     * board = M * chip with M = SIM_MOUNT_MATRIX, so chip = M^T * board:
+     * chip x = -board y, chip y = board x
+     */
+    raw[0] = -a[1] * SIM_GRAVITY / SIM_ACCEL_SCALE;
+    raw[1] = a[0] * SIM_GRAVITY / SIM_ACCEL_SCALE;
+    raw[2] = a[2] * SIM_GRAVITY / SIM_ACCEL_SCALE;
+    raw[3] = -DEG2RAD(g[1]) / SIM_GYRO_SCALE;
+    raw[4] = DEG2RAD(g[0]) / SIM_GYRO_SCALE;
+    raw[5] = DEG2RAD(g[2]) / SIM_GYRO_SCALE;
+}
+
+static int32_t sim_create(const char *dir, char *imu_dir, char *als_dir, int32_t hz)
+{
+    char hz_str[16], scale[2][16];
+    int32_t ret;
+    const struct sim_attr imu_attrs[] = {
+        { IIO_DEV_NAME_FILE, IMU_SENSOR_NAME },
+        { "sampling_frequency", hz_str },
+        { "in_accel_scale", scale[0] },
+        { "in_anglvel_scale", scale[1] },
+        { "in_accel_mount_matrix", SIM_MOUNT_MATRIX },
+        { "in_anglvel_mount_matrix", SIM_MOUNT_MATRIX },
+        { "in_accel_x_raw", "+000000" },
+        { "in_accel_y_raw", "+000000" },
+        { "in_accel_z_raw", "+000000" },
+        { "in_anglvel_x_raw", "+000000" },
+        { "in_anglvel_y_raw", "+000000" },
+        { "in_anglvel_z_raw", "+000000" },
+    };
+    const struct sim_attr als_attrs[] = {
+        { IIO_DEV_NAME_FILE, ALS_SENSOR_NAME },
+        { "in_illuminance_integration_time", "0.800000" },
+        { "in_illuminance_input", "00000.00" },
+    };
+
+    snprintf(hz_str, sizeof(hz_str), "%d", hz);
+    snprintf(scale[0], sizeof(scale[0]), "%.9f", SIM_ACCEL_SCALE);
+    snprintf(scale[1], sizeof(scale[1]), "%.9f", SIM_GYRO_SCALE);
+
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        LOG_ERROR("Cannot create %s: %s", dir, strerror(errno));
+        return -errno;
+    }
+
+    snprintf(imu_dir, SIM_PATH_MAX, "%s/iio:device0", dir);
+    snprintf(als_dir, SIM_PATH_MAX, "%s/iio:device1", dir);
+
+    ret = sim_make_device(imu_dir, imu_attrs, sizeof(imu_attrs) / sizeof(imu_attrs[0]));
+    if (!ret)
+        ret = sim_make_device(als_dir, als_attrs, sizeof(als_attrs) / sizeof(als_attrs[0]));
+    return ret;
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+int32_t run_iio_sim(int32_t argc, char **argv)
+{
+    char imu_dir[SIM_PATH_MAX], als_dir[SIM_PATH_MAX], buf[16];
+    int32_t opt, hz = IIO_SIM_DEFAULT_HZ, seconds = 0, settle = IIO_SIM_DEFAULT_SETTLE_S;
+    int32_t raw_fds[SIM_AXES], lux_fd, ret = 0;
+    double raw[SIM_AXES], e[3], de[3], t;
+    uint64_t start, period, next_print = 0;
+    struct timespec deadline;
+    uint64_t dl;
+
+    while ((opt = getopt(argc, argv, "r:t:s:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            hz = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 's':
+            settle = atoi(optarg);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        printf("Usage: sys-utils iio-sim [-r hz] [-t seconds] [-s settle] dir\n");
+        return EXIT_FAILURE;
+    }
+    if (hz <= 0 || hz > IIO_SIM_MAX_HZ || seconds < 0 || settle < 0) {
+        LOG_ERROR("Invalid rate, duration or settle time");
+        return EXIT_FAILURE;
+    }
+
+    if (sim_create(argv[optind], imu_dir, als_dir, hz))
+        return EXIT_FAILURE;
+
+    for (int32_t i = 0; i < SIM_AXES; i++)
+        raw_fds[i] = sim_open(imu_dir, raw_names[i]);
+    lux_fd = sim_open(als_dir, "in_illuminance_input");
+
+    for (int32_t i = 0; i < SIM_AXES; i++) {
+        if (raw_fds[i] < 0)
+            ret = -ENOENT;
+    }
+    if (lux_fd < 0)
+        ret = -ENOENT;
+    if (ret)
+        goto out;
+
+    signal(SIGINT, sim_stop);
+    signal(SIGTERM, sim_stop);
+
+    printf("IIO tree in %s: %s at %d Hz, %s; run sys-mgr with %s=%s\n",
+           argv[optind], IMU_SENSOR_NAME, hz, ALS_SENSOR_NAME,
+           IIO_DEV_SYSFS_PATH_ENV, argv[optind]);
+    fflush(stdout);
+
+    period = 1000000000ULL / (uint64_t)hz;
+    start = now_ns();
+    for (uint64_t i = 0; sim_run; i++) {
+        dl = start + i * period;
+        t = (double)(dl - start) / 1e9;
+        if (seconds && t >= seconds)
+            break;
+
+        deadline.tv_sec = (time_t)(dl / 1000000000ULL);
+        deadline.tv_nsec = (long)(dl % 1000000000ULL);
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL))
+            continue;
+
+        sim_angles(t - settle, e, de);
+        sim_imu_counts(e, de, raw);
+        for (int32_t k = 0; k < SIM_AXES; k++)
+            sim_set_raw(raw_fds[k], raw[k]);
+
+        if (dl >= next_print) {
+            sim_set(lux_fd, buf, (size_t)snprintf(buf, sizeof(buf), "%08.2f\n", \
+                    SIM_LUX_BASE + SIM_LUX_SWING * sin(2.0 * M_PI * t / SIM_LUX_PERIOD_S)));
+            printf("t=%7.2f roll %7.2f pitch %7.2f yaw %7.2f\n", t, e[0], e[1], e[2]);
+            fflush(stdout);
+            next_print = dl + 1000000000ULL;
+        }
+    }
+
+out:
+    for (int32_t i = 0; i < SIM_AXES; i++) {
+        if (raw_fds[i] >= 0)
+            close(raw_fds[i]);
+    }
+    if (lux_fd >= 0)
+        close(lux_fd);
+
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
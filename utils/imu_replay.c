@@ -0,0 +1,329 @@
+/**
+ * @file imu_replay.c
+ *
+ * Offline replay of a raw IMU recording (see imu_record.h, recorded by
+ * sys-mgr with SYS_MGR_IMU_RECORD set) through the fusion stage of the IMU
+ * loop: calibration, gyro bias adaptation and the engine, in batches as
+ * imu_fuse_batch runs them. No device, bus or sys-mgr needed.
+ *
+ *   sys-utils imu-replay [-f engine] [-p] [-m] [-o angles.csv]
+ *                        [-c reference.csv] [-e tolerance] recording
+ *
+ * As fast as possible by default, -p paces the samples at their recorded
+ * timestamps. "stage" is the throughput of the fusion stage alone, "total"
+ * includes reading the file. -o writes the angles of every sample, -c
+ * compares them with a file written by -o and fails past the tolerance
+ * (degrees, 0.01 by default): a regression check for fusion changes.
+ * -m lists the motion events sys-mgr would publish (see imu_motion.h), the
+ * angles fed to the detector at the rate sys-mgr derives them.
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <getopt.h>
+
+#include <hw/imu.h>
+#include <hw/imu_batch.h>
+#include <hw/imu_fusion.h>
+#include <hw/imu_motion.h>
+#include <hw/imu_record.h>
+#include <sched/clock.h>
+#include "sys_utils.h"
+
+/*********************
+ *      DEFINES
+ *********************/
+#define REPLAY_DEFAULT_TOLERANCE        0.01
+#define REPLAY_LINE_MAX                 128
+/* Angles for the motion detector, as ANGLES_EVAL_HZ in sys-mgr */
+#define REPLAY_MOTION_EVAL_HZ           50
+#define REPLAY_MOTION_EVENTS_MAX        8
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/**********************
+ *      MACROS
+ **********************/
+#define RAD2DEG(r) ((r) * 180.0 / M_PI)
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+/* Comparison with a reference file */
+struct replay_check {
+    FILE *fp;
+    double max_diff[3];
+    uint64_t mismatched;        /* samples missing or with another timestamp */
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+static double wrap_deg(double d)
+{
+    d = fmod(d + 180.0, 360.0);
+    if (d < 0.0)
+        d += 360.0;
+    return d - 180.0;
+}
+
+/* Level the engine on the first calibrated sample, as sys-mgr does */
+static void replay_level(struct imu_fusion *f, const struct imu_batch *b)
+{
+    float ax = b->accel[0][0], ay = b->accel[1][0], az = b->accel[2][0];
+
+    imu_fusion_reset(f, (float)RAD2DEG(atan2f(ay, az)), \
+                     (float)RAD2DEG(atan2f(-ax, sqrtf(ay * ay + az * az))), 0.0f);
+}
+
+/* Sleep until the recorded timestamp of ts_ns, shifted to the replay start */
+static void replay_pace(uint64_t ts_ns, int64_t shift_ns)
+{
+    struct timespec ts;
+    uint64_t due = ts_ns + shift_ns;
+
+    ts.tv_sec = (time_t)(due / 1000000000ULL);
+    ts.tv_nsec = (long)(due % 1000000000ULL);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void check_sample(struct replay_check *c, uint64_t ts_ns, \
+                         const struct imu_angles *a)
+{
+    char line[REPLAY_LINE_MAX];
+    unsigned long long ref_ts;
+    double ref[3], diff[3];
+
+    if (!fgets(line, sizeof(line), c->fp) || \
+        sscanf(line, "%llu,%lf,%lf,%lf", &ref_ts, &ref[0], &ref[1], &ref[2]) != 4 || \
+        ref_ts != ts_ns) {
+        c->mismatched++;
+        return;
+    }
+
+    diff[0] = fabs(a->roll - ref[0]);
+    diff[1] = fabs(a->pitch - ref[1]);
+    diff[2] = fabs(wrap_deg(a->yaw - ref[2]));
+    for (int32_t k = 0; k < 3; k++) {
+        if (diff[k] > c->max_diff[k])
+            c->max_diff[k] = diff[k];
+    }
+}
+
+static void replay_motion(struct imu_motion *m, const struct imu_batch *b, \
+                          const struct imu_fusion *f, uint64_t first_ts, \
+                          uint64_t *eval_ns, uint64_t *counts)
+{
+    struct imu_motion_event ev[REPLAY_MOTION_EVENTS_MAX];
+    struct imu_angles angles;
+    uint64_t ts_ns = b->ts_ns[b->n - 1];
+    bool evaluated = false;
+    uint32_t n;
+
+    if (ts_ns - *eval_ns >= 1000000000ULL / REPLAY_MOTION_EVAL_HZ) {
+        *eval_ns = ts_ns;
+        imu_attitude_angles(&f->att, &angles);
+        evaluated = true;
+    }
+
+    n = imu_motion_update(m, b, evaluated ? &angles : NULL, ev, REPLAY_MOTION_EVENTS_MAX);
+    for (uint32_t i = 0; i < n; i++) {
+        counts[ev[i].type]++;
+        printf("%10.3f s  %-8s %.2f\n", (ev[i].ts_ns - first_ts) / 1e9,
+               imu_motion_name(ev[i].type), ev[i].value);
+    }
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+int32_t run_imu_replay(int32_t argc, char **argv)
+{
+    struct imu_record rec;
+    struct imu_calib calib;
+    struct imu_batch batch;
+    struct imu_fusion f;
+    struct imu_attitude att[IMU_BATCH_MAX];
+    struct imu_angles angles = { 0.0f, 0.0f, 0.0f };
+    struct replay_check check;
+    struct imu_motion motion;
+    const float *const a[3] = { batch.accel[0], batch.accel[1], batch.accel[2] };
+    const float *const g[3] = { batch.gyro[0], batch.gyro[1], batch.gyro[2] };
+    const char *out_path = NULL, *ref_path = NULL;
+    FILE *out = NULL;
+    enum imu_fusion_type type = IMU_FUSION_KALMAN;
+    double tolerance = REPLAY_DEFAULT_TOLERANCE;
+    uint64_t prev_ts_ns = 0, stage_ns = 0, start, t0, span_ns = 0, first_ts = 0;
+    uint64_t eval_ns = 0, motion_counts[IMU_MOTION_COUNT] = { 0 };
+    int64_t shift_ns = 0;
+    int32_t opt, n, ret = 0;
+    bool paced = false, fail = false, motion_on = false;
+
+    while ((opt = getopt(argc, argv, "f:pmo:c:e:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            ret = imu_fusion_parse(optarg);
+            if (ret < 0) {
+                LOG_ERROR("Unknown fusion engine %s", optarg);
+                return EXIT_FAILURE;
+            }
+            type = (enum imu_fusion_type)ret;
+            ret = 0;
+            break;
+        case 'p':
+            paced = true;
+            break;
+        case 'm':
+            motion_on = true;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'c':
+            ref_path = optarg;
+            break;
+        case 'e':
+            tolerance = atof(optarg);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        printf("Usage: sys-utils imu-replay [-f engine] [-p] [-m] [-o angles.csv] " \
+               "[-c reference.csv] [-e tolerance] recording\n");
+        return EXIT_FAILURE;
+    }
+
+    if (imu_record_open(&rec, argv[optind]))
+        return EXIT_FAILURE;
+
+    memset(&check, 0, sizeof(check));
+    if (out_path) {
+        out = fopen(out_path, "w");
+        if (!out)
+            LOG_ERROR("Cannot create %s: %s", out_path, strerror(errno));
+    }
+    if (ref_path) {
+        check.fp = fopen(ref_path, "r");
+        if (!check.fp)
+            LOG_ERROR("Cannot open %s: %s", ref_path, strerror(errno));
+    }
+    if ((out_path && !out) || (ref_path && !check.fp)) {
+        ret = -ENOENT;
+        goto out;
+    }
+
+    calib = rec.hdr.calib;
+    imu_fusion_init(&f, type, NULL);
+    imu_motion_init(&motion);
+
+    start = now_ns();
+    while ((n = imu_record_read(&rec, &batch, IMU_BATCH_MAX)) > 0) {
+        if (rec.samples == (uint64_t)n) {
+            first_ts = batch.ts_ns[0];
+            shift_ns = (int64_t)(now_ns() - first_ts);
+        }
+        span_ns = batch.ts_ns[n - 1] - first_ts;
+
+        t0 = now_ns();
+        imu_batch_dt(&batch, &prev_ts_ns, (int32_t)rec.hdr.sample_hz);
+        imu_calib_apply(&calib, &batch);
+        if (rec.samples == (uint64_t)n)
+            replay_level(&f, &batch);
+        imu_calib_adapt_gyro(&calib, &batch);
+        imu_fusion_update_batch(&f, a, g, batch.dt, batch.n, att);
+        stage_ns += now_ns() - t0;
+
+        if (motion_on)
+            replay_motion(&motion, &batch, &f, first_ts, &eval_ns, motion_counts);
+
+        for (int32_t i = 0; i < n && (out || check.fp); i++) {
+            imu_attitude_angles(&att[i], &angles);
+            if (out)
+                fprintf(out, "%llu,%.6f,%.6f,%.6f\n", (unsigned long long)batch.ts_ns[i],
+                        angles.roll, angles.pitch, angles.yaw);
+            if (check.fp)
+                check_sample(&check, batch.ts_ns[i], &angles);
+        }
+
+        if (paced)
+            replay_pace(batch.ts_ns[n - 1], shift_ns);
+    }
+    if (n < 0)
+        ret = n;
+
+    if (!rec.samples) {
+        LOG_ERROR("%s holds no samples", argv[optind]);
+        ret = -ENODATA;
+        goto out;
+    }
+
+    imu_attitude_angles(&f.att, &angles);
+    printf("%s: %llu samples at %u Hz over %.2f s, %s engine, %s calibration\n",
+           argv[optind], (unsigned long long)rec.samples, rec.hdr.sample_hz,
+           span_ns / 1e9, imu_fusion_name(type), imu_calib_simd());
+    printf("stage %.0f samples/s (%.1f ns per sample), total %.0f samples/s\n",
+           rec.samples * 1e9 / (double)(stage_ns ? stage_ns : 1),
+           (double)stage_ns / rec.samples,
+           rec.samples * 1e9 / (double)(now_ns() - start));
+    printf("final roll %.3f pitch %.3f yaw %.3f\n", angles.roll, angles.pitch, angles.yaw);
+    if (motion_on) {
+        printf("motion events:");
+        for (int32_t k = 0; k < IMU_MOTION_COUNT; k++)
+            printf(" %s %llu", imu_motion_name((enum imu_motion_type)k),
+                   (unsigned long long)motion_counts[k]);
+        printf("\n");
+    }
+
+    if (check.fp) {
+        /* the reference must cover the same samples, no more */
+        if (fgetc(check.fp) != EOF)
+            check.mismatched++;
+        fail = check.mismatched || check.max_diff[0] > tolerance || \
+               check.max_diff[1] > tolerance || check.max_diff[2] > tolerance;
+        printf("against %s: max diff roll %.6f pitch %.6f yaw %.6f, %llu mismatched, %s\n",
+               ref_path, check.max_diff[0], check.max_diff[1], check.max_diff[2],
+               (unsigned long long)check.mismatched, fail ? "FAIL" : "ok");
+    }
+
+out:
+    if (out)
+        fclose(out);
+    if (check.fp)
+        fclose(check.fp);
+    imu_record_close(&rec);
+    return ret || fail ? EXIT_FAILURE : EXIT_SUCCESS;
+}
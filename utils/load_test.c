@@ -0,0 +1,588 @@
+/**
+ * @file load_test.c
+ *
+ * DBus load generator: drives sys-mgr with a mix of command frames and
+ * reports throughput and round-trip latency percentiles.
+ *
+ *   sys-utils load [-m method|signal] [-o name[:weight],...] [-r rate]
+ *                  [-c concurrency] [-n count] [-d seconds] [-F block|nonblock]
+ *                  [-t timeout_ms]
+ *
+ * Method calls run either open-loop at a fixed rate (-r), where latency is
+ * taken from the scheduled send time so a stalled server is not hidden by
+ * a stalled client, or closed-loop with a fixed number of calls in flight
+ * (-c). Signals have no reply, only the send rate is reported.
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <dbus/dbus.h>
+
+#include <comm/dbus_comm.h>
+#include <sched/workqueue.h>
+#include <sched/clock.h>
+#include "sys_utils.h"
+
+/*********************
+ *      DEFINES
+ *********************/
+#define LOAD_MAX_OPS                    16
+#define LOAD_DEFAULT_COUNT              10000
+#define LOAD_DEFAULT_TIMEOUT_MS         2000
+/* In-flight window, a power of two indexed by serial */
+#define LOAD_WINDOW                     4096
+/* Upper bound of a single read_write wait, keeps timeouts responsive */
+#define LOAD_POLL_MS                    50
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+struct load_op {
+    uint32_t opcode;
+    uint32_t weight;
+};
+
+struct load_cfg {
+    bool signal;
+    struct load_op ops[LOAD_MAX_OPS];
+    int32_t n_ops;
+    uint32_t total_weight;
+    double rate;                    /* msg/s, 0 = closed-loop */
+    int32_t concurrency;
+    int64_t count;
+    double duration_s;              /* 0 = count based */
+    uint8_t flow;
+    int32_t timeout_ms;
+    const char *component;          /* NULL = the one of the sample frame */
+};
+
+struct load_slot {
+    uint32_t serial;                /* 0 = free */
+    uint64_t t_ns;                  /* scheduled send time */
+};
+
+struct load_result {
+    int64_t sent;
+    int64_t replies;
+    int64_t errors;
+    int64_t timeouts;
+    int64_t behind;                 /* rate mode: sends skipped, window full */
+    uint64_t *lat_ns;
+    int64_t lat_cnt;
+    int64_t lat_cap;
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+static const struct {
+    const char *name;
+    uint32_t opcode;
+} op_names[] = {
+    { "ping",           OP_PING },
+    { "get_brightness", OP_GET_BRIGHTNESS },
+    { "set_brightness", OP_SET_BRIGHTNESS },
+    { "read_imu",       OP_READ_IMU },
+    { "left_vibrator",  OP_LEFT_VIBRATOR },
+    { "right_vibrator", OP_RIGHT_VIBRATOR },
+    { "sound_play",     OP_SOUND_PLAY },
+};
+
+static struct load_slot window[LOAD_WINDOW];
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+/**********************
+ *      MACROS
+ **********************/
+#define ARRAY_SIZE(a)                   (sizeof(a) / sizeof((a)[0]))
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void load_usage(void)
+{
+    printf("Usage: sys-utils load [options]\n"
+           "  -m method|signal   message type (method)\n"
+           "  -o name[:w],...    opcode mix, names or numbers (read_imu)\n"
+           "  -r rate            open-loop rate in msg/s\n"
+           "  -c concurrency     closed-loop calls in flight (1)\n"
+           "  -n count           messages to send (%d)\n"
+           "  -d seconds         run for a duration instead of a count\n"
+           "  -F block|nonblock  work flow requested from sys-mgr (block)\n"
+           "  -t timeout_ms      reply timeout (%d)\n"
+           "  -C component       component_id of the frames (terminal-ui)\n"
+           "Opcode names:", LOAD_DEFAULT_COUNT, LOAD_DEFAULT_TIMEOUT_MS);
+    for (size_t i = 0; i < ARRAY_SIZE(op_names); i++)
+        printf(" %s", op_names[i].name);
+    printf("\n");
+}
+
+static int32_t parse_opcode(const char *name, uint32_t *opcode)
+{
+    char *end;
+    long val;
+
+    for (size_t i = 0; i < ARRAY_SIZE(op_names); i++) {
+        if (strcmp(name, op_names[i].name) == 0) {
+            *opcode = op_names[i].opcode;
+            return 0;
+        }
+    }
+
+    val = strtol(name, &end, 0);
+    if (*name && !*end && val >= 0) {
+        *opcode = (uint32_t)val;
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+/* "read_imu:8,set_brightness:2" */
+static int32_t parse_mix(struct load_cfg *cfg, const char *arg)
+{
+    char buf[256];
+    char *tok, *save = NULL, *colon;
+
+    snprintf(buf, sizeof(buf), "%s", arg);
+    cfg->n_ops = 0;
+    cfg->total_weight = 0;
+
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        struct load_op *op;
+
+        if (cfg->n_ops >= LOAD_MAX_OPS)
+            return -E2BIG;
+
+        op = &cfg->ops[cfg->n_ops];
+        op->weight = 1;
+        colon = strchr(tok, ':');
+        if (colon) {
+            *colon = '\0';
+            op->weight = (uint32_t)atoi(colon + 1);
+        }
+
+        if (parse_opcode(tok, &op->opcode) || !op->weight) {
+            LOG_ERROR("Invalid opcode mix entry: %s", tok);
+            return -EINVAL;
+        }
+
+        cfg->total_weight += op->weight;
+        cfg->n_ops++;
+    }
+
+    return cfg->n_ops ? 0 : -EINVAL;
+}
+
+static int32_t parse_args(struct load_cfg *cfg, int32_t argc, char **argv)
+{
+    int32_t opt;
+
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->concurrency = 1;
+    cfg->count = LOAD_DEFAULT_COUNT;
+    cfg->flow = BLOCK;
+    cfg->timeout_ms = LOAD_DEFAULT_TIMEOUT_MS;
+    parse_mix(cfg, "read_imu");
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "m:o:r:c:n:d:F:t:C:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "signal") == 0)
+                cfg->signal = true;
+            else if (strcmp(optarg, "method") != 0)
+                return -EINVAL;
+            break;
+        case 'o':
+            if (parse_mix(cfg, optarg))
+                return -EINVAL;
+            break;
+        case 'r':
+            cfg->rate = strtod(optarg, NULL);
+            break;
+        case 'c':
+            cfg->concurrency = atoi(optarg);
+            break;
+        case 'n':
+            cfg->count = strtoll(optarg, NULL, 0);
+            break;
+        case 'd':
+            cfg->duration_s = strtod(optarg, NULL);
+            break;
+        case 'F':
+            if (strcmp(optarg, "nonblock") == 0)
+                cfg->flow = NON_BLOCK;
+            else if (strcmp(optarg, "block") != 0)
+                return -EINVAL;
+            break;
+        case 't':
+            cfg->timeout_ms = atoi(optarg);
+            break;
+        case 'C':
+            cfg->component = optarg;
+            break;
+        default:
+            return -EINVAL;
+        }
+    }
+
+    if (cfg->concurrency < 1 || cfg->concurrency > LOAD_WINDOW / 2 || \
+        cfg->rate < 0 || cfg->timeout_ms <= 0 || \
+        (cfg->count <= 0 && cfg->duration_s <= 0))
+        return -EINVAL;
+
+    // A duration run is bounded by time only
+    if (cfg->duration_s > 0)
+        cfg->count = INT64_MAX;
+
+    return 0;
+}
+
+static uint32_t pick_opcode(const struct load_cfg *cfg)
+{
+    uint32_t r;
+
+    if (cfg->n_ops == 1)
+        return cfg->ops[0].opcode;
+
+    r = (uint32_t)(rng_next() % cfg->total_weight);
+    for (int32_t i = 0; i < cfg->n_ops; i++) {
+        if (r < cfg->ops[i].weight)
+            return cfg->ops[i].opcode;
+        r -= cfg->ops[i].weight;
+    }
+
+    return cfg->ops[0].opcode;
+}
+
+static void record_latency(struct load_result *res, uint64_t lat)
+{
+    uint64_t *grown;
+
+    if (res->lat_cnt == res->lat_cap) {
+        res->lat_cap = res->lat_cap ? res->lat_cap * 2 : 65536;
+        grown = realloc(res->lat_ns, res->lat_cap * sizeof(*grown));
+        if (!grown) {
+            res->lat_cap = res->lat_cnt;
+            return;
+        }
+        res->lat_ns = grown;
+    }
+
+    res->lat_ns[res->lat_cnt++] = lat;
+}
+
+static int32_t send_frame(DBusConnection *conn, const struct load_cfg *cfg, \
+                          int64_t seq, uint32_t *serial)
+{
+    DBusMessage *msg;
+    remote_cmd_t cmd;
+    bool ok;
+
+    if (cfg->signal)
+        msg = dbus_message_new_signal(UI_DBUS_OBJ_PATH, UI_DBUS_IFACE, \
+                                      UI_DBUS_SIG);
+    else
+        msg = dbus_message_new_method_call(SYS_MGR_DBUS_SER, \
+                                           SYS_MGR_DBUS_OBJ_PATH, \
+                                           SYS_MGR_DBUS_IFACE, \
+                                           SYS_MGR_DBUS_METH);
+    if (!msg)
+        return -ENOMEM;
+
+    create_method_frame(&cmd);
+    cmd.umid = (int32_t)seq;
+    cmd.opcode = pick_opcode(cfg);
+    cmd.flow = cfg->flow;
+    if (cfg->component)
+        cmd.component_id = cfg->component;
+
+    ok = !frame_encode(msg, &cmd) && dbus_connection_send(conn, msg, serial);
+    dbus_message_unref(msg);
+
+    return ok ? 0 : -ENOMEM;
+}
+
+static void collect_replies(DBusConnection *conn, struct load_result *res, \
+                            int32_t *in_flight)
+{
+    DBusMessage *msg;
+    struct load_slot *slot;
+    uint32_t serial;
+    uint64_t now;
+    int32_t type;
+
+    while ((msg = dbus_connection_pop_message(conn)) != NULL) {
+        type = dbus_message_get_type(msg);
+        if (type != DBUS_MESSAGE_TYPE_METHOD_RETURN && \
+            type != DBUS_MESSAGE_TYPE_ERROR) {
+            dbus_message_unref(msg);
+            continue;
+        }
+
+        serial = dbus_message_get_reply_serial(msg);
+        slot = &window[serial & (LOAD_WINDOW - 1)];
+        if (slot->serial == serial) {
+            now = now_ns();
+            slot->serial = 0;
+            (*in_flight)--;
+            if (type == DBUS_MESSAGE_TYPE_ERROR) {
+                res->errors++;
+            } else {
+                res->replies++;
+                record_latency(res, now - slot->t_ns);
+            }
+        }
+        dbus_message_unref(msg);
+    }
+}
+
+/* Free slots whose reply is overdue, they count as timeouts */
+static void expire_slots(struct load_result *res, int32_t *in_flight, \
+                         uint64_t now, uint64_t timeout_ns)
+{
+    for (int32_t i = 0; i < LOAD_WINDOW && *in_flight; i++) {
+        if (window[i].serial && now - window[i].t_ns > timeout_ns) {
+            window[i].serial = 0;
+            (*in_flight)--;
+            res->timeouts++;
+        }
+    }
+}
+
+static int32_t run_methods(DBusConnection *conn, const struct load_cfg *cfg, \
+                           struct load_result *res, uint64_t *elapsed_ns)
+{
+    uint64_t start, now, end_ns, next_send, period_ns, timeout_ns, last_expire;
+    struct load_slot *slot;
+    int32_t in_flight = 0, max_in_flight, wait_ms;
+    uint32_t serial;
+    bool sending = true;
+
+    timeout_ns = (uint64_t)cfg->timeout_ms * 1000000ULL;
+    period_ns = cfg->rate > 0 ? (uint64_t)(1e9 / cfg->rate) : 0;
+    max_in_flight = cfg->rate > 0 ? LOAD_WINDOW / 2 : cfg->concurrency;
+
+    start = now_ns();
+    end_ns = cfg->duration_s > 0 ? start + (uint64_t)(cfg->duration_s * 1e9) : 0;
+    next_send = start;
+    last_expire = start;
+
+    while (sending || in_flight) {
+        now = now_ns();
+        if (sending && ((end_ns && now >= end_ns) || res->sent >= cfg->count))
+            sending = false;
+
+        while (sending && res->sent < cfg->count) {
+            if (period_ns && next_send > now)
+                break;
+            if (in_flight >= max_in_flight) {
+                if (!period_ns)
+                    break;
+                // Open loop never waits for the server, the send is lost
+                res->behind++;
+                next_send += period_ns;
+                continue;
+            }
+
+            if (send_frame(conn, cfg, res->sent, &serial))
+                return -ENOMEM;
+
+            slot = &window[serial & (LOAD_WINDOW - 1)];
+            if (slot->serial) {
+                // A call older than the whole window is still unanswered
+                res->timeouts++;
+                in_flight--;
+            }
+            slot->serial = serial;
+            slot->t_ns = period_ns ? next_send : now;
+            in_flight++;
+            res->sent++;
+            if (period_ns)
+                next_send += period_ns;
+        }
+
+        wait_ms = LOAD_POLL_MS;
+        if (sending && period_ns) {
+            now = now_ns();
+            wait_ms = next_send > now ? (int32_t)((next_send - now) / 1000000) : 0;
+        }
+
+        dbus_connection_read_write(conn, wait_ms);
+        collect_replies(conn, res, &in_flight);
+
+        now = now_ns();
+        if (now - last_expire > 10000000ULL) {
+            expire_slots(res, &in_flight, now, timeout_ns);
+            last_expire = now;
+        }
+
+        if (!dbus_connection_get_is_connected(conn)) {
+            LOG_ERROR("Lost the bus connection");
+            return -EPIPE;
+        }
+    }
+
+    *elapsed_ns = now_ns() - start;
+    return 0;
+}
+
+static int32_t run_signals(DBusConnection *conn, const struct load_cfg *cfg, \
+                           struct load_result *res, uint64_t *elapsed_ns)
+{
+    uint64_t start, now, end_ns, next_send, period_ns;
+    uint32_t serial;
+
+    period_ns = cfg->rate > 0 ? (uint64_t)(1e9 / cfg->rate) : 0;
+    start = now_ns();
+    end_ns = cfg->duration_s > 0 ? start + (uint64_t)(cfg->duration_s * 1e9) : 0;
+    next_send = start;
+
+    while (res->sent < cfg->count) {
+        now = now_ns();
+        if (end_ns && now >= end_ns)
+            break;
+
+        if (period_ns && next_send > now) {
+            dbus_connection_read_write(conn, (next_send - now) / 1000000);
+            continue;
+        }
+
+        if (send_frame(conn, cfg, res->sent, &serial))
+            return -ENOMEM;
+        res->sent++;
+        next_send += period_ns;
+
+        // Let libdbus write out, without waiting when the socket is full
+        if (!(res->sent & 63))
+            dbus_connection_read_write(conn, 0);
+    }
+
+    dbus_connection_flush(conn);
+    *elapsed_ns = now_ns() - start;
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const struct load_result *res, double pct)
+{
+    int64_t idx;
+
+    if (!res->lat_cnt)
+        return 0.0;
+
+    idx = (int64_t)(pct / 100.0 * (res->lat_cnt - 1) + 0.5);
+    return res->lat_ns[idx] / 1e3;
+}
+
+static void report(const struct load_cfg *cfg, struct load_result *res, \
+                   uint64_t elapsed_ns)
+{
+    double secs = elapsed_ns / 1e9;
+
+    printf("mode=%s flow=%s %s", cfg->signal ? "signal" : "method", \
+           cfg->flow == BLOCK ? "block" : "nonblock", \
+           cfg->rate > 0 ? "open-loop" : "closed-loop");
+    if (cfg->rate > 0)
+        printf(" rate=%.0f/s", cfg->rate);
+    else if (!cfg->signal)
+        printf(" concurrency=%d", cfg->concurrency);
+    printf(" ops=");
+    for (int32_t i = 0; i < cfg->n_ops; i++)
+        printf("%s%u:%u", i ? "," : "", cfg->ops[i].opcode, cfg->ops[i].weight);
+    if (cfg->component)
+        printf(" component=%s", cfg->component);
+    printf("\n");
+
+    if (cfg->signal) {
+        printf("sent %lld in %.3f s: %.0f msg/s (no reply, send rate only)\n", \
+               (long long)res->sent, secs, secs > 0 ? res->sent / secs : 0.0);
+        return;
+    }
+
+    printf("sent %lld replies %lld errors %lld timeouts %lld behind %lld\n", \
+           (long long)res->sent, (long long)res->replies, \
+           (long long)res->errors, (long long)res->timeouts, \
+           (long long)res->behind);
+    printf("elapsed %.3f s, throughput %.0f replies/s\n", secs, \
+           secs > 0 ? res->replies / secs : 0.0);
+
+    if (!res->lat_cnt)
+        return;
+
+    qsort(res->lat_ns, res->lat_cnt, sizeof(*res->lat_ns), cmp_u64);
+    printf("latency us: min %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n", \
+           res->lat_ns[0] / 1e3, percentile_us(res, 50), percentile_us(res, 90), \
+           percentile_us(res, 99), percentile_us(res, 99.9), \
+           res->lat_ns[res->lat_cnt - 1] / 1e3);
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+int32_t run_load_test(DBusConnection *conn, int32_t argc, char **argv)
+{
+    struct load_cfg cfg;
+    struct load_result res;
+    uint64_t elapsed_ns = 0;
+    int32_t ret;
+
+    if (parse_args(&cfg, argc, argv)) {
+        load_usage();
+        return EXIT_FAILURE;
+    }
+
+    memset(&res, 0, sizeof(res));
+    memset(window, 0, sizeof(window));
+
+    if (cfg.signal)
+        ret = run_signals(conn, &cfg, &res, &elapsed_ns);
+    else
+        ret = run_methods(conn, &cfg, &res, &elapsed_ns);
+
+    if (ret)
+        LOG_ERROR("Load test aborted (%d)", ret);
+
+    report(&cfg, &res, elapsed_ns);
+    free(res.lat_ns);
+
+    return (ret || res.errors || res.timeouts) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,493 @@
+/**
+ * @file replay.c
+ *
+ * Traffic replay: reissues a capture taken with SYS_MGR_CAPTURE as method
+ * calls to sys-mgr and reports round-trip latency, overall and per opcode.
+ *
+ *   sys-utils replay [-s speed] [-c concurrency] [-l loops] [-t timeout_ms]
+ *                    [-C component] capture
+ *
+ * With a speed, commands are sent at their captured receive times, scaled
+ * by 1/speed; latency is taken from that scheduled time, and how far the
+ * sender fell behind schedule is reported separately. Speed 0 sends flat
+ * out with a fixed number of calls in flight. Each command keeps its
+ * component, so per-client queuing in sys-mgr sees the original mix.
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <dbus/dbus.h>
+
+#include <comm/dbus_comm.h>
+#include <comm/capture_codec.h>
+#include <sched/clock.h>
+#include "sys_utils.h"
+
+/*********************
+ *      DEFINES
+ *********************/
+#define REPLAY_DEFAULT_TIMEOUT_MS       2000
+/* In-flight window, a power of two indexed by serial */
+#define REPLAY_WINDOW                   4096
+#define REPLAY_POLL_MS                  50
+/* A send this far behind its scheduled time counts as late */
+#define REPLAY_LATE_NS                  1000000ULL
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+struct replay_cfg {
+    const char *path;
+    double speed;                   /* 0 = flat out */
+    int32_t concurrency;
+    int32_t loops;
+    int32_t timeout_ms;
+    const char *component;          /* NULL = the captured one */
+};
+
+struct replay_slot {
+    uint32_t serial;                /* 0 = free */
+    uint32_t opcode;
+    uint64_t t_ns;                  /* scheduled (paced) or actual send time */
+};
+
+struct replay_sample {
+    uint32_t opcode;
+    uint64_t lat_ns;
+};
+
+struct replay_result {
+    int64_t sent;
+    int64_t replies;
+    int64_t errors;
+    int64_t timeouts;
+    int64_t late;
+    uint64_t lag_max_ns;
+    struct replay_sample *lat;
+    int64_t lat_cnt;
+    int64_t lat_cap;
+};
+
+/* Read-ahead of the capture, with the offset carried across loops */
+struct replay_src {
+    FILE *fp;
+    int32_t loops_left;
+    uint64_t first_ns;              /* raw offset of the first record */
+    uint64_t base_ns;               /* added to offsets of the current loop */
+    uint64_t last_ns;
+    bool have;
+    remote_cmd_t cmd;
+    uint64_t offset_ns;
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+static struct replay_slot window[REPLAY_WINDOW];
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+static void replay_usage(void)
+{
+    printf("Usage: sys-utils replay [options] capture\n"
+           "  -s speed           pacing: 1 as captured, 10 ten times faster,\n"
+           "                     0 flat out (1)\n"
+           "  -c concurrency     calls in flight when flat out (1)\n"
+           "  -l loops           times to replay the capture (1)\n"
+           "  -t timeout_ms      reply timeout (%d)\n"
+           "  -C component       replace the captured component_id\n", \
+           REPLAY_DEFAULT_TIMEOUT_MS);
+}
+
+static int32_t parse_args(struct replay_cfg *cfg, int32_t argc, char **argv)
+{
+    int32_t opt;
+
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->speed = 1.0;
+    cfg->concurrency = 1;
+    cfg->loops = 1;
+    cfg->timeout_ms = REPLAY_DEFAULT_TIMEOUT_MS;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "s:c:l:t:C:h")) != -1) {
+        switch (opt) {
+        case 's':
+            cfg->speed = strtod(optarg, NULL);
+            break;
+        case 'c':
+            cfg->concurrency = atoi(optarg);
+            break;
+        case 'l':
+            cfg->loops = atoi(optarg);
+            break;
+        case 't':
+            cfg->timeout_ms = atoi(optarg);
+            break;
+        case 'C':
+            cfg->component = optarg;
+            break;
+        default:
+            return -EINVAL;
+        }
+    }
+
+    if (optind != argc - 1)
+        return -EINVAL;
+    cfg->path = argv[optind];
+
+    if (cfg->speed < 0 || cfg->loops < 1 || cfg->timeout_ms <= 0 || \
+        cfg->concurrency < 1 || cfg->concurrency > REPLAY_WINDOW / 2)
+        return -EINVAL;
+
+    return 0;
+}
+
+/* Load the next record into src, rewinding for the next loop at the end */
+static int32_t replay_next(struct replay_src *src)
+{
+    int32_t ret;
+
+    src->have = false;
+    for (;;) {
+        ret = capture_read(src->fp, &src->cmd, &src->offset_ns);
+        if (ret < 0) {
+            LOG_ERROR("Malformed capture record: %d", ret);
+            return ret;
+        }
+        if (ret > 0)
+            break;
+
+        if (--src->loops_left <= 0)
+            return 0;
+        // The next loop starts where the previous one ended
+        src->base_ns = src->last_ns - src->first_ns;
+        if (fseek(src->fp, CAPTURE_HEADER_SIZE, SEEK_SET))
+            return -errno;
+    }
+
+    src->offset_ns += src->base_ns;
+    src->last_ns = src->offset_ns;
+    src->have = true;
+    return 0;
+}
+
+static void record_latency(struct replay_result *res, uint32_t opcode, \
+                           uint64_t lat)
+{
+    struct replay_sample *grown;
+
+    if (res->lat_cnt == res->lat_cap) {
+        res->lat_cap = res->lat_cap ? res->lat_cap * 2 : 65536;
+        grown = realloc(res->lat, res->lat_cap * sizeof(*grown));
+        if (!grown) {
+            res->lat_cap = res->lat_cnt;
+            return;
+        }
+        res->lat = grown;
+    }
+
+    res->lat[res->lat_cnt].opcode = opcode;
+    res->lat[res->lat_cnt].lat_ns = lat;
+    res->lat_cnt++;
+}
+
+static int32_t send_cmd(DBusConnection *conn, const struct replay_cfg *cfg, \
+                        remote_cmd_t *cmd, uint32_t *serial)
+{
+    DBusMessage *msg;
+    bool ok;
+
+    msg = dbus_message_new_method_call(SYS_MGR_DBUS_SER, \
+                                       SYS_MGR_DBUS_OBJ_PATH, \
+                                       SYS_MGR_DBUS_IFACE, \
+                                       SYS_MGR_DBUS_METH);
+    if (!msg)
+        return -ENOMEM;
+
+    if (cfg->component)
+        cmd->component_id = cfg->component;
+
+    ok = !frame_encode(msg, cmd) && dbus_connection_send(conn, msg, serial);
+    dbus_message_unref(msg);
+
+    return ok ? 0 : -ENOMEM;
+}
+
+static void collect_replies(DBusConnection *conn, struct replay_result *res, \
+                            int32_t *in_flight)
+{
+    DBusMessage *msg;
+    struct replay_slot *slot;
+    uint32_t serial;
+    uint64_t now;
+    int32_t type;
+
+    while ((msg = dbus_connection_pop_message(conn)) != NULL) {
+        type = dbus_message_get_type(msg);
+        if (type != DBUS_MESSAGE_TYPE_METHOD_RETURN && \
+            type != DBUS_MESSAGE_TYPE_ERROR) {
+            dbus_message_unref(msg);
+            continue;
+        }
+
+        serial = dbus_message_get_reply_serial(msg);
+        slot = &window[serial & (REPLAY_WINDOW - 1)];
+        if (slot->serial == serial) {
+            now = now_ns();
+            slot->serial = 0;
+            (*in_flight)--;
+            if (type == DBUS_MESSAGE_TYPE_ERROR) {
+                res->errors++;
+            } else {
+                res->replies++;
+                record_latency(res, slot->opcode, now - slot->t_ns);
+            }
+        }
+        dbus_message_unref(msg);
+    }
+}
+
+static void expire_slots(struct replay_result *res, int32_t *in_flight, \
+                         uint64_t now, uint64_t timeout_ns)
+{
+    for (int32_t i = 0; i < REPLAY_WINDOW && *in_flight; i++) {
+        if (window[i].serial && now - window[i].t_ns > timeout_ns) {
+            window[i].serial = 0;
+            (*in_flight)--;
+            res->timeouts++;
+        }
+    }
+}
+
+static int32_t run_replay(DBusConnection *conn, const struct replay_cfg *cfg, \
+                          struct replay_src *src, struct replay_result *res, \
+                          uint64_t *elapsed_ns)
+{
+    uint64_t start, now, due = 0, timeout_ns, last_expire;
+    struct replay_slot *slot;
+    int32_t in_flight = 0, max_in_flight, wait_ms, ret;
+    uint32_t serial;
+
+    timeout_ns = (uint64_t)cfg->timeout_ms * 1000000ULL;
+    max_in_flight = cfg->speed > 0 ? REPLAY_WINDOW / 2 : cfg->concurrency;
+
+    start = now_ns();
+    last_expire = start;
+
+    while (src->have || in_flight) {
+        now = now_ns();
+        while (src->have && in_flight < max_in_flight) {
+            if (cfg->speed > 0) {
+                due = start + (uint64_t)((src->offset_ns - src->first_ns) / cfg->speed);
+                if (due > now)
+                    break;
+                if (now - due > REPLAY_LATE_NS)
+                    res->late++;
+                if (now - due > res->lag_max_ns)
+                    res->lag_max_ns = now - due;
+            }
+
+            if (send_cmd(conn, cfg, &src->cmd, &serial))
+                return -ENOMEM;
+
+            slot = &window[serial & (REPLAY_WINDOW - 1)];
+            if (slot->serial) {
+                // A call older than the whole window is still unanswered
+                res->timeouts++;
+                in_flight--;
+            }
+            slot->serial = serial;
+            slot->opcode = src->cmd.opcode;
+            slot->t_ns = cfg->speed > 0 ? due : now;
+            in_flight++;
+            res->sent++;
+
+            ret = replay_next(src);
+            if (ret)
+                return ret;
+        }
+
+        wait_ms = REPLAY_POLL_MS;
+        if (src->have && cfg->speed > 0 && in_flight < max_in_flight) {
+            now = now_ns();
+            due = start + (uint64_t)((src->offset_ns - src->first_ns) / cfg->speed);
+            wait_ms = due > now ? (int32_t)((due - now) / 1000000) : 0;
+            if (wait_ms > REPLAY_POLL_MS)
+                wait_ms = REPLAY_POLL_MS;
+        }
+
+        dbus_connection_read_write(conn, wait_ms);
+        collect_replies(conn, res, &in_flight);
+
+        now = now_ns();
+        if (now - last_expire > 10000000ULL) {
+            expire_slots(res, &in_flight, now, timeout_ns);
+            last_expire = now;
+        }
+
+        if (!dbus_connection_get_is_connected(conn)) {
+            LOG_ERROR("Lost the bus connection");
+            return -EPIPE;
+        }
+    }
+
+    *elapsed_ns = now_ns() - start;
+    return 0;
+}
+
+static int cmp_sample(const void *a, const void *b)
+{
+    const struct replay_sample *x = a, *y = b;
+
+    if (x->opcode != y->opcode)
+        return x->opcode < y->opcode ? -1 : 1;
+    return x->lat_ns < y->lat_ns ? -1 : x->lat_ns > y->lat_ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double pct_us(const uint64_t *sorted, int64_t n, double pct)
+{
+    return n ? sorted[(int64_t)(pct / 100.0 * (n - 1) + 0.5)] / 1e3 : 0.0;
+}
+
+static void report(const struct replay_cfg *cfg, struct replay_result *res, \
+                   uint64_t span_ns, uint64_t elapsed_ns)
+{
+    double secs = elapsed_ns / 1e9;
+    uint64_t *lat;
+    int64_t i, j;
+
+    if (cfg->speed > 0)
+        printf("paced x%g: capture span %.3f s, replayed in %.3f s, " \
+               "late sends %lld, max lag %.1f us\n", cfg->speed, \
+               span_ns / 1e9, secs, (long long)res->late, \
+               res->lag_max_ns / 1e3);
+    else
+        printf("flat out, concurrency=%d: replayed in %.3f s\n", \
+               cfg->concurrency, secs);
+
+    printf("sent %lld replies %lld errors %lld timeouts %lld\n", \
+           (long long)res->sent, (long long)res->replies, \
+           (long long)res->errors, (long long)res->timeouts);
+    printf("throughput %.0f replies/s\n", secs > 0 ? res->replies / secs : 0.0);
+
+    if (!res->lat_cnt)
+        return;
+
+    lat = malloc(res->lat_cnt * sizeof(*lat));
+    if (!lat)
+        return;
+
+    for (i = 0; i < res->lat_cnt; i++)
+        lat[i] = res->lat[i].lat_ns;
+    qsort(lat, res->lat_cnt, sizeof(*lat), cmp_u64);
+    printf("latency us: min %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n", \
+           lat[0] / 1e3, pct_us(lat, res->lat_cnt, 50), \
+           pct_us(lat, res->lat_cnt, 90), pct_us(lat, res->lat_cnt, 99), \
+           pct_us(lat, res->lat_cnt, 99.9), lat[res->lat_cnt - 1] / 1e3);
+
+    // Samples grouped by opcode, each group sorted by latency
+    qsort(res->lat, res->lat_cnt, sizeof(*res->lat), cmp_sample);
+    printf("opcode    replies      p50 us      p99 us      max us\n");
+    for (i = 0; i < res->lat_cnt; i = j) {
+        for (j = i; j < res->lat_cnt && res->lat[j].opcode == res->lat[i].opcode; j++)
+            lat[j - i] = res->lat[j].lat_ns;
+        printf("%6u %10lld %11.1f %11.1f %11.1f\n", res->lat[i].opcode, \
+               (long long)(j - i), pct_us(lat, j - i, 50), \
+               pct_us(lat, j - i, 99), lat[j - i - 1] / 1e3);
+    }
+
+    free(lat);
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+int32_t run_replay_test(DBusConnection *conn, int32_t argc, char **argv)
+{
+    struct capture_header hdr;
+    struct replay_cfg cfg;
+    struct replay_result res;
+    struct replay_src *src;
+    uint64_t elapsed_ns = 0;
+    int32_t ret;
+
+    if (parse_args(&cfg, argc, argv)) {
+        replay_usage();
+        return EXIT_FAILURE;
+    }
+
+    src = calloc(1, sizeof(*src));
+    if (!src)
+        return EXIT_FAILURE;
+
+    src->fp = fopen(cfg.path, "rb");
+    if (!src->fp) {
+        LOG_ERROR("Failed to open %s: %s", cfg.path, strerror(errno));
+        free(src);
+        return EXIT_FAILURE;
+    }
+
+    ret = capture_read_header(src->fp, &hdr);
+    if (!ret) {
+        src->loops_left = cfg.loops;
+        ret = replay_next(src);
+        src->first_ns = src->offset_ns;
+    }
+    if (ret || !src->have) {
+        LOG_ERROR("%s: %s", cfg.path, ret ? "not a usable capture" : \
+                  "capture holds no command");
+        fclose(src->fp);
+        free(src);
+        return EXIT_FAILURE;
+    }
+
+    memset(&res, 0, sizeof(res));
+    memset(window, 0, sizeof(window));
+
+    ret = run_replay(conn, &cfg, src, &res, &elapsed_ns);
+    if (ret)
+        LOG_ERROR("Replay aborted (%d)", ret);
+
+    report(&cfg, &res, src->last_ns - src->first_ns, elapsed_ns);
+    free(res.lat);
+    fclose(src->fp);
+    free(src);
+
+    return (ret || res.timeouts) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Run a sys-utils load test against a sys-mgr instance on a private
+# session bus, so nothing depends on the system bus or its policy.
+#
+#   utils/run_load_test.sh <build dir> [sys-utils load options]
+#
+# e.g. utils/run_load_test.sh build -c 16 -n 50000 -o read_imu:9,ping:1
+
+BUILD_DIR=${1:-build}
+[ $# -gt 0 ] && shift
+
+SYS_MGR="$BUILD_DIR/sys-mgr"
+SYS_UTILS="$BUILD_DIR/sys-utils"
+RUN_DIR=$(mktemp -d /tmp/sys-mgr-load.XXXXXX)
+
+for bin in "$SYS_MGR" "$SYS_UTILS"; do
+    if [ ! -x "$bin" ]; then
+        echo "Missing $bin, build the project first" >&2
+        exit 1
+    fi
+done
+
+cleanup() {
+    [ -n "$MGR_PID" ] && kill -INT "$MGR_PID" 2>/dev/null && wait "$MGR_PID"
+    [ -n "$BUS_PID" ] && kill "$BUS_PID" 2>/dev/null
+    rm -rf "$RUN_DIR"
+}
+trap cleanup EXIT INT TERM
+
+# Private bus, its address and pid are printed on two lines
+dbus-daemon --session --fork --print-address=3 --print-pid=4 \
+    --address="unix:path=$RUN_DIR/bus" 3>"$RUN_DIR/address" 4>"$RUN_DIR/pid" \
+    || exit 1
+BUS_PID=$(cat "$RUN_DIR/pid")
+
+export SYS_MGR_DBUS_BUS=$(head -n 1 "$RUN_DIR/address")
+export SYS_MGR_P2P_PATH="$RUN_DIR/p2p.sock"
+
+"$SYS_MGR" >"$RUN_DIR/sys-mgr.log" 2>&1 &
+MGR_PID=$!
+
+# Wait until sys-mgr owns its name
+i=0
+until dbus-send --bus="$SYS_MGR_DBUS_BUS" --print-reply \
+        --dest=org.freedesktop.DBus / org.freedesktop.DBus.GetNameOwner \
+        string:com.SystemManager.Service >/dev/null 2>&1; do
+    i=$((i + 1))
+    if [ $i -gt 50 ] || ! kill -0 "$MGR_PID" 2>/dev/null; then
+        echo "sys-mgr did not come up:" >&2
+        tail -n 20 "$RUN_DIR/sys-mgr.log" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+"$SYS_UTILS" load "$@"
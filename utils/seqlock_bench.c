@@ -0,0 +1,282 @@
+/**
+ * @file seqlock_bench.c
+ *
+ * Attitude publication micro-benchmark: a writer publishing at the IMU rate
+ * against N readers copying the attitude in a loop, with a mutex (what
+ * angles_lock was) and with the seqlock imu.c now uses.
+ *
+ *   sys-utils seqlock-bench [-r max readers] [-z hz] [-t seconds]
+ *
+ * Reader counts double from 0 up to max readers. "publish" is the time the
+ * writer spends in one publication, "late" how far its wake-ups are behind
+ * the period grid, both what the sensor thread would lose. Every reader
+ * checks each copy for consistency, "torn" must stay 0.
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+// #define LOG_LEVEL LOG_LEVEL_TRACE
+#if defined(LOG_LEVEL)
+#warning "LOG_LEVEL defined locally will override the global setting in this file"
+#endif
+#include <log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <getopt.h>
+
+#include <comm/seqlock.h>
+#include <hw/imu_fusion.h>
+#include <sched/clock.h>
+#include "sys_utils.h"
+
+/*********************
+ *      DEFINES
+ *********************/
+#define SEQ_BENCH_DEFAULT_READERS       4
+#define SEQ_BENCH_DEFAULT_HZ            1000
+#define SEQ_BENCH_DEFAULT_SECONDS       2
+#define SEQ_BENCH_MAX_READERS           64
+#define SEQ_BENCH_MAX_HZ                100000
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+enum seq_bench_mode {
+    SEQ_BENCH_MUTEX = 0,
+    SEQ_BENCH_SEQLOCK,
+};
+
+struct seq_bench {
+    enum seq_bench_mode mode;
+    pthread_mutex_t lock;
+    struct seqlock seq;
+    struct imu_attitude att;
+
+    atomic_bool stop;
+    atomic_uint_fast64_t reads;
+    atomic_uint_fast64_t retries;
+    atomic_uint_fast64_t torn;
+};
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+static const char *mode_names[] = {
+    [SEQ_BENCH_MUTEX] = "mutex",
+    [SEQ_BENCH_SEQLOCK] = "seqlock",
+};
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Every field of a publication carries the same value, a mix is a torn copy */
+static void att_fill(struct imu_attitude *att, uint32_t n)
+{
+    att->type = n;
+    for (int32_t i = 0; i < 4; i++)
+        att->q[i] = (float)n;
+    att->angles.roll = att->angles.pitch = att->angles.yaw = (float)n;
+}
+
+static bool att_consistent(const struct imu_attitude *att)
+{
+    float v = (float)att->type;
+
+    return att->q[0] == v && att->q[1] == v && att->q[2] == v && att->q[3] == v && \
+           att->angles.roll == v && att->angles.pitch == v && att->angles.yaw == v;
+}
+
+static void *reader_thread(void *arg)
+{
+    struct seq_bench *b = arg;
+    struct imu_attitude att;
+    uint64_t reads = 0, retries = 0, torn = 0;
+
+    while (!atomic_load_explicit(&b->stop, memory_order_relaxed)) {
+        if (b->mode == SEQ_BENCH_MUTEX) {
+            pthread_mutex_lock(&b->lock);
+            att = b->att;
+            pthread_mutex_unlock(&b->lock);
+        } else {
+            retries += seqlock_load(&b->seq, &att, &b->att, sizeof(att));
+        }
+
+        if (!att_consistent(&att))
+            torn++;
+        reads++;
+    }
+
+    atomic_fetch_add(&b->reads, reads);
+    atomic_fetch_add(&b->retries, retries);
+    atomic_fetch_add(&b->torn, torn);
+    return NULL;
+}
+
+static void bench_publish(struct seq_bench *b, uint32_t n)
+{
+    struct imu_attitude att;
+
+    att_fill(&att, n);
+    if (b->mode == SEQ_BENCH_MUTEX) {
+        pthread_mutex_lock(&b->lock);
+        b->att = att;
+        pthread_mutex_unlock(&b->lock);
+    } else {
+        seqlock_store(&b->seq, &b->att, &att, sizeof(att));
+    }
+}
+
+/*
+ * The writer runs in the calling thread on an absolute period grid, like the
+ * polled IMU loop, and records its publish time and wake-up lateness.
+ */
+static int32_t bench_run(enum seq_bench_mode mode, int32_t readers, int32_t hz, \
+                         int32_t seconds, uint32_t *pub_ns, uint32_t *late_ns)
+{
+    struct seq_bench b;
+    pthread_t threads[SEQ_BENCH_MAX_READERS];
+    struct timespec deadline;
+    uint64_t period = 1000000000ULL / hz, t0, t1, dl, start, sum = 0, reads;
+    uint32_t samples = (uint32_t)hz * (uint32_t)seconds;
+    int32_t started = 0, ret = 0;
+
+    memset(&b, 0, sizeof(b));
+    b.mode = mode;
+    pthread_mutex_init(&b.lock, NULL);
+    seqlock_init(&b.seq);
+    att_fill(&b.att, 0);
+    atomic_init(&b.stop, false);
+
+    for (; started < readers; started++) {
+        if (pthread_create(&threads[started], NULL, reader_thread, &b)) {
+            LOG_ERROR("Cannot start reader %d", started);
+            ret = -EAGAIN;
+            break;
+        }
+    }
+
+    start = now_ns() + period;
+    for (uint32_t i = 0; !ret && i < samples; i++) {
+        dl = start + i * period;
+        deadline.tv_sec = (time_t)(dl / 1000000000ULL);
+        deadline.tv_nsec = (long)(dl % 1000000000ULL);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+            ;
+
+        t0 = now_ns();
+        bench_publish(&b, i + 1);
+        t1 = now_ns();
+
+        pub_ns[i] = (uint32_t)(t1 - t0);
+        late_ns[i] = t0 > dl ? (uint32_t)(t0 - dl) : 0;
+    }
+
+    atomic_store(&b.stop, true);
+    for (int32_t i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&b.lock);
+    if (ret)
+        return ret;
+
+    qsort(pub_ns, samples, sizeof(*pub_ns), cmp_u32);
+    qsort(late_ns, samples, sizeof(*late_ns), cmp_u32);
+
+    for (uint32_t i = 0; i < samples; i++)
+        sum += pub_ns[i];
+
+    reads = atomic_load(&b.reads);
+    printf("%-8s %7d %9.0f %9u %9u %9.1f %9.1f %12.0f %9.4f %6llu\n",
+           mode_names[mode], readers, (double)sum / samples,
+           pub_ns[samples * 99 / 100], pub_ns[samples - 1],
+           late_ns[samples * 99 / 100] / 1e3, late_ns[samples - 1] / 1e3,
+           reads / (double)seconds,
+           reads ? (double)atomic_load(&b.retries) / reads : 0.0,
+           (unsigned long long)atomic_load(&b.torn));
+    fflush(stdout);
+
+    return 0;
+}
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+int32_t run_seqlock_bench(int32_t argc, char **argv)
+{
+    int32_t opt, readers = SEQ_BENCH_DEFAULT_READERS, hz = SEQ_BENCH_DEFAULT_HZ;
+    int32_t seconds = SEQ_BENCH_DEFAULT_SECONDS, ret = 0;
+    uint32_t *pub_ns, *late_ns;
+
+    while ((opt = getopt(argc, argv, "r:z:t:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            readers = atoi(optarg);
+            break;
+        case 'z':
+            hz = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        default:
+            printf("Usage: sys-utils seqlock-bench [-r max readers] [-z hz] " \
+                   "[-t seconds]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (readers < 0 || readers > SEQ_BENCH_MAX_READERS || hz <= 0 || \
+        hz > SEQ_BENCH_MAX_HZ || seconds <= 0 || seconds > 60) {
+        LOG_ERROR("Invalid readers, rate or duration");
+        return EXIT_FAILURE;
+    }
+
+    pub_ns = malloc((size_t)hz * seconds * sizeof(*pub_ns));
+    late_ns = malloc((size_t)hz * seconds * sizeof(*late_ns));
+    if (!pub_ns || !late_ns) {
+        free(pub_ns);
+        free(late_ns);
+        return EXIT_FAILURE;
+    }
+
+    printf("writer at %d Hz for %d s per run, publish in ns, late in us\n", hz, seconds);
+    printf("%-8s %7s %9s %9s %9s %9s %9s %12s %9s %6s\n", "mode", "readers",
+           "pub avg", "pub p99", "pub max", "late p99", "late max", "reads/s",
+           "retries", "torn");
+
+    for (int32_t n = 0; !ret && n <= readers; n = n ? n * 2 : 1) {
+        for (int32_t mode = SEQ_BENCH_MUTEX; !ret && mode <= SEQ_BENCH_SEQLOCK; mode++)
+            ret = bench_run((enum seq_bench_mode)mode, n, hz, seconds, pub_ns, late_ns);
+    }
+
+    free(pub_ns);
+    free(late_ns);
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -16,129 +16,47 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <comm/dbus_comm.h>
+#include <comm/cmd_batch.h>
+#include <comm/p2p_comm.h>
+#include <comm/shm_ring.h>
+#include <hw/imu.h>
 #include <sched/task.h>
+#include <sched/clock.h>
+#include "sys_utils.h"
 
-// Encode remote_cmd_t into an existing DBusMessage
-bool encode_data_frame(DBusMessage *msg, const remote_cmd_t *cmd)
-{
-    DBusMessageIter iter, array_iter, struct_iter, variant_iter;
-
-    dbus_message_iter_init_append(msg, &iter);
-
-    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &cmd->component_id);
-    dbus_message_iter_append_basic(&iter, DBUS_TYPE_INT32, &cmd->umid);
-    dbus_message_iter_append_basic(&iter, DBUS_TYPE_INT32, &cmd->opcode);
-
-    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(siiv)", &array_iter);
-
-    for (int32_t i = 0; i < cmd->entry_count; ++i) {
-        const payload_t *entry = &cmd->entries[i];
-
-        dbus_message_iter_open_container(&array_iter, DBUS_TYPE_STRUCT, NULL, &struct_iter);
-
-        dbus_message_iter_append_basic(&struct_iter, DBUS_TYPE_STRING, &entry->key);
-        dbus_message_iter_append_basic(&struct_iter, DBUS_TYPE_INT32, &entry->data_type);
-        dbus_message_iter_append_basic(&struct_iter, DBUS_TYPE_INT32, &entry->data_length);
-
-        const char *sig = NULL;
-        switch (entry->data_type) {
-            case DBUS_TYPE_STRING: sig = "s"; break;
-            case DBUS_TYPE_INT32:  sig = "i"; break;
-            case DBUS_TYPE_UINT32: sig = "u"; break;
-            case DBUS_TYPE_DOUBLE: sig = "d"; break;
-            default:
-                LOG_ERROR("Unsupported data_type %d for key '%s'", entry->data_type, entry->key);
-                return false;
-        }
-
-        dbus_message_iter_open_container(&struct_iter, DBUS_TYPE_VARIANT, sig, &variant_iter);
-
-        switch (entry->data_type) {
-            case DBUS_TYPE_STRING:
-                dbus_message_iter_append_basic(&variant_iter, DBUS_TYPE_STRING, &entry->value.str);
-                break;
-            case DBUS_TYPE_INT32:
-                dbus_message_iter_append_basic(&variant_iter, DBUS_TYPE_INT32, &entry->value.i32);
-                break;
-            case DBUS_TYPE_UINT32:
-                dbus_message_iter_append_basic(&variant_iter, DBUS_TYPE_UINT32, &entry->value.u32);
-                break;
-            case DBUS_TYPE_DOUBLE:
-                dbus_message_iter_append_basic(&variant_iter, DBUS_TYPE_DOUBLE, &entry->value.dbl);
-                break;
-        }
-
-        dbus_message_iter_close_container(&struct_iter, &variant_iter);
-        dbus_message_iter_close_container(&array_iter, &struct_iter);
-    }
-
-    dbus_message_iter_close_container(&iter, &array_iter);
-    return true;
-}
-
-// Decode DBusMessage into remote_cmd_t
-bool decode_data_frame(DBusMessage *msg, remote_cmd_t *out)
+/*
+ * Connect to the bus selected by SYS_MGR_DBUS_BUS ("system", "session" or
+ * an address), the same variable sys-mgr reads, so both ends of a test run
+ * can be pointed at a private dbus-daemon.
+ */
+DBusConnection *sys_utils_bus_get(DBusError *err)
 {
-    DBusMessageIter iter, array_iter, struct_iter, variant_iter;
-
-    if (!dbus_message_iter_init(msg, &iter)) {
-        LOG_ERROR("Failed to init DBus iterator");
-        return false;
-    }
-
-    dbus_message_iter_get_basic(&iter, &out->component_id);
-    dbus_message_iter_next(&iter);
-
-    dbus_message_iter_get_basic(&iter, &out->umid);
-    dbus_message_iter_next(&iter);
-
-    dbus_message_iter_get_basic(&iter, &out->opcode);
-    dbus_message_iter_next(&iter);
-
-    dbus_message_iter_recurse(&iter, &array_iter);
-
-    int32_t i = 0;
-    while (dbus_message_iter_get_arg_type(&array_iter) == DBUS_TYPE_STRUCT && i < MAX_ENTRIES) {
-        payload_t *entry = &out->entries[i];
-        dbus_message_iter_recurse(&array_iter, &struct_iter);
-
-        dbus_message_iter_get_basic(&struct_iter, &entry->key);
-        dbus_message_iter_next(&struct_iter);
-
-        dbus_message_iter_get_basic(&struct_iter, &entry->data_type);
-        dbus_message_iter_next(&struct_iter);
+    DBusConnection *conn;
+    const char *bus;
 
-        dbus_message_iter_get_basic(&struct_iter, &entry->data_length);
-        dbus_message_iter_next(&struct_iter);
+    bus = getenv(SYS_MGR_DBUS_BUS_ENV);
+    if (!bus || !bus[0] || strcmp(bus, "system") == 0)
+        return dbus_bus_get(DBUS_BUS_SYSTEM, err);
+    if (strcmp(bus, "session") == 0)
+        return dbus_bus_get(DBUS_BUS_SESSION, err);
 
-        dbus_message_iter_recurse(&struct_iter, &variant_iter);
+    conn = dbus_connection_open(bus, err);
+    if (!conn)
+        return NULL;
 
-        switch (entry->data_type) {
-            case DBUS_TYPE_STRING:
-                dbus_message_iter_get_basic(&variant_iter, &entry->value.str);
-                break;
-            case DBUS_TYPE_INT32:
-                dbus_message_iter_get_basic(&variant_iter, &entry->value.i32);
-                break;
-            case DBUS_TYPE_UINT32:
-                dbus_message_iter_get_basic(&variant_iter, &entry->value.u32);
-                break;
-            case DBUS_TYPE_DOUBLE:
-                dbus_message_iter_get_basic(&variant_iter, &entry->value.dbl);
-                break;
-            default:
-                LOG_WARN("Unsupported type %d for entry %d", entry->data_type, i);
-                break;
-        }
-
-        dbus_message_iter_next(&array_iter);
-        i++;
+    if (!dbus_bus_register(conn, err)) {
+        dbus_connection_unref(conn);
+        return NULL;
     }
 
-    out->entry_count = i;
-    return true;
+    return conn;
 }
 
 // Create a method cmd to send via method call
@@ -147,6 +65,8 @@ void create_method_frame(remote_cmd_t *cmd)
     cmd->component_id = "terminal-ui";
     cmd->umid = 1001;
     cmd->opcode = OP_SET_BRIGHTNESS;
+    cmd->flow = BLOCK;
+    cmd->duration = SHORT;
     cmd->entry_count = 2;
 
     cmd->entries[0].key = "backlight";
@@ -166,6 +86,8 @@ void create_signal_frame(remote_cmd_t *cmd)
     cmd->component_id = "terminal-ui";
     cmd->umid = 1001;
     cmd->opcode = OP_SET_BRIGHTNESS;
+    cmd->flow = BLOCK;
+    cmd->duration = SHORT;
     cmd->entry_count = 2;
 
     cmd->entries[0].key = "backlight";
@@ -200,7 +122,7 @@ int32_t send_method_call(DBusConnection *conn)
 
     create_method_frame(&cmd);
 
-    if (!encode_data_frame(msg, &cmd)) {
+    if (frame_encode(msg, &cmd)) {
         LOG_ERROR("Failed to encode data frame");
         dbus_message_unref(msg);
         return EXIT_FAILURE;
@@ -256,7 +178,7 @@ int32_t send_signal(DBusConnection *conn)
 
     create_signal_frame(&cmd);
 
-    if (!encode_data_frame(msg, &cmd)) {
+    if (frame_encode(msg, &cmd)) {
         LOG_ERROR("Failed to encode data frame");
         dbus_message_unref(msg);
         return EXIT_FAILURE;
@@ -275,6 +197,865 @@ int32_t send_signal(DBusConnection *conn)
     return EXIT_SUCCESS;
 }
 
+// Ask sys-mgr for the path of its peer socket
+int32_t p2p_discover(DBusConnection *conn, char *path, size_t path_len)
+{
+    DBusMessage *msg, *reply;
+    DBusError err;
+    const char *reply_path = NULL;
+
+    msg = dbus_message_new_method_call(SYS_MGR_DBUS_SER,
+                                       SYS_MGR_DBUS_OBJ_PATH,
+                                       SYS_MGR_DBUS_IFACE,
+                                       SYS_MGR_DBUS_P2P_METH);
+    if (!msg)
+        return -1;
+
+    dbus_error_init(&err);
+    reply = dbus_connection_send_with_reply_and_block(conn, msg, 1000, &err);
+    dbus_message_unref(msg);
+    if (!reply) {
+        LOG_ERROR("Peer discovery failed: %s", err.message);
+        dbus_error_free(&err);
+        return -1;
+    }
+
+    if (!dbus_message_get_args(reply, &err, DBUS_TYPE_STRING, &reply_path,
+                               DBUS_TYPE_INVALID)) {
+        LOG_ERROR("Invalid discovery reply: %s", err.message);
+        dbus_error_free(&err);
+        dbus_message_unref(reply);
+        return -1;
+    }
+
+    snprintf(path, path_len, "%s", reply_path);
+    dbus_message_unref(reply);
+    return 0;
+}
+
+// Send the method frame over the peer socket and wait for each reply
+int32_t send_p2p_calls(DBusConnection *conn, int32_t count)
+{
+    struct sockaddr_un addr;
+    struct timespec t_start, t_end;
+    DBusMessage *msg, *reply;
+    DBusError err;
+    remote_cmd_t cmd;
+    char *buf = NULL;
+    int32_t len, fd, i, ok = 0;
+    ssize_t n;
+    double elapsed_us;
+    char *rx;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (p2p_discover(conn, addr.sun_path, sizeof(addr.sun_path)))
+        return EXIT_FAILURE;
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        LOG_ERROR("Failed to connect peer socket %s", addr.sun_path);
+        if (fd >= 0)
+            close(fd);
+        return EXIT_FAILURE;
+    }
+    LOG_INFO("Connected to peer socket %s", addr.sun_path);
+
+    rx = malloc(P2P_MAX_PACKET);
+    if (!rx) {
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    create_method_frame(&cmd);
+    dbus_error_init(&err);
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    for (i = 0; i < count; i++) {
+        msg = dbus_message_new_method_call(SYS_MGR_DBUS_SER,
+                                           SYS_MGR_DBUS_OBJ_PATH,
+                                           SYS_MGR_DBUS_IFACE,
+                                           SYS_MGR_DBUS_METH);
+        if (!msg)
+            break;
+
+        cmd.umid = i;
+        if (frame_encode(msg, &cmd)) {
+            dbus_message_unref(msg);
+            break;
+        }
+        dbus_message_set_serial(msg, i + 1);
+        if (!dbus_message_marshal(msg, &buf, &len)) {
+            dbus_message_unref(msg);
+            break;
+        }
+        dbus_message_unref(msg);
+
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        dbus_free(buf);
+        if (n != len)
+            break;
+
+        n = recv(fd, rx, P2P_MAX_PACKET, 0);
+        if (n <= 0)
+            break;
+
+        reply = dbus_message_demarshal(rx, n, &err);
+        if (!reply) {
+            LOG_ERROR("Invalid peer reply: %s", err.message);
+            dbus_error_free(&err);
+            break;
+        }
+
+        if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+            dbus_message_get_reply_serial(reply) == (uint32_t)(i + 1))
+            ok++;
+        dbus_message_unref(reply);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+
+    elapsed_us = (t_end.tv_sec - t_start.tv_sec) * 1e6 +
+                 (t_end.tv_nsec - t_start.tv_nsec) / 1e3;
+    LOG_INFO("Peer calls: %d/%d replied, avg round trip %.1f us", ok, count,
+             i ? elapsed_us / i : 0.0);
+
+    free(rx);
+    close(fd);
+    return ok == count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Map the IMU sample ring and read count samples from it, appended to the
+ * file at path when given (a recording for "sys-utils fusion-bench")
+ */
+int32_t read_sensor_stream(DBusConnection *conn, int32_t count, const char *path)
+{
+    struct shm_ring ring;
+    struct imu_sample sample;
+    DBusMessage *msg, *reply;
+    DBusError err;
+    FILE *fp = NULL;
+    int32_t mem_fd = -1, event_fd = -1, got = 0;
+    uint32_t slot_size = 0, slot_count = 0;
+    uint64_t cursor, lost = 0, wakeups = 0;
+
+    msg = dbus_message_new_method_call(SYS_MGR_DBUS_SER,
+                                       SYS_MGR_DBUS_OBJ_PATH,
+                                       SYS_MGR_DBUS_IFACE,
+                                       SYS_MGR_DBUS_STREAM_METH);
+    if (!msg)
+        return EXIT_FAILURE;
+
+    dbus_error_init(&err);
+    reply = dbus_connection_send_with_reply_and_block(conn, msg, 1000, &err);
+    dbus_message_unref(msg);
+    if (!reply) {
+        LOG_ERROR("Stream request failed: %s", err.message);
+        dbus_error_free(&err);
+        return EXIT_FAILURE;
+    }
+
+    if (!dbus_message_get_args(reply, &err,
+                               DBUS_TYPE_UNIX_FD, &mem_fd,
+                               DBUS_TYPE_UNIX_FD, &event_fd,
+                               DBUS_TYPE_UINT32, &slot_size,
+                               DBUS_TYPE_UINT32, &slot_count,
+                               DBUS_TYPE_INVALID)) {
+        LOG_ERROR("Invalid stream reply: %s", err.message);
+        dbus_error_free(&err);
+        dbus_message_unref(reply);
+        return EXIT_FAILURE;
+    }
+    dbus_message_unref(reply);
+
+    if (slot_size != sizeof(sample) || shm_ring_attach(&ring, mem_fd, event_fd)) {
+        LOG_ERROR("Incompatible stream (slot %u bytes)", slot_size);
+        close(mem_fd);
+        close(event_fd);
+        return EXIT_FAILURE;
+    }
+    LOG_INFO("Attached to sensor stream: %u slots x %u bytes",
+             slot_count, slot_size);
+
+    if (path) {
+        fp = fopen(path, "wb");
+        if (!fp) {
+            LOG_ERROR("Cannot create %s: %s", path, strerror(errno));
+            shm_ring_destroy(&ring);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Only new samples, the history already in the ring is skipped
+    cursor = shm_ring_head(&ring);
+    while (got < count) {
+        if (shm_ring_read(&ring, &cursor, &sample, &lost) == 0) {
+            got++;
+            if (fp && fwrite(&sample, sizeof(sample), 1, fp) != 1) {
+                LOG_ERROR("Write to %s failed", path);
+                break;
+            }
+            LOG_DEBUG("#%llu t=%llu roll=%.2f pitch=%.2f yaw=%.2f",
+                      (unsigned long long)cursor - 1,
+                      (unsigned long long)sample.ts_ns,
+                      sample.angles.roll, sample.angles.pitch,
+                      sample.angles.yaw);
+            continue;
+        }
+
+        if (shm_ring_wait(&ring, 2000) == -ETIMEDOUT) {
+            LOG_WARN("No sample for 2 s, stopping");
+            break;
+        }
+        wakeups++;
+    }
+
+    LOG_INFO("Stream: %d samples, %llu lost, %llu wake-ups", got,
+             (unsigned long long)lost, (unsigned long long)wakeups);
+    if (fp)
+        fclose(fp);
+    shm_ring_destroy(&ring);
+    return got == count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Fill cmds with the commands of the sample batch
+static uint32_t create_batch_frames(remote_cmd_t *cmds)
+{
+    static const uint32_t opcodes[] = {
+        OP_SET_BRIGHTNESS, OP_GET_BRIGHTNESS, OP_PING,
+    };
+    uint32_t i;
+
+    for (i = 0; i < sizeof(opcodes) / sizeof(opcodes[0]); i++) {
+        memset(&cmds[i], 0, sizeof(cmds[i]));
+        create_method_frame(&cmds[i]);
+        cmds[i].umid = 2001 + i;
+        cmds[i].opcode = opcodes[i];
+        if (opcodes[i] != OP_SET_BRIGHTNESS)
+            cmds[i].entry_count = 0;
+    }
+
+    return i;
+}
+
+// Send one batch frame, return the aggregated status or -1 on failure
+static int32_t send_batch_call(DBusConnection *conn, struct frame_batch *batch,
+                               bool verbose)
+{
+    DBusMessage *msg, *reply;
+    DBusMessageIter iter, array, st;
+    DBusError err;
+    int32_t status, umid, result;
+
+    msg = dbus_message_new_method_call(SYS_MGR_DBUS_SER,
+                                       SYS_MGR_DBUS_OBJ_PATH,
+                                       SYS_MGR_DBUS_IFACE,
+                                       SYS_MGR_DBUS_BATCH_METH);
+    if (!msg)
+        return -1;
+
+    if (frame_encode_batch(msg, batch)) {
+        LOG_ERROR("Failed to encode batch frame");
+        dbus_message_unref(msg);
+        return -1;
+    }
+
+    dbus_error_init(&err);
+    reply = dbus_connection_send_with_reply_and_block(conn, msg, 2000, &err);
+    dbus_message_unref(msg);
+    if (!reply) {
+        LOG_ERROR("Batch call failed: %s", err.message);
+        dbus_error_free(&err);
+        return -1;
+    }
+
+    if (strcmp(dbus_message_get_signature(reply),
+               CMD_BATCH_REPLY_SIGNATURE) != 0) {
+        LOG_ERROR("Invalid batch reply '%s'", dbus_message_get_signature(reply));
+        dbus_message_unref(reply);
+        return -1;
+    }
+
+    dbus_message_iter_init(reply, &iter);
+    dbus_message_iter_get_basic(&iter, &status);
+    dbus_message_iter_next(&iter);
+    dbus_message_iter_recurse(&iter, &array);
+    while (verbose &&
+           dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT) {
+        dbus_message_iter_recurse(&array, &st);
+        dbus_message_iter_get_basic(&st, &umid);
+        dbus_message_iter_next(&st);
+        dbus_message_iter_get_basic(&st, &result);
+        LOG_INFO("  umid %d: %d", umid, result);
+        dbus_message_iter_next(&array);
+    }
+
+    dbus_message_unref(reply);
+    return status;
+}
+
+// Single method call with the given frame, blocking until the reply
+static int32_t send_single_call(DBusConnection *conn, const remote_cmd_t *cmd)
+{
+    DBusMessage *msg, *reply;
+    DBusError err;
+
+    msg = dbus_message_new_method_call(SYS_MGR_DBUS_SER,
+                                       SYS_MGR_DBUS_OBJ_PATH,
+                                       SYS_MGR_DBUS_IFACE,
+                                       SYS_MGR_DBUS_METH);
+    if (!msg || frame_encode(msg, cmd)) {
+        if (msg)
+            dbus_message_unref(msg);
+        return -1;
+    }
+
+    dbus_error_init(&err);
+    reply = dbus_connection_send_with_reply_and_block(conn, msg, 2000, &err);
+    dbus_message_unref(msg);
+    if (!reply) {
+        dbus_error_free(&err);
+        return -1;
+    }
+
+    dbus_message_unref(reply);
+    return 0;
+}
+
+/*
+ * Send the sample batch once, then time count groups of pings sent as one
+ * batch and as single calls. The pings take the workqueue path so that both
+ * are timed to completion: a batch reply waits for its commands to complete
+ * and a workqueue ping is answered once it ran.
+ */
+int32_t send_batch_calls(DBusConnection *conn, int32_t argc, char **argv)
+{
+    remote_cmd_t cmds[FRAME_BATCH_MAX], pings[FRAME_BATCH_MAX];
+    struct frame_batch batch;
+    struct timespec t0, t1, t2;
+    int32_t i, count = 1, status = 0, fail = 0;
+    double batch_us, single_us;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.component_id = "terminal-ui";
+    batch.umid = 2000;
+    batch.mode = FRAME_BATCH_ORDERED;
+    if (argc > 1 && strcmp(argv[1], "parallel") == 0)
+        batch.mode = FRAME_BATCH_PARALLEL;
+    if (argc > 2)
+        count = atoi(argv[2]);
+    if (count <= 0)
+        count = 1;
+
+    batch.count = create_batch_frames(cmds);
+    for (i = 0; i < (int32_t)batch.count; i++)
+        batch.cmds[i] = &cmds[i];
+
+    LOG_INFO("Batch of %u commands, %s", batch.count,
+             batch.mode == FRAME_BATCH_ORDERED ? "ordered" : "parallel");
+    status = send_batch_call(conn, &batch, true);
+    LOG_INFO("Batch status: %d", status);
+    if (status == -1)
+        return EXIT_FAILURE;
+
+    for (i = 0; i < (int32_t)batch.count; i++) {
+        memset(&pings[i], 0, sizeof(pings[i]));
+        pings[i].component_id = batch.component_id;
+        pings[i].umid = 3001 + i;
+        pings[i].opcode = OP_PING;
+        pings[i].flow = BLOCK;
+        pings[i].duration = SHORT;
+        pings[i].entry_count = 1;
+        pings[i].entries[0].key = PING_PATH_KEY;
+        pings[i].entries[0].data_type = DBUS_TYPE_STRING;
+        pings[i].entries[0].value.str = PING_PATH_WORKQUEUE;
+        batch.cmds[i] = &pings[i];
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < count; i++) {
+        batch.umid = 2000 + i;
+        if (send_batch_call(conn, &batch, false) == -1)
+            fail++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for (i = 0; i < count; i++) {
+        for (uint32_t j = 0; j < batch.count; j++) {
+            if (send_single_call(conn, &pings[j]))
+                fail++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    batch_us = (t1.tv_sec - t0.tv_sec) * 1e6 +
+               (t1.tv_nsec - t0.tv_nsec) / 1e3;
+    single_us = (t2.tv_sec - t1.tv_sec) * 1e6 +
+                (t2.tv_nsec - t1.tv_nsec) / 1e3;
+    LOG_INFO("%d group(s) of %u pings: batch %.1f us, single calls %.1f us, "
+             "%d failed",
+             count, batch.count, batch_us / count, single_us / count, fail);
+
+    return fail ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Send one ping, fill the server stamps, return the round trip in ns
+static int64_t send_ping_call(DBusConnection *conn, const remote_cmd_t *cmd,
+                              struct ping_stamps *ps, uint64_t *t_send)
+{
+    DBusMessage *msg, *reply;
+    DBusMessageIter iter, var, st;
+    DBusError err;
+    uint64_t *stamp[] = {
+        &ps->rx_ns, &ps->enqueue_ns, &ps->dequeue_ns, &ps->reply_ns,
+    };
+    uint64_t t_recv;
+
+    msg = dbus_message_new_method_call(SYS_MGR_DBUS_SER,
+                                       SYS_MGR_DBUS_OBJ_PATH,
+                                       SYS_MGR_DBUS_IFACE,
+                                       SYS_MGR_DBUS_METH);
+    if (!msg || frame_encode(msg, cmd)) {
+        if (msg)
+            dbus_message_unref(msg);
+        return -1;
+    }
+
+    dbus_error_init(&err);
+    *t_send = now_ns();
+    reply = dbus_connection_send_with_reply_and_block(conn, msg, 1000, &err);
+    t_recv = now_ns();
+    dbus_message_unref(msg);
+    if (!reply) {
+        LOG_ERROR("Ping failed: %s", err.message);
+        dbus_error_free(&err);
+        return -1;
+    }
+
+    if (strcmp(dbus_message_get_signature(reply), "sv") != 0) {
+        LOG_ERROR("Unexpected ping reply '%s'",
+                  dbus_message_get_signature(reply));
+        dbus_message_unref(reply);
+        return -1;
+    }
+
+    dbus_message_iter_init(reply, &iter);
+    dbus_message_iter_next(&iter);
+    dbus_message_iter_recurse(&iter, &var);
+    if (strcmp(dbus_message_iter_get_signature(&var), PING_STAMPS_SIGNATURE)) {
+        dbus_message_unref(reply);
+        return -1;
+    }
+
+    dbus_message_iter_recurse(&var, &st);
+    for (uint32_t i = 0; i < 4; i++) {
+        dbus_message_iter_get_basic(&st, stamp[i]);
+        dbus_message_iter_next(&st);
+    }
+
+    dbus_message_unref(reply);
+    return t_recv - *t_send;
+}
+
+/*
+ * Break the ping round trip down with the server timestamps. Client and
+ * server share CLOCK_MONOTONIC on the same host:
+ *   bus in    send -> listener receipt
+ *   dispatch  receipt -> enqueue (decode, push)
+ *   queue     enqueue -> dequeue by the task handler
+ *   handler   dequeue -> reply built
+ *   bus out   reply built -> reply received
+ */
+int32_t send_ping_calls(DBusConnection *conn, int32_t argc, char **argv)
+{
+    static const char *names[] = {
+        "bus in", "dispatch", "queue", "handler", "bus out", "total",
+    };
+    const int32_t n_parts = sizeof(names) / sizeof(names[0]);
+    struct ping_stamps ps;
+    remote_cmd_t cmd;
+    uint64_t *part[sizeof(names) / sizeof(names[0])];
+    uint64_t t_send, sum;
+    int64_t rtt;
+    int32_t i, count = 1000, got = 0;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.component_id = "terminal-ui";
+    cmd.opcode = OP_PING;
+    cmd.flow = BLOCK;
+    cmd.duration = SHORT;
+    cmd.entry_count = 1;
+    cmd.entries[0].key = PING_PATH_KEY;
+    cmd.entries[0].data_type = DBUS_TYPE_STRING;
+    cmd.entries[0].value.str = PING_PATH_INLINE;
+    if (argc > 1 && strcmp(argv[1], PING_PATH_WORKQUEUE) == 0)
+        cmd.entries[0].value.str = PING_PATH_WORKQUEUE;
+    if (argc > 2)
+        count = atoi(argv[2]);
+    if (count <= 0)
+        count = 1000;
+
+    for (i = 0; i < n_parts; i++) {
+        part[i] = calloc(count, sizeof(uint64_t));
+        if (!part[i]) {
+            while (i--)
+                free(part[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        cmd.umid = i;
+        rtt = send_ping_call(conn, &cmd, &ps, &t_send);
+        if (rtt < 0)
+            continue;
+
+        part[0][got] = ps.rx_ns - t_send;
+        part[1][got] = ps.enqueue_ns - ps.rx_ns;
+        part[2][got] = ps.dequeue_ns - ps.enqueue_ns;
+        part[3][got] = ps.reply_ns - ps.dequeue_ns;
+        part[4][got] = t_send + rtt - ps.reply_ns;
+        part[5][got] = rtt;
+        got++;
+    }
+
+    printf("ping via %s: %d/%d replied\n", cmd.entries[0].value.str, got, count);
+    if (got) {
+        printf("%-10s %10s %10s %10s %10s\n", "us", "min", "p50", "p99", "avg");
+        for (i = 0; i < n_parts; i++) {
+            sum = 0;
+            for (int32_t j = 0; j < got; j++)
+                sum += part[i][j];
+            qsort(part[i], got, sizeof(uint64_t), cmp_u64);
+            printf("%-10s %10.1f %10.1f %10.1f %10.1f\n", names[i],
+                   part[i][0] / 1e3, part[i][got / 2] / 1e3,
+                   part[i][(uint64_t)got * 99 / 100] / 1e3,
+                   (double)sum / got / 1e3);
+        }
+    }
+
+    for (i = 0; i < n_parts; i++)
+        free(part[i]);
+    return got == count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Print the per-client workqueue counters of sys-mgr
+int32_t print_queue_stats(DBusConnection *conn)
+{
+    DBusMessage *msg, *reply;
+    DBusMessageIter iter, array, st;
+    DBusError err;
+    const char *name;
+    uint32_t u[4];
+    uint64_t t[5];
+
+    msg = dbus_message_new_method_call(SYS_MGR_DBUS_SER,
+                                       SYS_MGR_DBUS_OBJ_PATH,
+                                       SYS_MGR_DBUS_IFACE,
+                                       SYS_MGR_DBUS_QSTATS_METH);
+    if (!msg)
+        return EXIT_FAILURE;
+
+    dbus_error_init(&err);
+    reply = dbus_connection_send_with_reply_and_block(conn, msg, 1000, &err);
+    dbus_message_unref(msg);
+    if (!reply) {
+        LOG_ERROR("Queue stats request failed: %s", err.message);
+        dbus_error_free(&err);
+        return EXIT_FAILURE;
+    }
+
+    if (strcmp(dbus_message_get_signature(reply),
+               SYS_MGR_QSTATS_SIGNATURE) != 0) {
+        LOG_ERROR("Invalid queue stats reply");
+        dbus_message_unref(reply);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-16s %6s %6s %6s %6s %10s %10s %8s %10s %10s\n", "client",
+           "weight", "quota", "depth", "peak", "enqueued", "dequeued",
+           "dropped", "wait avg", "wait max");
+    dbus_message_iter_init(reply, &iter);
+    dbus_message_iter_recurse(&iter, &array);
+    while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT) {
+        dbus_message_iter_recurse(&array, &st);
+        dbus_message_iter_get_basic(&st, &name);
+        for (int32_t i = 0; i < 4; i++) {
+            dbus_message_iter_next(&st);
+            dbus_message_iter_get_basic(&st, &u[i]);
+        }
+        for (int32_t i = 0; i < 5; i++) {
+            dbus_message_iter_next(&st);
+            dbus_message_iter_get_basic(&st, &t[i]);
+        }
+
+        printf("%-16s %6u %6u %6u %6u %10llu %10llu %8llu %8.1fus %8.1fus\n",
+               name, u[0], u[1], u[2], u[3], (unsigned long long)t[0],
+               (unsigned long long)t[1], (unsigned long long)t[2],
+               t[1] ? t[3] / 1e3 / t[1] : 0.0, t[4] / 1e3);
+        dbus_message_iter_next(&array);
+    }
+
+    dbus_message_unref(reply);
+    return EXIT_SUCCESS;
+}
+
+// Print the outbound method call counters of sys-mgr
+int32_t print_call_stats(DBusConnection *conn)
+{
+    DBusMessage *msg, *reply;
+    DBusError err;
+    uint64_t sent, replied, errors, timeouts, cancelled, unmatched, untracked;
+    uint64_t rtt_min, rtt_max, rtt_sum;
+    uint32_t in_flight, peak;
+    int32_t ok;
+
+    msg = dbus_message_new_method_call(SYS_MGR_DBUS_SER,
+                                       SYS_MGR_DBUS_OBJ_PATH,
+                                       SYS_MGR_DBUS_IFACE,
+                                       SYS_MGR_DBUS_CALL_STATS_METH);
+    if (!msg)
+        return EXIT_FAILURE;
+
+    dbus_error_init(&err);
+    reply = dbus_connection_send_with_reply_and_block(conn, msg, 1000, &err);
+    dbus_message_unref(msg);
+    if (!reply) {
+        LOG_ERROR("Call stats request failed: %s", err.message);
+        dbus_error_free(&err);
+        return EXIT_FAILURE;
+    }
+
+    ok = dbus_message_get_args(reply, &err,
+                               DBUS_TYPE_UINT64, &sent,
+                               DBUS_TYPE_UINT64, &replied,
+                               DBUS_TYPE_UINT64, &errors,
+                               DBUS_TYPE_UINT64, &timeouts,
+                               DBUS_TYPE_UINT64, &cancelled,
+                               DBUS_TYPE_UINT64, &unmatched,
+                               DBUS_TYPE_UINT64, &untracked,
+                               DBUS_TYPE_UINT64, &rtt_min,
+                               DBUS_TYPE_UINT64, &rtt_max,
+                               DBUS_TYPE_UINT64, &rtt_sum,
+                               DBUS_TYPE_UINT32, &in_flight,
+                               DBUS_TYPE_UINT32, &peak,
+                               DBUS_TYPE_INVALID);
+    dbus_message_unref(reply);
+    if (!ok) {
+        LOG_ERROR("Invalid call stats reply: %s", err.message);
+        dbus_error_free(&err);
+        return EXIT_FAILURE;
+    }
+
+    printf("%10s %10s %8s %8s %9s %9s %9s %9s %9s %9s %6s %6s\n", "sent",
+           "replied", "errors", "timeouts", "cancelled", "unmatched",
+           "untracked", "rtt min", "rtt avg", "rtt max", "flight", "peak");
+    printf("%10llu %10llu %8llu %8llu %9llu %9llu %9llu %7.1fus %7.1fus %7.1fus "
+           "%6u %6u\n", (unsigned long long)sent, (unsigned long long)replied,
+           (unsigned long long)errors, (unsigned long long)timeouts,
+           (unsigned long long)cancelled, (unsigned long long)unmatched,
+           (unsigned long long)untracked, rtt_min / 1e3,
+           replied + errors ? rtt_sum / 1e3 / (replied + errors) : 0.0,
+           rtt_max / 1e3, in_flight, peak);
+    return EXIT_SUCCESS;
+}
+
+// Print the IMU loop timing of sys-mgr, count times one second apart
+int32_t print_imu_stats(DBusConnection *conn, int32_t count)
+{
+    DBusMessage *msg, *reply;
+    DBusError err;
+    dbus_bool_t buffered;
+    uint32_t target_hz, jit_avg, jit_max, late_avg, late_max;
+    uint64_t samples, missed, overruns;
+    double rate;
+    int32_t ok;
+
+    if (count <= 0)
+        count = 1;
+
+    for (int32_t i = 0; i < count; i++) {
+        if (i)
+            sleep(1);
+
+        msg = dbus_message_new_method_call(SYS_MGR_DBUS_SER,
+                                           SYS_MGR_DBUS_OBJ_PATH,
+                                           SYS_MGR_DBUS_IFACE,
+                                           SYS_MGR_DBUS_IMU_STATS_METH);
+        if (!msg)
+            return EXIT_FAILURE;
+
+        dbus_error_init(&err);
+        reply = dbus_connection_send_with_reply_and_block(conn, msg, 1000, &err);
+        dbus_message_unref(msg);
+        if (!reply) {
+            LOG_ERROR("IMU stats request failed: %s", err.message);
+            dbus_error_free(&err);
+            return EXIT_FAILURE;
+        }
+
+        ok = dbus_message_get_args(reply, &err,
+                                   DBUS_TYPE_UINT32, &target_hz,
+                                   DBUS_TYPE_BOOLEAN, &buffered,
+                                   DBUS_TYPE_UINT64, &samples,
+                                   DBUS_TYPE_UINT64, &missed,
+                                   DBUS_TYPE_UINT64, &overruns,
+                                   DBUS_TYPE_DOUBLE, &rate,
+                                   DBUS_TYPE_UINT32, &jit_avg,
+                                   DBUS_TYPE_UINT32, &jit_max,
+                                   DBUS_TYPE_UINT32, &late_avg,
+                                   DBUS_TYPE_UINT32, &late_max,
+                                   DBUS_TYPE_INVALID);
+        dbus_message_unref(reply);
+        if (!ok) {
+            LOG_ERROR("Invalid IMU stats reply: %s", err.message);
+            dbus_error_free(&err);
+            return EXIT_FAILURE;
+        }
+
+        if (!i)
+            printf("%6s %5s %9s %10s %8s %8s %10s %10s %10s %10s\n", "target",
+                   "mode", "rate", "samples", "missed", "overruns", "jitter avg",
+                   "jitter max", "late avg", "late max");
+        printf("%4uHz %5s %7.1fHz %10llu %8llu %8llu %8.1fus %8.1fus %8.1fus %8.1fus\n",
+               target_hz, buffered ? "buf" : "poll", rate,
+               (unsigned long long)samples, (unsigned long long)missed,
+               (unsigned long long)overruns, jit_avg / 1e3, jit_max / 1e3,
+               late_avg / 1e3, late_max / 1e3);
+        fflush(stdout);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Print IMU history entries of sys-mgr fetched in one call: the latest max
+ * entries, or the ones after since_ns when it is not 0
+ */
+int32_t print_imu_history(DBusConnection *conn, uint32_t max, uint64_t since_ns)
+{
+    DBusMessage *msg, *reply;
+    DBusMessageIter iter, array, st;
+    DBusError err;
+    dbus_uint64_t since = since_ns, ts, first = 0, last = 0;
+    dbus_uint32_t n_max = max;
+    uint64_t t0, t1;
+    double v[9];
+    uint32_t n = 0;
+
+    msg = dbus_message_new_method_call(SYS_MGR_DBUS_SER,
+                                       SYS_MGR_DBUS_OBJ_PATH,
+                                       SYS_MGR_DBUS_IFACE,
+                                       SYS_MGR_DBUS_IMU_HISTORY_METH);
+    if (!msg)
+        return EXIT_FAILURE;
+    dbus_message_append_args(msg, DBUS_TYPE_UINT64, &since,
+                             DBUS_TYPE_UINT32, &n_max, DBUS_TYPE_INVALID);
+
+    dbus_error_init(&err);
+    t0 = now_ns();
+    reply = dbus_connection_send_with_reply_and_block(conn, msg, 1000, &err);
+    t1 = now_ns();
+    dbus_message_unref(msg);
+    if (!reply) {
+        LOG_ERROR("IMU history request failed: %s", err.message);
+        dbus_error_free(&err);
+        return EXIT_FAILURE;
+    }
+
+    if (!dbus_message_has_signature(reply, SYS_MGR_IMU_HISTORY_SIGNATURE)) {
+        LOG_ERROR("Unexpected IMU history reply %s", dbus_message_get_signature(reply));
+        dbus_message_unref(reply);
+        return EXIT_FAILURE;
+    }
+
+    printf("%16s %8s %8s %8s %9s %9s %9s %8s %8s %8s\n", "ts ns", "ax", "ay",
+           "az", "gx", "gy", "gz", "roll", "pitch", "yaw");
+
+    dbus_message_iter_init(reply, &iter);
+    dbus_message_iter_recurse(&iter, &array);
+    while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT) {
+        dbus_message_iter_recurse(&array, &st);
+        dbus_message_iter_get_basic(&st, &ts);
+        for (int32_t k = 0; k < 9; k++) {
+            dbus_message_iter_next(&st);
+            dbus_message_iter_get_basic(&st, &v[k]);
+        }
+
+        printf("%16llu %8.4f %8.4f %8.4f %9.3f %9.3f %9.3f %8.2f %8.2f %8.2f\n",
+               (unsigned long long)ts, v[0], v[1], v[2], v[3], v[4], v[5],
+               v[6], v[7], v[8]);
+        if (!n)
+            first = ts;
+        last = ts;
+        n++;
+        dbus_message_iter_next(&array);
+    }
+    dbus_message_unref(reply);
+
+    printf("%u entries spanning %.1f ms in one call of %.1f us, next since %llu\n",
+           n, n ? (last - first) / 1e6 : 0.0, (t1 - t0) / 1e3,
+           (unsigned long long)(n ? last : since_ns));
+
+    return EXIT_SUCCESS;
+}
+
+// Print the IMU state of sys-mgr interpolated at ts_ns
+int32_t print_imu_history_at(DBusConnection *conn, uint64_t ts_ns)
+{
+    DBusMessage *msg, *reply;
+    DBusMessageIter iter, st;
+    DBusError err;
+    dbus_uint64_t ts = ts_ns;
+    double v[9];
+
+    msg = dbus_message_new_method_call(SYS_MGR_DBUS_SER,
+                                       SYS_MGR_DBUS_OBJ_PATH,
+                                       SYS_MGR_DBUS_IFACE,
+                                       SYS_MGR_DBUS_IMU_HISTORY_AT_METH);
+    if (!msg)
+        return EXIT_FAILURE;
+    dbus_message_append_args(msg, DBUS_TYPE_UINT64, &ts, DBUS_TYPE_INVALID);
+
+    dbus_error_init(&err);
+    reply = dbus_connection_send_with_reply_and_block(conn, msg, 1000, &err);
+    dbus_message_unref(msg);
+    if (!reply) {
+        LOG_ERROR("IMU history at %llu failed: %s", (unsigned long long)ts_ns,
+                  err.message);
+        dbus_error_free(&err);
+        return EXIT_FAILURE;
+    }
+
+    if (!dbus_message_has_signature(reply, SYS_MGR_IMU_HISTORY_AT_SIGNATURE)) {
+        LOG_ERROR("Unexpected IMU history reply %s", dbus_message_get_signature(reply));
+        dbus_message_unref(reply);
+        return EXIT_FAILURE;
+    }
+
+    dbus_message_iter_init(reply, &iter);
+    dbus_message_iter_recurse(&iter, &st);
+    dbus_message_iter_get_basic(&st, &ts);
+    for (int32_t k = 0; k < 9; k++) {
+        dbus_message_iter_next(&st);
+        dbus_message_iter_get_basic(&st, &v[k]);
+    }
+    dbus_message_unref(reply);
+
+    printf("%16s %8s %8s %8s %9s %9s %9s %8s %8s %8s\n", "ts ns", "ax", "ay",
+           "az", "gx", "gy", "gz", "roll", "pitch", "yaw");
+    printf("%16llu %8.4f %8.4f %8.4f %9.3f %9.3f %9.3f %8.2f %8.2f %8.2f\n",
+           (unsigned long long)ts, v[0], v[1], v[2], v[3], v[4], v[5],
+           v[6], v[7], v[8]);
+
+    return EXIT_SUCCESS;
+}
+
 // Main entry point32_t of the CLI test application
 int32_t main(int32_t argc, char **argv)
 {
@@ -282,15 +1063,27 @@ int32_t main(int32_t argc, char **argv)
     DBusConnection *conn;
     int32_t ret;
 
+    // Needs no bus
+    if (argc > 1 && strcmp(argv[1], "codec-bench") == 0)
+        return run_codec_bench(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "fusion-bench") == 0)
+        return run_fusion_bench(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "seqlock-bench") == 0)
+        return run_seqlock_bench(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "imu-replay") == 0)
+        return run_imu_replay(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "iio-sim") == 0)
+        return run_iio_sim(argc - 1, argv + 1);
+
     dbus_error_init(&err);
-    conn = dbus_bus_get(DBUS_BUS_SYSTEM, &err);
+    conn = sys_utils_bus_get(&err);
     if (dbus_error_is_set(&err)) {
         LOG_ERROR("Connection error: %s", err.message);
         dbus_error_free(&err);
     }
 
     if (!conn) {
-        LOG_FATAL("Failed to connect to DBus system bus");
+        LOG_FATAL("Failed to connect to DBus");
         return EXIT_FAILURE;
     }
 
@@ -310,6 +1103,30 @@ int32_t main(int32_t argc, char **argv)
 
     if (argc > 1 && strcmp(argv[1], "signal") == 0) {
         return send_signal(conn);
+    } else if (argc > 1 && strcmp(argv[1], "p2p") == 0) {
+        return send_p2p_calls(conn, argc > 2 ? atoi(argv[2]) : 1);
+    } else if (argc > 1 && strcmp(argv[1], "load") == 0) {
+        return run_load_test(conn, argc - 1, argv + 1);
+    } else if (argc > 1 && strcmp(argv[1], "replay") == 0) {
+        return run_replay_test(conn, argc - 1, argv + 1);
+    } else if (argc > 1 && strcmp(argv[1], "qstats") == 0) {
+        return print_queue_stats(conn);
+    } else if (argc > 1 && strcmp(argv[1], "cstats") == 0) {
+        return print_call_stats(conn);
+    } else if (argc > 1 && strcmp(argv[1], "imu-stats") == 0) {
+        return print_imu_stats(conn, argc > 2 ? atoi(argv[2]) : 1);
+    } else if (argc > 2 && strcmp(argv[1], "imu-at") == 0) {
+        return print_imu_history_at(conn, strtoull(argv[2], NULL, 10));
+    } else if (argc > 1 && strcmp(argv[1], "imu-history") == 0) {
+        return print_imu_history(conn, argc > 2 ? (uint32_t)atoi(argv[2]) : 20,
+                                 argc > 3 ? strtoull(argv[3], NULL, 10) : 0);
+    } else if (argc > 1 && strcmp(argv[1], "ping") == 0) {
+        return send_ping_calls(conn, argc - 1, argv + 1);
+    } else if (argc > 1 && strcmp(argv[1], "batch") == 0) {
+        return send_batch_calls(conn, argc - 1, argv + 1);
+    } else if (argc > 1 && strcmp(argv[1], "stream") == 0) {
+        return read_sensor_stream(conn, argc > 2 ? atoi(argv[2]) : 100,
+                                  argc > 3 ? argv[3] : NULL);
     } else {
         return send_method_call(conn);
     }
@@ -0,0 +1,79 @@
+/**
+ * @file sys_utils.h
+ *
+ */
+
+#ifndef G_SYS_UTILS_H
+#define G_SYS_UTILS_H
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+#include <stdbool.h>
+#include <dbus/dbus.h>
+
+#include <comm/cmd_payload.h>
+#include <comm/frame_codec.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  GLOBAL VARIABLES
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+
+/**********************
+ *  GLOBAL PROTOTYPES
+ **********************/
+/* sys_utils.c */
+DBusConnection *sys_utils_bus_get(DBusError *err);
+void create_method_frame(remote_cmd_t *cmd);
+void create_signal_frame(remote_cmd_t *cmd);
+
+/* load_test.c */
+int32_t run_load_test(DBusConnection *conn, int32_t argc, char **argv);
+
+/* codec_bench.c */
+int32_t run_codec_bench(int32_t argc, char **argv);
+
+/* replay.c */
+int32_t run_replay_test(DBusConnection *conn, int32_t argc, char **argv);
+
+/* fusion_bench.c */
+int32_t run_fusion_bench(int32_t argc, char **argv);
+
+/* seqlock_bench.c */
+int32_t run_seqlock_bench(int32_t argc, char **argv);
+
+/* imu_replay.c */
+int32_t run_imu_replay(int32_t argc, char **argv);
+
+/* iio_sim.c */
+int32_t run_iio_sim(int32_t argc, char **argv);
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+
+#endif /* G_SYS_UTILS_H */